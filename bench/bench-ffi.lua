@@ -0,0 +1,76 @@
+-- Hot timer and write loop through the regular bindings and through the FFI
+-- shim in lib/luv_ffi.lua, with the JIT compiler on and off. The C function
+-- calls of the bindings abort trace compilation, so on LuaJIT they stay close
+-- to the interpreter numbers while the FFI loop gets compiled.
+
+-- One op: read the loop time, restart the timer, write one byte
+local source = [[
+local now, timer, stream, drain = ...
+return function (n)
+  for _ = 1, n do
+    now()
+    timer:again()
+    if %s then drain() end
+  end
+end
+]]
+local binding_write = "not stream:try_write('x')"
+local ffi_write = "stream:try_write('x') < 0"
+
+return require('lib/bench')(function (bench)
+
+  bench("timer+try_write loop", function (uv, options, report)
+    local jit = rawget(_G, "jit")
+    local fast = require('lib/luv_ffi')
+    if not (jit and fast) then
+      return report(nil, "requires the LuaJIT FFI")
+    end
+    if not uv.socketpair then
+      return report(nil, "requires uv.socketpair")
+    end
+
+    local fds = assert(uv.socketpair(nil, nil, {nonblock=true}, {nonblock=true}))
+    local writer, reader = uv.new_tcp(), uv.new_tcp()
+    assert(writer:open(fds[1]))
+    assert(reader:open(fds[2]))
+    reader:read_start(function () end)
+    local timer = uv.new_timer()
+    timer:start(3600 * 1000, 3600 * 1000, function () end)
+    local function drain() uv.run("nowait") end
+
+    -- separate chunks so jit.off only affects its own prototype
+    local function variant(name, ffi_calls, compiled)
+      local chunk = assert(load(string.format(source, ffi_calls and ffi_write or binding_write), name))
+      local run
+      if ffi_calls then
+        run = chunk(fast.now, fast.timer(timer), fast.stream(writer), drain)
+      else
+        run = chunk(uv.now, timer, writer, drain)
+      end
+      if not compiled then jit.off(run, true) end
+      jit.flush()
+      run(1000)
+      local ops, start = 0, uv.hrtime()
+      local deadline = start + options.duration / 4 * 1e9
+      while uv.hrtime() < deadline do
+        run(10000)
+        ops = ops + 10000
+      end
+      return (uv.hrtime() - start) / ops
+    end
+
+    local metrics = {
+      binding_interp_ns = variant("binding interp", false, false),
+      binding_jit_ns = variant("binding jit", false, true),
+      ffi_interp_ns = variant("ffi interp", true, false),
+      ffi_jit_ns = variant("ffi jit", true, true),
+    }
+    metrics.ffi_speedup = metrics.binding_jit_ns / metrics.ffi_jit_ns
+
+    timer:close()
+    writer:close()
+    reader:close()
+    report(metrics)
+  end, "1.41.0")
+
+end)
@@ -0,0 +1,179 @@
+local percentiles = require('lib/bench').percentiles
+
+-- Park-Miller generator so every Lua engine walks the same sequence for a
+-- given --seed, math.random differs between versions.
+local function generator(seed)
+  local state = seed % 2147483646 + 1
+  return function (n)
+    state = state * 16807 % 2147483647
+    return state % n + 1
+  end
+end
+
+-- Creates `count` files of 1 to `max_size` bytes (empty when 0) in a fresh
+-- directory, on tmpfs when available so the numbers measure luv and the
+-- threadpool rather than the disk.
+local function fixture(uv, options, count, max_size)
+  local base = options.dir
+  if not base then
+    local shm = uv.fs_stat("/dev/shm")
+    base = shm and shm.type == "directory" and "/dev/shm" or uv.os_tmpdir()
+  end
+  local dir = assert(uv.fs_mkdtemp(base .. "/luv-bench-XXXXXX"))
+  local random = generator(options.seed or 1)
+  local files = {}
+  for i = 1, count do
+    local path = dir .. "/" .. i
+    local fd = assert(uv.fs_open(path, "w", 420))
+    if max_size > 0 then
+      assert(uv.fs_write(fd, string.rep("x", random(max_size))))
+    end
+    assert(uv.fs_close(fd))
+    files[i] = path
+  end
+  local function cleanup()
+    for i = 1, count do
+      assert(uv.fs_unlink(files[i]))
+    end
+    assert(uv.fs_rmdir(dir))
+  end
+  return dir, files, random, cleanup
+end
+
+local function metrics(samples, elapsed)
+  local latency = percentiles(samples, 1e-3)
+  return {
+    ops_per_sec = latency.count / elapsed,
+    p50_us = latency.p50,
+    p90_us = latency.p90,
+    p99_us = latency.p99,
+    max_us = latency.max,
+  }
+end
+
+-- Runs the blocking `op` back to back for the duration
+local function run_sync(uv, options, op)
+  local samples = {}
+  local start = uv.hrtime()
+  local deadline = start + options.duration * 1e9
+  local now
+  repeat
+    local before = uv.hrtime()
+    op()
+    now = uv.hrtime()
+    samples[#samples + 1] = now - before
+  until now >= deadline
+  return metrics(samples, (now - start) / 1e9)
+end
+
+-- Keeps `inflight` chains of the callback based `op` running for the
+-- duration, `finish` gets the metrics once the last chain is done.
+local function run_async(uv, options, op, finish)
+  local inflight = options.inflight or 64
+  local samples = {}
+  local start = uv.hrtime()
+  local deadline = start + options.duration * 1e9
+  local active = inflight
+  local function cycle()
+    local before = uv.hrtime()
+    op(function ()
+      local now = uv.hrtime()
+      samples[#samples + 1] = now - before
+      if now < deadline then return cycle() end
+      active = active - 1
+      if active == 0 then
+        finish(metrics(samples, (now - start) / 1e9))
+      end
+    end)
+  end
+  for _ = 1, inflight do cycle() end
+end
+
+return require('lib/bench')(function (bench)
+
+  bench("small file read sync", function (uv, options, report)
+    local _, files, random, cleanup = fixture(uv, options, options.files or 1000, 4096)
+    local result = run_sync(uv, options, function ()
+      local fd = assert(uv.fs_open(files[random(#files)], "r", 0))
+      assert(uv.fs_read(fd, 4096, 0))
+      assert(uv.fs_close(fd))
+    end)
+    cleanup()
+    report(result)
+  end)
+
+  bench("small file read async", function (uv, options, report)
+    local _, files, random, cleanup = fixture(uv, options, options.files or 1000, 4096)
+    run_async(uv, options, function (done)
+      uv.fs_open(files[random(#files)], "r", 0, function (err, fd)
+        assert(not err, err)
+        uv.fs_read(fd, 4096, 0, function (err)
+          assert(not err, err)
+          uv.fs_close(fd, function (err)
+            assert(not err, err)
+            done()
+          end)
+        end)
+      end)
+    end, function (result)
+      cleanup()
+      report(result)
+    end)
+  end)
+
+  bench("stat sync", function (uv, options, report)
+    local _, files, random, cleanup = fixture(uv, options, options.files or 1000, 4096)
+    local result = run_sync(uv, options, function ()
+      assert(uv.fs_stat(files[random(#files)]))
+    end)
+    cleanup()
+    report(result)
+  end)
+
+  bench("stat async", function (uv, options, report)
+    local _, files, random, cleanup = fixture(uv, options, options.files or 1000, 4096)
+    run_async(uv, options, function (done)
+      uv.fs_stat(files[random(#files)], function (err)
+        assert(not err, err)
+        done()
+      end)
+    end, function (result)
+      cleanup()
+      report(result)
+    end)
+  end)
+
+  bench("scandir sync", function (uv, options, report)
+    local entries = options.entries or 10000
+    local dir, _, _, cleanup = fixture(uv, options, entries, 0)
+    local result = run_sync(uv, options, function ()
+      local req = assert(uv.fs_scandir(dir))
+      local count = 0
+      while uv.fs_scandir_next(req) do count = count + 1 end
+      assert(count == entries)
+    end)
+    cleanup()
+    result.entries_per_sec = result.ops_per_sec * entries
+    report(result)
+  end)
+
+  bench("scandir async", function (uv, options, report)
+    local entries = options.entries or 10000
+    local dir, _, _, cleanup = fixture(uv, options, entries, 0)
+    options = setmetatable({ inflight = 1 }, { __index = options })
+    run_async(uv, options, function (done)
+      uv.fs_scandir(dir, function (err, req)
+        assert(not err, err)
+        local count = 0
+        while uv.fs_scandir_next(req) do count = count + 1 end
+        assert(count == entries)
+        done()
+      end)
+    end, function (result)
+      cleanup()
+      result.entries_per_sec = result.ops_per_sec * entries
+      report(result)
+    end)
+  end)
+
+end)
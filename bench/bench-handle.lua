@@ -0,0 +1,53 @@
+-- Cost of keeping many handles alive: a full GC cycle with all of them
+-- holding callbacks, and dispatching one callback per handle.
+return require('lib/bench')(function (bench)
+
+  bench("100k timers", function (uv, options, report)
+    local count = options.handles or 100000
+    local timers = {}
+    local fired = 0
+    local function ontimeout()
+      fired = fired + 1
+    end
+    local function onclose() end
+
+    collectgarbage()
+    local before = uv.hrtime()
+    for i = 1, count do
+      local timer = uv.new_timer()
+      timer:start(3600 * 1000, 0, ontimeout)
+      timers[i] = timer
+    end
+    local create = uv.hrtime() - before
+
+    before = uv.hrtime()
+    collectgarbage()
+    local gc = uv.hrtime() - before
+
+    for i = 1, count do
+      timers[i]:start(0, 0, ontimeout)
+    end
+    before = uv.hrtime()
+    uv.run("once")
+    local dispatch = uv.hrtime() - before
+    assert(fired == count, fired)
+
+    before = uv.hrtime()
+    for i = 1, count do
+      timers[i]:close(onclose)
+    end
+    uv.run()
+    local close = uv.hrtime() - before
+
+    timers = nil
+    collectgarbage()
+    report({
+      handles = count,
+      create_ns = create / count,
+      gc_ms = gc / 1e6,
+      dispatch_ns = dispatch / count,
+      close_ns = close / count,
+    })
+  end)
+
+end)
@@ -0,0 +1,65 @@
+local isWindows
+if _G.jit and _G.jit.os then
+  isWindows = _G.jit.os == "Windows"
+else
+  isWindows = package.config:find("\\") and true or false
+end
+
+return require('lib/bench')(function (bench)
+
+  bench("throughput", function (uv, options, report)
+    local chunk = string.rep("x", options.chunk or 64 * 1024)
+    local high_water = 4 * #chunk
+    local name = "luv-bench-" .. uv.os_getpid()
+    local path
+    if isWindows then
+      path = "\\\\.\\pipe\\" .. name
+    else
+      path = uv.os_tmpdir() .. "/" .. name .. ".sock"
+      uv.fs_unlink(path)
+    end
+
+    local received = 0
+    local server = uv.new_pipe(false)
+    local reader
+    assert(server:bind(path))
+    assert(server:listen(128, function (err)
+      assert(not err, err)
+      reader = uv.new_pipe(false)
+      assert(server:accept(reader))
+      reader:read_start(function (err, data)
+        assert(not err, err)
+        if data then received = received + #data end
+      end)
+    end))
+
+    local writer = uv.new_pipe(false)
+    local start
+    writer:connect(path, function (err)
+      assert(not err, err)
+      start = uv.hrtime()
+      local function fill()
+        while not writer:is_closing() and writer:get_write_queue_size() < high_water do
+          writer:write(chunk, function (err)
+            if not err then fill() end
+          end)
+        end
+      end
+      fill()
+    end)
+
+    local timer = uv.new_timer()
+    timer:start(options.duration * 1000, 0, function ()
+      local elapsed = (uv.hrtime() - start) / 1e9
+      timer:close()
+      writer:close()
+      if reader then reader:close() end
+      server:close()
+      if not isWindows then uv.fs_unlink(path) end
+      report({
+        mbytes_per_sec = received / elapsed / (1024 * 1024),
+      })
+    end)
+  end)
+
+end)
@@ -0,0 +1,47 @@
+-- Read scaling of uv.shared_map: threads reading random keys of a 1000 entry
+-- map, with some writes mixed in. Readers of different stripes don't wait for
+-- each other, so ops_per_sec should grow with the thread count up to the
+-- number of cores.
+
+local function reader(count, writes)
+  local uv = require('luv')
+  local map = uv.shared_map("bench")
+  local get, set = map.get, map.set
+  local random = math.random
+  for i = 1, count do
+    local key = "key" .. random(1000)
+    if writes > 0 and i % writes == 0 then
+      set(map, key, i)
+    else
+      get(map, key)
+    end
+  end
+end
+
+return require('lib/bench')(function (bench)
+
+  for _, threads in ipairs({ 1, 4, 16 }) do
+    for _, writes in ipairs({ 0, 10 }) do
+      local name = string.format("shared_map %d threads%s", threads,
+        writes > 0 and ", 10% writes" or "")
+      bench(name, function (uv, options, report)
+        local count = options.ops or 1000000
+        local map = uv.shared_map("bench")
+        for i = 1, 1000 do map:set("key" .. i, i) end
+        local start = uv.hrtime()
+        local list = {}
+        for i = 1, threads do
+          list[i] = uv.new_thread(reader, count, writes)
+        end
+        for i = 1, threads do list[i]:join() end
+        local elapsed = (uv.hrtime() - start) / 1e9
+        report({
+          threads = threads,
+          ops_per_sec = threads * count / elapsed,
+          per_thread_ops_per_sec = count / elapsed,
+        })
+      end)
+    end
+  end
+
+end)
@@ -0,0 +1,188 @@
+local percentiles = require('lib/bench').percentiles
+
+-- Echo server on an ephemeral port, pauses reading while a client's write
+-- queue is backed up so throughput runs don't buffer without bound.
+local function echo_server(uv)
+  local server = uv.new_tcp()
+  local clients = {}
+  assert(server:bind("127.0.0.1", 0))
+  assert(server:listen(1024, function (err)
+    assert(not err, err)
+    local client = uv.new_tcp()
+    assert(server:accept(client))
+    client:nodelay(true)
+    clients[client] = true
+    local paused = false
+    local function onread(err, data)
+      if err or not data then
+        clients[client] = nil
+        if not client:is_closing() then client:close() end
+        return
+      end
+      client:write(data, function ()
+        if paused and client:get_write_queue_size() == 0 and not client:is_closing() then
+          paused = false
+          client:read_start(onread)
+        end
+      end)
+      if client:get_write_queue_size() > 1024 * 1024 then
+        paused = true
+        client:read_stop()
+      end
+    end
+    client:read_start(onread)
+  end))
+  local function close()
+    for client in pairs(clients) do
+      if not client:is_closing() then client:close() end
+    end
+    server:close()
+  end
+  return server:getsockname().port, close
+end
+
+return require('lib/bench')(function (bench)
+
+  bench("echo latency", function (uv, options, report)
+    local connections = options.connections or 100
+    local size = options.size or 64
+    local message = string.rep("x", size)
+    local port, close_server = echo_server(uv)
+    local sockets = {}
+    local samples = {}
+    local start = uv.hrtime()
+
+    for i = 1, connections do
+      local socket = uv.new_tcp()
+      sockets[i] = socket
+      socket:connect("127.0.0.1", port, function (err)
+        assert(not err, err)
+        socket:nodelay(true)
+        local sent, received = uv.hrtime(), 0
+        socket:read_start(function (err, data)
+          assert(not err, err)
+          if not data then return end
+          received = received + #data
+          if received >= size then
+            local now = uv.hrtime()
+            samples[#samples + 1] = now - sent
+            received, sent = received - size, now
+            socket:write(message)
+          end
+        end)
+        socket:write(message)
+      end)
+    end
+
+    local timer = uv.new_timer()
+    timer:start(options.duration * 1000, 0, function ()
+      local elapsed = (uv.hrtime() - start) / 1e9
+      timer:close()
+      for i = 1, connections do sockets[i]:close() end
+      close_server()
+      local rtt = percentiles(samples, 1e-3)
+      report({
+        connections = connections,
+        msgs_per_sec = rtt.count / elapsed,
+        rtt_mean_us = rtt.mean,
+        rtt_p50_us = rtt.p50,
+        rtt_p90_us = rtt.p90,
+        rtt_p99_us = rtt.p99,
+        rtt_max_us = rtt.max,
+      })
+    end)
+  end)
+
+  bench("echo throughput", function (uv, options, report)
+    local connections = options.streams or 16
+    local chunk = string.rep("x", options.chunk or 64 * 1024)
+    local high_water = 4 * #chunk
+    local port, close_server = echo_server(uv)
+    local sockets = {}
+    local received = 0
+    local start = uv.hrtime()
+
+    for i = 1, connections do
+      local socket = uv.new_tcp()
+      sockets[i] = socket
+      socket:connect("127.0.0.1", port, function (err)
+        assert(not err, err)
+        local function fill()
+          while not socket:is_closing() and socket:get_write_queue_size() < high_water do
+            socket:write(chunk, function (err)
+              if not err then fill() end
+            end)
+          end
+        end
+        socket:read_start(function (err, data)
+          assert(not err, err)
+          if data then received = received + #data end
+        end)
+        fill()
+      end)
+    end
+
+    local timer = uv.new_timer()
+    timer:start(options.duration * 1000, 0, function ()
+      local elapsed = (uv.hrtime() - start) / 1e9
+      timer:close()
+      for i = 1, connections do sockets[i]:close() end
+      close_server()
+      report({
+        connections = connections,
+        mbytes_per_sec = received / elapsed / (1024 * 1024),
+      })
+    end)
+  end)
+
+  bench("accept rate", function (uv, options, report)
+    local concurrency = options.concurrency or 64
+    local accepted, errors = 0, 0
+    local running = true
+    local server = uv.new_tcp()
+    assert(server:bind("127.0.0.1", 0))
+    assert(server:listen(1024, function (err)
+      assert(not err, err)
+      local client = uv.new_tcp()
+      assert(server:accept(client))
+      accepted = accepted + 1
+      client:close()
+    end))
+    local port = server:getsockname().port
+    local start = uv.hrtime()
+
+    -- each slot connects, waits for the server to hang up and starts over
+    local function connect()
+      local socket = uv.new_tcp()
+      socket:connect("127.0.0.1", port, function (err)
+        if err then
+          errors = errors + 1
+          socket:close(function () if running then connect() end end)
+          return
+        end
+        socket:read_start(function (err, data)
+          if data then return end
+          socket:close(function () if running then connect() end end)
+        end)
+      end)
+    end
+    for _ = 1, concurrency do connect() end
+
+    local timer = uv.new_timer()
+    timer:start(options.duration * 1000, 0, function ()
+      local elapsed = (uv.hrtime() - start) / 1e9
+      running = false
+      timer:close()
+      server:close()
+      uv.walk(function (handle)
+        if not handle:is_closing() then handle:close() end
+      end)
+      report({
+        concurrency = concurrency,
+        accepts_per_sec = accepted / elapsed,
+        connect_error_pct = errors * 100 / math.max(1, accepted + errors),
+      })
+    end)
+  end)
+
+end)
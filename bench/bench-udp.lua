@@ -0,0 +1,61 @@
+-- Blasts datagrams over loopback from an idle handle and counts what the
+-- receiver gets. Losses are expected once the receiver can't keep up, the
+-- interesting numbers are recv_pps and how it moves with recvmmsg.
+local function pps(uv, options, report, mmsgs)
+  local burst = options.burst or 64
+  local payload = string.rep("x", options.size or 64)
+  local sent, received = 0, 0
+
+  local receiver
+  if mmsgs then
+    receiver = uv.new_udp({ family = "inet", mmsgs = mmsgs })
+  else
+    receiver = uv.new_udp("inet")
+  end
+  assert(receiver:bind("127.0.0.1", 0))
+  pcall(uv.recv_buffer_size, receiver, 4 * 1024 * 1024)
+  local port = receiver:getsockname().port
+  assert(receiver:recv_start(function (err, data)
+    assert(not err, err)
+    if data then received = received + 1 end
+  end))
+
+  local sender = uv.new_udp("inet")
+  assert(sender:connect("127.0.0.1", port))
+  local idle = uv.new_idle()
+  idle:start(function ()
+    for _ = 1, burst do
+      -- stop the burst once the socket buffer is full
+      if not sender:try_send(payload) then break end
+      sent = sent + 1
+    end
+  end)
+
+  local start = uv.hrtime()
+  local timer = uv.new_timer()
+  timer:start(options.duration * 1000, 0, function ()
+    local elapsed = (uv.hrtime() - start) / 1e9
+    timer:close()
+    idle:close()
+    sender:close()
+    receiver:close()
+    report({
+      mmsgs = mmsgs or 1,
+      send_pps = sent / elapsed,
+      recv_pps = received / elapsed,
+      loss_pct = sent > 0 and (sent - received) * 100 / sent or 0,
+    })
+  end)
+end
+
+return require('lib/bench')(function (bench)
+
+  bench("pps", function (uv, options, report)
+    pps(uv, options, report)
+  end, "1.27.0")
+
+  bench("pps recvmmsg", function (uv, options, report)
+    pps(uv, options, report, options.mmsgs or 32)
+  end, "1.39.0")
+
+end)
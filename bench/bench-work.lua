@@ -0,0 +1,96 @@
+local percentiles = require('lib/bench').percentiles
+
+-- The threadpool size is fixed once the pool started, run this file once per
+-- size with UV_THREADPOOL_SIZE set (the `bench` CMake target does that).
+local uv = require('luv')
+local pool = tonumber(uv.os_getenv("UV_THREADPOOL_SIZE") or "") or 4
+
+return require('lib/bench')(function (bench)
+
+  bench("queue roundtrip (pool=" .. pool .. ")", function (uv, options, report)
+    local samples = {}
+    local start = uv.hrtime()
+    local deadline = start + options.duration * 1e9
+    local before
+    local work
+    work = uv.new_work(function (n)
+      return n
+    end, function ()
+      local now = uv.hrtime()
+      samples[#samples + 1] = now - before
+      if now < deadline then
+        before = uv.hrtime()
+        return work:queue(1)
+      end
+      local latency = percentiles(samples, 1e-3)
+      report({
+        pool = pool,
+        ops_per_sec = latency.count / ((now - start) / 1e9),
+        p50_us = latency.p50,
+        p90_us = latency.p90,
+        p99_us = latency.p99,
+        max_us = latency.max,
+      })
+    end)
+    before = uv.hrtime()
+    work:queue(1)
+  end)
+
+  bench("queue throughput (pool=" .. pool .. ")", function (uv, options, report)
+    local inflight = options.inflight or 256
+    local active = inflight
+    local completed = 0
+    local start = uv.hrtime()
+    local deadline = start + options.duration * 1e9
+    local work
+    work = uv.new_work(function (n)
+      return n
+    end, function ()
+      completed = completed + 1
+      local now = uv.hrtime()
+      if now < deadline then
+        return work:queue(1)
+      end
+      active = active - 1
+      if active == 0 then
+        report({
+          pool = pool,
+          inflight = inflight,
+          ops_per_sec = completed / ((now - start) / 1e9),
+        })
+      end
+    end)
+    for _ = 1, inflight do work:queue(1) end
+  end)
+
+  -- One thread sends as fast as it can, wakeups are fewer than sends since
+  -- uv_async_send coalesces until the loop gets to run the callback.
+  bench("async_send", function (uv, options, report)
+    local messages = options.messages or 1000000
+    local wakeups = 0
+    local start = uv.hrtime()
+    local thread
+    local async
+    async = uv.new_async(function (n, elapsed)
+      wakeups = wakeups + 1
+      if n < messages then return end
+      async:close()
+      thread:join()
+      local total = (uv.hrtime() - start) / 1e9
+      report({
+        sends_per_sec = messages / (elapsed / 1e9),
+        wakeups_per_sec = wakeups / total,
+        messages_per_wakeup = messages / wakeups,
+      })
+    end)
+    thread = uv.new_thread(function (async, messages)
+      local uv = require('luv')
+      local start = uv.hrtime()
+      for i = 1, messages - 1 do
+        async:send(i)
+      end
+      async:send(messages, uv.hrtime() - start)
+    end, async, messages)
+  end)
+
+end)
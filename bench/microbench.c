@@ -0,0 +1,322 @@
+/*
+ *  Copyright 2014 The Luvit Authors. All Rights Reserved.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ */
+
+/* Binding overhead microbenchmarks
+
+   Times tight Lua loops over cheap luv calls and reports ns/op, plus
+   user space cycles, instructions and cache misses per op when
+   perf_event_open(2) is available.
+
+   Build with `cmake --build build --target microbench` and run
+   ./build/microbench [-n iterations] [-r repeats] [name-filter]
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <lua.h>
+#include <lauxlib.h>
+#include <lualib.h>
+
+#include "luv.h"
+
+#if defined(__linux__)
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#define MB_HAVE_PERF 1
+#endif
+
+#define MB_COUNTERS 3
+
+typedef struct {
+  const char* name;
+  /* chunk returning run(n) and an optional teardown() */
+  const char* code;
+} microbench_t;
+
+static const microbench_t benches[] = {
+  { "empty loop",
+    "return function (n)\n"
+    "  for _ = 1, n do end\n"
+    "end\n" },
+
+  { "uv.now",
+    "local now = uv.now\n"
+    "return function (n)\n"
+    "  for _ = 1, n do now() end\n"
+    "end\n" },
+
+  { "timer:again",
+    "local timer = uv.new_timer()\n"
+    "timer:start(1000000, 1000000, function () end)\n"
+    "return function (n)\n"
+    "  for _ = 1, n do timer:again() end\n"
+    "end, function ()\n"
+    "  timer:close()\n"
+    "  uv.run()\n"
+    "end\n" },
+
+  { "stream:is_writable",
+    "local fds = assert(uv.socketpair(nil, nil, {nonblock=true}, {nonblock=true}))\n"
+    "local stream, peer = uv.new_tcp(), uv.new_tcp()\n"
+    "assert(stream:open(fds[1]))\n"
+    "assert(peer:open(fds[2]))\n"
+    "return function (n)\n"
+    "  for _ = 1, n do stream:is_writable() end\n"
+    "end, function ()\n"
+    "  stream:close()\n"
+    "  peer:close()\n"
+    "  uv.run()\n"
+    "end\n" },
+
+  /* the peer drains whenever the socket buffer fills up */
+  { "stream:try_write",
+    "local fds = assert(uv.socketpair(nil, nil, {nonblock=true}, {nonblock=true}))\n"
+    "local writer, reader = uv.new_tcp(), uv.new_tcp()\n"
+    "assert(writer:open(fds[1]))\n"
+    "assert(reader:open(fds[2]))\n"
+    "reader:read_start(function () end)\n"
+    "return function (n)\n"
+    "  for _ = 1, n do\n"
+    "    if not writer:try_write('x') then uv.run('nowait') end\n"
+    "  end\n"
+    "end, function ()\n"
+    "  writer:close()\n"
+    "  reader:close()\n"
+    "  uv.run()\n"
+    "end\n" },
+
+  /* nobody reads, so after the first few calls every one fails with EAGAIN */
+  { "try_write EAGAIN",
+    "local fds = assert(uv.socketpair(nil, nil, {nonblock=true}, {nonblock=true}))\n"
+    "local writer, reader = uv.new_tcp(), uv.new_tcp()\n"
+    "assert(writer:open(fds[1]))\n"
+    "assert(reader:open(fds[2]))\n"
+    "return function (n)\n"
+    "  for _ = 1, n do writer:try_write('x') end\n"
+    "end, function ()\n"
+    "  writer:close()\n"
+    "  reader:close()\n"
+    "  uv.run()\n"
+    "end\n" },
+
+  /* same with the allocation-free error returns */
+  { "try_write EAGAIN (code)",
+    "local fds = assert(uv.socketpair(nil, nil, {nonblock=true}, {nonblock=true}))\n"
+    "local writer, reader = uv.new_tcp(), uv.new_tcp()\n"
+    "assert(writer:open(fds[1]))\n"
+    "assert(reader:open(fds[2]))\n"
+    "local mode = uv.set_try_error_mode('code')\n"
+    "return function (n)\n"
+    "  for _ = 1, n do writer:try_write('x') end\n"
+    "end, function ()\n"
+    "  uv.set_try_error_mode(mode)\n"
+    "  writer:close()\n"
+    "  reader:close()\n"
+    "  uv.run()\n"
+    "end\n" },
+
+  /* handle allocation, setup and teardown, closed in batches */
+  { "new_timer+close",
+    "local new_timer, close = uv.new_timer, uv.close\n"
+    "return function (n)\n"
+    "  for i = 1, n do\n"
+    "    close(new_timer())\n"
+    "    if i % 1000 == 0 then uv.run() end\n"
+    "  end\n"
+    "  uv.run()\n"
+    "end\n" },
+
+  /* a loop iteration plus luv_cfpcall into the callback per op */
+  { "timer tick dispatch",
+    "local timer = uv.new_timer()\n"
+    "return function (n)\n"
+    "  local count = 0\n"
+    "  local function tick()\n"
+    "    count = count + 1\n"
+    "    if count < n then timer:start(0, 0, tick) end\n"
+    "  end\n"
+    "  timer:start(0, 0, tick)\n"
+    "  uv.run()\n"
+    "end, function ()\n"
+    "  timer:close()\n"
+    "  uv.run()\n"
+    "end\n" },
+};
+
+#ifdef MB_HAVE_PERF
+static const char* const counter_names[MB_COUNTERS] = {
+  "cycles", "instructions", "cache-misses"
+};
+
+static int perf_fd = -1;
+
+static void perf_init(void) {
+  static const uint64_t configs[MB_COUNTERS] = {
+    PERF_COUNT_HW_CPU_CYCLES,
+    PERF_COUNT_HW_INSTRUCTIONS,
+    PERF_COUNT_HW_CACHE_MISSES,
+  };
+  int i;
+  for (i = 0; i < MB_COUNTERS; i++) {
+    struct perf_event_attr attr;
+    int fd;
+    memset(&attr, 0, sizeof(attr));
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.size = sizeof(attr);
+    attr.config = configs[i];
+    attr.disabled = i == 0;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    attr.read_format = PERF_FORMAT_GROUP;
+    fd = (int)syscall(__NR_perf_event_open, &attr, 0, -1, perf_fd, 0);
+    if (fd < 0) {
+      if (perf_fd >= 0) close(perf_fd);
+      perf_fd = -1;
+      return;
+    }
+    if (i == 0) perf_fd = fd;
+  }
+}
+
+static void perf_start(void) {
+  if (perf_fd < 0) return;
+  ioctl(perf_fd, PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+  ioctl(perf_fd, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+}
+
+static int perf_stop(uint64_t counters[MB_COUNTERS]) {
+  struct {
+    uint64_t nr;
+    uint64_t values[MB_COUNTERS];
+  } data;
+  if (perf_fd < 0) return 0;
+  ioctl(perf_fd, PERF_EVENT_IOC_DISABLE, PERF_IOC_FLAG_GROUP);
+  if (read(perf_fd, &data, sizeof(data)) != (ssize_t)sizeof(data)) return 0;
+  memcpy(counters, data.values, sizeof(data.values));
+  return 1;
+}
+#else
+static void perf_init(void) {}
+static void perf_start(void) {}
+static int perf_stop(uint64_t counters[MB_COUNTERS]) {
+  (void)counters;
+  return 0;
+}
+#endif
+
+/* Runs the case `repeats` times and keeps the fastest run */
+static int run_bench(lua_State* L, const microbench_t* bench, lua_Integer n, int repeats) {
+  uint64_t best = (uint64_t)-1;
+  uint64_t counters[MB_COUNTERS];
+  uint64_t best_counters[MB_COUNTERS];
+  int have_counters = 0;
+  int i;
+
+  lua_settop(L, 0);
+  if (luaL_loadstring(L, bench->code) || lua_pcall(L, 0, 2, 0)) {
+    fprintf(stderr, "%s: %s\n", bench->name, lua_tostring(L, -1));
+    return 0;
+  }
+
+  /* warm up the JIT and the caches */
+  lua_pushvalue(L, 1);
+  lua_pushinteger(L, n / 10 + 1);
+  if (lua_pcall(L, 1, 0, 0)) goto error;
+
+  for (i = 0; i < repeats; i++) {
+    uint64_t start, elapsed;
+    lua_pushvalue(L, 1);
+    lua_pushinteger(L, n);
+    perf_start();
+    start = uv_hrtime();
+    if (lua_pcall(L, 1, 0, 0)) goto error;
+    elapsed = uv_hrtime() - start;
+    if (perf_stop(counters) && elapsed < best) {
+      memcpy(best_counters, counters, sizeof(counters));
+      have_counters = 1;
+    }
+    if (elapsed < best) best = elapsed;
+  }
+
+  printf("%-24s %10.2f", bench->name, (double)best / (double)n);
+  if (have_counters) {
+    for (i = 0; i < MB_COUNTERS; i++) {
+      printf(" %14.2f", (double)best_counters[i] / (double)n);
+    }
+  }
+  printf("\n");
+
+  if (!lua_isnil(L, 2)) {
+    lua_pushvalue(L, 2);
+    if (lua_pcall(L, 0, 0, 0)) goto error;
+  }
+  return 1;
+
+error:
+  fprintf(stderr, "%s: %s\n", bench->name, lua_tostring(L, -1));
+  return 0;
+}
+
+int main(int argc, char* argv[]) {
+  lua_Integer n = 1000000;
+  int repeats = 5;
+  const char* filter = NULL;
+  int failed = 0;
+  size_t i;
+  lua_State* L;
+
+  for (i = 1; i < (size_t)argc; i++) {
+    if (!strcmp(argv[i], "-n") && i + 1 < (size_t)argc) {
+      n = strtol(argv[++i], NULL, 10);
+    } else if (!strcmp(argv[i], "-r") && i + 1 < (size_t)argc) {
+      repeats = atoi(argv[++i]);
+    } else {
+      filter = argv[i];
+    }
+  }
+  if (n < 1 || repeats < 1) {
+    fprintf(stderr, "usage: %s [-n iterations] [-r repeats] [name-filter]\n", argv[0]);
+    return EXIT_FAILURE;
+  }
+
+  L = luaL_newstate();
+  luaL_openlibs(L);
+  lua_pushcfunction(L, luaopen_luv);
+  lua_call(L, 0, 1);
+  lua_setglobal(L, "uv");
+
+  perf_init();
+  printf("%-24s %10s", "case", "ns/op");
+#ifdef MB_HAVE_PERF
+  if (perf_fd >= 0) {
+    for (i = 0; i < MB_COUNTERS; i++) printf(" %14s", counter_names[i]);
+  }
+#endif
+  printf("\n");
+
+  for (i = 0; i < sizeof(benches) / sizeof(benches[0]); i++) {
+    if (filter && !strstr(benches[i].name, filter)) continue;
+    if (!run_bench(L, &benches[i], n, repeats)) failed++;
+  }
+
+  lua_close(L);
+  return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
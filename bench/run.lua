@@ -0,0 +1,50 @@
+-- Run this from the parent directory as
+--
+--     luajit bench/run.lua [options] [name-pattern...]
+--
+-- Options:
+--     --duration=<seconds>    time spent in each case (default 2)
+--     --json=<path>           write the results as JSON
+--     --compare=<path>        compare against results saved with --json,
+--                             exits with 1 when a metric regressed
+--     --threshold=<percent>   change counted as a regression (default 10)
+--
+-- Any other --key=value is passed to the cases in their options table.
+--
+
+local bench = require("lib/bench")
+local uv = require("luv")
+
+local options = bench.options
+for _, arg in ipairs({...}) do
+  local key, value = arg:match("^%-%-([%w_]+)=(.*)$")
+  if key then
+    options[key] = tonumber(value) or value
+  elseif arg:sub(1, 2) == "--" then
+    error("unknown option " .. arg)
+  else
+    options.filter = options.filter or {}
+    options.filter[#options.filter + 1] = arg
+  end
+end
+
+local req = uv.fs_scandir("bench")
+local names = {}
+
+while true do
+  local name = uv.fs_scandir_next(req)
+  if not name then break end
+  local match = string.match(name, "^bench%-(.*).lua$")
+  if match then
+    names[#names + 1] = match
+  end
+end
+table.sort(names)
+
+for _, match in ipairs(names) do
+  bench(match)
+  require("bench/bench-" .. match)
+end
+
+-- run the benchmarks!
+bench(true)
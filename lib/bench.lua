@@ -0,0 +1,385 @@
+local uv = require('luv')
+
+-- Minimal JSON support for the result files, numbers, strings, booleans,
+-- arrays and objects only.
+
+local function encode(value, indent)
+  indent = indent or ""
+  local t = type(value)
+  if t == "number" then
+    if value ~= value or value == math.huge or value == -math.huge then
+      return "null"
+    elseif value == math.floor(value) and math.abs(value) < 2^53 then
+      return string.format("%.0f", value)
+    end
+    return string.format("%.3f", value)
+  elseif t == "string" then
+    return '"' .. value:gsub('[%c"\\]', function (c)
+      return string.format("\\u%04x", c:byte())
+    end) .. '"'
+  elseif t == "boolean" then
+    return tostring(value)
+  elseif t == "table" then
+    local inner = indent .. "  "
+    local parts = {}
+    if #value > 0 then
+      for i = 1, #value do
+        parts[i] = inner .. encode(value[i], inner)
+      end
+      return "[\n" .. table.concat(parts, ",\n") .. "\n" .. indent .. "]"
+    end
+    local keys = {}
+    for k in pairs(value) do keys[#keys + 1] = tostring(k) end
+    if #keys == 0 then return "{}" end
+    table.sort(keys)
+    for i = 1, #keys do
+      parts[i] = inner .. encode(keys[i]) .. ": " .. encode(value[keys[i]], inner)
+    end
+    return "{\n" .. table.concat(parts, ",\n") .. "\n" .. indent .. "}"
+  end
+  return "null"
+end
+
+local function decode(text)
+  local pos = 1
+
+  local function fail(msg)
+    error("invalid JSON at offset " .. pos .. ": " .. msg, 0)
+  end
+
+  local function skip()
+    pos = text:find("[^ \t\r\n]", pos) or #text + 1
+  end
+
+  local value
+
+  local function str()
+    local parts = {}
+    pos = pos + 1
+    while true do
+      local c = text:sub(pos, pos)
+      if c == "" then fail("unterminated string") end
+      if c == '"' then
+        pos = pos + 1
+        return table.concat(parts)
+      elseif c == "\\" then
+        local e = text:sub(pos + 1, pos + 1)
+        if e == "u" then
+          parts[#parts + 1] = string.char(tonumber(text:sub(pos + 2, pos + 5), 16) % 256)
+          pos = pos + 6
+        else
+          local map = { b = "\b", f = "\f", n = "\n", r = "\r", t = "\t" }
+          parts[#parts + 1] = map[e] or e
+          pos = pos + 2
+        end
+      else
+        parts[#parts + 1] = c
+        pos = pos + 1
+      end
+    end
+  end
+
+  function value()
+    skip()
+    local c = text:sub(pos, pos)
+    if c == "{" then
+      local obj = {}
+      pos = pos + 1
+      skip()
+      if text:sub(pos, pos) == "}" then
+        pos = pos + 1
+        return obj
+      end
+      while true do
+        skip()
+        if text:sub(pos, pos) ~= '"' then fail("expected key") end
+        local k = str()
+        skip()
+        if text:sub(pos, pos) ~= ":" then fail("expected ':'") end
+        pos = pos + 1
+        obj[k] = value()
+        skip()
+        c = text:sub(pos, pos)
+        pos = pos + 1
+        if c == "}" then return obj end
+        if c ~= "," then fail("expected ',' or '}'") end
+      end
+    elseif c == "[" then
+      local arr = {}
+      pos = pos + 1
+      skip()
+      if text:sub(pos, pos) == "]" then
+        pos = pos + 1
+        return arr
+      end
+      while true do
+        arr[#arr + 1] = value()
+        skip()
+        c = text:sub(pos, pos)
+        pos = pos + 1
+        if c == "]" then return arr end
+        if c ~= "," then fail("expected ',' or ']'") end
+      end
+    elseif c == '"' then
+      return str()
+    end
+    for word, v in pairs({ ["true"] = true, ["false"] = false, ["null"] = false }) do
+      if text:sub(pos, pos + #word - 1) == word then
+        pos = pos + #word
+        return v
+      end
+    end
+    local num = text:match("^-?%d+%.?%d*[eE]?[-+]?%d*", pos)
+    if not num or num == "" then fail("unexpected '" .. c .. "'") end
+    pos = pos + #num
+    return tonumber(num)
+  end
+
+  local result = value()
+  skip()
+  if pos <= #text then fail("trailing data") end
+  return result
+end
+
+-- Metrics ending in one of these are better when lower, all others are
+-- better when higher (rates, throughput).
+local lower_is_better = { "_ns", "_us", "_ms", "_pct" }
+
+local function is_lower_better(metric)
+  for i = 1, #lower_is_better do
+    local suffix = lower_is_better[i]
+    if metric:sub(-#suffix) == suffix then return true end
+  end
+  return false
+end
+
+local options = {
+  duration = 2,       -- seconds per case
+  filter = nil,       -- lua patterns, a case runs if its name matches one
+  json = nil,         -- path to write the results to
+  compare = nil,      -- path of a baseline to compare against
+  threshold = 10,     -- percentage that counts as a regression
+}
+
+local function uv_version_geq(min_version)
+  if not min_version then return true end
+  local major, minor, patch = min_version:match("^(%d+)%.(%d+)%.(%d+)$")
+  assert(major, "malformed version string: " .. min_version)
+  return uv.version() >= major * 0x10000 + minor * 0x100 + patch
+end
+
+local function selected(name)
+  local filter = options.filter
+  if not filter then return true end
+  if type(filter) ~= "table" then filter = { filter } end
+  for i = 1, #filter do
+    if name:find(filter[i]) then return true end
+  end
+  return false
+end
+
+local benches = {}
+local single = true
+local prefix
+
+local function run()
+  local results = {}
+  local ran, skipped, failed = 0, 0, 0
+
+  for i = 1, #benches do
+    local case = benches[i]
+    if not selected(case.name) then
+      -- not selected
+    elseif not uv_version_geq(case.min_uv_ver) then
+      print(string.format("%-40s skip (requires libuv >= %s)", case.name, case.min_uv_ver))
+      skipped = skipped + 1
+    else
+      local metrics, reason
+      collectgarbage()
+      collectgarbage()
+      local start = uv.hrtime()
+      local pass, err = xpcall(function ()
+        case.fn(uv, options, function (m, why)
+          assert(not metrics and not reason, "report called twice")
+          metrics, reason = m, why
+        end)
+        uv.run()
+        local unclosed = 0
+        uv.walk(function (handle)
+          unclosed = unclosed + 1
+          print("UNCLOSED", handle)
+        end)
+        if unclosed > 0 then
+          error(unclosed .. " unclosed handle" .. (unclosed == 1 and "" or "s"))
+        end
+        if not metrics and not reason then
+          error("case did not report results")
+        end
+      end, debug.traceback)
+      local elapsed = (uv.hrtime() - start) / 1e9
+
+      -- Flush out anything left behind by a failure
+      uv.walk(function (handle)
+        if not uv.is_closing(handle) then uv.close(handle) end
+      end)
+      uv.run()
+
+      if not pass then
+        print(string.format("%-40s FAILED", case.name))
+        print(err)
+        failed = failed + 1
+      elseif not metrics then
+        print(string.format("%-40s skip (%s)", case.name, tostring(reason)))
+        skipped = skipped + 1
+      else
+        ran = ran + 1
+        results[case.name] = metrics
+        local keys = {}
+        for k in pairs(metrics) do keys[#keys + 1] = k end
+        table.sort(keys)
+        print(string.format("%-40s %.1fs", case.name, elapsed))
+        for _, k in ipairs(keys) do
+          print(string.format("    %-24s %14.3f", k, metrics[k]))
+        end
+      end
+    end
+  end
+
+  print(string.format("# %d ran, %d skipped, %d failed", ran, skipped, failed))
+
+  if options.json then
+    local jit = rawget(_G, "jit")
+    local uname = uv.os_uname and uv.os_uname() or {}
+    local report = {
+      meta = {
+        lua = jit and jit.version or _VERSION,
+        libuv = uv.version_string(),
+        os = (uname.sysname or "?") .. " " .. (uname.release or "?"),
+        machine = uname.machine or "?",
+        cpus = #uv.cpu_info(),
+        duration = options.duration,
+        date = os.date("!%Y-%m-%dT%H:%M:%SZ"),
+      },
+      results = results,
+    }
+    local file = assert(io.open(options.json, "w"))
+    file:write(encode(report), "\n")
+    file:close()
+    print("# results written to " .. options.json)
+  end
+
+  local regressions = 0
+  if options.compare then
+    local file = assert(io.open(options.compare, "r"))
+    local baseline = decode(file:read("*a")).results or {}
+    file:close()
+    print("# compared to " .. options.compare)
+    local names = {}
+    for name in pairs(results) do names[#names + 1] = name end
+    table.sort(names)
+    for _, name in ipairs(names) do
+      local base = baseline[name]
+      if base then
+        print(name)
+        local keys = {}
+        for k in pairs(results[name]) do keys[#keys + 1] = k end
+        table.sort(keys)
+        for _, k in ipairs(keys) do
+          local old, new = base[k], results[name][k]
+          if type(old) == "number" and old ~= 0 then
+            local change = (new - old) / math.abs(old) * 100
+            local worse = is_lower_better(k) and change or -change
+            local mark = ""
+            if worse > options.threshold then
+              mark = "  REGRESSION"
+              regressions = regressions + 1
+            end
+            print(string.format("    %-24s %14.3f -> %14.3f %+7.1f%%%s", k, old, new, change, mark))
+          end
+        end
+      end
+    end
+    print(string.format("# %d regression%s over %g%%", regressions,
+      regressions == 1 and "" or "s", options.threshold))
+  end
+
+  if failed > 0 or regressions > 0 then
+    os.exit(1)
+  end
+end
+
+-- Nearest-rank percentiles of an array of numbers, sorts it in place.
+local function percentiles(samples, scale)
+  scale = scale or 1
+  local n = #samples
+  local result = { count = n }
+  if n == 0 then return result end
+  table.sort(samples)
+  local function at(p)
+    return samples[math.max(1, math.ceil(n * p))] * scale
+  end
+  local sum = 0
+  for i = 1, n do sum = sum + samples[i] end
+  result.mean = sum / n * scale
+  result.p50 = at(0.50)
+  result.p90 = at(0.90)
+  result.p99 = at(0.99)
+  result.max = samples[n] * scale
+  return result
+end
+
+local bench = setmetatable({
+  options = options,
+  encode = encode,
+  decode = decode,
+  percentiles = percentiles,
+}, {
+  __call = function (_, suite)
+    if type(suite) == "function" then
+      suite(function (name, fn, min_uv_ver)
+        if prefix then
+          name = prefix .. " - " .. name
+        end
+        benches[#benches + 1] = {
+          name = name,
+          fn = fn,
+          min_uv_ver = min_uv_ver,
+        }
+      end)
+      prefix = nil
+    elseif type(suite) == "string" then
+      prefix = suite
+      single = false
+    else
+      single = suite
+    end
+
+    if single then run() end
+  end
+})
+
+--[[
+-- Sample Usage
+
+return require('lib/bench')(function (bench)
+
+  bench("timer ticks", function (uv, options, report)
+    local count = 0
+    local timer = uv.new_timer()
+    local start = uv.hrtime()
+    local function tick()
+      count = count + 1
+      if uv.hrtime() - start < options.duration * 1e9 then
+        timer:start(0, 0, tick)
+      else
+        timer:close()
+        report({ ticks_per_sec = count / options.duration })
+      end
+    end
+    timer:start(0, 0, tick)
+  end)
+
+end)
+]]
+
+return bench
@@ -0,0 +1,99 @@
+-- LuaJIT FFI shim for the hottest luv calls
+--
+--     local fast = require("luv_ffi") -- nil when the FFI isn't available
+--     local now = fast.now()
+--     local timer = fast.timer(uv.new_timer())
+--     timer:again()
+--
+-- Calling a lua_CFunction aborts LuaJIT trace compilation, these go through
+-- the plain C functions of luv_ffi_api() instead. Failures are the negative
+-- libuv error codes, to be compared against uv.errno, as no error string is
+-- created here.
+
+local ok, ffi = pcall(require, "ffi")
+if not ok then return nil end
+
+local uv = require("luv")
+
+ffi.cdef[[
+typedef struct {
+  int version;
+  uint64_t (*now)(const void* loop);
+  void (*update_time)(void* loop);
+  uint64_t (*hrtime)(void);
+  int (*is_active)(const void* handle);
+  int (*timer_again)(void* timer);
+  int (*timer_set_repeat)(void* timer, uint64_t repeat);
+  uint64_t (*timer_get_repeat)(const void* timer);
+  int (*try_write)(void* stream, const char* data, size_t len);
+  size_t (*write_queue_size)(const void* stream);
+} luv_ffi_api_t;
+]]
+
+local api_ptr, loop_ptr = uv.ffi_api()
+local api = ffi.cast("const luv_ffi_api_t*", api_ptr)
+local loop = ffi.cast("void*", loop_ptr)
+assert(api.version >= 1, "luv_ffi_api_t version mismatch")
+
+local tonumber = tonumber
+
+local fast = { version = api.version }
+
+function fast.now()
+  return tonumber(api.now(loop))
+end
+
+function fast.update_time()
+  api.update_time(loop)
+end
+
+function fast.hrtime()
+  return tonumber(api.hrtime())
+end
+
+-- Wrappers keep the userdata referenced, the C side only sees the pointer
+local Timer = {}
+Timer.__index = Timer
+
+function Timer:again()
+  return api.timer_again(self.ptr)
+end
+
+function Timer:set_repeat(repeat_)
+  return api.timer_set_repeat(self.ptr, repeat_)
+end
+
+function Timer:get_repeat()
+  return tonumber(api.timer_get_repeat(self.ptr))
+end
+
+function Timer:is_active()
+  return api.is_active(self.ptr) ~= 0
+end
+
+local Stream = {}
+Stream.__index = Stream
+
+-- Returns the number of bytes written or the negative error code
+function Stream:try_write(data)
+  return api.try_write(self.ptr, data, #data)
+end
+
+function Stream:write_queue_size()
+  return tonumber(api.write_queue_size(self.ptr))
+end
+
+Stream.is_active = Timer.is_active
+
+function fast.timer(handle)
+  assert(uv.handle_get_type(handle) == "timer", "uv_timer_t expected")
+  return setmetatable({ handle = handle, ptr = ffi.cast("void*", uv.ffi_handle(handle)) }, Timer)
+end
+
+function fast.stream(handle)
+  local kind = uv.handle_get_type(handle)
+  assert(kind == "tcp" or kind == "pipe" or kind == "tty", "uv_stream_t expected")
+  return setmetatable({ handle = handle, ptr = ffi.cast("void*", uv.ffi_handle(handle)) }, Stream)
+end
+
+return fast
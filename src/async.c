@@ -17,7 +17,7 @@
 #include "private.h"
 
 static uv_async_t* luv_check_async(lua_State* L, int index) {
-  uv_async_t* handle = (uv_async_t*)luv_checkudata(L, index, "uv_async");
+  uv_async_t* handle = (uv_async_t*)luv_checkudata(L, index, UV_ASYNC, "uv_async");
   luaL_argcheck(L, handle->type == UV_ASYNC && handle->data, index, "Expected uv_async_t");
   return handle;
 }
@@ -30,11 +30,22 @@ static void luv_async_cb(uv_async_t* handle) {
   luv_thread_arg_clear(L, (luv_thread_arg_t*)data->extra, LUVF_THREAD_SIDE_MAIN);
 }
 
+// Drops the sync objects of a send the callback never got
+static void luv_async_gc(void* extra) {
+  luv_thread_arg_t* args = (luv_thread_arg_t*)extra;
+  int i;
+  for (i = 0; i < args->argc; i++) {
+    if (args->argv[i].type == LUV_THREAD_TSYNC)
+      luv_sync_release((void*)args->argv[i].val.udata.data);
+  }
+  luv_free(args);
+}
+
 static int luv_new_async(lua_State* L) {
   uv_async_t* handle;
   luv_handle_t* data;
   int ret;
-  luv_ctx_t* ctx = luv_context(L);
+  luv_ctx_t* ctx = luv_upvalue_context(L);
   luaL_checktype(L, 1, LUA_TFUNCTION);
   handle = (uv_async_t*)luv_newuserdata(L, sizeof(*handle));
   ret = uv_async_init(ctx->loop, handle, luv_async_cb);
@@ -43,8 +54,8 @@ static int luv_new_async(lua_State* L) {
     return luv_error(L, ret);
   }
   data = luv_setup_handle(L, ctx);
-  data->extra = (luv_thread_arg_t*)malloc(sizeof(luv_thread_arg_t));
-  data->extra_gc = free;
+  data->extra = (luv_thread_arg_t*)luv_malloc(sizeof(luv_thread_arg_t), LUV_MEM_OTHER);
+  data->extra_gc = luv_async_gc;
   memset(data->extra, 0, sizeof(luv_thread_arg_t));
   handle->data = data;
   luv_check_callback(L, (luv_handle_t*)handle->data, LUV_ASYNC, 1);
@@ -17,13 +17,13 @@
 #include "private.h"
 
 static uv_check_t* luv_check_check(lua_State* L, int index) {
-  uv_check_t* handle = (uv_check_t*)luv_checkudata(L, index, "uv_check");
+  uv_check_t* handle = (uv_check_t*)luv_checkudata(L, index, UV_CHECK, "uv_check");
   luaL_argcheck(L, handle->type == UV_CHECK && handle->data, index, "Expected uv_check_t");
   return handle;
 }
 
 static int luv_new_check(lua_State* L) {
-  luv_ctx_t* ctx = luv_context(L);
+  luv_ctx_t* ctx = luv_upvalue_context(L);
   uv_check_t* handle = (uv_check_t*)luv_newuserdata(L, sizeof(*handle));
   int ret = uv_check_init(ctx->loop, handle);
   if (ret < 0) {
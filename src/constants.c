@@ -328,6 +328,17 @@ static int luv_constants(lua_State* L) {
   return 1;
 }
 
+// The libuv error codes by name, e.g. errno.EAGAIN
+static int luv_errno(lua_State* L) {
+  lua_newtable(L);
+#define XX(code, _)                  \
+  lua_pushinteger(L, UV_ ## code);   \
+  lua_setfield(L, -2, #code);
+  UV_ERRNO_MAP(XX)
+#undef XX
+  return 1;
+}
+
 static int luv_af_string_to_num(const char* string) {
   if (!string) return AF_UNSPEC;
 #ifdef AF_UNIX
@@ -60,129 +60,803 @@ static void luv_pushaddrinfo(lua_State* L, struct addrinfo* res) {
   }
 }
 
-static void luv_getaddrinfo_cb(uv_getaddrinfo_t* req, int status, struct addrinfo* res) {
-  luv_req_t* data = (luv_req_t*)req->data;
-  lua_State* L = data->ctx->L;
-  int nargs;
+/* Compact results
 
-  if (status < 0) {
-    luv_status(L, status);
-    nargs = 1;
+   The `result` hint selects what a lookup returns: the tables built above,
+   the distinct addresses as IP strings, or as uv_sockaddr userdata that
+   tcp:connect(), udp:send() and udp:connect() take in place of host and port.
+*/
+
+enum {
+  LUV_ADDRINFO_TABLE,
+  LUV_ADDRINFO_IP,
+  LUV_ADDRINFO_SOCKADDR
+};
+
+static const char* const luv_addrinfo_formats[] = {"table", "ip", "sockaddr", NULL};
+
+static size_t luv_sockaddr_len(int family) {
+  return family == AF_INET6 ? sizeof(struct sockaddr_in6) : sizeof(struct sockaddr_in);
+}
+
+static void luv_push_sockaddr(lua_State* L, const struct sockaddr* addr) {
+  struct sockaddr_storage* ud = (struct sockaddr_storage*)lua_newuserdata(L, sizeof(*ud));
+  memset(ud, 0, sizeof(*ud));
+  memcpy(ud, addr, luv_sockaddr_len(addr->sa_family));
+  luaL_getmetatable(L, "uv_sockaddr");
+  lua_setmetatable(L, -2);
+}
+
+static struct sockaddr* luv_test_sockaddr(lua_State* L, int index, int portidx, struct sockaddr_storage* addr) {
+  struct sockaddr_storage* ud = (struct sockaddr_storage*)luaL_testudata(L, index, "uv_sockaddr");
+  if (!ud) return NULL;
+  memcpy(addr, ud, sizeof(*addr));
+  if (lua_type(L, portidx) == LUA_TNUMBER) {
+    lua_Integer port = lua_tointeger(L, portidx);
+    luaL_argcheck(L, port >= 0 && port <= 65535, portidx, "port out of range");
+    if (addr->ss_family == AF_INET)
+      ((struct sockaddr_in*)addr)->sin_port = htons((unsigned short)port);
+    else
+      ((struct sockaddr_in6*)addr)->sin6_port = htons((unsigned short)port);
+  }
+  return (struct sockaddr*)addr;
+}
+
+// Pushes the ip and returns the port of an inet or inet6 address
+static int luv_sockaddr_ip(lua_State* L, const struct sockaddr* addr) {
+  char ip[INET6_ADDRSTRLEN];
+  int port;
+  if (addr->sa_family == AF_INET) {
+    uv_ip4_name((const struct sockaddr_in*)addr, ip, sizeof(ip));
+    port = ntohs(((const struct sockaddr_in*)addr)->sin_port);
   }
   else {
-    lua_pushnil(L);
+    uv_ip6_name((const struct sockaddr_in6*)addr, ip, sizeof(ip));
+    port = ntohs(((const struct sockaddr_in6*)addr)->sin6_port);
+  }
+  lua_pushstring(L, ip);
+  return port;
+}
+
+static int luv_sockaddr_index(lua_State* L) {
+  struct sockaddr_storage* addr = (struct sockaddr_storage*)luaL_checkudata(L, 1, "uv_sockaddr");
+  const char* key = luaL_checkstring(L, 2);
+  int port;
+  if (strcmp(key, "family") == 0) {
+    lua_pushstring(L, luv_af_num_to_string(addr->ss_family));
+    return 1;
+  }
+  port = luv_sockaddr_ip(L, (struct sockaddr*)addr);
+  if (strcmp(key, "ip") == 0) return 1;
+  lua_pop(L, 1);
+  if (strcmp(key, "port") == 0) {
+    lua_pushinteger(L, port);
+    return 1;
+  }
+  return 0;
+}
+
+static int luv_sockaddr_tostring(lua_State* L) {
+  struct sockaddr_storage* addr = (struct sockaddr_storage*)luaL_checkudata(L, 1, "uv_sockaddr");
+  int port = luv_sockaddr_ip(L, (struct sockaddr*)addr);
+  if (addr->ss_family == AF_INET6)
+    lua_pushfstring(L, "uv_sockaddr: [%s]:%d", lua_tostring(L, -1), port);
+  else
+    lua_pushfstring(L, "uv_sockaddr: %s:%d", lua_tostring(L, -1), port);
+  return 1;
+}
+
+static int luv_sockaddr_eq(lua_State* L) {
+  struct sockaddr_storage* a = (struct sockaddr_storage*)luaL_checkudata(L, 1, "uv_sockaddr");
+  struct sockaddr_storage* b = (struct sockaddr_storage*)luaL_checkudata(L, 2, "uv_sockaddr");
+  lua_pushboolean(L, a->ss_family == b->ss_family &&
+                     memcmp(a, b, luv_sockaddr_len(a->ss_family)) == 0);
+  return 1;
+}
+
+// Reads the `result` hint, hints that are not a table select the default
+static int luv_check_addrinfo_format(lua_State* L, int index) {
+  int format = LUV_ADDRINFO_TABLE;
+  if (lua_type(L, index) != LUA_TTABLE) return format;
+  lua_getfield(L, index, "result");
+  if (!lua_isnil(L, -1)) {
+    const char* name = lua_tostring(L, -1);
+    for (format = 0; name && luv_addrinfo_formats[format]; format++) {
+      if (strcmp(name, luv_addrinfo_formats[format]) == 0) break;
+    }
+    if (!name || !luv_addrinfo_formats[format])
+      luaL_argerror(L, index, "result hint must be \"table\", \"ip\" or \"sockaddr\"");
+  }
+  lua_pop(L, 1);
+  return format;
+}
+
+// Whether an inet or inet6 entry before curr has the same address and port,
+// getaddrinfo repeats them for every socktype
+static int luv_addrinfo_seen(struct addrinfo* res, struct addrinfo* curr) {
+  for (; res != curr; res = res->ai_next) {
+    if (res->ai_family == curr->ai_family &&
+        memcmp(res->ai_addr, curr->ai_addr, luv_sockaddr_len(curr->ai_family)) == 0)
+      return 1;
+  }
+  return 0;
+}
+
+static void luv_pushaddrinfo_format(lua_State* L, struct addrinfo* res, int format) {
+  struct addrinfo* curr;
+  int i = 0;
+  if (format == LUV_ADDRINFO_TABLE) {
     luv_pushaddrinfo(L, res);
-    nargs = 2;
+    return;
+  }
+  lua_newtable(L);
+  for (curr = res; curr; curr = curr->ai_next) {
+    if (curr->ai_family != AF_INET && curr->ai_family != AF_INET6) continue;
+    if (luv_addrinfo_seen(res, curr)) continue;
+    if (format == LUV_ADDRINFO_IP) luv_sockaddr_ip(L, curr->ai_addr);
+    else luv_push_sockaddr(L, curr->ai_addr);
+    lua_rawseti(L, -2, ++i);
   }
-  luv_fulfill_req(L, (luv_req_t*)req->data, nargs);
-  luv_cleanup_req(L, (luv_req_t*)req->data);
-  req->data = NULL;
-  if (res) uv_freeaddrinfo(res);
 }
 
+/* Resolver cache
 
-static int luv_getaddrinfo(lua_State* L) {
-  uv_getaddrinfo_t* req;
-  const char* node;
-  const char* service;
-  struct addrinfo hints_s;
-  struct addrinfo* hints = &hints_s;
-  int ret, ref;
-  luv_ctx_t* ctx = luv_context(L);
-  if (lua_isnoneornil(L, 1)) node = NULL;
-  else node = luaL_checkstring(L, 1);
-  if (lua_isnoneornil(L, 2)) service = NULL;
-  else service = luaL_checkstring(L, 2);
-  if (!lua_isnoneornil(L, 3)) luaL_checktype(L, 3, LUA_TTABLE);
-  else hints = NULL;
+   Opt-in per loop with uv.getaddrinfo_cache(). Entries are keyed by node,
+   service and hints and keep the addrinfo list returned by libuv, failures
+   that are about the name itself are cached too. A lookup already running in
+   the threadpool for a key is shared by every async caller asking for the same
+   key in the meantime.
+*/
+
+// Longer names bypass the cache, valid host names are at most 253 bytes
+#define LUV_DNS_MAX_KEY 1024
+
+typedef struct luv_dns_entry_s luv_dns_entry_t;
+
+struct luv_dns_entry_s {
+  luv_dns_entry_t* next;      /* bucket chain */
+  luv_dns_entry_t* lru_prev;  /* towards the most recently used */
+  luv_dns_entry_t* lru_next;
+  uint32_t hash;
+  int inflight;               /* a lookup for the key is running */
+  int status;                 /* < 0 for a cached failure */
+  struct addrinfo* res;
+  uint64_t expires;           /* in ms, same clock as luv_dns_now */
+  int waiters_ref;            /* table of callbacks sharing the lookup */
+  size_t keylen;
+  char key[1];
+};
+
+struct luv_dnscache_s {
+  uv_idle_t idle;             /* internal handle, must stay the first member */
+  luv_ctx_t* ctx;
+  int enabled;
+  uint64_t ttl;               /* in ms */
+  uint64_t negative_ttl;
+  size_t max_entries;
+  size_t nbuckets;            /* power of two */
+  luv_dns_entry_t** buckets;
+  luv_dns_entry_t* lru_head;  /* resolved entries, most recently used first */
+  luv_dns_entry_t* lru_tail;
+  size_t entries;
+  size_t inflight;
+  int pending_ref;            /* hits delivered from the idle callback */
+  int npending;
+  uint64_t hits, negative_hits, misses, coalesced, evictions, expired;
+};
+typedef struct luv_dnscache_s luv_dnscache_t;
+
+// uv_now only moves while the loop runs, sync lookups can happen without it
+static uint64_t luv_dns_now(void) {
+  return uv_hrtime() / 1000000;
+}
+
+// FNV-1a
+static uint32_t luv_dns_hash(const char* key, size_t len) {
+  uint32_t hash = 2166136261u;
+  size_t i;
+  for (i = 0; i < len; i++) {
+    hash ^= (unsigned char)key[i];
+    hash *= 16777619u;
+  }
+  return hash;
+}
+
+// Returns the length of the key written to buf, 0 when it doesn't fit
+static size_t luv_dns_key(char* buf, size_t size, const char* node, const char* service, const struct addrinfo* hints) {
+  int len;
   if (hints) {
-    // Initialize the hints
-    memset(hints, 0, sizeof(*hints));
+    len = snprintf(buf, size, "%d,%d,%d,%d|%c%s|%c%s",
+      hints->ai_family, hints->ai_socktype, hints->ai_protocol, hints->ai_flags,
+      node ? '+' : '-', node ? node : "", service ? '+' : '-', service ? service : "");
+  }
+  else {
+    len = snprintf(buf, size, "-|%c%s|%c%s",
+      node ? '+' : '-', node ? node : "", service ? '+' : '-', service ? service : "");
+  }
+  if (len < 0 || (size_t)len >= size) return 0;
+  return len;
+}
 
-    // Process the `family` hint.
-    lua_getfield(L, 3, "family");
-    if (lua_isnumber(L, -1)) {
-      hints->ai_family = lua_tointeger(L, -1);
+static luv_dns_entry_t* luv_dns_find(luv_dnscache_t* cache, const char* key, size_t keylen, uint32_t hash) {
+  luv_dns_entry_t* entry = cache->buckets[hash & (cache->nbuckets - 1)];
+  for (; entry; entry = entry->next) {
+    if (entry->hash == hash && entry->keylen == keylen && !memcmp(entry->key, key, keylen))
+      return entry;
+  }
+  return NULL;
+}
+
+static luv_dns_entry_t* luv_dns_insert(luv_dnscache_t* cache, const char* key, size_t keylen, uint32_t hash) {
+  luv_dns_entry_t** bucket = &cache->buckets[hash & (cache->nbuckets - 1)];
+  luv_dns_entry_t* entry = (luv_dns_entry_t*)luv_malloc(sizeof(*entry) + keylen, LUV_MEM_OTHER);
+  if (!entry) return NULL;
+  memset(entry, 0, sizeof(*entry));
+  entry->hash = hash;
+  entry->waiters_ref = LUA_NOREF;
+  entry->keylen = keylen;
+  memcpy(entry->key, key, keylen);
+  entry->key[keylen] = '\0';
+  entry->next = *bucket;
+  *bucket = entry;
+  return entry;
+}
+
+static void luv_dns_lru_unlink(luv_dnscache_t* cache, luv_dns_entry_t* entry) {
+  if (entry->lru_prev) entry->lru_prev->lru_next = entry->lru_next;
+  else cache->lru_head = entry->lru_next;
+  if (entry->lru_next) entry->lru_next->lru_prev = entry->lru_prev;
+  else cache->lru_tail = entry->lru_prev;
+  entry->lru_prev = entry->lru_next = NULL;
+}
+
+static void luv_dns_lru_push(luv_dnscache_t* cache, luv_dns_entry_t* entry) {
+  entry->lru_prev = NULL;
+  entry->lru_next = cache->lru_head;
+  if (cache->lru_head) cache->lru_head->lru_prev = entry;
+  else cache->lru_tail = entry;
+  cache->lru_head = entry;
+}
+
+// Unlinks and frees an entry, resolved entries are also in the lru list
+static void luv_dns_remove(luv_dnscache_t* cache, luv_dns_entry_t* entry) {
+  luv_dns_entry_t** link = &cache->buckets[entry->hash & (cache->nbuckets - 1)];
+  while (*link != entry) link = &(*link)->next;
+  *link = entry->next;
+  if (!entry->inflight) {
+    luv_dns_lru_unlink(cache, entry);
+    cache->entries--;
+  }
+  if (entry->res) uv_freeaddrinfo(entry->res);
+  luv_free(entry);
+}
+
+// Like luv_dns_find but drops an expired result
+static luv_dns_entry_t* luv_dns_fresh(luv_dnscache_t* cache, const char* key, size_t keylen, uint32_t hash) {
+  luv_dns_entry_t* entry = luv_dns_find(cache, key, keylen, hash);
+  if (entry && !entry->inflight && entry->expires <= luv_dns_now()) {
+    luv_dns_remove(cache, entry);
+    cache->expired++;
+    entry = NULL;
+  }
+  return entry;
+}
+
+static void luv_dns_trim(luv_dnscache_t* cache) {
+  while (cache->entries > cache->max_entries) {
+    luv_dns_remove(cache, cache->lru_tail);
+    cache->evictions++;
+  }
+}
+
+// Drops every resolved entry, running lookups complete and are dropped then
+static void luv_dns_flush(luv_dnscache_t* cache) {
+  while (cache->lru_head) luv_dns_remove(cache, cache->lru_head);
+}
+
+// Only failures about the name are worth remembering, not cancellations or
+// bad arguments
+static int luv_dns_cacheable_error(int status) {
+  return status == UV_EAI_NONAME || status == UV_EAI_AGAIN ||
+         status == UV_EAI_FAIL || status == UV_EAI_NODATA;
+}
+
+static luv_dns_entry_t* luv_dns_start(luv_dnscache_t* cache, const char* key, size_t keylen, uint32_t hash) {
+  luv_dns_entry_t* entry = luv_dns_insert(cache, key, keylen, hash);
+  if (entry) {
+    entry->inflight = 1;
+    cache->inflight++;
+  }
+  return entry;
+}
+
+// Completes an in-flight entry. Returns 1 when the entry took ownership of
+// res, otherwise it stays the caller's to free. Entries that aren't kept are
+// freed.
+static int luv_dns_store(luv_dnscache_t* cache, luv_dns_entry_t* entry, int status, struct addrinfo* res) {
+  uint64_t ttl = status < 0 ? cache->negative_ttl : cache->ttl;
+  cache->inflight--;
+  if (!cache->enabled || !ttl || (status < 0 && !luv_dns_cacheable_error(status))) {
+    luv_dns_remove(cache, entry);
+    return 0;
+  }
+  entry->inflight = 0;
+  entry->status = status < 0 ? status : 0;
+  entry->res = status < 0 ? NULL : res;
+  entry->expires = luv_dns_now() + ttl;
+  luv_dns_lru_push(cache, entry);
+  cache->entries++;
+  luv_dns_trim(cache);
+  return status >= 0;
+}
+
+// Pushes what a callback gets for the result: the error name, or nil and the
+// address table. Returns the number of values pushed.
+static int luv_dns_push_result(lua_State* L, int status, struct addrinfo* res, int format) {
+  if (status < 0) {
+    luv_status(L, status);
+    return 1;
+  }
+  lua_pushnil(L);
+  luv_pushaddrinfo_format(L, res, format);
+  return 2;
+}
+
+static void luv_dns_idle_cb(uv_idle_t* handle) {
+  luv_dnscache_t* cache = (luv_dnscache_t*)handle;
+  lua_State* L = cache->ctx->L;
+  int i, n;
+  // swap in a fresh queue first, callbacks may hit the cache again
+  lua_rawgeti(L, LUA_REGISTRYINDEX, cache->pending_ref);
+  luaL_unref(L, LUA_REGISTRYINDEX, cache->pending_ref);
+  lua_newtable(L);
+  cache->pending_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+  n = cache->npending;
+  cache->npending = 0;
+  uv_idle_stop(handle);
+  // triples of callback, error and addresses, either of the last two is nil
+  for (i = 1; i < n; i += 3) {
+    lua_rawgeti(L, -1, i);
+    lua_rawgeti(L, -2, i + 1);
+    lua_rawgeti(L, -3, i + 2);
+    cache->ctx->pcall(L, 2, 0, 0);
+  }
+  lua_pop(L, 1);
+}
+
+// Serves a hit to an async caller from the idle callback, never from within
+// uv.getaddrinfo itself
+static void luv_dns_defer(lua_State* L, luv_dnscache_t* cache, int ref, luv_dns_entry_t* entry, int format) {
+  int n = cache->npending;
+  lua_rawgeti(L, LUA_REGISTRYINDEX, cache->pending_ref);
+  lua_rawgeti(L, LUA_REGISTRYINDEX, ref);
+  lua_rawseti(L, -2, n + 1);
+  luaL_unref(L, LUA_REGISTRYINDEX, ref);
+  if (entry->status < 0) {
+    luv_status(L, entry->status);
+    lua_rawseti(L, -2, n + 2);
+  }
+  else {
+    luv_pushaddrinfo_format(L, entry->res, format);
+    lua_rawseti(L, -2, n + 3);
+  }
+  lua_pop(L, 1);
+  cache->npending = n + 3;
+  uv_idle_start(&cache->idle, luv_dns_idle_cb);
+}
+
+// Waiters are kept as pairs of callback and result format. The table also
+// keeps node, service and hints, to run the lookup again for the waiters when
+// the caller that started it cancels.
+static void luv_dns_add_waiter(lua_State* L, luv_dns_entry_t* entry, int ref, int format,
+                               const char* node, const char* service, const struct addrinfo* hints) {
+  int n;
+  if (entry->waiters_ref == LUA_NOREF) {
+    lua_newtable(L);
+    lua_pushstring(L, node);
+    lua_setfield(L, -2, "node");
+    lua_pushstring(L, service);
+    lua_setfield(L, -2, "service");
+    if (hints) {
+      *(struct addrinfo*)lua_newuserdata(L, sizeof(*hints)) = *hints;
+      lua_setfield(L, -2, "hints");
     }
-    else if (lua_isstring(L, -1)) {
-      hints->ai_family = luv_af_string_to_num(lua_tostring(L, -1));
+    entry->waiters_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+  }
+  lua_rawgeti(L, LUA_REGISTRYINDEX, entry->waiters_ref);
+  n = (int)lua_rawlen(L, -1);
+  lua_rawgeti(L, LUA_REGISTRYINDEX, ref);
+  lua_rawseti(L, -2, n + 1);
+  lua_pushinteger(L, format);
+  lua_rawseti(L, -2, n + 2);
+  lua_pop(L, 1);
+  luaL_unref(L, LUA_REGISTRYINDEX, ref);
+}
+
+static int luv_dns_rehash(luv_dnscache_t* cache, size_t max_entries) {
+  size_t nbuckets = 16, i;
+  luv_dns_entry_t** buckets;
+  while (nbuckets < max_entries && nbuckets < ((size_t)1 << 20)) nbuckets <<= 1;
+  if (nbuckets == cache->nbuckets) return 0;
+  buckets = (luv_dns_entry_t**)luv_malloc(nbuckets * sizeof(*buckets), LUV_MEM_OTHER);
+  if (!buckets) return UV_ENOMEM;
+  memset(buckets, 0, nbuckets * sizeof(*buckets));
+  for (i = 0; i < cache->nbuckets; i++) {
+    luv_dns_entry_t* entry = cache->buckets[i];
+    while (entry) {
+      luv_dns_entry_t* next = entry->next;
+      luv_dns_entry_t** bucket = &buckets[entry->hash & (nbuckets - 1)];
+      entry->next = *bucket;
+      *bucket = entry;
+      entry = next;
     }
-    else if (lua_isnil(L, -1)) {
-      hints->ai_family = AF_UNSPEC;
+  }
+  luv_free(cache->buckets);
+  cache->buckets = buckets;
+  cache->nbuckets = nbuckets;
+  return 0;
+}
+
+static void luv_dnscache_free_cb(uv_handle_t* handle) {
+  luv_free(handle);
+}
+
+static int luv_dnscache_gc(lua_State* L) {
+  luv_dnscache_t** udata = (luv_dnscache_t**)lua_touserdata(L, 1);
+  luv_dnscache_t* cache = *udata;
+  size_t i;
+  if (!cache) return 0;
+  // loop_gc may still run the callbacks of pending lookups, they find no
+  // cache then and free their in-flight entries themselves
+  for (i = 0; i < cache->nbuckets; i++) {
+    luv_dns_entry_t* entry = cache->buckets[i];
+    while (entry) {
+      luv_dns_entry_t* next = entry->next;
+      if (entry->inflight) {
+        entry->next = NULL;
+      }
+      else {
+        if (entry->res) uv_freeaddrinfo(entry->res);
+        luv_free(entry);
+      }
+      entry = next;
     }
-    else {
-      luaL_argerror(L, 3, "family hint must be string if set");
+  }
+  luv_free(cache->buckets);
+  cache->buckets = NULL;
+  cache->ctx->dnscache = NULL;
+  if (!luv_close_internal_handle((uv_handle_t*)&cache->idle, luv_dnscache_free_cb))
+    luv_free(cache);
+  *udata = NULL;
+  return 0;
+}
+
+static int luv_getaddrinfo_cache(lua_State* L) {
+  luv_ctx_t* ctx = luv_upvalue_context(L);
+  luv_dnscache_t* cache = ctx->dnscache;
+  lua_Integer ttl = 60000, negative_ttl = 5000, max_entries = 1024;
+  int ret;
+
+  if (lua_isnoneornil(L, 1)) {
+    if (cache) {
+      cache->enabled = 0;
+      luv_dns_flush(cache);
     }
-    lua_pop(L, 1);
+    return luv_result(L, 0);
+  }
+  luaL_checktype(L, 1, LUA_TTABLE);
+  lua_getfield(L, 1, "ttl");
+  ttl = luaL_optinteger(L, -1, ttl);
+  lua_getfield(L, 1, "negative_ttl");
+  negative_ttl = luaL_optinteger(L, -1, negative_ttl);
+  lua_getfield(L, 1, "max_entries");
+  max_entries = luaL_optinteger(L, -1, max_entries);
+  lua_pop(L, 3);
+  luaL_argcheck(L, ttl >= 0, 1, "ttl must not be negative");
+  luaL_argcheck(L, negative_ttl >= 0, 1, "negative_ttl must not be negative");
+  luaL_argcheck(L, max_entries > 0, 1, "max_entries must be positive");
 
-    // Process `socktype` hint
-    lua_getfield(L, 3, "socktype");
-    if (lua_isnumber(L, -1)) {
-      hints->ai_socktype = lua_tointeger(L, -1);
+  if (!cache) {
+    cache = (luv_dnscache_t*)luv_malloc(sizeof(*cache), LUV_MEM_OTHER);
+    if (!cache) return luaL_error(L, "Can't allocate resolver cache");
+    memset(cache, 0, sizeof(*cache));
+    ret = uv_idle_init(ctx->loop, &cache->idle);
+    if (ret < 0) {
+      luv_free(cache);
+      return luv_error(L, ret);
     }
-    else if (lua_isstring(L, -1)) {
-      hints->ai_socktype = luv_sock_string_to_num(lua_tostring(L, -1));
+    luv_init_internal_handle((uv_handle_t*)&cache->idle);
+    cache->ctx = ctx;
+    lua_newtable(L);
+    cache->pending_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+
+    luv_anchor_internal(L, cache, "luv_dnscache");
+    ctx->dnscache = cache;
+  }
+
+  ret = luv_dns_rehash(cache, (size_t)max_entries);
+  if (ret < 0) return luv_error(L, ret);
+  cache->enabled = 1;
+  cache->ttl = ttl;
+  cache->negative_ttl = negative_ttl;
+  cache->max_entries = max_entries;
+  luv_dns_trim(cache);
+  return luv_result(L, 0);
+}
+
+static int luv_getaddrinfo_cache_stats(lua_State* L) {
+  luv_dnscache_t* cache = luv_upvalue_context(L)->dnscache;
+  int reset = luv_optboolean(L, 1, 0);
+  if (!cache) return 0;
+  lua_createtable(L, 0, 8);
+  lua_pushinteger(L, cache->entries);
+  lua_setfield(L, -2, "entries");
+  lua_pushinteger(L, cache->inflight);
+  lua_setfield(L, -2, "inflight");
+  lua_pushinteger(L, cache->hits);
+  lua_setfield(L, -2, "hits");
+  lua_pushinteger(L, cache->negative_hits);
+  lua_setfield(L, -2, "negative_hits");
+  lua_pushinteger(L, cache->misses);
+  lua_setfield(L, -2, "misses");
+  lua_pushinteger(L, cache->coalesced);
+  lua_setfield(L, -2, "coalesced");
+  lua_pushinteger(L, cache->expired);
+  lua_setfield(L, -2, "expired");
+  lua_pushinteger(L, cache->evictions);
+  lua_setfield(L, -2, "evictions");
+  if (reset) {
+    cache->hits = cache->negative_hits = cache->misses = 0;
+    cache->coalesced = cache->expired = cache->evictions = 0;
+  }
+  return 1;
+}
+
+static int luv_addrinfo_batch_gc(lua_State* L);
+
+static void luv_dns_init(lua_State* L) {
+  luaL_newmetatable(L, "luv_dnscache");
+  lua_pushcfunction(L, luv_dnscache_gc);
+  lua_setfield(L, -2, "__gc");
+  lua_pop(L, 1);
+
+  luaL_newmetatable(L, "luv_addrinfo_batch");
+  lua_pushcfunction(L, luv_addrinfo_batch_gc);
+  lua_setfield(L, -2, "__gc");
+  lua_pop(L, 1);
+
+  luaL_newmetatable(L, "uv_sockaddr");
+  lua_pushcfunction(L, luv_sockaddr_index);
+  lua_setfield(L, -2, "__index");
+  lua_pushcfunction(L, luv_sockaddr_tostring);
+  lua_setfield(L, -2, "__tostring");
+  lua_pushcfunction(L, luv_sockaddr_eq);
+  lua_setfield(L, -2, "__eq");
+  lua_pop(L, 1);
+}
+
+// The request userdata of uv.getaddrinfo, remembers the result format
+typedef struct {
+  uv_getaddrinfo_t req;
+  int format;
+} luv_getaddrinfo_req_t;
+
+static void luv_getaddrinfo_cb(uv_getaddrinfo_t* req, int status, struct addrinfo* res);
+
+// Runs a shared lookup again for its waiters, the caller that started it
+// canceled. The new request has no callback of its own, its callback only
+// serves the waiters.
+static int luv_dns_resubmit(lua_State* L, luv_ctx_t* ctx, luv_dns_entry_t* entry) {
+  luv_getaddrinfo_req_t* data;
+  uv_getaddrinfo_t* req;
+  const char* node;
+  const char* service;
+  const struct addrinfo* hints;
+  int ret;
+  // the waiters table keeps the strings alive while it is on the stack
+  lua_rawgeti(L, LUA_REGISTRYINDEX, entry->waiters_ref);
+  lua_getfield(L, -1, "node");
+  node = lua_tostring(L, -1);
+  lua_getfield(L, -2, "service");
+  service = lua_tostring(L, -1);
+  lua_getfield(L, -3, "hints");
+  hints = (const struct addrinfo*)lua_touserdata(L, -1);
+  lua_pop(L, 3);
+
+  data = (luv_getaddrinfo_req_t*)lua_newuserdata(L, sizeof(*data));
+  data->format = LUV_ADDRINFO_IP;
+  req = &data->req;
+  req->data = luv_setup_req(L, ctx, LUA_NOREF);
+  ret = uv_getaddrinfo(ctx->loop, req, luv_getaddrinfo_cb, node, service, hints);
+  if (ret < 0)
+    luv_cleanup_req(L, (luv_req_t*)req->data);
+  else {
+    ((luv_req_t*)req->data)->data = entry;
+    luv_threadpool_submit(ctx, LUV_TP_GETADDRINFO, &((luv_req_t*)req->data)->submitted);
+  }
+  lua_pop(L, 2);
+  return ret;
+}
+
+static void luv_getaddrinfo_cb(uv_getaddrinfo_t* req, int status, struct addrinfo* res) {
+  luv_req_t* data = (luv_req_t*)req->data;
+  int format = ((luv_getaddrinfo_req_t*)req)->format;
+  lua_State* L = data->ctx->L;
+  luv_dns_entry_t* entry = (luv_dns_entry_t*)data->data;
+  int nargs, i, nwaiters = 0, waiting = 0;
+
+  luv_threadpool_complete(data->ctx, LUV_TP_GETADDRINFO, data->submitted, 0, 0);
+
+  // set by the resolver cache, not owned by the request
+  data->data = NULL;
+  if (status == UV_ECANCELED && entry && data->ctx->dnscache && entry->waiters_ref != LUA_NOREF) {
+    // only the caller that canceled gets UV_ECANCELED, the waiters keep
+    // waiting on a new request
+    int ret = luv_dns_resubmit(L, data->ctx, entry);
+    if (ret == 0) {
+      nargs = luv_dns_push_result(L, status, NULL, format);
+      luv_fulfill_req(L, data, nargs);
+      luv_cleanup_req(L, data);
+      req->data = NULL;
+      return;
     }
-    else if (!lua_isnil(L, -1)) {
-      return luaL_argerror(L, 3, "socktype hint must be string if set");
+    status = ret;
+  }
+  if (entry && entry->waiters_ref != LUA_NOREF) {
+    // Build every result before any callback runs, the callbacks can flush
+    // the cache and res with it. Each waiter gets its own table.
+    lua_rawgeti(L, LUA_REGISTRYINDEX, entry->waiters_ref);
+    luaL_unref(L, LUA_REGISTRYINDEX, entry->waiters_ref);
+    entry->waiters_ref = LUA_NOREF;
+    waiting = 1;
+    nwaiters = (int)lua_rawlen(L, -1) / 2;
+    for (i = 1; status >= 0 && i <= nwaiters; i++) {
+      lua_rawgeti(L, -1, 2 * i);
+      luv_pushaddrinfo_format(L, res, (int)lua_tointeger(L, -1));
+      lua_remove(L, -2);
+      lua_rawseti(L, -2, 2 * nwaiters + i);
     }
-    lua_pop(L, 1);
+  }
+
+  nargs = luv_dns_push_result(L, status, res, format);
+  if (entry && !data->ctx->dnscache)
+    luv_free(entry);
+  else if (entry && luv_dns_store(data->ctx->dnscache, entry, status, res))
+    res = NULL;
+  if (res) uv_freeaddrinfo(res);
+  luv_fulfill_req(L, (luv_req_t*)req->data, nargs);
+  luv_cleanup_req(L, (luv_req_t*)req->data);
+  req->data = NULL;
 
-    // Process the `protocol` hint
-    lua_getfield(L, 3, "protocol");
-    if (lua_isnumber(L, -1)) {
-      hints->ai_protocol = lua_tointeger(L, -1);
+  for (i = 1; i <= nwaiters; i++) {
+    lua_rawgeti(L, -1, 2 * i - 1);
+    if (status < 0) {
+      luv_status(L, status);
+      nargs = 1;
     }
-    else if (lua_isstring(L, -1)) {
-      int protocol = luv_proto_string_to_num(lua_tostring(L, -1));
-      if (protocol < 0) {
-        return luaL_argerror(L, 3, lua_pushfstring(L, "invalid protocol: %s", lua_tostring(L, -1)));
-      }
-      hints->ai_protocol = protocol;
+    else {
+      lua_pushnil(L);
+      lua_rawgeti(L, -3, 2 * nwaiters + i);
+      nargs = 2;
     }
-    else if (!lua_isnil(L, -1)) {
-      return luaL_argerror(L, 3, "protocol hint must be string if set");
+    data->ctx->pcall(L, nargs, 0, 0);
+  }
+  if (waiting) lua_pop(L, 1);
+}
+
+
+// Fills hints from the table at index, the same way for every lookup function
+static void luv_check_addrinfo_hints(lua_State* L, int index, struct addrinfo* hints) {
+  // Initialize the hints
+  memset(hints, 0, sizeof(*hints));
+
+  // Process the `family` hint.
+  lua_getfield(L, index, "family");
+  if (lua_isnumber(L, -1)) {
+    hints->ai_family = lua_tointeger(L, -1);
+  }
+  else if (lua_isstring(L, -1)) {
+    hints->ai_family = luv_af_string_to_num(lua_tostring(L, -1));
+  }
+  else if (lua_isnil(L, -1)) {
+    hints->ai_family = AF_UNSPEC;
+  }
+  else {
+    luaL_argerror(L, index, "family hint must be string if set");
+  }
+  lua_pop(L, 1);
+
+  // Process `socktype` hint
+  lua_getfield(L, index, "socktype");
+  if (lua_isnumber(L, -1)) {
+    hints->ai_socktype = lua_tointeger(L, -1);
+  }
+  else if (lua_isstring(L, -1)) {
+    hints->ai_socktype = luv_sock_string_to_num(lua_tostring(L, -1));
+  }
+  else if (!lua_isnil(L, -1)) {
+    luaL_argerror(L, index, "socktype hint must be string if set");
+  }
+  lua_pop(L, 1);
+
+  // Process the `protocol` hint
+  lua_getfield(L, index, "protocol");
+  if (lua_isnumber(L, -1)) {
+    hints->ai_protocol = lua_tointeger(L, -1);
+  }
+  else if (lua_isstring(L, -1)) {
+    int protocol = luv_proto_string_to_num(lua_tostring(L, -1));
+    if (protocol < 0) {
+      luaL_argerror(L, index, lua_pushfstring(L, "invalid protocol: %s", lua_tostring(L, -1)));
     }
-    lua_pop(L, 1);
+    hints->ai_protocol = protocol;
+  }
+  else if (!lua_isnil(L, -1)) {
+    luaL_argerror(L, index, "protocol hint must be string if set");
+  }
+  lua_pop(L, 1);
 
-    lua_getfield(L, 3, "addrconfig");
-    if (lua_toboolean(L, -1)) hints->ai_flags |=  AI_ADDRCONFIG;
-    lua_pop(L, 1);
+  lua_getfield(L, index, "addrconfig");
+  if (lua_toboolean(L, -1)) hints->ai_flags |=  AI_ADDRCONFIG;
+  lua_pop(L, 1);
 
 #ifdef AI_V4MAPPED
-    lua_getfield(L, 3, "v4mapped");
-    if (lua_toboolean(L, -1)) hints->ai_flags |=  AI_V4MAPPED;
-    lua_pop(L, 1);
+  lua_getfield(L, index, "v4mapped");
+  if (lua_toboolean(L, -1)) hints->ai_flags |=  AI_V4MAPPED;
+  lua_pop(L, 1);
 #endif
 
 #ifdef AI_ALL
-    lua_getfield(L, 3, "all");
-    if (lua_toboolean(L, -1)) hints->ai_flags |=  AI_ALL;
-    lua_pop(L, 1);
+  lua_getfield(L, index, "all");
+  if (lua_toboolean(L, -1)) hints->ai_flags |=  AI_ALL;
+  lua_pop(L, 1);
 #endif
 
-    lua_getfield(L, 3, "numerichost");
-    if (lua_toboolean(L, -1)) hints->ai_flags |=  AI_NUMERICHOST;
-    lua_pop(L, 1);
+  lua_getfield(L, index, "numerichost");
+  if (lua_toboolean(L, -1)) hints->ai_flags |=  AI_NUMERICHOST;
+  lua_pop(L, 1);
 
-    lua_getfield(L, 3, "passive");
-    if (lua_toboolean(L, -1)) hints->ai_flags |=  AI_PASSIVE;
-    lua_pop(L, 1);
+  lua_getfield(L, index, "passive");
+  if (lua_toboolean(L, -1)) hints->ai_flags |=  AI_PASSIVE;
+  lua_pop(L, 1);
 
-    lua_getfield(L, 3, "numericserv");
-    if (lua_toboolean(L, -1)) {
-        hints->ai_flags |=  AI_NUMERICSERV;
-        /* On OS X upto at least OSX 10.9, getaddrinfo crashes
-         * if AI_NUMERICSERV is set and the servname is NULL or "0".
-         * This workaround avoids a segfault in libsystem.
-         */
-        if (NULL == service) service = "00";
-    }
-    lua_pop(L, 1);
+  lua_getfield(L, index, "numericserv");
+  if (lua_toboolean(L, -1)) hints->ai_flags |=  AI_NUMERICSERV;
+  lua_pop(L, 1);
 
-    lua_getfield(L, 3, "canonname");
-    if (lua_toboolean(L, -1)) hints->ai_flags |=  AI_CANONNAME;
-    lua_pop(L, 1);
+  lua_getfield(L, index, "canonname");
+  if (lua_toboolean(L, -1)) hints->ai_flags |=  AI_CANONNAME;
+  lua_pop(L, 1);
+}
+
+static int luv_getaddrinfo(lua_State* L) {
+  luv_getaddrinfo_req_t* data;
+  uv_getaddrinfo_t* req;
+  const char* node;
+  const char* service;
+  struct addrinfo hints_s;
+  struct addrinfo* hints = &hints_s;
+  int ret, ref, format;
+  luv_ctx_t* ctx = luv_context(L);
+  luv_dnscache_t* cache = ctx->dnscache;
+  luv_dns_entry_t* entry = NULL;
+  char key[LUV_DNS_MAX_KEY];
+  size_t keylen = 0;
+  uint32_t hash = 0;
+  if (lua_isnoneornil(L, 1)) node = NULL;
+  else node = luaL_checkstring(L, 1);
+  if (lua_isnoneornil(L, 2)) service = NULL;
+  else service = luaL_checkstring(L, 2);
+  if (!lua_isnoneornil(L, 3)) luaL_checktype(L, 3, LUA_TTABLE);
+  else hints = NULL;
+  format = luv_check_addrinfo_format(L, 3);
+  if (hints) {
+    luv_check_addrinfo_hints(L, 3, hints);
+    /* On OS X upto at least OSX 10.9, getaddrinfo crashes
+     * if AI_NUMERICSERV is set and the servname is NULL or "0".
+     * This workaround avoids a segfault in libsystem.
+     */
+    if ((hints->ai_flags & AI_NUMERICSERV) && NULL == service) service = "00";
   }
 
   ref = luv_check_continuation(L, 4);
@@ -192,31 +866,350 @@ static int luv_getaddrinfo(lua_State* L) {
     return luaL_argerror(L, 4, "callback must be provided");
   }
 #endif
-  req = (uv_getaddrinfo_t*)lua_newuserdata(L, sizeof(*req));
+  if (cache && cache->enabled)
+    keylen = luv_dns_key(key, sizeof(key), node, service, hints);
+  if (keylen) {
+    hash = luv_dns_hash(key, keylen);
+    entry = luv_dns_fresh(cache, key, keylen, hash);
+    if (entry && entry->inflight) {
+      // share the running lookup, a sync caller can't wait on it and does
+      // its own without storing the result
+      if (ref != LUA_NOREF) {
+        luv_dns_add_waiter(L, entry, ref, format, node, service, hints);
+        cache->coalesced++;
+        lua_pushboolean(L, 1);
+        return 1;
+      }
+      keylen = 0;
+      entry = NULL;
+    }
+    else if (entry) {
+      luv_dns_lru_unlink(cache, entry);
+      luv_dns_lru_push(cache, entry);
+      if (entry->status < 0) cache->negative_hits++;
+      else cache->hits++;
+      if (ref != LUA_NOREF) {
+        luv_dns_defer(L, cache, ref, entry, format);
+        lua_pushboolean(L, 1);
+        return 1;
+      }
+      if (entry->status < 0) return luv_error(L, entry->status);
+      luv_pushaddrinfo_format(L, entry->res, format);
+      return 1;
+    }
+    else {
+      cache->misses++;
+    }
+  }
+
+  data = (luv_getaddrinfo_req_t*)lua_newuserdata(L, sizeof(*data));
+  data->format = format;
+  req = &data->req;
   req->data = luv_setup_req(L, ctx, ref);
 
   ret = uv_getaddrinfo(ctx->loop, req, ref == LUA_NOREF ? NULL : luv_getaddrinfo_cb, node, service, hints);
+  // for the sync version ret is the outcome of the lookup itself
+  if (keylen && (ret == 0 || (ref == LUA_NOREF && luv_dns_cacheable_error(ret))))
+    entry = luv_dns_start(cache, key, keylen, hash);
   if (ret < 0) {
+    if (entry) luv_dns_store(cache, entry, ret, NULL);
     luv_cleanup_req(L, (luv_req_t*)req->data);
     lua_pop(L, 1);
     return luv_error(L, ret);
   }
+  if (ref != LUA_NOREF) {
+    ((luv_req_t*)req->data)->data = entry;
+    luv_threadpool_submit(ctx, LUV_TP_GETADDRINFO, &((luv_req_t*)req->data)->submitted);
+  }
 #if LUV_UV_VERSION_GEQ(1, 3, 0)
   if (ref == LUA_NOREF) {
     lua_pop(L, 1);
-    luv_pushaddrinfo(L, req->addrinfo);
-    uv_freeaddrinfo(req->addrinfo);
+    luv_pushaddrinfo_format(L, req->addrinfo, format);
+    if (!entry || !luv_dns_store(cache, entry, 0, req->addrinfo))
+      uv_freeaddrinfo(req->addrinfo);
     luv_cleanup_req(L, (luv_req_t*)req->data);
   }
 #endif
   return 1;
 }
 
+/* Batch lookups
+
+   uv.getaddrinfo_many() keeps at most `concurrency` requests of a list in the
+   threadpool and collects everything in one table, so a refresh of thousands
+   of names needs neither a userdata nor a callback per name.
+*/
+
+typedef struct {
+  uv_timer_t timer;           /* internal handle, must stay the first member */
+  luv_ctx_t* ctx;
+  struct addrinfo hints;
+  int has_hints;
+  int format;
+  int names_ref;              /* copy of the list */
+  int results_ref;            /* name -> addresses or error name */
+  int cb_ref;
+  int count;
+  int next;                   /* names started so far */
+  int active;
+  int concurrency;
+  int anchor;                 /* tears it down when the state closes */
+  int dead;                   /* state closing, nothing is called back */
+  int closed;                 /* timer closed, freed once nothing runs */
+} luv_addrinfo_batch_t;
+
+typedef struct {
+  uv_getaddrinfo_t req;
+  luv_addrinfo_batch_t* batch;
+  int index;                  /* of the name in the list */
+  uint64_t submitted;
+} luv_addrinfo_batch_req_t;
+
+static void luv_addrinfo_batch_release(luv_addrinfo_batch_t* batch) {
+  if (batch->closed && !batch->active) luv_free(batch);
+}
+
+static void luv_addrinfo_batch_close_cb(uv_handle_t* handle) {
+  luv_addrinfo_batch_t* batch = (luv_addrinfo_batch_t*)handle;
+  batch->closed = 1;
+  luv_addrinfo_batch_release(batch);
+}
+
+static void luv_addrinfo_batch_finish(luv_addrinfo_batch_t* batch) {
+  lua_State* L = batch->ctx->L;
+  lua_rawgeti(L, LUA_REGISTRYINDEX, batch->cb_ref);
+  lua_pushnil(L);
+  lua_rawgeti(L, LUA_REGISTRYINDEX, batch->results_ref);
+  luaL_unref(L, LUA_REGISTRYINDEX, batch->cb_ref);
+  luaL_unref(L, LUA_REGISTRYINDEX, batch->results_ref);
+  luaL_unref(L, LUA_REGISTRYINDEX, batch->names_ref);
+  luv_unanchor_internal(L, batch->anchor);
+  luv_close_internal_handle((uv_handle_t*)&batch->timer, luv_addrinfo_batch_close_cb);
+  batch->ctx->pcall(L, 2, 0, 0);
+}
+
+// Runs when the state closes before the batch is done. Requests in the
+// threadpool still complete, the last one frees the batch.
+static int luv_addrinfo_batch_gc(lua_State* L) {
+  luv_addrinfo_batch_t** udata = (luv_addrinfo_batch_t**)lua_touserdata(L, 1);
+  luv_addrinfo_batch_t* batch = *udata;
+  if (!batch) return 0;
+  *udata = NULL;
+  batch->dead = 1;
+  luaL_unref(L, LUA_REGISTRYINDEX, batch->cb_ref);
+  luaL_unref(L, LUA_REGISTRYINDEX, batch->results_ref);
+  luaL_unref(L, LUA_REGISTRYINDEX, batch->names_ref);
+  // after loop_gc every request is done and the timer closed
+  if (!luv_close_internal_handle((uv_handle_t*)&batch->timer, luv_addrinfo_batch_close_cb))
+    luv_addrinfo_batch_close_cb((uv_handle_t*)&batch->timer);
+  return 0;
+}
+
+static void luv_addrinfo_batch_timer_cb(uv_timer_t* handle) {
+  luv_addrinfo_batch_finish((luv_addrinfo_batch_t*)handle);
+}
+
+// Cache key of a batch name, 0 when the cache is off, already collected or
+// can't hold it
+static size_t luv_addrinfo_batch_key(luv_addrinfo_batch_t* batch, const char* name, char* key, uint32_t* hash) {
+  luv_dnscache_t* cache = batch->ctx->dnscache;
+  size_t keylen;
+  if (!cache || !cache->enabled) return 0;
+  keylen = luv_dns_key(key, LUV_DNS_MAX_KEY, name, NULL, batch->has_hints ? &batch->hints : NULL);
+  if (keylen) *hash = luv_dns_hash(key, keylen);
+  return keylen;
+}
+
+static void luv_addrinfo_batch_cb(uv_getaddrinfo_t* req, int status, struct addrinfo* res);
+
+// Starts names until `concurrency` requests run, names answered by the cache
+// or failing right away are filled in directly
+static void luv_addrinfo_batch_pump(lua_State* L, luv_addrinfo_batch_t* batch) {
+  luv_dnscache_t* cache = batch->ctx->dnscache;
+  char key[LUV_DNS_MAX_KEY];
+  uint32_t hash = 0;
+  lua_rawgeti(L, LUA_REGISTRYINDEX, batch->names_ref);
+  lua_rawgeti(L, LUA_REGISTRYINDEX, batch->results_ref);
+  while (batch->active < batch->concurrency && batch->next < batch->count) {
+    luv_addrinfo_batch_req_t* req;
+    const char* name;
+    size_t keylen;
+    int ret;
+    int index = ++batch->next;
+    lua_rawgeti(L, -2, index);
+    name = lua_tostring(L, -1);
+    // duplicates are looked up once
+    lua_pushvalue(L, -1);
+    lua_rawget(L, -3);
+    if (!lua_isnil(L, -1)) {
+      lua_pop(L, 2);
+      continue;
+    }
+    lua_pop(L, 1);
+
+    keylen = luv_addrinfo_batch_key(batch, name, key, &hash);
+    if (keylen) {
+      luv_dns_entry_t* entry = luv_dns_fresh(cache, key, keylen, hash);
+      if (entry && !entry->inflight) {
+        luv_dns_lru_unlink(cache, entry);
+        luv_dns_lru_push(cache, entry);
+        if (entry->status < 0) {
+          cache->negative_hits++;
+          luv_status(L, entry->status);
+        }
+        else {
+          cache->hits++;
+          luv_pushaddrinfo_format(L, entry->res, batch->format);
+        }
+        lua_rawset(L, -3);
+        continue;
+      }
+      if (!entry) cache->misses++;
+    }
+
+    req = (luv_addrinfo_batch_req_t*)luv_malloc(sizeof(*req), LUV_MEM_REQ);
+    ret = req ? 0 : UV_ENOMEM;
+    if (req) {
+      req->batch = batch;
+      req->index = index;
+      req->submitted = 0;
+      ret = uv_getaddrinfo(batch->ctx->loop, &req->req, luv_addrinfo_batch_cb, name, NULL,
+                           batch->has_hints ? &batch->hints : NULL);
+    }
+    if (ret < 0) {
+      luv_free(req);
+      luv_status(L, ret);
+      lua_rawset(L, -3);
+      continue;
+    }
+    luv_threadpool_submit(batch->ctx, LUV_TP_GETADDRINFO, &req->submitted);
+    batch->active++;
+    // marks the name as started until the result replaces it
+    lua_pushboolean(L, 1);
+    lua_rawset(L, -3);
+  }
+  lua_pop(L, 2);
+}
+
+static void luv_addrinfo_batch_cb(uv_getaddrinfo_t* req, int status, struct addrinfo* res) {
+  luv_addrinfo_batch_req_t* data = (luv_addrinfo_batch_req_t*)req;
+  luv_addrinfo_batch_t* batch = data->batch;
+  luv_dnscache_t* cache = batch->ctx->dnscache;
+  lua_State* L = batch->ctx->L;
+  char key[LUV_DNS_MAX_KEY];
+  uint32_t hash = 0;
+  size_t keylen;
+
+  luv_threadpool_complete(batch->ctx, LUV_TP_GETADDRINFO, data->submitted, 0, 0);
+  // the state is closing: torn down by its anchor, or loop_gc got the timer
+  // first and the batch can't be freed safely anymore
+  if (batch->dead || uv_is_closing((uv_handle_t*)&batch->timer)) {
+    if (res) uv_freeaddrinfo(res);
+    luv_free(data);
+    batch->active--;
+    luv_addrinfo_batch_release(batch);
+    return;
+  }
+
+  lua_rawgeti(L, LUA_REGISTRYINDEX, batch->results_ref);
+  lua_rawgeti(L, LUA_REGISTRYINDEX, batch->names_ref);
+  lua_rawgeti(L, -1, data->index);
+  lua_remove(L, -2);
+  if (status < 0) luv_status(L, status);
+  else luv_pushaddrinfo_format(L, res, batch->format);
+
+  // keep it for later lookups unless a uv.getaddrinfo for it is running
+  keylen = luv_addrinfo_batch_key(batch, lua_tostring(L, -2), key, &hash);
+  if (keylen && !luv_dns_find(cache, key, keylen, hash)) {
+    luv_dns_entry_t* entry = luv_dns_start(cache, key, keylen, hash);
+    if (entry && luv_dns_store(cache, entry, status, res))
+      res = NULL;
+  }
+  if (res) uv_freeaddrinfo(res);
+  lua_rawset(L, -3);
+  lua_pop(L, 1);
+  luv_free(data);
+
+  batch->active--;
+  luv_addrinfo_batch_pump(L, batch);
+  if (batch->active == 0)
+    luv_addrinfo_batch_finish(batch);
+}
+
+static int luv_getaddrinfo_many(lua_State* L) {
+  luv_ctx_t* ctx = luv_upvalue_context(L);
+  luv_addrinfo_batch_t* batch;
+  struct addrinfo hints;
+  int i, count, ret, concurrency = 4, has_hints = 0, format = LUV_ADDRINFO_TABLE;
+
+  luaL_checktype(L, 1, LUA_TTABLE);
+  count = (int)lua_rawlen(L, 1);
+  for (i = 1; i <= count; i++) {
+    lua_rawgeti(L, 1, i);
+    if (lua_type(L, -1) != LUA_TSTRING)
+      return luaL_argerror(L, 1, lua_pushfstring(L, "name at index %d must be a string", i));
+    lua_pop(L, 1);
+  }
+  if (!lua_isnoneornil(L, 3)) {
+    luaL_checktype(L, 3, LUA_TTABLE);
+    lua_getfield(L, 3, "concurrency");
+    concurrency = (int)luaL_optinteger(L, -1, concurrency);
+    lua_pop(L, 1);
+    luaL_argcheck(L, concurrency > 0, 3, "concurrency must be positive");
+  }
+  if (!lua_isnoneornil(L, 2)) {
+    luaL_checktype(L, 2, LUA_TTABLE);
+    luv_check_addrinfo_hints(L, 2, &hints);
+    has_hints = 1;
+    format = luv_check_addrinfo_format(L, 2);
+  }
+  luv_check_callable(L, 4);
+
+  // arguments are all checked above, the batch would leak on a raise
+  batch = (luv_addrinfo_batch_t*)luv_malloc(sizeof(*batch), LUV_MEM_OTHER);
+  if (!batch) return luaL_error(L, "Can't allocate lookup batch");
+  memset(batch, 0, sizeof(*batch));
+  if (has_hints) batch->hints = hints;
+  batch->has_hints = has_hints;
+  batch->format = format;
+  ret = uv_timer_init(ctx->loop, &batch->timer);
+  if (ret < 0) {
+    luv_free(batch);
+    return luv_error(L, ret);
+  }
+  luv_init_internal_handle((uv_handle_t*)&batch->timer);
+  batch->ctx = ctx;
+  batch->count = count;
+  batch->concurrency = concurrency;
+
+  // the caller may change the list while the lookups run
+  lua_createtable(L, count, 0);
+  for (i = 1; i <= count; i++) {
+    lua_rawgeti(L, 1, i);
+    lua_rawseti(L, -2, i);
+  }
+  batch->names_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+  lua_createtable(L, 0, count);
+  batch->results_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+  lua_pushvalue(L, 4);
+  batch->cb_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+  batch->anchor = luv_anchor_internal(L, batch, "luv_addrinfo_batch");
+
+  luv_addrinfo_batch_pump(L, batch);
+  // everything answered by the cache, still call back from the loop
+  if (batch->active == 0)
+    uv_timer_start(&batch->timer, luv_addrinfo_batch_timer_cb, 0, 0);
+  lua_pushboolean(L, 1);
+  return 1;
+}
+
 static void luv_getnameinfo_cb(uv_getnameinfo_t* req, int status, const char* hostname, const char* service) {
   luv_req_t* data = (luv_req_t*)req->data;
   lua_State* L = data->ctx->L;
   int nargs;
 
+  luv_threadpool_complete(data->ctx, LUV_TP_GETNAMEINFO, data->submitted, 0, 0);
+
   if (status < 0) {
     luv_status(L, status);
     nargs = 1;
@@ -311,5 +1304,6 @@ static int luv_getnameinfo(lua_State* L) {
     luv_cleanup_req(L, (luv_req_t*)req->data);
     return 2;
   }
+  luv_threadpool_submit(ctx, LUV_TP_GETNAMEINFO, &((luv_req_t*)req->data)->submitted);
   return 1;
 }
@@ -0,0 +1,95 @@
+/*
+ *  Copyright 2014 The Luvit Authors. All Rights Reserved.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ */
+#include "private.h"
+
+// Entry points of luv_ffi_api_t, see lib/luv_ffi.lua for the Lua side.
+// They trust the pointers they are given, the shim keeps the handle
+// userdata alive as long as it uses them.
+
+static uint64_t luv_ffi_now(const uv_loop_t* loop) {
+  return uv_now(loop);
+}
+
+static void luv_ffi_update_time(uv_loop_t* loop) {
+  uv_update_time(loop);
+}
+
+static uint64_t luv_ffi_hrtime(void) {
+  return uv_hrtime();
+}
+
+static int luv_ffi_is_active(const uv_handle_t* handle) {
+  return uv_is_active(handle);
+}
+
+static int luv_ffi_timer_again(uv_timer_t* timer) {
+  if (uv_is_closing((uv_handle_t*)timer)) return UV_EINVAL;
+  return uv_timer_again(timer);
+}
+
+static int luv_ffi_timer_set_repeat(uv_timer_t* timer, uint64_t repeat) {
+  if (uv_is_closing((uv_handle_t*)timer)) return UV_EINVAL;
+  uv_timer_set_repeat(timer, repeat);
+  return 0;
+}
+
+static uint64_t luv_ffi_timer_get_repeat(const uv_timer_t* timer) {
+  return uv_timer_get_repeat(timer);
+}
+
+static int luv_ffi_try_write(uv_stream_t* stream, const char* data, size_t len) {
+  uv_buf_t buf;
+  if (uv_is_closing((uv_handle_t*)stream)) return UV_EINVAL;
+  buf = uv_buf_init((char*)data, (unsigned int)len);
+  return uv_try_write(stream, &buf, 1);
+}
+
+static size_t luv_ffi_write_queue_size(const uv_stream_t* stream) {
+#if LUV_UV_VERSION_GEQ(1, 19, 0)
+  return uv_stream_get_write_queue_size(stream);
+#else
+  return stream->write_queue_size;
+#endif
+}
+
+static const luv_ffi_api_t luv_ffi = {
+  LUV_FFI_VERSION,
+  luv_ffi_now,
+  luv_ffi_update_time,
+  luv_ffi_hrtime,
+  luv_ffi_is_active,
+  luv_ffi_timer_again,
+  luv_ffi_timer_set_repeat,
+  luv_ffi_timer_get_repeat,
+  luv_ffi_try_write,
+  luv_ffi_write_queue_size,
+};
+
+LUALIB_API const luv_ffi_api_t* luv_ffi_api(void) {
+  return &luv_ffi;
+}
+
+static int luv_ffi_pointers(lua_State* L) {
+  lua_pushlightuserdata(L, (void*)&luv_ffi);
+  lua_pushlightuserdata(L, luv_upvalue_context(L)->loop);
+  return 2;
+}
+
+static int luv_ffi_handle(lua_State* L) {
+  lua_pushlightuserdata(L, luv_check_handle(L, 1));
+  return 1;
+}
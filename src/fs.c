@@ -374,6 +374,7 @@ static void luv_fs_cb(uv_fs_t* req) {
   luv_req_t* data = (luv_req_t*)req->data;
   lua_State* L = data->ctx->L;
 
+  luv_threadpool_complete(data->ctx, LUV_TP_FS, data->submitted, 0, 0);
   int nargs = push_fs_result(L, req);
   if (nargs == 2 && lua_isnil(L, -nargs)) {
     // If it was an error, convert to (err, value) format.
@@ -444,6 +445,8 @@ static void luv_fs_cb(uv_fs_t* req) {
     }                                                     \
   }                                                       \
   else {                                                  \
+    luv_threadpool_submit(data->ctx, LUV_TP_FS,           \
+                          &data->submitted);              \
     lua_rawgeti(L, LUA_REGISTRYINDEX, data->req_ref);     \
     nargs = 1;                                            \
   }                                                       \
@@ -490,7 +493,7 @@ static int luv_fs_read(lua_State* L) {
     offset = luaL_optinteger(L, 3, offset);
     ref = luv_check_continuation(L, 4);
   }
-  char* data = (char*)malloc(len);
+  char* data = (char*)luv_malloc(len, LUV_MEM_FS_BUF);
   if (!data) {
     luaL_unref(L, LUA_REGISTRYINDEX, ref);
     return luaL_error(L, "Failure to allocate buffer");
@@ -532,7 +535,7 @@ static int luv_fs_write(lua_State* L) {
   uv_buf_t* bufs = luv_check_bufs(L, 2, &count, (luv_req_t*)req->data);
   int nargs;
   FS_CALL_NORETURN(write, req, file, bufs, count, offset);
-  free(bufs);
+  luv_free(bufs);
   return nargs;
 }
 
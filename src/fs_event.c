@@ -18,13 +18,13 @@
 #include "private.h"
 
 static uv_fs_event_t* luv_check_fs_event(lua_State* L, int index) {
-  uv_fs_event_t* handle = (uv_fs_event_t*)luv_checkudata(L, index, "uv_fs_event");
+  uv_fs_event_t* handle = (uv_fs_event_t*)luv_checkudata(L, index, UV_FS_EVENT, "uv_fs_event");
   luaL_argcheck(L, handle->type == UV_FS_EVENT && handle->data, index, "Expected uv_fs_event_t");
   return handle;
 }
 
 static int luv_new_fs_event(lua_State* L) {
-  luv_ctx_t* ctx = luv_context(L);
+  luv_ctx_t* ctx = luv_upvalue_context(L);
   uv_fs_event_t* handle = (uv_fs_event_t*)luv_newuserdata(L, sizeof(*handle));
   int ret = uv_fs_event_init(ctx->loop, handle);
   if (ret < 0) {
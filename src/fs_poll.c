@@ -18,13 +18,13 @@
 #include "luv.h"
 
 static uv_fs_poll_t* luv_check_fs_poll(lua_State* L, int index) {
-  uv_fs_poll_t* handle = (uv_fs_poll_t*)luv_checkudata(L, index, "uv_fs_poll");
+  uv_fs_poll_t* handle = (uv_fs_poll_t*)luv_checkudata(L, index, UV_FS_POLL, "uv_fs_poll");
   luaL_argcheck(L, handle->type == UV_FS_POLL && handle->data, index, "Expected uv_fs_poll_t");
   return handle;
 }
 
 static int luv_new_fs_poll(lua_State* L) {
-  luv_ctx_t* ctx = luv_context(L);
+  luv_ctx_t* ctx = luv_upvalue_context(L);
   uv_fs_poll_t* handle = (uv_fs_poll_t*)luv_newuserdata(L, sizeof(*handle));
   int ret = uv_fs_poll_init(ctx->loop, handle);
   if (ret < 0) {
@@ -16,31 +16,60 @@
  */
 #include "private.h"
 
+// The uv handle and its luv_handle_t share one allocation, see
+// luv_handle_prefix_t
 static void* luv_newuserdata(lua_State* L, size_t sz) {
-  void* handle = malloc(sz);
-  if (handle) {
-    *(void**)lua_newuserdata(L, sizeof(void*)) = handle;
-  }
+  luv_handle_prefix_t* block;
+  void* handle;
+  block = (luv_handle_prefix_t*)luv_malloc(sizeof(*block) + sz, LUV_MEM_HANDLE);
+  if (!block) return NULL;
+  handle = block + 1;
+  *(void**)lua_newuserdata(L, sizeof(void*)) = handle;
   return handle;
 }
 
-static void* luv_checkudata(lua_State* L, int ud, const char* tname) {
+// The luv functions and handle methods carry their luv_ctx_t as first
+// upvalue, metamethods have none and fall back to the registry.
+static luv_ctx_t* luv_upvalue_context(lua_State* L) {
+  luv_ctx_t* ctx = (luv_ctx_t*)lua_touserdata(L, lua_upvalueindex(1));
+  return ctx ? ctx : luv_context(L);
+}
+
+// Address of the metatable of the value at index, NULL if it has none
+static const void* luv_metatable_ptr(lua_State* L, int index) {
+  const void* mt = NULL;
+  if (lua_getmetatable(L, index)) {
+    mt = lua_topointer(L, -1);
+    lua_pop(L, 1);
+  }
+  return mt;
+}
+
+// Handle userdata are recognized by comparing their metatable address with
+// the ones cached in ctx->handle_mt, so nothing gets dereferenced before the
+// value is known to be a luv handle.
+static void* luv_checkudata(lua_State* L, int ud, uv_handle_type type, const char* tname) {
+  void* udata = lua_touserdata(L, ud);
+  if (udata && luv_metatable_ptr(L, ud) == luv_upvalue_context(L)->handle_mt[type]) {
+    return *(void**)udata;
+  }
+  // raises the usual "uv_xxx expected" error
   return *(void**) luaL_checkudata(L, ud, tname);
 }
 
 static uv_handle_t* luv_check_handle(lua_State* L, int index) {
-  int isHandle;
+  luv_ctx_t* ctx = luv_upvalue_context(L);
+  void* udata = lua_touserdata(L, index);
+  const void* mt;
   uv_handle_t* handle;
-  void *udata;
-  if (!(udata = lua_touserdata(L, index))) { goto fail; }
-  if (!(handle = *(uv_handle_t**) udata)) { goto fail; }
-  if (!handle->data) { goto fail; }
-  lua_getfield(L, LUA_REGISTRYINDEX, "uv_handle");
-  lua_getmetatable(L, index < 0 ? index - 1 : index);
-  lua_rawget(L, -2);
-  isHandle = lua_toboolean(L, -1);
-  lua_pop(L, 2);
-  if (isHandle) { return handle; }
+  int i;
+  if (!udata || !(mt = luv_metatable_ptr(L, index))) { goto fail; }
+  for (i = 0; i < UV_HANDLE_TYPE_MAX; i++) {
+    if (mt != ctx->handle_mt[i]) continue;
+    if (!(handle = *(uv_handle_t**) udata)) { goto fail; }
+    if (!handle->data) { goto fail; }
+    return handle;
+  }
   fail: luaL_argerror(L, index, "Expected uv_handle userdata");
   return NULL;
 }
@@ -82,6 +111,51 @@ static void luv_close_cb(uv_handle_t* handle) {
   luv_unref_handle(L, data);
 }
 
+// Internal handles are the ones luv keeps for its own bookkeeping, like the
+// idle handle of the resolver cache or the timers of a connect attempt. They
+// carry no luv_handle_t, so uv.walk skips them and luv_close_cb ignores them.
+//
+// At lua_close, loop_gc closes every handle still open, internal ones too,
+// with luv_close_cb and runs the loop until they are gone. Their owners have
+// to close them through luv_close_internal_handle for that reason.
+static void luv_init_internal_handle(uv_handle_t* handle) {
+  handle->data = NULL;
+}
+
+// Closes an internal handle unless loop_gc did already, returns 0 and never
+// calls close_cb then. A __gc metamethod running after loop_gc can free the
+// handle right away. Callbacks run by loop_gc itself must leave its memory
+// alone, as libuv may not be done with it yet.
+static int luv_close_internal_handle(uv_handle_t* handle, uv_close_cb close_cb) {
+  if (uv_is_closing(handle)) return 0;
+  uv_close(handle, close_cb);
+  return 1;
+}
+
+// Boxes `ptr` in a userdata with the metatable `tname` and keeps it in the
+// registry, its __gc tears down the per state bookkeeping when the state
+// closes. Anchors are made after the loop userdata, so their __gc runs before
+// loop_gc and can still close the handles with their own callbacks.
+static int luv_anchor_internal(lua_State* L, void* ptr, const char* tname) {
+  void** udata = (void**)lua_newuserdata(L, sizeof(*udata));
+  *udata = ptr;
+  luaL_getmetatable(L, tname);
+  lua_setmetatable(L, -2);
+  return luaL_ref(L, LUA_REGISTRYINDEX);
+}
+
+// Drops the anchor of an object that is done before the state closes, its
+// __gc then finds nothing to tear down
+static void luv_unanchor_internal(lua_State* L, int ref) {
+  void** udata;
+  if (ref == LUA_NOREF) return;
+  lua_rawgeti(L, LUA_REGISTRYINDEX, ref);
+  udata = (void**)lua_touserdata(L, -1);
+  if (udata) *udata = NULL;
+  lua_pop(L, 1);
+  luaL_unref(L, LUA_REGISTRYINDEX, ref);
+}
+
 static int luv_close(lua_State* L) {
   uv_handle_t* handle = luv_check_handle(L, 1);
   if (uv_is_closing(handle)) {
@@ -96,12 +170,9 @@ static int luv_close(lua_State* L) {
 
 static void luv_handle_free(uv_handle_t* handle) {
   luv_handle_t* data = (luv_handle_t*)handle->data;
-  if (data) {
-    if (data->extra_gc)
-      data->extra_gc(data->extra);
-    free(data);
-  }
-  free(handle);
+  if (data && data->extra_gc)
+    data->extra_gc(data->extra);
+  luv_free((luv_handle_prefix_t*)handle - 1);
 }
 
 static void luv_gc_cb(uv_handle_t* handle) {
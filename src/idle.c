@@ -17,13 +17,13 @@
 #include "private.h"
 
 static uv_idle_t* luv_check_idle(lua_State* L, int index) {
-  uv_idle_t* handle = (uv_idle_t*)luv_checkudata(L, index, "uv_idle");
+  uv_idle_t* handle = (uv_idle_t*)luv_checkudata(L, index, UV_IDLE, "uv_idle");
   luaL_argcheck(L, handle->type == UV_IDLE && handle->data, index, "Expected uv_idle_t");
   return handle;
 }
 
 static int luv_new_idle(lua_State* L) {
-  luv_ctx_t* ctx = luv_context(L);
+  luv_ctx_t* ctx = luv_upvalue_context(L);
   uv_idle_t* handle = (uv_idle_t*)luv_newuserdata(L, sizeof(*handle));
   int ret = uv_idle_init(ctx->loop, handle);
   if (ret < 0) {
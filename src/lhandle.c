@@ -20,6 +20,7 @@ static luv_handle_t* luv_setup_handle(lua_State* L, luv_ctx_t* ctx) {
   luv_handle_t* data;
   const uv_handle_t* handle;
   void *udata;
+  int mt_ref;
 
   if (!(udata = lua_touserdata(L, -1))) {
     luaL_error(L, "NULL userdata");
@@ -28,28 +29,21 @@ static luv_handle_t* luv_setup_handle(lua_State* L, luv_ctx_t* ctx) {
   handle = *(uv_handle_t**)udata;
   luaL_checktype(L, -1, LUA_TUSERDATA);
 
-  data = (luv_handle_t*)malloc(sizeof(*data));
-  if (!data) luaL_error(L, "Can't allocate luv handle");
+  // allocated along with the handle by luv_newuserdata
+  data = &((luv_handle_prefix_t*)handle - 1)->data;
 
-  #define XX(uc, lc) case UV_##uc: \
-    luaL_getmetatable(L, "uv_"#lc); \
-    break;
-  switch (handle->type) {
-    UV_HANDLE_TYPE_MAP(XX)
-    default:
-      free(data);
-      luaL_error(L, "Unknown handle type");
-      return NULL;
+  mt_ref = (unsigned)handle->type < UV_HANDLE_TYPE_MAX ? ctx->handle_mt_ref[handle->type] : 0;
+  if (mt_ref <= 0) {
+    luaL_error(L, "Unknown handle type");
+    return NULL;
   }
-  #undef XX
-
+  lua_rawgeti(L, LUA_REGISTRYINDEX, mt_ref);
   lua_setmetatable(L, -2);
 
   lua_pushvalue(L, -1);
 
   data->ref = luaL_ref(L, LUA_REGISTRYINDEX);
-  data->callbacks[0] = LUA_NOREF;
-  data->callbacks[1] = LUA_NOREF;
+  data->callbacks = 0;
   data->ctx = ctx;
   data->extra = NULL;
   data->extra_gc = NULL;
@@ -58,9 +52,20 @@ static luv_handle_t* luv_setup_handle(lua_State* L, luv_ctx_t* ctx) {
 
 static void luv_check_callback(lua_State* L, luv_handle_t* data, luv_callback_id id, int index) {
   luv_check_callable(L, index);
-  luaL_unref(L, LUA_REGISTRYINDEX, data->callbacks[id]);
+  // the handle is closed already, its callbacks are gone
+  if (data->ref == LUA_NOREF) return;
+  lua_rawgeti(L, LUA_REGISTRYINDEX, data->ref);
+  if (!data->callbacks) {
+    // created lazily, the uservalue of a new userdata isn't a table on 5.2+
+    // and is the global environment on 5.1
+    lua_createtable(L, 2, 0);
+    lua_setuservalue(L, -2);
+  }
+  lua_getuservalue(L, -1);
   lua_pushvalue(L, index);
-  data->callbacks[id] = luaL_ref(L, LUA_REGISTRYINDEX);
+  lua_rawseti(L, -2, id + 1);
+  lua_pop(L, 2);
+  data->callbacks |= 1 << id;
 }
 
 static int luv_traceback (lua_State *L) {
@@ -86,13 +91,16 @@ static int luv_traceback (lua_State *L) {
 
 static void luv_call_callback(lua_State* L, luv_handle_t* data, luv_callback_id id, int nargs) {
   luv_ctx_t* ctx = data->ctx;
-  int ref = data->callbacks[id];
-  if (ref == LUA_NOREF) {
+  if (!(data->callbacks & (1 << id)) || data->ref == LUA_NOREF) {
     lua_pop(L, nargs);
   }
   else {
-    // Get the callback
-    lua_rawgeti(L, LUA_REGISTRYINDEX, ref);
+    // Get the callback from the uservalue of the handle
+    lua_rawgeti(L, LUA_REGISTRYINDEX, data->ref);
+    lua_getuservalue(L, -1);
+    lua_rawgeti(L, -1, id + 1);
+    lua_replace(L, -3);
+    lua_pop(L, 1);
     // And insert it before the args if there are any.
     if (nargs) {
       lua_insert(L, -1 - nargs);
@@ -103,9 +111,21 @@ static void luv_call_callback(lua_State* L, luv_handle_t* data, luv_callback_id
 }
 
 static void luv_unref_handle(lua_State* L, luv_handle_t* data) {
+  int id;
+  if (data->ref == LUA_NOREF) return;
+  // drop the callbacks now, the userdata may be kept around for a while
+  if (data->callbacks) {
+    lua_rawgeti(L, LUA_REGISTRYINDEX, data->ref);
+    lua_getuservalue(L, -1);
+    for (id = 0; id < 2; id++) {
+      lua_pushnil(L);
+      lua_rawseti(L, -2, id + 1);
+    }
+    lua_pop(L, 2);
+    data->callbacks = 0;
+  }
   luaL_unref(L, LUA_REGISTRYINDEX, data->ref);
-  luaL_unref(L, LUA_REGISTRYINDEX, data->callbacks[0]);
-  luaL_unref(L, LUA_REGISTRYINDEX, data->callbacks[1]);
+  data->ref = LUA_NOREF;
 }
 
 static void luv_find_handle(lua_State* L, luv_handle_t* data) {
@@ -41,13 +41,28 @@
 
 typedef void (*luv_handle_extra_gc) (void* ptr);
 
-/* Ref for userdata and event callbacks */
+/* Ref for userdata and event callbacks
+
+   The callbacks live in the uservalue table of the handle userdata, at index
+   id + 1, so they don't take registry slots. `callbacks` has the bit
+   (1 << id) set for each one stored there.
+*/
 typedef struct {
   int ref;
-  int callbacks[2];
+  int callbacks;
   luv_ctx_t* ctx;
   void* extra;
   luv_handle_extra_gc extra_gc;
 } luv_handle_t;
 
+/* luv_handle_t is stored right before the uv handle in the same allocation,
+   the union keeps the handle that follows it aligned.
+*/
+typedef union {
+  luv_handle_t data;
+  double d;
+  void* p;
+  long long ll;
+} luv_handle_prefix_t;
+
 #endif
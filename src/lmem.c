@@ -0,0 +1,397 @@
+/*
+ *  Copyright 2014 The Luvit Authors. All Rights Reserved.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ */
+#include "private.h"
+
+// Counters are shared by every lua_State and thread in the process since
+// memory allocated on one side of a thread boundary is often freed on the
+// other side.
+#if defined(__GNUC__) || defined(__clang__)
+#define luv_atomic_add(p, v) __atomic_add_fetch((p), (v), __ATOMIC_RELAXED)
+// for refcounts, the last owner must see every write before destroying
+#define luv_atomic_addref(p, v) __atomic_add_fetch((p), (v), __ATOMIC_ACQ_REL)
+#define luv_atomic_load(p)   __atomic_load_n((p), __ATOMIC_RELAXED)
+#define luv_atomic_cas(p, e, v) \
+  __atomic_compare_exchange_n((p), &(e), (v), 0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)
+#define luv_atomic_loadp(p)  __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define luv_atomic_storep(p, v) __atomic_store_n((p), (v), __ATOMIC_RELEASE)
+#define luv_atomic_casp(p, e, v) \
+  __atomic_compare_exchange_n((p), &(e), (v), 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)
+#define luv_atomic_xchgp(p, v) __atomic_exchange_n((p), (v), __ATOMIC_ACQ_REL)
+#elif defined(_MSC_VER)
+#define luv_atomic_add(p, v) (InterlockedExchangeAdd64((volatile LONG64*)(p), (v)) + (v))
+#define luv_atomic_addref(p, v) luv_atomic_add(p, v)
+#define luv_atomic_load(p)   InterlockedCompareExchange64((volatile LONG64*)(p), 0, 0)
+#define luv_atomic_cas(p, e, v) luv_atomic_cas_msvc((volatile LONG64*)(p), &(e), (v))
+static int luv_atomic_cas_msvc(volatile LONG64* p, int64_t* expected, int64_t value) {
+  LONG64 old = InterlockedCompareExchange64(p, value, *expected);
+  if (old == *expected) return 1;
+  *expected = old;
+  return 0;
+}
+#define luv_atomic_loadp(p)  InterlockedCompareExchangePointer((PVOID volatile*)(p), NULL, NULL)
+#define luv_atomic_storep(p, v) ((void)InterlockedExchangePointer((PVOID volatile*)(p), (v)))
+#define luv_atomic_casp(p, e, v) luv_atomic_casp_msvc((PVOID volatile*)(p), (PVOID*)&(e), (v))
+#define luv_atomic_xchgp(p, v) InterlockedExchangePointer((PVOID volatile*)(p), (v))
+static int luv_atomic_casp_msvc(PVOID volatile* p, PVOID* expected, PVOID value) {
+  PVOID old = InterlockedCompareExchangePointer(p, value, *expected);
+  if (old == *expected) return 1;
+  *expected = old;
+  return 0;
+}
+#else
+// no atomics available, the numbers are only approximate with threads
+#define luv_atomic_add(p, v) (*(p) += (v))
+#define luv_atomic_addref(p, v) luv_atomic_add(p, v)
+#define luv_atomic_load(p)   (*(p))
+#define luv_atomic_cas(p, e, v) (*(p) == (e) ? (*(p) = (v), 1) : ((e) = *(p), 0))
+#define luv_atomic_loadp(p)  (*(p))
+#define luv_atomic_storep(p, v) (*(p) = (v))
+#define luv_atomic_casp(p, e, v) luv_atomic_cas(p, e, v)
+#define luv_atomic_xchgp(p, v) luv_atomic_xchgp_plain((void**)(p), (v))
+static void* luv_atomic_xchgp_plain(void** p, void* value) {
+  void* old = *p;
+  *p = value;
+  return old;
+}
+#endif
+
+static int64_t luv_mem_bytes[LUV_MEM_MAX];
+static int64_t luv_mem_count[LUV_MEM_MAX];
+static int64_t luv_mem_total;
+
+static const char* const luv_mem_category_names[LUV_MEM_MAX] = {
+  "handle", "req", "read_buffer", "mmsg_buffer",
+  "bufs", "thread_arg", "fs_buffer", "other", "libuv"
+};
+
+static void* luv_default_malloc(void* ud, size_t size) {
+  (void)ud;
+  return malloc(size);
+}
+
+static void luv_default_free(void* ud, void* ptr, size_t size) {
+  (void)ud;
+  (void)size;
+  free(ptr);
+}
+
+static luv_malloc_fn luv_alloc_malloc = luv_default_malloc;
+static luv_free_fn luv_alloc_free = luv_default_free;
+static void* luv_alloc_ud = NULL;
+
+static void* luv_malloc(size_t size, luv_mem_category category) {
+  luv_mem_header_t* header;
+  if (size > (size_t)-1 - sizeof(*header)) return NULL;
+  header = (luv_mem_header_t*)luv_alloc_malloc(luv_alloc_ud, sizeof(*header) + size);
+  if (!header) return NULL;
+  header->h.size = size;
+  header->h.category = category;
+  luv_atomic_add(&luv_mem_bytes[category], (int64_t)size);
+  luv_atomic_add(&luv_mem_count[category], 1);
+  luv_atomic_add(&luv_mem_total, (int64_t)size);
+  return header + 1;
+}
+
+static void luv_free(void* ptr) {
+  luv_mem_header_t* header;
+  if (!ptr) return;
+  header = (luv_mem_header_t*)ptr - 1;
+  luv_atomic_add(&luv_mem_bytes[header->h.category], -(int64_t)header->h.size);
+  luv_atomic_add(&luv_mem_count[header->h.category], -1);
+  luv_atomic_add(&luv_mem_total, -(int64_t)header->h.size);
+  luv_alloc_free(luv_alloc_ud, header, sizeof(*header) + header->h.size);
+}
+
+// libuv gets the same allocator through these, accounted as "libuv"
+static void* luv_uv_malloc(size_t size) {
+  return luv_malloc(size, LUV_MEM_LIBUV);
+}
+
+static void* luv_uv_realloc(void* ptr, size_t size) {
+  void* block;
+  size_t old_size;
+  if (!ptr) return luv_malloc(size, LUV_MEM_LIBUV);
+  if (!size) {
+    luv_free(ptr);
+    return NULL;
+  }
+  old_size = ((luv_mem_header_t*)ptr - 1)->h.size;
+  if (size <= old_size) return ptr;
+  block = luv_malloc(size, LUV_MEM_LIBUV);
+  if (!block) return NULL;
+  memcpy(block, ptr, old_size);
+  luv_free(ptr);
+  return block;
+}
+
+static void* luv_uv_calloc(size_t count, size_t size) {
+  void* block;
+  if (size && count > (size_t)-1 / size) return NULL;
+  block = luv_malloc(count * size, LUV_MEM_LIBUV);
+  if (block) memset(block, 0, count * size);
+  return block;
+}
+
+LUALIB_API int luv_set_allocator(luv_malloc_fn malloc_fn, luv_free_fn free_fn,
+                                 void* ud, int flags) {
+  int i;
+  if (!malloc_fn != !free_fn) return UV_EINVAL;
+  // blocks from the previous allocator can't be given to the new one
+  for (i = 0; i < LUV_MEM_MAX; i++) {
+    if (luv_atomic_load(&luv_mem_count[i]) != 0) return UV_EBUSY;
+  }
+  luv_alloc_malloc = malloc_fn ? malloc_fn : luv_default_malloc;
+  luv_alloc_free = free_fn ? free_fn : luv_default_free;
+  luv_alloc_ud = malloc_fn ? ud : NULL;
+  if (flags & LUV_ALLOCATOR_REPLACE_UV) {
+    return uv_replace_allocator(luv_uv_malloc, luv_uv_realloc,
+                                luv_uv_calloc, luv_free);
+  }
+  return 0;
+}
+
+static int luv_memory_stats(lua_State* L) {
+  luv_memwatch_t* watch = luv_upvalue_context(L)->memwatch;
+  int i;
+  lua_createtable(L, 0, LUV_MEM_MAX + 2);
+  lua_pushinteger(L, luv_atomic_load(&luv_mem_total));
+  lua_setfield(L, -2, "bytes");
+  lua_pushinteger(L, watch ? watch->limit : 0);
+  lua_setfield(L, -2, "limit");
+  for (i = 0; i < LUV_MEM_MAX; i++) {
+    lua_createtable(L, 0, 2);
+    lua_pushinteger(L, luv_atomic_load(&luv_mem_bytes[i]));
+    lua_setfield(L, -2, "bytes");
+    lua_pushinteger(L, luv_atomic_load(&luv_mem_count[i]));
+    lua_setfield(L, -2, "count");
+    lua_setfield(L, -2, luv_mem_category_names[i]);
+  }
+  return 1;
+}
+
+// The soft limit is checked once per loop iteration by an internal check
+// handle rather than from luv_malloc, which can run in worker threads or in
+// the middle of libuv callbacks where calling into Lua is not safe.
+static void luv_memwatch_cb(uv_check_t* handle) {
+  luv_memwatch_t* watch = (luv_memwatch_t*)handle;
+  luv_ctx_t* ctx = watch->ctx;
+  int64_t bytes = luv_atomic_load(&luv_mem_total);
+  if (bytes <= watch->limit) {
+    // re-arm once usage went back under the limit
+    watch->over = 0;
+    return;
+  }
+  if (watch->over) return;
+  watch->over = 1;
+  lua_rawgeti(ctx->L, LUA_REGISTRYINDEX, watch->cb_ref);
+  lua_pushinteger(ctx->L, bytes);
+  lua_pushinteger(ctx->L, watch->limit);
+  ctx->pcall(ctx->L, 2, 0, 0);
+}
+
+static void luv_memwatch_free_cb(uv_handle_t* handle) {
+  luv_free(handle);
+}
+
+static int luv_memwatch_gc(lua_State* L) {
+  luv_memwatch_t** udata = (luv_memwatch_t**)lua_touserdata(L, 1);
+  uv_handle_t* handle = (uv_handle_t*)*udata;
+  if (handle) {
+    if (!luv_close_internal_handle(handle, luv_memwatch_free_cb))
+      luv_free(handle);
+    *udata = NULL;
+  }
+  return 0;
+}
+
+static int luv_set_memory_limit(lua_State* L) {
+  luv_ctx_t* ctx = luv_upvalue_context(L);
+  luv_memwatch_t* watch = ctx->memwatch;
+  lua_Integer limit = 0;
+  int ret;
+
+  if (!lua_isnoneornil(L, 1)) {
+    limit = luaL_checkinteger(L, 1);
+    luaL_argcheck(L, limit > 0, 1, "limit must be positive");
+    luv_check_callable(L, 2);
+  }
+
+  if (!watch) {
+    if (!limit) return luv_result(L, 0);
+    watch = (luv_memwatch_t*)luv_malloc(sizeof(*watch), LUV_MEM_OTHER);
+    if (!watch) return luaL_error(L, "Can't allocate memory watcher");
+    ret = uv_check_init(ctx->loop, &watch->check);
+    if (ret < 0) {
+      luv_free(watch);
+      return luv_error(L, ret);
+    }
+    luv_init_internal_handle((uv_handle_t*)&watch->check);
+    uv_unref((uv_handle_t*)&watch->check);
+    watch->ctx = ctx;
+    watch->cb_ref = LUA_NOREF;
+    watch->over = 0;
+
+    luv_anchor_internal(L, watch, "luv_memwatch");
+    ctx->memwatch = watch;
+  }
+
+  luaL_unref(L, LUA_REGISTRYINDEX, watch->cb_ref);
+  watch->cb_ref = LUA_NOREF;
+  watch->limit = limit;
+  watch->over = 0;
+  if (!limit) {
+    ret = uv_check_stop(&watch->check);
+    return luv_result(L, ret);
+  }
+  lua_pushvalue(L, 2);
+  watch->cb_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+  ret = uv_check_start(&watch->check, luv_memwatch_cb);
+  return luv_result(L, ret);
+}
+
+// Runs protected, finalizers called by the collector may raise errors
+static int luv_gcidle_run(lua_State* L) {
+  luv_gcidle_t* gc = (luv_gcidle_t*)lua_touserdata(L, 1);
+  uint64_t budget = gc->budget;
+  uint64_t start = uv_hrtime(), elapsed;
+  int timeout = uv_backend_timeout(gc->ctx->loop);
+  // don't step past the next timer
+  if (timeout >= 0 && (uint64_t)timeout * 1000000 < budget)
+    budget = (uint64_t)timeout * 1000000;
+  do {
+    gc->steps++;
+    if (lua_gc(L, LUA_GCSTEP, gc->step)) {
+      gc->cycles++;
+      gc->done = 1;
+      gc->cycle_kb = lua_gc(L, LUA_GCCOUNT, 0);
+      break;
+    }
+    elapsed = uv_hrtime() - start;
+  } while (elapsed < budget);
+  elapsed = uv_hrtime() - start;
+  gc->time += elapsed;
+  if (elapsed > gc->max) gc->max = elapsed;
+  return 0;
+}
+
+// Prepare handles run right before the loop polls for I/O, the backend
+// timeout tells whether it is going to block there.
+static void luv_gcidle_cb(uv_prepare_t* handle) {
+  luv_gcidle_t* gc = (luv_gcidle_t*)handle;
+  lua_State* L = gc->ctx->L;
+  if (gc->ctx->mode == UV_RUN_NOWAIT || uv_backend_timeout(gc->ctx->loop) == 0) {
+    gc->skipped++;
+    return;
+  }
+  if (gc->done) {
+    // idle loops shouldn't keep running cycles over the same heap
+    int kb = lua_gc(L, LUA_GCCOUNT, 0);
+    if (kb <= gc->cycle_kb + gc->cycle_kb / 8) return;
+    gc->done = 0;
+  }
+  lua_pushcfunction(L, luv_gcidle_run);
+  lua_pushlightuserdata(L, gc);
+  gc->ctx->pcall(L, 1, 0, 0);
+}
+
+static int luv_gcidle_gc(lua_State* L) {
+  luv_gcidle_t** udata = (luv_gcidle_t**)lua_touserdata(L, 1);
+  uv_handle_t* handle = (uv_handle_t*)*udata;
+  if (handle) {
+    if (!luv_close_internal_handle(handle, luv_memwatch_free_cb))
+      luv_free(handle);
+    *udata = NULL;
+  }
+  return 0;
+}
+
+static int luv_gc_idle(lua_State* L) {
+  luv_ctx_t* ctx = luv_upvalue_context(L);
+  luv_gcidle_t* gc = ctx->gcidle;
+  lua_Integer budget = 1000, step = 0;
+  int ret;
+
+  if (lua_isnoneornil(L, 1)) {
+    if (!gc) return luv_result(L, 0);
+    return luv_result(L, uv_prepare_stop(&gc->prepare));
+  }
+  luaL_checktype(L, 1, LUA_TTABLE);
+  lua_getfield(L, 1, "budget");
+  budget = luaL_optinteger(L, -1, budget);
+  lua_getfield(L, 1, "step");
+  step = luaL_optinteger(L, -1, step);
+  lua_pop(L, 2);
+  luaL_argcheck(L, budget > 0, 1, "budget must be positive");
+  luaL_argcheck(L, step >= 0 && step <= INT_MAX, 1, "step must not be negative");
+
+  if (!gc) {
+    gc = (luv_gcidle_t*)luv_malloc(sizeof(*gc), LUV_MEM_OTHER);
+    if (!gc) return luaL_error(L, "Can't allocate idle collector");
+    memset(gc, 0, sizeof(*gc));
+    ret = uv_prepare_init(ctx->loop, &gc->prepare);
+    if (ret < 0) {
+      luv_free(gc);
+      return luv_error(L, ret);
+    }
+    luv_init_internal_handle((uv_handle_t*)&gc->prepare);
+    uv_unref((uv_handle_t*)&gc->prepare);
+    gc->ctx = ctx;
+
+    luv_anchor_internal(L, gc, "luv_gcidle");
+    ctx->gcidle = gc;
+  }
+
+  gc->budget = (uint64_t)budget * 1000;
+  gc->step = (int)step;
+  gc->done = 0;
+  ret = uv_prepare_start(&gc->prepare, luv_gcidle_cb);
+  return luv_result(L, ret);
+}
+
+static int luv_gc_idle_stats(lua_State* L) {
+  luv_gcidle_t* gc = luv_upvalue_context(L)->gcidle;
+  int reset = luv_optboolean(L, 1, 0);
+  if (!gc) return 0;
+  lua_createtable(L, 0, 6);
+  lua_pushboolean(L, uv_is_active((uv_handle_t*)&gc->prepare));
+  lua_setfield(L, -2, "active");
+  lua_pushinteger(L, gc->steps);
+  lua_setfield(L, -2, "steps");
+  lua_pushinteger(L, gc->cycles);
+  lua_setfield(L, -2, "cycles");
+  lua_pushinteger(L, gc->skipped);
+  lua_setfield(L, -2, "skipped");
+  lua_pushinteger(L, gc->time / 1000);
+  lua_setfield(L, -2, "time");
+  lua_pushinteger(L, gc->max / 1000);
+  lua_setfield(L, -2, "max");
+  if (reset)
+    gc->steps = gc->cycles = gc->skipped = gc->time = gc->max = 0;
+  return 1;
+}
+
+static void luv_mem_init(lua_State* L) {
+  luaL_newmetatable(L, "luv_memwatch");
+  lua_pushcfunction(L, luv_memwatch_gc);
+  lua_setfield(L, -2, "__gc");
+  lua_pop(L, 1);
+
+  luaL_newmetatable(L, "luv_gcidle");
+  lua_pushcfunction(L, luv_gcidle_gc);
+  lua_setfield(L, -2, "__gc");
+  lua_pop(L, 1);
+}
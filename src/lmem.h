@@ -0,0 +1,73 @@
+/*
+ *  Copyright 2014 The Luvit Authors. All Rights Reserved.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ */
+#ifndef LUV_LMEM_H
+#define LUV_LMEM_H
+
+#include "luv.h"
+
+/* Every allocation luv makes outside of the Lua heap is tagged with one of
+   these so it can be reported by uv.memory_stats().
+*/
+typedef enum {
+  LUV_MEM_HANDLE = 0,   /* uv_*_t handle structs with their luv_handle_t */
+  LUV_MEM_REQ,          /* luv_req_t bookkeeping */
+  LUV_MEM_READ_BUF,     /* stream and udp read buffers */
+  LUV_MEM_MMSG_BUF,     /* udp recvmmsg buffers */
+  LUV_MEM_BUFS,         /* uv_buf_t and string ref arrays for writes */
+  LUV_MEM_THREAD_ARG,   /* string copies passed across threads */
+  LUV_MEM_FS_BUF,       /* fs_read buffers */
+  LUV_MEM_OTHER,        /* everything else (spawn options, thread code, ...) */
+  LUV_MEM_LIBUV,        /* libuv internals, with LUV_ALLOCATOR_REPLACE_UV */
+  LUV_MEM_MAX
+} luv_mem_category;
+
+/* Prepended to every block so luv_free knows what it releases.
+   The union keeps the payload aligned for any basic type.
+*/
+typedef union {
+  struct {
+    size_t size;
+    luv_mem_category category;
+  } h;
+  double d;
+  void* p;
+  long long ll;
+} luv_mem_header_t;
+
+/* Soft memory limit of a loop, see uv.set_memory_limit() */
+struct luv_memwatch_s {
+  uv_check_t check;     /* internal handle, must stay the first member */
+  luv_ctx_t* ctx;
+  int64_t limit;        /* in bytes, 0 when disabled */
+  int cb_ref;
+  int over;             /* set once the callback fired until usage drops */
+};
+typedef struct luv_memwatch_s luv_memwatch_t;
+
+/* Garbage collection moved into idle loop iterations, see uv.gc_idle() */
+struct luv_gcidle_s {
+  uv_prepare_t prepare; /* internal handle, must stay the first member */
+  luv_ctx_t* ctx;
+  uint64_t budget;      /* in ns per iteration */
+  int step;             /* size argument of LUA_GCSTEP */
+  int done;             /* a cycle finished, wait for the heap to grow */
+  int cycle_kb;         /* heap size when it finished */
+  uint64_t steps, cycles, skipped, time, max;
+};
+typedef struct luv_gcidle_s luv_gcidle_t;
+
+#endif
@@ -93,9 +93,12 @@ static void luv_walk_cb(uv_handle_t* handle, void* arg) {
   lua_State* L = (lua_State*)arg;
   luv_handle_t* data = (luv_handle_t*)handle->data;
 
+  // Internal handles have no luv_handle_t and are not exposed to Lua
+  if (!data) return;
+
   // Sanity check
   // Most invalid values are large and refs are small, 0x1000000 is arbitrary.
-  assert(data && data->ref < 0x1000000);
+  assert(data->ref < 0x1000000);
 
   lua_pushvalue(L, 1);           // Copy the function
   luv_find_handle(L, data);      // Get the userdata
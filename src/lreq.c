@@ -31,7 +31,7 @@ static luv_req_t* luv_setup_req(lua_State* L, luv_ctx_t* ctx, int cb_ref) {
 
   luaL_checktype(L, -1, LUA_TUSERDATA);
 
-  data = (luv_req_t*)malloc(sizeof(*data));
+  data = (luv_req_t*)luv_malloc(sizeof(*data), LUV_MEM_REQ);
   if (!data) luaL_error(L, "Problem allocating luv request");
 
   luaL_getmetatable(L, "uv_req");
@@ -43,6 +43,7 @@ static luv_req_t* luv_setup_req(lua_State* L, luv_ctx_t* ctx, int cb_ref) {
   data->data_ref = LUA_NOREF;
   data->ctx = ctx;
   data->data = NULL;
+  data->submitted = 0;
 
   return data;
 }
@@ -74,6 +75,6 @@ static void luv_cleanup_req(lua_State* L, luv_req_t* data) {
   }
   else
     luaL_unref(L, LUA_REGISTRYINDEX, data->data_ref);
-  free(data->data);
-  free(data);
+  luv_free(data->data);
+  luv_free(data);
 }
@@ -25,6 +25,7 @@ typedef struct {
   int data_ref; /* ref for write data */
   luv_ctx_t* ctx; /* context for callback */
   void* data; /* extra data */
+  uint64_t submitted; /* uv_hrtime() when handed to the threadpool */
 } luv_req_t;
 
 // This is an arbitrary value that we can assume will never be returned by luaL_ref
@@ -42,6 +42,10 @@ typedef struct {
   int ref[2];          // ref of string or userdata
 } luv_val_t;
 
+// type of a shared sync object, val.udata.data holds the reference taken when
+// the argument was set until a copy adopts it
+#define LUV_THREAD_TSYNC  0x100
+
 typedef struct {
   int argc;
   int flags;          // control gc
@@ -62,4 +66,44 @@ typedef struct {
 #define LUVF_THREAD_SIDE(i)        ((i)&0x01)
 #define LUVF_THREAD_ASYNC(i)       ((i)&0x02)
 
+// Request kinds that go through the libuv threadpool
+typedef enum {
+  LUV_TP_FS = 0,
+  LUV_TP_GETADDRINFO,
+  LUV_TP_GETNAMEINFO,
+  LUV_TP_RANDOM,
+  LUV_TP_WORK,
+  LUV_TP_MAX
+} luv_threadpool_type;
+
+// Histogram buckets are powers of two in microseconds, bucket i holds
+// samples in [2^(i-1), 2^i) us and the last bucket everything above.
+#define LUV_TP_BUCKETS 32
+
+#define LUV_TP_WAIT     0   /* submission until a worker picked it up */
+#define LUV_TP_SERVICE  1   /* time spent running in the worker */
+#define LUV_TP_TOTAL    2   /* submission until the completion callback */
+#define LUV_TP_NHIST    3
+
+typedef struct {
+  uint64_t count;
+  uint64_t sum;             /* us */
+  uint64_t max;             /* us */
+  uint64_t buckets[LUV_TP_BUCKETS];
+} luv_histogram_t;
+
+typedef struct {
+  uint64_t submitted;
+  uint64_t completed;
+  uint64_t inflight;        /* submitted but not yet completed */
+  uint64_t max_inflight;
+  luv_histogram_t hist[LUV_TP_NHIST];
+} luv_threadpool_type_stats_t;
+
+struct luv_threadpool_stats_s {
+  uint64_t inflight;        /* across all request kinds */
+  uint64_t max_inflight;
+  luv_threadpool_type_stats_t types[LUV_TP_MAX];
+};
+
 #endif //LUV_LTHREADPOOL_H
@@ -25,23 +25,30 @@
 #include "check.c"
 #include "constants.c"
 #include "dns.c"
+#include "ffi.c"
 #include "fs.c"
 #include "fs_event.c"
 #include "fs_poll.c"
 #include "handle.c"
 #include "idle.c"
 #include "lhandle.c"
+#include "lmem.c"
 #include "loop.c"
 #include "lreq.c"
 #include "metrics.c"
 #include "misc.c"
 #include "pipe.c"
 #include "poll.c"
+#include "post.c"
 #include "prepare.c"
 #include "process.c"
+#include "procpool.c"
+#include "resolver.c"
 #include "req.c"
+#include "sharedmap.c"
 #include "signal.c"
 #include "stream.c"
+#include "sync.c"
 #include "tcp.c"
 #include "thread.c"
 #include "timer.c"
@@ -133,6 +140,12 @@ static const luaL_Reg luv_functions[] = {
   // process.c
   {"disable_stdio_inheritance", luv_disable_stdio_inheritance},
   {"spawn", luv_spawn},
+  {"spawn_capture", luv_spawn_capture},
+  {"spawn_template", luv_spawn_template},
+
+  // procpool.c
+  {"new_process_pool", luv_new_process_pool},
+  {"process_pool_serve", luv_process_pool_serve},
   {"process_kill", luv_process_kill},
 #if LUV_UV_VERSION_GEQ(1, 19, 0)
   {"process_get_pid", luv_process_get_pid},
@@ -165,6 +178,7 @@ static const luaL_Reg luv_functions[] = {
   {"tcp_getpeername", luv_tcp_getpeername},
   {"tcp_getsockname", luv_tcp_getsockname},
   {"tcp_connect", luv_tcp_connect},
+  {"tcp_connect_host", luv_tcp_connect_host},
   {"tcp_write_queue_size", luv_write_queue_size},
 #if LUV_UV_VERSION_GEQ(1, 32, 0)
   {"tcp_close_reset", luv_tcp_close_reset},
@@ -295,6 +309,13 @@ static const luaL_Reg luv_functions[] = {
   // dns.c
   {"getaddrinfo", luv_getaddrinfo},
   {"getnameinfo", luv_getnameinfo},
+  {"getaddrinfo_cache", luv_getaddrinfo_cache},
+  {"getaddrinfo_cache_stats", luv_getaddrinfo_cache_stats},
+  {"getaddrinfo_many", luv_getaddrinfo_many},
+
+  // resolver.c
+  {"new_resolver", luv_new_resolver},
+  {"resolve", luv_resolve},
 
   // misc.c
   {"chdir", luv_chdir},
@@ -364,9 +385,26 @@ static const luaL_Reg luv_functions[] = {
 #endif
 #if LUV_UV_VERSION_GEQ(1, 33, 0)
   {"random", luv_random},
+  {"random_fill", luv_random_fill},
+  {"random_pool", luv_random_pool},
+  {"random_pool_stats", luv_random_pool_stats},
 #endif
   {"sleep", luv_sleep},
 
+  // ffi.c
+  {"ffi_api", luv_ffi_pointers},
+  {"ffi_handle", luv_ffi_handle},
+
+  // sharedmap.c
+  {"shared_map", luv_shared_map},
+
+  // sync.c
+  {"new_mutex", luv_new_mutex},
+  {"new_sem", luv_new_sem},
+  {"new_cond", luv_new_cond},
+  {"new_barrier", luv_new_barrier},
+  {"new_counter", luv_new_counter},
+
   // thread.c
   {"new_thread", luv_new_thread},
   {"thread_equal", luv_thread_equal},
@@ -381,11 +419,19 @@ static const luaL_Reg luv_functions[] = {
 #if LUV_UV_VERSION_GEQ(1, 10, 0)
   {"translate_sys_error", luv_translate_sys_error},
 #endif
+  {"set_try_error_mode", luv_set_try_error_mode},
 
   // metrics.c
 #if LUV_UV_VERSION_GEQ(1, 39, 0)
   {"metrics_idle_time", luv_metrics_idle_time},
 #endif
+  {"threadpool_stats", luv_threadpool_stats},
+
+  // lmem.c
+  {"memory_stats", luv_memory_stats},
+  {"set_memory_limit", luv_set_memory_limit},
+  {"gc_idle", luv_gc_idle},
+  {"gc_idle_stats", luv_gc_idle_stats},
 
   {NULL, NULL}
 };
@@ -579,16 +625,23 @@ static void luv_dir_init(lua_State* L) {
 #endif
 
 static void luv_handle_init(lua_State* L) {
+  luv_ctx_t* ctx = luv_context(L);
 
   lua_newtable(L);
 #define XX(uc, lc)                             \
     luaL_newmetatable (L, "uv_"#lc);           \
+    ctx->handle_mt[UV_##uc] = lua_topointer(L, -1); \
+    lua_pushvalue(L, -1);                      \
+    ctx->handle_mt_ref[UV_##uc] = luaL_ref(L, LUA_REGISTRYINDEX); \
     lua_pushcfunction(L, luv_handle_tostring); \
     lua_setfield(L, -2, "__tostring");         \
     lua_pushcfunction(L, luv_handle_gc);       \
     lua_setfield(L, -2, "__gc");               \
-    luaL_newlib(L, luv_##lc##_methods);        \
-    luaL_setfuncs(L, luv_handle_methods, 0);   \
+    luaL_newlibtable(L, luv_##lc##_methods);   \
+    lua_pushlightuserdata(L, ctx);             \
+    luaL_setfuncs(L, luv_##lc##_methods, 1);   \
+    lua_pushlightuserdata(L, ctx);             \
+    luaL_setfuncs(L, luv_handle_methods, 1);   \
     lua_setfield(L, -2, "__index");            \
     lua_pushboolean(L, 1);                     \
     lua_rawset(L, -3);
@@ -601,21 +654,24 @@ static void luv_handle_init(lua_State* L) {
 
   luaL_getmetatable(L, "uv_pipe");
   lua_getfield(L, -1, "__index");
-  luaL_setfuncs(L, luv_stream_methods, 0);
+  lua_pushlightuserdata(L, ctx);
+  luaL_setfuncs(L, luv_stream_methods, 1);
   lua_pop(L, 1);
   lua_pushboolean(L, 1);
   lua_rawset(L, -3);
 
   luaL_getmetatable(L, "uv_tcp");
   lua_getfield(L, -1, "__index");
-  luaL_setfuncs(L, luv_stream_methods, 0);
+  lua_pushlightuserdata(L, ctx);
+  luaL_setfuncs(L, luv_stream_methods, 1);
   lua_pop(L, 1);
   lua_pushboolean(L, 1);
   lua_rawset(L, -3);
 
   luaL_getmetatable(L, "uv_tty");
   lua_getfield(L, -1, "__index");
-  luaL_setfuncs(L, luv_stream_methods, 0);
+  lua_pushlightuserdata(L, ctx);
+  luaL_setfuncs(L, luv_stream_methods, 1);
   lua_pop(L, 1);
   lua_pushboolean(L, 1);
   lua_rawset(L, -3);
@@ -763,7 +819,10 @@ static int loop_gc(lua_State *L) {
 LUALIB_API int luaopen_luv (lua_State* L) {
   luv_ctx_t* ctx = luv_context(L);
 
-  luaL_newlib(L, luv_functions);
+  // the context upvalue spares handle type checks a registry lookup
+  luaL_newlibtable(L, luv_functions);
+  lua_pushlightuserdata(L, ctx);
+  luaL_setfuncs(L, luv_functions, 1);
 
   // loop is NULL, luv need to create an inner loop
   if (ctx->loop==NULL) {
@@ -803,13 +862,26 @@ LUALIB_API int luaopen_luv (lua_State* L) {
 
   luv_req_init(L);
   luv_handle_init(L);
+  luv_tcp_init(L);
 #if LUV_UV_VERSION_GEQ(1, 28, 0)
   luv_dir_init(L);
 #endif
   luv_thread_init(L);
   luv_work_init(L);
+  luv_mem_init(L);
+  luv_misc_init(L);
+  luv_dns_init(L);
+  luv_resolver_init(L);
+  luv_process_init(L);
+  luv_procpool_init(L);
+  luv_sharedmap_init(L);
+  luv_sync_init(L);
+  luv_post_init(L);
+  luv_threadpool_stats_init(L, ctx);
 
   luv_constants(L);
   lua_setfield(L, -2, "constants");
+  luv_errno(L);
+  lua_setfield(L, -2, "errno");
   return 1;
 }
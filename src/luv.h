@@ -94,6 +94,18 @@ typedef struct {
   int          mode;        /* the mode used to run the loop (-1 if not running) */
 
   void* extra;              /* extra data */
+
+  /* maintained by luv, not meant to be set by embedders */
+  struct luv_threadpool_stats_s* tpstats; /* threadpool queue metrics */
+  struct luv_memwatch_s* memwatch;        /* native memory soft limit */
+  const void* handle_mt[UV_HANDLE_TYPE_MAX]; /* handle metatables by type */
+  int handle_mt_ref[UV_HANDLE_TYPE_MAX];     /* registry refs of the same */
+  int try_errors;                            /* how try_write/try_send fail */
+  int try_names_ref;                         /* error names by code, 0 if unset */
+  struct luv_dnscache_s* dnscache;           /* getaddrinfo results */
+  struct luv_randpool_s* randpool;           /* buffered uv.random bytes */
+  struct luv_gcidle_s* gcidle;               /* idle time garbage collection */
+  struct luv_post_queue_s* post;             /* luv_post() callbacks */
 } luv_ctx_t;
 
 /* Retrieve all the luv context from a lua_State */
@@ -119,6 +131,67 @@ LUALIB_API void luv_set_loop(lua_State* L, uv_loop_t* loop);
 */
 LUALIB_API void luv_set_callback(lua_State* L, luv_CFpcall pcall);
 
+/* Allocator for the memory luv keeps outside of the Lua heap (handles,
+   requests, buffers, thread arguments, ...). `size` passed to the free
+   function is the size that was requested from the matching malloc call.
+   Both functions are called from the loop thread, the libuv threadpool and
+   luv threads so they must be thread safe.
+*/
+typedef void* (*luv_malloc_fn)(void* ud, size_t size);
+typedef void (*luv_free_fn)(void* ud, void* ptr, size_t size);
+
+/* Route libuv's own allocations through the allocator too */
+#define LUV_ALLOCATOR_REPLACE_UV 0x01
+
+/* Set or clear (NULL functions) the allocator used by luv in the process
+   This must be called before luaopen_luv, and before any other libuv function
+   when LUV_ALLOCATOR_REPLACE_UV is set (see uv_replace_allocator).
+   Returns 0, UV_EINVAL when only one function is given or UV_EBUSY when luv
+   still owns memory from the previous allocator.
+*/
+LUALIB_API int luv_set_allocator(luv_malloc_fn malloc_fn, luv_free_fn free_fn,
+                                 void* ud, int flags);
+
+/* Plain C entry points for a few hot operations, meant to be called through
+   the LuaJIT FFI where calling a lua_CFunction would abort the trace. Fields
+   are only ever appended, check `version` before using newer ones. Handle
+   functions return UV_EINVAL for closing handles instead of touching them.
+*/
+#define LUV_FFI_VERSION 1
+
+typedef struct {
+  int version;
+  uint64_t (*now)(const uv_loop_t* loop);
+  void (*update_time)(uv_loop_t* loop);
+  uint64_t (*hrtime)(void);
+  int (*is_active)(const uv_handle_t* handle);
+  int (*timer_again)(uv_timer_t* timer);
+  int (*timer_set_repeat)(uv_timer_t* timer, uint64_t repeat);
+  uint64_t (*timer_get_repeat)(const uv_timer_t* timer);
+  int (*try_write)(uv_stream_t* stream, const char* data, size_t len);
+  size_t (*write_queue_size)(const uv_stream_t* stream);
+} luv_ffi_api_t;
+
+/* The table above, static for the lifetime of the process */
+LUALIB_API const luv_ffi_api_t* luv_ffi_api(void);
+
+/* Callback queued with luv_post, run on the loop thread with the main thread
+   of the state. It may push values and call into Lua, the stack is restored
+   afterwards and errors are reported by the luv_CFpcall routine like those of
+   other luv callbacks. `L` is NULL when the state was closed before the
+   callback could run, only `ud` should be released then.
+*/
+typedef void (*luv_post_cb)(lua_State* L, void* ud);
+
+/* Queue `cb` to run on the loop of `L`, safe to call from any thread
+   `L` is the state luaopen_luv ran on (see luv_state), it is only used as a
+   key and never touched here. Callbacks run in the order they were posted,
+   all queued ones once per loop wakeup. The queue does not keep the loop
+   alive. It must not be called while or after `L` is closed.
+   Returns 0, UV_EINVAL when luv is not loaded in `L` or UV_ENOMEM.
+*/
+LUALIB_API int luv_post(lua_State* L, luv_post_cb cb, void* ud);
+
 /* This is the main hook to load the library.
    This can be called multiple times in a process as long
    as you use a different lua_State and thread for each.
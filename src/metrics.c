@@ -15,8 +15,7 @@
  *
  */
 
-#include "luv.h"
-#include "util.h"
+#include "private.h"
 
 #if LUV_UV_VERSION_GEQ(1, 39, 0)
 static int luv_metrics_idle_time(lua_State* L) {
@@ -25,3 +24,145 @@ static int luv_metrics_idle_time(lua_State* L) {
   return 1;
 }
 #endif
+
+static const char* const luv_threadpool_type_names[LUV_TP_MAX] = {
+  "fs", "getaddrinfo", "getnameinfo", "random", "work"
+};
+
+static const char* const luv_threadpool_hist_names[LUV_TP_NHIST] = {
+  "wait", "service", "total"
+};
+
+static void luv_threadpool_stats_init(lua_State* L, luv_ctx_t* ctx) {
+  if (ctx->tpstats) return;
+  ctx->tpstats = (struct luv_threadpool_stats_s*)lua_newuserdata(L, sizeof(*ctx->tpstats));
+  memset(ctx->tpstats, 0, sizeof(*ctx->tpstats));
+  // the stats live as long as the state
+  luaL_ref(L, LUA_REGISTRYINDEX);
+}
+
+static void luv_threadpool_submit(luv_ctx_t* ctx, luv_threadpool_type type, uint64_t* submitted) {
+  struct luv_threadpool_stats_s* stats = ctx->tpstats;
+  luv_threadpool_type_stats_t* ts;
+  if (*submitted == 0)
+    *submitted = uv_hrtime();
+  if (!stats) return;
+  ts = &stats->types[type];
+  ts->submitted++;
+  if (++ts->inflight > ts->max_inflight)
+    ts->max_inflight = ts->inflight;
+  if (++stats->inflight > stats->max_inflight)
+    stats->max_inflight = stats->inflight;
+}
+
+static void luv_histogram_add(luv_histogram_t* hist, uint64_t ns) {
+  uint64_t us = ns / 1000;
+  int i = 0;
+  while (i < LUV_TP_BUCKETS - 1 && us >= ((uint64_t)1 << i))
+    i++;
+  hist->count++;
+  hist->sum += us;
+  if (us > hist->max) hist->max = us;
+  hist->buckets[i]++;
+}
+
+static void luv_threadpool_complete(luv_ctx_t* ctx, luv_threadpool_type type,
+  uint64_t submitted, uint64_t started, uint64_t finished) {
+  struct luv_threadpool_stats_s* stats = ctx->tpstats;
+  luv_threadpool_type_stats_t* ts;
+  uint64_t now;
+  // submitted is 0 if the request never went through luv_threadpool_submit
+  if (!stats || !submitted) return;
+  now = uv_hrtime();
+  ts = &stats->types[type];
+  ts->completed++;
+  if (ts->inflight) ts->inflight--;
+  if (stats->inflight) stats->inflight--;
+  luv_histogram_add(&ts->hist[LUV_TP_TOTAL], now - submitted);
+  // started is 0 when the request was cancelled before a worker ran it
+  if (started && finished >= started) {
+    luv_histogram_add(&ts->hist[LUV_TP_WAIT], started - submitted);
+    luv_histogram_add(&ts->hist[LUV_TP_SERVICE], finished - started);
+  }
+}
+
+// Upper bound in us of the bucket containing the given percentile
+static uint64_t luv_histogram_percentile(const luv_histogram_t* hist, double pct) {
+  uint64_t rank, seen = 0;
+  int i;
+  if (hist->count == 0) return 0;
+  rank = (uint64_t)(hist->count * pct / 100.0 + 0.5);
+  if (rank < 1) rank = 1;
+  for (i = 0; i < LUV_TP_BUCKETS; i++) {
+    seen += hist->buckets[i];
+    if (seen >= rank)
+      return i == LUV_TP_BUCKETS - 1 ? hist->max : ((uint64_t)1 << i);
+  }
+  return hist->max;
+}
+
+static void luv_push_histogram(lua_State* L, const luv_histogram_t* hist) {
+  int i;
+  lua_createtable(L, 0, 8);
+  lua_pushinteger(L, hist->count);
+  lua_setfield(L, -2, "count");
+  lua_pushinteger(L, hist->sum);
+  lua_setfield(L, -2, "sum");
+  lua_pushinteger(L, hist->max);
+  lua_setfield(L, -2, "max");
+  lua_pushinteger(L, luv_histogram_percentile(hist, 50));
+  lua_setfield(L, -2, "p50");
+  lua_pushinteger(L, luv_histogram_percentile(hist, 90));
+  lua_setfield(L, -2, "p90");
+  lua_pushinteger(L, luv_histogram_percentile(hist, 99));
+  lua_setfield(L, -2, "p99");
+  lua_createtable(L, LUV_TP_BUCKETS, 0);
+  for (i = 0; i < LUV_TP_BUCKETS; i++) {
+    lua_pushinteger(L, hist->buckets[i]);
+    lua_rawseti(L, -2, i + 1);
+  }
+  lua_setfield(L, -2, "buckets");
+}
+
+static int luv_threadpool_stats(lua_State* L) {
+  luv_ctx_t* ctx = luv_upvalue_context(L);
+  struct luv_threadpool_stats_s* stats = ctx->tpstats;
+  int reset = luv_optboolean(L, 1, 0);
+  int i, j;
+  if (!stats) return 0;
+
+  lua_createtable(L, 0, LUV_TP_MAX + 2);
+  lua_pushinteger(L, stats->inflight);
+  lua_setfield(L, -2, "inflight");
+  lua_pushinteger(L, stats->max_inflight);
+  lua_setfield(L, -2, "max_inflight");
+  for (i = 0; i < LUV_TP_MAX; i++) {
+    luv_threadpool_type_stats_t* ts = &stats->types[i];
+    lua_createtable(L, 0, 4 + LUV_TP_NHIST);
+    lua_pushinteger(L, ts->submitted);
+    lua_setfield(L, -2, "submitted");
+    lua_pushinteger(L, ts->completed);
+    lua_setfield(L, -2, "completed");
+    lua_pushinteger(L, ts->inflight);
+    lua_setfield(L, -2, "inflight");
+    lua_pushinteger(L, ts->max_inflight);
+    lua_setfield(L, -2, "max_inflight");
+    for (j = 0; j < LUV_TP_NHIST; j++) {
+      luv_push_histogram(L, &ts->hist[j]);
+      lua_setfield(L, -2, luv_threadpool_hist_names[j]);
+    }
+    lua_setfield(L, -2, luv_threadpool_type_names[i]);
+  }
+
+  if (reset) {
+    // keep the in-flight counters so pending completions stay balanced
+    stats->max_inflight = stats->inflight;
+    for (i = 0; i < LUV_TP_MAX; i++) {
+      luv_threadpool_type_stats_t* ts = &stats->types[i];
+      ts->submitted = ts->completed = 0;
+      ts->max_inflight = ts->inflight;
+      memset(ts->hist, 0, sizeof(ts->hist));
+    }
+  }
+  return 1;
+}
@@ -58,10 +58,10 @@ static uv_buf_t* luv_prep_bufs(lua_State* L, int index, size_t *count, int **ref
   uv_buf_t *bufs;
   size_t i;
   *count = lua_rawlen(L, index);
-  bufs = (uv_buf_t*)malloc(sizeof(uv_buf_t) * *count);
+  bufs = (uv_buf_t*)luv_malloc(sizeof(uv_buf_t) * *count, LUV_MEM_BUFS);
   int *refs_array = NULL;
   if (refs)
-    refs_array = (int*)malloc(sizeof(int) * (*count + 1));
+    refs_array = (int*)luv_malloc(sizeof(int) * (*count + 1), LUV_MEM_BUFS);
   for (i = 0; i < *count; ++i) {
     lua_rawgeti(L, index, i + 1);
     if (!lua_isstring(L, -1)) {
@@ -98,7 +98,7 @@ static uv_buf_t* luv_check_bufs(lua_State* L, int index, size_t* count, luv_req_
   }
   else if (lua_isstring(L, index)) {
     *count = 1;
-    bufs = (uv_buf_t*)malloc(sizeof(uv_buf_t));
+    bufs = (uv_buf_t*)luv_malloc(sizeof(uv_buf_t), LUV_MEM_BUFS);
     luv_prep_buf(L, index, bufs);
     lua_pushvalue(L, index);
     req_data->data_ref = luaL_ref(L, LUA_REGISTRYINDEX);
@@ -111,14 +111,16 @@ static uv_buf_t* luv_check_bufs(lua_State* L, int index, size_t* count, luv_req_
 
 // Like luv_check_bufs but does not ref the buf strings.
 // Only meant to be used for functions like luv_udp_try_send.
-static uv_buf_t* luv_check_bufs_noref(lua_State* L, int index, size_t* count) {
+// - single: caller storage used for a plain string, the result only needs to
+//   be freed when it isn't `single`
+static uv_buf_t* luv_check_bufs_noref(lua_State* L, int index, size_t* count, uv_buf_t* single) {
   uv_buf_t* bufs = NULL;
   if (lua_istable(L, index)) {
     bufs = luv_prep_bufs(L, index, count, NULL);
   }
   else if (lua_isstring(L, index)) {
     *count = 1;
-    bufs = (uv_buf_t*)malloc(sizeof(uv_buf_t));
+    bufs = single;
     luv_prep_buf(L, index, bufs);
   }
   else {
@@ -465,14 +467,14 @@ static int luv_print_active_handles(lua_State* L){
 static int luv_os_getenv(lua_State* L) {
   const char* name = luaL_checkstring(L, 1);
   size_t size = luaL_optinteger(L, 2, LUAL_BUFFERSIZE);
-  char *buff = malloc(size);
+  char *buff = (char*)luv_malloc(size, LUV_MEM_OTHER);
   int ret = uv_os_getenv(name, buff, &size);
   if (ret == 0) {
     lua_pushlstring(L, buff, size);
     ret = 1;
   } else
     ret = luv_error(L, ret);
-  free(buff);
+  luv_free(buff);
   return ret;
 }
 
@@ -674,6 +676,8 @@ static void luv_random_cb(uv_random_t* req, int status, void* buf, size_t buflen
   lua_State* L = data->ctx->L;
   int nargs;
 
+  luv_threadpool_complete(data->ctx, LUV_TP_RANDOM, data->submitted, 0, 0);
+
   if (status < 0) {
     luv_status(L, status);
     nargs = 1;
@@ -689,6 +693,193 @@ static void luv_random_cb(uv_random_t* req, int status, void* buf, size_t buflen
   req->data = NULL;
 }
 
+struct luv_randpool_s {
+  uv_random_t req;            /* refill of spare, runs in the threadpool */
+  luv_ctx_t* ctx;
+  size_t size;                /* bytes per buffer */
+  size_t max_request;         /* larger requests bypass the pool */
+  unsigned char* active;      /* served from, consumed bytes are zeroed */
+  unsigned char* spare;
+  size_t pos;                 /* first unused byte of active */
+  int spare_state;
+  int closed;                 /* detached while refilling, freed by the callback */
+  uint64_t submitted;
+  uint64_t hits, misses, refills, sync_refills;
+};
+typedef struct luv_randpool_s luv_randpool_t;
+
+#define LUV_RANDPOOL_EMPTY   0
+#define LUV_RANDPOOL_FILLING 1
+#define LUV_RANDPOOL_READY   2
+
+static void luv_randpool_cb(uv_random_t* req, int status, void* buf, size_t buflen) {
+  luv_randpool_t* pool = (luv_randpool_t*)req->data;
+  (void)buf;
+  if (pool->closed) {
+    memset(pool->spare, 0, buflen);
+    luv_free(pool);
+    return;
+  }
+  luv_threadpool_complete(pool->ctx, LUV_TP_RANDOM, pool->submitted, 0, 0);
+  if (status < 0) {
+    // the next take that runs dry refills synchronously
+    pool->spare_state = LUV_RANDPOOL_EMPTY;
+    return;
+  }
+  pool->spare_state = LUV_RANDPOOL_READY;
+  pool->refills++;
+}
+
+static void luv_randpool_refill(luv_randpool_t* pool) {
+  int ret;
+  pool->req.data = pool;
+  ret = uv_random(pool->ctx->loop, &pool->req, pool->spare, pool->size, 0, luv_randpool_cb);
+  if (ret < 0) return;
+  pool->spare_state = LUV_RANDPOOL_FILLING;
+  luv_threadpool_submit(pool->ctx, LUV_TP_RANDOM, &pool->submitted);
+}
+
+// Copies len bytes out of the pool, refilling from the spare buffer or
+// synchronously when it runs dry. Bytes are never handed out twice.
+static int luv_randpool_take(luv_randpool_t* pool, unsigned char* out, size_t len) {
+  while (len > 0) {
+    size_t n = pool->size - pool->pos;
+    if (n == 0) {
+      if (pool->spare_state == LUV_RANDPOOL_READY) {
+        unsigned char* tmp = pool->active;
+        pool->active = pool->spare;
+        pool->spare = tmp;
+        pool->spare_state = LUV_RANDPOOL_EMPTY;
+      }
+      else {
+        int ret = uv_random(NULL, NULL, pool->active, pool->size, 0, NULL);
+        if (ret < 0) return ret;
+        pool->sync_refills++;
+      }
+      pool->pos = 0;
+      continue;
+    }
+    if (n > len) n = len;
+    memcpy(out, pool->active + pool->pos, n);
+    memset(pool->active + pool->pos, 0, n);
+    pool->pos += n;
+    out += n;
+    len -= n;
+  }
+  // refill ahead once half of the active buffer is gone
+  if (pool->spare_state == LUV_RANDPOOL_EMPTY && pool->pos >= pool->size / 2)
+    luv_randpool_refill(pool);
+  return 0;
+}
+
+static void luv_randpool_detach(luv_randpool_t* pool) {
+  memset(pool->active, 0, pool->size);
+  if (pool->spare_state == LUV_RANDPOOL_FILLING) {
+    // the threadpool still writes into spare
+    pool->closed = 1;
+    return;
+  }
+  memset(pool->spare, 0, pool->size);
+  luv_free(pool);
+}
+
+static int luv_randpool_gc(lua_State* L) {
+  luv_ctx_t** udata = (luv_ctx_t**)lua_touserdata(L, 1);
+  luv_ctx_t* ctx = *udata;
+  if (ctx && ctx->randpool) {
+    luv_randpool_detach(ctx->randpool);
+    ctx->randpool = NULL;
+  }
+  *udata = NULL;
+  return 0;
+}
+
+static int luv_random_pool(lua_State* L) {
+  luv_ctx_t* ctx = luv_upvalue_context(L);
+  luv_randpool_t* pool;
+  lua_Integer size = 4096, max_request = 256;
+  int ret;
+
+  if (!lua_isnoneornil(L, 1)) {
+    luaL_checktype(L, 1, LUA_TTABLE);
+    lua_getfield(L, 1, "size");
+    size = luaL_optinteger(L, -1, size);
+    lua_getfield(L, 1, "max_request");
+    max_request = luaL_optinteger(L, -1, max_request);
+    lua_pop(L, 2);
+    luaL_argcheck(L, size >= 64 && size <= 0x1000000, 1, "size must be between 64 and 16 MiB");
+    luaL_argcheck(L, max_request >= 0 && max_request <= size, 1, "max_request must be between 0 and size");
+  }
+
+  if (ctx->randpool) {
+    luv_randpool_detach(ctx->randpool);
+    ctx->randpool = NULL;
+  }
+  if (lua_isnoneornil(L, 1)) return luv_result(L, 0);
+
+  // anchor a finalizer for the lifetime of the lua_State, once
+  lua_getfield(L, LUA_REGISTRYINDEX, "luv_randpool");
+  if (lua_isnil(L, -1)) {
+    luv_ctx_t** udata = (luv_ctx_t**)lua_newuserdata(L, sizeof(*udata));
+    *udata = ctx;
+    luaL_getmetatable(L, "luv_randpool");
+    lua_setmetatable(L, -2);
+    lua_setfield(L, LUA_REGISTRYINDEX, "luv_randpool");
+  }
+  lua_pop(L, 1);
+
+  pool = (luv_randpool_t*)luv_malloc(sizeof(*pool) + 2 * (size_t)size, LUV_MEM_OTHER);
+  if (!pool) return luaL_error(L, "Can't allocate random pool");
+  memset(pool, 0, sizeof(*pool));
+  pool->ctx = ctx;
+  pool->size = (size_t)size;
+  pool->max_request = (size_t)max_request;
+  pool->active = (unsigned char*)(pool + 1);
+  pool->spare = pool->active + pool->size;
+  ret = uv_random(NULL, NULL, pool->active, pool->size, 0, NULL);
+  if (ret < 0) {
+    luv_free(pool);
+    return luv_error(L, ret);
+  }
+  ctx->randpool = pool;
+  return luv_result(L, 0);
+}
+
+static int luv_random_pool_stats(lua_State* L) {
+  luv_randpool_t* pool = luv_upvalue_context(L)->randpool;
+  int reset = luv_optboolean(L, 1, 0);
+  if (!pool) return 0;
+  lua_createtable(L, 0, 6);
+  lua_pushinteger(L, pool->size);
+  lua_setfield(L, -2, "size");
+  lua_pushinteger(L, pool->size - pool->pos);
+  lua_setfield(L, -2, "available");
+  lua_pushinteger(L, pool->hits);
+  lua_setfield(L, -2, "hits");
+  lua_pushinteger(L, pool->misses);
+  lua_setfield(L, -2, "misses");
+  lua_pushinteger(L, pool->refills);
+  lua_setfield(L, -2, "refills");
+  lua_pushinteger(L, pool->sync_refills);
+  lua_setfield(L, -2, "sync_refills");
+  if (reset)
+    pool->hits = pool->misses = pool->refills = pool->sync_refills = 0;
+  return 1;
+}
+
+// Fills buf synchronously, from the pool when the request is small enough
+static int luv_random_sync(luv_ctx_t* ctx, void* buf, size_t buflen, unsigned int flags) {
+  luv_randpool_t* pool = ctx->randpool;
+  if (pool && flags == 0) {
+    if (buflen <= pool->max_request) {
+      pool->hits++;
+      return luv_randpool_take(pool, (unsigned char*)buf, buflen);
+    }
+    pool->misses++;
+  }
+  return uv_random(NULL, NULL, buf, buflen, flags, NULL);
+}
+
 static int luv_random(lua_State* L) {
   luv_ctx_t* ctx = luv_context(L);
   size_t buflen = (size_t)luaL_checkinteger(L, 1);
@@ -714,17 +905,21 @@ static int luv_random(lua_State* L) {
   int cb_ref = luv_check_continuation(L, 3);
   int sync = cb_ref == LUA_NOREF;
 
-  void* buf = lua_newuserdata(L, buflen);
   if (sync) {
-    // sync version doesn't need anything except buf, buflen, and flags
-    int ret = uv_random(NULL, NULL, buf, buflen, flags, NULL);
+    // sync version doesn't need anything except buf, buflen, and flags,
+    // small requests skip the userdata
+    char small[256];
+    void* buf = buflen <= sizeof(small) ? small : lua_newuserdata(L, buflen);
+    int ret = luv_random_sync(ctx, buf, buflen, flags);
     if (ret < 0) {
       return luv_error(L, ret);
     }
     lua_pushlstring(L, (const char*)buf, buflen);
+    if (buf == small) memset(small, 0, buflen);
     return 1;
   }
   else {
+    void* buf = lua_newuserdata(L, buflen);
     // ref buffer
     int buf_ref = luaL_ref(L, LUA_REGISTRYINDEX);
 
@@ -738,7 +933,40 @@ static int luv_random(lua_State* L) {
       lua_pop(L, 1);
       return luv_error(L, ret);
     }
+    luv_threadpool_submit(ctx, LUV_TP_RANDOM, &((luv_req_t*)req->data)->submitted);
     return luv_result(L, ret);
   }
 }
+
+static int luv_random_fill(lua_State* L) {
+  luv_ctx_t* ctx = luv_upvalue_context(L);
+  unsigned char* buf;
+  size_t len = (size_t)luaL_checkinteger(L, 2);
+  size_t offset = (size_t)luaL_optinteger(L, 3, 0);
+  size_t size;
+  int ret;
+  // only full userdata know their size, a lightuserdata or a cdata could
+  // send the bytes anywhere
+  luaL_checktype(L, 1, LUA_TUSERDATA);
+  buf = (unsigned char*)lua_touserdata(L, 1);
+  size = lua_rawlen(L, 1);
+  luaL_argcheck(L, offset <= size && len <= size - offset, 2,
+                "out of the bounds of the userdata");
+  if (len > 0x7FFFFFFFu) {
+    return luv_error(L, UV_E2BIG);
+  }
+  ret = luv_random_sync(ctx, buf + offset, len, 0);
+  return luv_result(L, ret);
+}
+#endif
+
+static void luv_misc_init(lua_State* L) {
+#if LUV_UV_VERSION_GEQ(1, 33, 0)
+  luaL_newmetatable(L, "luv_randpool");
+  lua_pushcfunction(L, luv_randpool_gc);
+  lua_setfield(L, -2, "__gc");
+  lua_pop(L, 1);
+#else
+  (void)L;
 #endif
+}
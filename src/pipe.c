@@ -17,7 +17,7 @@
 #include "private.h"
 
 static uv_pipe_t* luv_check_pipe(lua_State* L, int index) {
-  uv_pipe_t* handle = (uv_pipe_t*)luv_checkudata(L, index, "uv_pipe");
+  uv_pipe_t* handle = (uv_pipe_t*)luv_checkudata(L, index, UV_NAMED_PIPE, "uv_pipe");
   luaL_argcheck(L, handle->type == UV_NAMED_PIPE && handle->data, index, "Expected uv_pipe_t");
   return handle;
 }
@@ -25,7 +25,7 @@ static uv_pipe_t* luv_check_pipe(lua_State* L, int index) {
 static int luv_new_pipe(lua_State* L) {
   uv_pipe_t* handle;
   int ipc, ret;
-  luv_ctx_t* ctx = luv_context(L);
+  luv_ctx_t* ctx = luv_upvalue_context(L);
   ipc = luv_optboolean(L, 1, 0);
   handle = (uv_pipe_t*)luv_newuserdata(L, sizeof(*handle));
   ret = uv_pipe_init(ctx->loop, handle, ipc);
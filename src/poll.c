@@ -17,13 +17,13 @@
 #include "private.h"
 
 static uv_poll_t* luv_check_poll(lua_State* L, int index) {
-  uv_poll_t* handle = (uv_poll_t*)luv_checkudata(L, index, "uv_poll");
+  uv_poll_t* handle = (uv_poll_t*)luv_checkudata(L, index, UV_POLL, "uv_poll");
   luaL_argcheck(L, handle->type == UV_POLL && handle->data, index, "Expected uv_poll_t");
   return handle;
 }
 
 static int luv_new_poll(lua_State* L) {
-  luv_ctx_t* ctx = luv_context(L);
+  luv_ctx_t* ctx = luv_upvalue_context(L);
   int fd = luaL_checkinteger(L, 1);
   uv_poll_t* handle = (uv_poll_t*)luv_newuserdata(L, sizeof(*handle));
   int ret = uv_poll_init(ctx->loop, handle, fd);
@@ -36,7 +36,7 @@ static int luv_new_poll(lua_State* L) {
 }
 
 static int luv_new_socket_poll(lua_State* L) {
-  luv_ctx_t* ctx = luv_context(L);
+  luv_ctx_t* ctx = luv_upvalue_context(L);
   int fd = luaL_checkinteger(L, 1);
   uv_poll_t* handle = (uv_poll_t*)luv_newuserdata(L, sizeof(*handle));
   int ret = uv_poll_init_socket(ctx->loop, handle, fd);
@@ -0,0 +1,163 @@
+/*
+ *  Copyright 2014 The Luvit Authors. All Rights Reserved.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ */
+#include "private.h"
+
+// A luv_post() call waiting for the loop thread
+typedef struct luv_post_item_s {
+  struct luv_post_item_s* next;
+  luv_post_cb cb;
+  void* ud;
+} luv_post_item_t;
+
+// One queue per state that ran luaopen_luv. Queues sit in a process wide list
+// and are never freed, so luv_post can find the one of its state from any
+// thread without a lock and without touching the state. The queue of a closed
+// state is reused by the next one.
+typedef struct luv_post_queue_s {
+  uv_async_t async;                // internal handle, wakes the loop
+  struct luv_post_queue_s* next;   // process wide list, set before publishing
+  lua_State* L;                    // owner, NULL once the handle is closed
+  luv_ctx_t* ctx;                  // NULL once the state is closing
+  luv_post_item_t* head;           // newest first, pushed by any thread
+} luv_post_queue_t;
+
+static luv_post_queue_t* luv_post_queues;
+
+static int luv_post_call(lua_State* L) {
+  luv_post_item_t* item = (luv_post_item_t*)lua_touserdata(L, 1);
+  lua_settop(L, 0);
+  item->cb(L, item->ud);
+  return 0;
+}
+
+// Runs the callbacks queued so far in the order they were posted. Anything
+// posted meanwhile waits for the next wakeup. Without a state the callbacks
+// are only given a chance to release their userdata.
+static void luv_post_run(luv_post_queue_t* queue, luv_ctx_t* ctx) {
+  luv_post_item_t* item = (luv_post_item_t*)luv_atomic_xchgp(&queue->head, NULL);
+  luv_post_item_t* fifo = NULL;
+  while (item) {
+    luv_post_item_t* next = item->next;
+    item->next = fifo;
+    fifo = item;
+    item = next;
+  }
+  while (fifo) {
+    item = fifo;
+    fifo = item->next;
+    if (ctx) {
+      lua_State* L = ctx->L;
+      int top = lua_gettop(L);
+      lua_pushcfunction(L, luv_post_call);
+      lua_pushlightuserdata(L, item);
+      ctx->pcall(L, 1, 0, 0);
+      lua_settop(L, top);
+    } else {
+      item->cb(NULL, item->ud);
+    }
+    luv_free(item);
+  }
+}
+
+static void luv_post_async_cb(uv_async_t* handle) {
+  luv_post_queue_t* queue = (luv_post_queue_t*)handle;
+  luv_post_run(queue, queue->ctx);
+}
+
+LUALIB_API int luv_post(lua_State* L, luv_post_cb cb, void* ud) {
+  luv_post_queue_t* queue = (luv_post_queue_t*)luv_atomic_loadp(&luv_post_queues);
+  luv_post_item_t* item;
+  luv_post_item_t* head;
+  if (!L || !cb) return UV_EINVAL;
+  while (queue && !(luv_atomic_loadp(&queue->L) == L && luv_atomic_loadp(&queue->ctx)))
+    queue = queue->next;
+  if (!queue) return UV_EINVAL;
+
+  item = (luv_post_item_t*)luv_malloc(sizeof(*item), LUV_MEM_OTHER);
+  if (!item) return UV_ENOMEM;
+  item->cb = cb;
+  item->ud = ud;
+  head = (luv_post_item_t*)luv_atomic_loadp(&queue->head);
+  do {
+    item->next = head;
+  } while (!luv_atomic_casp(&queue->head, head, item));
+  // the loop takes the whole list at once, only a push onto an empty list
+  // needs to wake it up
+  return head ? 0 : uv_async_send(&queue->async);
+}
+
+static void luv_post_close_cb(uv_handle_t* handle) {
+  luv_post_queue_t* queue = (luv_post_queue_t*)handle;
+  luv_post_run(queue, NULL);
+  luv_atomic_storep(&queue->L, NULL);
+}
+
+static int luv_post_gc(lua_State* L) {
+  luv_post_queue_t** udata = (luv_post_queue_t**)lua_touserdata(L, 1);
+  luv_post_queue_t* queue = *udata;
+  if (!queue) return 0;
+  queue->ctx->post = NULL;
+  luv_atomic_storep(&queue->ctx, NULL);
+  luv_post_run(queue, NULL);
+  if (!luv_close_internal_handle((uv_handle_t*)&queue->async, luv_post_close_cb))
+    luv_post_close_cb((uv_handle_t*)&queue->async);
+  *udata = NULL;
+  return 0;
+}
+
+static void luv_post_init(lua_State* L) {
+  luv_ctx_t* ctx = luv_context(L);
+  luv_post_queue_t* queue;
+
+  luaL_newmetatable(L, "luv_post");
+  lua_pushcfunction(L, luv_post_gc);
+  lua_setfield(L, -2, "__gc");
+  lua_pop(L, 1);
+
+  // luaopen_luv already ran on this state
+  if (ctx->post) return;
+
+  // take over the queue of a closed state or add a new one
+  for (queue = (luv_post_queue_t*)luv_atomic_loadp(&luv_post_queues); queue; queue = queue->next) {
+    lua_State* expected = NULL;
+    if (luv_atomic_casp(&queue->L, expected, ctx->L)) break;
+  }
+  if (!queue) {
+    luv_post_queue_t* head;
+    // lives as long as the process, kept out of the luv_set_allocator books
+    queue = (luv_post_queue_t*)malloc(sizeof(*queue));
+    if (!queue) return;
+    memset(queue, 0, sizeof(*queue));
+    queue->L = ctx->L;
+    head = (luv_post_queue_t*)luv_atomic_loadp(&luv_post_queues);
+    do {
+      queue->next = head;
+    } while (!luv_atomic_casp(&luv_post_queues, head, queue));
+  }
+  // late posts to the previous owner
+  luv_post_run(queue, NULL);
+
+  if (uv_async_init(ctx->loop, &queue->async, luv_post_async_cb) < 0) {
+    luv_atomic_storep(&queue->L, NULL);
+    return;
+  }
+  luv_init_internal_handle((uv_handle_t*)&queue->async);
+  uv_unref((uv_handle_t*)&queue->async);
+  ctx->post = queue;
+  luv_atomic_storep(&queue->ctx, ctx);
+  luv_anchor_internal(L, queue, "luv_post");
+}
@@ -17,13 +17,13 @@
 #include "private.h"
 
 static uv_prepare_t* luv_check_prepare(lua_State* L, int index) {
-  uv_prepare_t* handle = (uv_prepare_t*)luv_checkudata(L, index, "uv_prepare");
+  uv_prepare_t* handle = (uv_prepare_t*)luv_checkudata(L, index, UV_PREPARE, "uv_prepare");
   luaL_argcheck(L, handle->type == UV_PREPARE && handle->data, index, "Expected uv_prepare_t");
   return handle;
 }
 
 static int luv_new_prepare(lua_State* L) {
-  luv_ctx_t* ctx = luv_context(L);
+  luv_ctx_t* ctx = luv_upvalue_context(L);
   uv_prepare_t* handle = (uv_prepare_t*)luv_newuserdata(L, sizeof(*handle));
   int ret = uv_prepare_init(ctx->loop, handle);
   if (ret < 0) {
@@ -7,6 +7,7 @@
 #endif
 
 #include "lhandle.h"
+#include "lmem.h"
 #include "lreq.h"
 #include "lthreadpool.h"
 #include "luv.h"
@@ -44,6 +45,13 @@ static void luv_find_handle(lua_State* L, luv_handle_t* data);
 /* Unref the handle from the lua world, allowing it to GC */
 static void luv_unref_handle(lua_State* L, luv_handle_t* data);
 
+/* From lmem.c */
+/* Allocate size bytes accounted under the given category */
+static void* luv_malloc(size_t size, luv_mem_category category);
+
+/* Release a block from luv_malloc, NULL is ignored */
+static void luv_free(void* ptr);
+
 /* From lreq.c */
 /* Used in the top of a setup function to check the arg
    and ref the callback to an integer.
@@ -58,15 +66,23 @@ static void luv_fulfill_req(lua_State* L, luv_req_t* data, int nargs);
 static void luv_cleanup_req(lua_State* L, luv_req_t* data);
 
 /* From handle.c */
-static void* luv_checkudata(lua_State* L, int ud, const char* tname);
+static luv_ctx_t* luv_upvalue_context(lua_State* L);
+static const void* luv_metatable_ptr(lua_State* L, int index);
+static uv_handle_t* luv_check_handle(lua_State* L, int index);
+static void* luv_checkudata(lua_State* L, int ud, uv_handle_type type, const char* tname);
 static void* luv_newuserdata(lua_State* L, size_t sz);
+static void luv_close_cb(uv_handle_t* handle);
+static void luv_init_internal_handle(uv_handle_t* handle);
+static int luv_close_internal_handle(uv_handle_t* handle, uv_close_cb close_cb);
+static int luv_anchor_internal(lua_State* L, void* ptr, const char* tname);
+static void luv_unanchor_internal(lua_State* L, int ref);
 
 
 /* From misc.c */
 static void luv_prep_buf(lua_State *L, int idx, uv_buf_t *pbuf);
 static uv_buf_t* luv_prep_bufs(lua_State* L, int index, size_t *count, int **refs);
 static uv_buf_t* luv_check_bufs(lua_State* L, int index, size_t *count, luv_req_t* req_data);
-static uv_buf_t* luv_check_bufs_noref(lua_State* L, int index, size_t *count);
+static uv_buf_t* luv_check_bufs_noref(lua_State* L, int index, size_t *count, uv_buf_t* single);
 
 /* From tcp.c */
 static void parse_sockaddr(lua_State* L, struct sockaddr_storage* address);
@@ -75,6 +91,26 @@ static void luv_connect_cb(uv_connect_t* req, int status);
 /* From fs.c */
 static void luv_push_stats_table(lua_State* L, const uv_stat_t* s);
 
+/* From dns.c */
+static uint32_t luv_dns_hash(const char* key, size_t len);
+static void luv_pushaddrinfo(lua_State* L, struct addrinfo* res);
+static void luv_pushaddrinfo_format(lua_State* L, struct addrinfo* res, int format);
+static int luv_check_addrinfo_format(lua_State* L, int index);
+/* Copies the uv_sockaddr at index into addr, with the port at portidx when
+   that is a number. Returns NULL when the value is not a uv_sockaddr.
+*/
+static struct sockaddr* luv_test_sockaddr(lua_State* L, int index, int portidx, struct sockaddr_storage* addr);
+
+/* From sync.c */
+/* Takes a reference of the sync object at index for thread arguments,
+   returns NULL when the value is not one.
+*/
+static void* luv_sync_retain(lua_State* L, int index);
+/* Pushes a userdata adopting a reference taken by luv_sync_retain */
+static void luv_sync_push(lua_State* L, void* sync);
+/* Drops a reference taken by luv_sync_retain */
+static void luv_sync_release(void* sync);
+
 /* From constants.c */
 static int luv_af_string_to_num(const char* string);
 static const char* luv_af_num_to_string(const int num);
@@ -88,6 +124,7 @@ static const char* luv_proto_num_to_string(int num);
 /* From util.c */
 // Push a Libuv error code onto the Lua stack
 static int luv_error(lua_State* L, int status);
+static int luv_try_error(lua_State* L, int status);
 
 // Common error handling pattern for binding uv functions that only return success/error.
 // If the binding returns a value other than success/error, this function should not be used.
@@ -114,6 +151,21 @@ static lua_State* luv_thread_acquire_vm();
 
 /* From process.c */
 static int luv_parse_signal(lua_State* L, int slot);
+static int luv_spawn_template(lua_State* L);
+static int luv_spawn_template_start(lua_State* L, int index, uv_process_t* process,
+                                    uv_stdio_container_t* stdio, int stdio_count, uv_exit_cb exit_cb);
+
+/* From metrics.c */
+/* Record that a request of the given kind was handed to the threadpool.
+   Stores the submission time in *submitted unless the caller already did.
+*/
+static void luv_threadpool_submit(luv_ctx_t* ctx, luv_threadpool_type type, uint64_t* submitted);
+/* Record the completion of a threadpool request. started and finished are
+   the worker-side timestamps, or 0 when they are not observable (libuv
+   internal requests like fs and dns).
+*/
+static void luv_threadpool_complete(luv_ctx_t* ctx, luv_threadpool_type type,
+  uint64_t submitted, uint64_t started, uint64_t finished);
 
 /* From work.c */
 static int luv_thread_dumped(lua_State* L, int idx);
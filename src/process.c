@@ -24,7 +24,7 @@ static int luv_disable_stdio_inheritance(lua_State* L) {
 }
 
 static uv_process_t* luv_check_process(lua_State* L, int index) {
-  uv_process_t* handle = (uv_process_t*)luv_checkudata(L, index, "uv_process");
+  uv_process_t* handle = (uv_process_t*)luv_checkudata(L, index, UV_PROCESS, "uv_process");
   luaL_argcheck(L, handle->type == UV_PROCESS && handle->data, index, "Expected uv_process_t");
   return handle;
 }
@@ -44,15 +44,15 @@ static void luv_spawn_close_cb(uv_handle_t* handle) {
 }
 
 static void luv_clean_options(lua_State* L, uv_process_options_t* options, int* args_refs) {
-  free(options->args);
-  free(options->stdio);
-  free(options->env);
+  luv_free(options->args);
+  luv_free(options->stdio);
+  luv_free(options->env);
   if (args_refs) {
     int i;
     for (i = 0; args_refs[i] != LUA_NOREF; i++) {
       luaL_unref(L, LUA_REGISTRYINDEX, args_refs[i]);
     }
-    free(args_refs);
+    luv_free(args_refs);
   }
 }
 
@@ -79,18 +79,60 @@ static int sparse_rawlen(lua_State* L, int tbl) {
   return len;
 }
 
-static int luv_spawn(lua_State* L) {
-  uv_process_t* handle;
-  uv_process_options_t options;
+// Fills len stdio containers from the list at index. Returns an error
+// message for entries of the wrong type, NULL on success.
+static const char* luv_check_spawn_stdio(lua_State* L, int index, uv_stdio_container_t* stdio, size_t len) {
+  size_t i;
+  for (i = 0; i < len; ++i) {
+    lua_rawgeti(L, index, i + 1);
+    // integers are assumed to be file descripters
+    if (lua_type(L, -1) == LUA_TNUMBER) {
+      stdio[i].flags = UV_INHERIT_FD;
+      stdio[i].data.fd = lua_tointeger(L, -1);
+    }
+    // userdata is assumed to be a uv_stream_t instance
+    else if (lua_type(L, -1) == LUA_TUSERDATA) {
+      uv_os_fd_t fd;
+      uv_stream_t* stream = luv_check_stream(L, -1);
+      int err = uv_fileno((uv_handle_t*)stream, &fd);
+      if (err == UV_EINVAL || err == UV_EBADF) {
+        // stdin (fd 0) is read-only, stdout and stderr (fds 1 & 2) are
+        // write-only, and all fds > 2 are read-write
+        int flags = UV_CREATE_PIPE;
+        if (i == 0 || i > 2)
+          flags |= UV_READABLE_PIPE;
+        if (i != 0)
+          flags |= UV_WRITABLE_PIPE;
+        stdio[i].flags = (uv_stdio_flags)flags;
+      }
+      else {
+        stdio[i].flags = UV_INHERIT_STREAM;
+      }
+      stdio[i].data.stream = stream;
+    }
+    else if (lua_type(L, -1) == LUA_TNIL) {
+      stdio[i].flags = UV_IGNORE;
+    }
+    else {
+      lua_pop(L, 1);
+      return "stdio table entries must be nil, uv_stream_t, or integer";
+    }
+    lua_pop(L, 1);
+  }
+  return NULL;
+}
+
+// Fills options from the file at index 1 and the table at index 2, the
+// strings stay owned by the Lua stack and the refs in *refs_out. Raises
+// errors after releasing what it allocated, always returns 0 otherwise.
+static int luv_check_spawn_options(lua_State* L, uv_process_options_t* options, int** refs_out) {
   int* args_refs = NULL;
   size_t i, len = 0;
-  int ret;
-  luv_ctx_t* ctx = luv_context(L);
+  const char* err;
 
-  memset(&options, 0, sizeof(options));
-  options.exit_cb = exit_cb;
-  options.file = luaL_checkstring(L, 1);
-  options.flags = 0;
+  memset(options, 0, sizeof(*options));
+  options->file = luaL_checkstring(L, 1);
+  options->flags = 0;
 
   // Make sure the 2nd argument is a table
   luaL_checktype(L, 2, LUA_TTABLE);
@@ -102,14 +144,14 @@ static int luv_spawn(lua_State* L) {
     len = 1 + lua_rawlen(L, -1);
   }
   else if (lua_type(L, -1) != LUA_TNIL) {
-    luv_clean_options(L, &options, args_refs);
+    luv_clean_options(L, options, args_refs);
     return luaL_argerror(L, 3, "args option must be table");
   }
   else {
     len = 1;
   }
   // +1 for null terminator at end
-  options.args = (char**)malloc((len + 1) * sizeof(*options.args));
+  options->args = (char**)luv_malloc((len + 1) * sizeof(*options->args), LUV_MEM_OTHER);
 
   // args must be referenced to ensure that they don't get garbage
   // collected between now and when they are used in uv_spawn.
@@ -117,72 +159,41 @@ static int luv_spawn(lua_State* L) {
   // from the stack. Note: args_refs is a LUA_NOREF-terminated array
   // when it is non-NULL 
   if (len > 1) {
-    args_refs = (int*)malloc(len * sizeof(int));
+    args_refs = (int*)luv_malloc(len * sizeof(int), LUV_MEM_OTHER);
     if (args_refs)
       args_refs[len-1] = LUA_NOREF;
   }
 
-  if (!options.args || (len > 1 && !args_refs)) {
-    luv_clean_options(L, &options, args_refs);
+  if (!options->args || (len > 1 && !args_refs)) {
+    luv_clean_options(L, options, args_refs);
     return luaL_error(L, "Problem allocating args");
   }
-  options.args[0] = (char*)options.file;
+  options->args[0] = (char*)options->file;
   for (i = 1; i < len; ++i) {
     lua_rawgeti(L, -1, i);
-    options.args[i] = (char*)lua_tostring(L, -1);
+    options->args[i] = (char*)lua_tostring(L, -1);
     args_refs[i - 1] = luaL_ref(L, LUA_REGISTRYINDEX);
   }
-  options.args[len] = NULL;
+  options->args[len] = NULL;
   lua_pop(L, 1); // pop the args field (either table or nil)
 
   // get the stdio list
   lua_getfield(L, 2, "stdio");
   if (lua_type(L, -1) == LUA_TTABLE) {
-    options.stdio_count = len = sparse_rawlen(L, -1);
-    options.stdio = (uv_stdio_container_t*)malloc(len * sizeof(*options.stdio));
-    if (!options.stdio) {
-      luv_clean_options(L, &options, args_refs);
+    options->stdio_count = len = sparse_rawlen(L, -1);
+    options->stdio = (uv_stdio_container_t*)luv_malloc(len * sizeof(*options->stdio), LUV_MEM_OTHER);
+    if (!options->stdio) {
+      luv_clean_options(L, options, args_refs);
       return luaL_error(L, "Problem allocating stdio");
     }
-    for (i = 0; i < len; ++i) {
-      lua_rawgeti(L, -1, i + 1);
-      // integers are assumed to be file descripters
-      if (lua_type(L, -1) == LUA_TNUMBER) {
-        options.stdio[i].flags = UV_INHERIT_FD;
-        options.stdio[i].data.fd = lua_tointeger(L, -1);
-      }
-      // userdata is assumed to be a uv_stream_t instance
-      else if (lua_type(L, -1) == LUA_TUSERDATA) {
-        uv_os_fd_t fd;
-        uv_stream_t* stream = luv_check_stream(L, -1);
-        int err = uv_fileno((uv_handle_t*)stream, &fd);
-        if (err == UV_EINVAL || err == UV_EBADF) {
-          // stdin (fd 0) is read-only, stdout and stderr (fds 1 & 2) are
-          // write-only, and all fds > 2 are read-write
-          int flags = UV_CREATE_PIPE;
-          if (i == 0 || i > 2)
-            flags |= UV_READABLE_PIPE;
-          if (i != 0)
-            flags |= UV_WRITABLE_PIPE;
-          options.stdio[i].flags = (uv_stdio_flags)flags;
-        }
-        else {
-          options.stdio[i].flags = UV_INHERIT_STREAM;
-        }
-        options.stdio[i].data.stream = stream;
-      }
-      else if (lua_type(L, -1) == LUA_TNIL) {
-        options.stdio[i].flags = UV_IGNORE;
-      }
-      else {
-        luv_clean_options(L, &options, args_refs);
-        return luaL_argerror(L, 2, "stdio table entries must be nil, uv_stream_t, or integer");
-      }
-      lua_pop(L, 1);
+    err = luv_check_spawn_stdio(L, lua_gettop(L), options->stdio, len);
+    if (err) {
+      luv_clean_options(L, options, args_refs);
+      return luaL_argerror(L, 2, err);
     }
   }
   else if (lua_type(L, -1) != LUA_TNIL) {
-    luv_clean_options(L, &options, args_refs);
+    luv_clean_options(L, options, args_refs);
     return luaL_argerror(L, 2, "stdio option must be table");
   }
   lua_pop(L, 1);
@@ -191,20 +202,20 @@ static int luv_spawn(lua_State* L) {
   lua_getfield(L, 2, "env");
   if (lua_type(L, -1) == LUA_TTABLE) {
     len = lua_rawlen(L, -1);
-    options.env = (char**)malloc((len + 1) * sizeof(*options.env));
-    if (!options.env) {
-      luv_clean_options(L, &options, args_refs);
+    options->env = (char**)luv_malloc((len + 1) * sizeof(*options->env), LUV_MEM_OTHER);
+    if (!options->env) {
+      luv_clean_options(L, options, args_refs);
       return luaL_error(L, "Problem allocating env");
     }
     for (i = 0; i < len; ++i) {
       lua_rawgeti(L, -1, i + 1);
-      options.env[i] = (char*)lua_tostring(L, -1);
+      options->env[i] = (char*)lua_tostring(L, -1);
       lua_pop(L, 1);
     }
-    options.env[len] = NULL;
+    options->env[len] = NULL;
   }
   else if (lua_type(L, -1) != LUA_TNIL) {
-    luv_clean_options(L, &options, args_refs);
+    luv_clean_options(L, options, args_refs);
     return luaL_argerror(L, 2, "env option must be table");
   }
   lua_pop(L, 1);
@@ -212,10 +223,10 @@ static int luv_spawn(lua_State* L) {
   // Get the cwd
   lua_getfield(L, 2, "cwd");
   if (lua_type(L, -1) == LUA_TSTRING) {
-    options.cwd = (char*)lua_tostring(L, -1);
+    options->cwd = (char*)lua_tostring(L, -1);
   }
   else if (lua_type(L, -1) != LUA_TNIL) {
-    luv_clean_options(L, &options, args_refs);
+    luv_clean_options(L, options, args_refs);
     return luaL_argerror(L, 2, "cwd option must be string");
   }
   lua_pop(L, 1);
@@ -223,11 +234,11 @@ static int luv_spawn(lua_State* L) {
   // Check for uid
   lua_getfield(L, 2, "uid");
   if (lua_type(L, -1) == LUA_TNUMBER) {
-    options.uid = lua_tointeger(L, -1);
-    options.flags |= UV_PROCESS_SETUID;
+    options->uid = lua_tointeger(L, -1);
+    options->flags |= UV_PROCESS_SETUID;
   }
   else if (lua_type(L, -1) != LUA_TNIL) {
-    luv_clean_options(L, &options, args_refs);
+    luv_clean_options(L, options, args_refs);
     return luaL_argerror(L, 2, "uid option must be number");
   }
   lua_pop(L, 1);
@@ -235,11 +246,11 @@ static int luv_spawn(lua_State* L) {
   // Check for gid
   lua_getfield(L, 2, "gid");
   if (lua_type(L, -1) == LUA_TNUMBER) {
-    options.gid = lua_tointeger(L, -1);
-    options.flags |= UV_PROCESS_SETGID;
+    options->gid = lua_tointeger(L, -1);
+    options->flags |= UV_PROCESS_SETGID;
   }
   else if (lua_type(L, -1) != LUA_TNIL) {
-    luv_clean_options(L, &options, args_refs);
+    luv_clean_options(L, options, args_refs);
     return luaL_argerror(L, 2, "gid option must be number");
   }
   lua_pop(L, 1);
@@ -247,32 +258,47 @@ static int luv_spawn(lua_State* L) {
   // Check for the boolean flags
   lua_getfield(L, 2, "verbatim");
   if (lua_toboolean(L, -1)) {
-    options.flags |= UV_PROCESS_WINDOWS_VERBATIM_ARGUMENTS;
+    options->flags |= UV_PROCESS_WINDOWS_VERBATIM_ARGUMENTS;
   }
   lua_pop(L, 1);
   lua_getfield(L, 2, "detached");
   if (lua_toboolean(L, -1)) {
-    options.flags |= UV_PROCESS_DETACHED;
+    options->flags |= UV_PROCESS_DETACHED;
   }
   lua_pop(L, 1);
   lua_getfield(L, 2, "hide");
   if (lua_toboolean(L, -1)) {
-    options.flags |= UV_PROCESS_WINDOWS_HIDE;
+    options->flags |= UV_PROCESS_WINDOWS_HIDE;
   }
   lua_pop(L, 1);
 #if LUV_UV_VERSION_GEQ(1, 24, 0)
   lua_getfield(L, 2, "hide_console");
   if (lua_toboolean(L, -1)) {
-    options.flags |= UV_PROCESS_WINDOWS_HIDE_CONSOLE;
+    options->flags |= UV_PROCESS_WINDOWS_HIDE_CONSOLE;
   }
   lua_pop(L, 1);
   lua_getfield(L, 2, "hide_gui");
   if (lua_toboolean(L, -1)) {
-    options.flags |= UV_PROCESS_WINDOWS_HIDE_GUI;
+    options->flags |= UV_PROCESS_WINDOWS_HIDE_GUI;
   }
   lua_pop(L, 1);
 #endif
 
+  *refs_out = args_refs;
+  return 0;
+}
+
+static int luv_spawn(lua_State* L) {
+  uv_process_t* handle;
+  uv_process_options_t options;
+  int* args_refs = NULL;
+  int ret;
+  luv_ctx_t* ctx = luv_upvalue_context(L);
+
+  memset(&options, 0, sizeof(options));
+  luv_check_spawn_options(L, &options, &args_refs);
+  options.exit_cb = exit_cb;
+
   // this will fill the 3rd argument with nil if it doesn't exist so that
   // the uv_process_t userdata doesn't get treated as the 3rd argument
   lua_settop(L, 3);
@@ -330,3 +356,491 @@ static int luv_process_get_pid(lua_State* L) {
   return 1;
 }
 #endif
+
+/* Spawn and capture
+
+   uv.spawn_capture() owns the stdio pipes of the child: stdin is written
+   from a string and closed, stdout and stderr are read into C buffers up to
+   a limit each. The callback runs once the child exited and both outputs
+   reached EOF, with no Lua string or callback per chunk in between.
+*/
+
+#define LUV_CAPTURE_LIMIT (1024 * 1024)
+#define LUV_CAPTURE_CHUNK 65536
+
+typedef struct luv_capture_s luv_capture_t;
+
+typedef struct {
+  uv_pipe_t handle;           /* internal handle, must stay the first member */
+  luv_capture_t* capture;
+  char* data;
+  size_t len;
+  size_t size;
+  int truncated;
+  int closed;                 /* closed by the capture, not by loop_gc */
+} luv_capture_pipe_t;
+
+struct luv_capture_s {
+  uv_process_t process;       /* internal handle, must stay the first member */
+  luv_ctx_t* ctx;
+  luv_capture_pipe_t pipes[3];
+  uv_write_t write_req;
+  int input_ref;              /* the stdin string while it is written */
+  size_t limit;
+  int64_t exit_status;
+  int term_signal;
+  int exited;
+  int reading;                /* outputs that did not reach EOF yet */
+  int handles;                /* handles still to be closed */
+  int cb_ref;
+  int anchor;
+  char discard[4096];         /* sink for output past the limit */
+};
+
+static void luv_capture_close_cb(uv_handle_t* handle) {
+  luv_capture_t* capture = handle->type == UV_PROCESS
+    ? (luv_capture_t*)handle
+    : ((luv_capture_pipe_t*)handle)->capture;
+  if (--capture->handles) return;
+  luv_free(capture->pipes[1].data);
+  luv_free(capture->pipes[2].data);
+  luv_free(capture);
+}
+
+static int luv_capture_close(luv_capture_t* capture, uv_handle_t* handle) {
+  (void)capture;
+  if (handle->type != UV_PROCESS) ((luv_capture_pipe_t*)handle)->closed = 1;
+  return luv_close_internal_handle(handle, luv_capture_close_cb);
+}
+
+static void luv_capture_finish(luv_capture_t* capture) {
+  lua_State* L = capture->ctx->L;
+  if (!capture->exited || capture->reading) return;
+  lua_rawgeti(L, LUA_REGISTRYINDEX, capture->cb_ref);
+  luaL_unref(L, LUA_REGISTRYINDEX, capture->cb_ref);
+  lua_pushinteger(L, capture->exit_status);
+  lua_pushinteger(L, capture->term_signal);
+  lua_pushlstring(L, capture->pipes[1].data ? capture->pipes[1].data : "", capture->pipes[1].len);
+  lua_pushlstring(L, capture->pipes[2].data ? capture->pipes[2].data : "", capture->pipes[2].len);
+  lua_pushboolean(L, capture->pipes[1].truncated || capture->pipes[2].truncated);
+  luv_unanchor_internal(L, capture->anchor);
+  capture->anchor = LUA_NOREF;
+  // loop_gc closed the process already, the state is going away
+  if (!luv_capture_close(capture, (uv_handle_t*)&capture->process)) {
+    lua_pop(L, 6);
+    return;
+  }
+  capture->ctx->pcall(L, 5, 0, 0);
+}
+
+// Runs when the state closes with the child still running, drops the outputs
+// without calling back. The child itself is left alone, like the one of a
+// process handle.
+static int luv_capture_gc(lua_State* L) {
+  luv_capture_t** udata = (luv_capture_t**)lua_touserdata(L, 1);
+  luv_capture_t* capture = *udata;
+  int closed = 0, i;
+  if (!capture) return 0;
+  *udata = NULL;
+  capture->anchor = LUA_NOREF;
+  luaL_unref(L, LUA_REGISTRYINDEX, capture->cb_ref);
+  capture->cb_ref = LUA_NOREF;
+  luaL_unref(L, LUA_REGISTRYINDEX, capture->input_ref);
+  capture->input_ref = LUA_NOREF;
+  // handles loop_gc closed already never reach luv_capture_close_cb
+  for (i = 0; i < 3; i++) {
+    if (!capture->pipes[i].closed)
+      closed += !luv_capture_close(capture, (uv_handle_t*)&capture->pipes[i].handle);
+  }
+  closed += !luv_capture_close(capture, (uv_handle_t*)&capture->process);
+  if (closed && !(capture->handles -= closed)) {
+    luv_free(capture->pipes[1].data);
+    luv_free(capture->pipes[2].data);
+    luv_free(capture);
+  }
+  return 0;
+}
+
+static void luv_capture_exit_cb(uv_process_t* handle, int64_t exit_status, int term_signal) {
+  luv_capture_t* capture = (luv_capture_t*)handle;
+  capture->exit_status = exit_status;
+  capture->term_signal = term_signal;
+  capture->exited = 1;
+  luv_capture_finish(capture);
+}
+
+// Hands out the free end of the buffer, grown in chunks up to the limit
+static void luv_capture_alloc_cb(uv_handle_t* handle, size_t suggested_size, uv_buf_t* buf) {
+  luv_capture_pipe_t* pipe = (luv_capture_pipe_t*)handle;
+  luv_capture_t* capture = pipe->capture;
+  (void)suggested_size;
+  if (pipe->len >= capture->limit) {
+    *buf = uv_buf_init(capture->discard, sizeof(capture->discard));
+    return;
+  }
+  if (pipe->size - pipe->len < LUV_CAPTURE_CHUNK / 4 && pipe->size < capture->limit) {
+    size_t size = pipe->size ? pipe->size * 2 : LUV_CAPTURE_CHUNK;
+    char* data;
+    if (size > capture->limit) size = capture->limit;
+    data = (char*)luv_malloc(size, LUV_MEM_READ_BUF);
+    if (!data) {
+      *buf = uv_buf_init(NULL, 0);
+      return;
+    }
+    if (pipe->len) memcpy(data, pipe->data, pipe->len);
+    luv_free(pipe->data);
+    pipe->data = data;
+    pipe->size = size;
+  }
+  *buf = uv_buf_init(pipe->data + pipe->len, (unsigned int)(pipe->size - pipe->len));
+}
+
+static void luv_capture_read_cb(uv_stream_t* stream, ssize_t nread, const uv_buf_t* buf) {
+  luv_capture_pipe_t* pipe = (luv_capture_pipe_t*)stream;
+  luv_capture_t* capture = pipe->capture;
+  if (nread > 0) {
+    if (buf->base == capture->discard) pipe->truncated = 1;
+    else pipe->len += nread;
+    return;
+  }
+  if (nread == 0) return;
+  // EOF, or an error that ends the output just as well
+  uv_read_stop(stream);
+  luv_capture_close(capture, (uv_handle_t*)stream);
+  capture->reading--;
+  luv_capture_finish(capture);
+}
+
+static void luv_capture_write_cb(uv_write_t* req, int status) {
+  luv_capture_t* capture = (luv_capture_t*)((char*)req - offsetof(luv_capture_t, write_req));
+  (void)status;
+  luaL_unref(capture->ctx->L, LUA_REGISTRYINDEX, capture->input_ref);
+  capture->input_ref = LUA_NOREF;
+  luv_capture_close(capture, (uv_handle_t*)&capture->pipes[0].handle);
+}
+
+static int luv_spawn_capture(lua_State* L) {
+  luv_ctx_t* ctx = luv_upvalue_context(L);
+  uv_process_options_t options;
+  uv_stdio_container_t stdio[3];
+  luv_capture_t* capture;
+  int* args_refs = NULL;
+  size_t input_len = 0;
+  const char* input = NULL;
+  int input_index;
+  lua_Integer limit = LUV_CAPTURE_LIMIT;
+  int i, ret;
+
+  luaL_checktype(L, 2, LUA_TTABLE);
+  lua_getfield(L, 2, "stdio");
+  luaL_argcheck(L, lua_isnil(L, -1), 2, "stdio option is not supported, the pipes are created internally");
+  lua_pop(L, 1);
+  // the stdin string stays on the stack until it is referenced
+  lua_getfield(L, 2, "stdin");
+  input_index = lua_gettop(L);
+  if (!lua_isnil(L, -1)) {
+    luaL_argcheck(L, lua_type(L, -1) == LUA_TSTRING, 2, "stdin option must be string");
+    input = lua_tolstring(L, -1, &input_len);
+  }
+  lua_getfield(L, 2, "max_output");
+  limit = luaL_optinteger(L, -1, limit);
+  luaL_argcheck(L, limit > 0, 2, "max_output must be positive");
+  lua_pop(L, 1);
+  luv_check_callable(L, 3);
+  luv_check_spawn_options(L, &options, &args_refs);
+
+  capture = (luv_capture_t*)luv_malloc(sizeof(*capture), LUV_MEM_HANDLE);
+  if (!capture) {
+    luv_clean_options(L, &options, args_refs);
+    return luaL_error(L, "Can't allocate capture");
+  }
+  memset(capture, 0, sizeof(*capture));
+  capture->ctx = ctx;
+  capture->limit = (size_t)limit;
+  capture->input_ref = LUA_NOREF;
+  capture->cb_ref = LUA_NOREF;
+  capture->anchor = LUA_NOREF;
+  for (i = 0; i < 3; i++) {
+    ret = uv_pipe_init(ctx->loop, &capture->pipes[i].handle, 0);
+    if (ret < 0) {
+      luv_clean_options(L, &options, args_refs);
+      // the last close callback frees the capture
+      if (!capture->handles) luv_free(capture);
+      while (i-- > 0)
+        luv_capture_close(capture, (uv_handle_t*)&capture->pipes[i].handle);
+      return luv_error(L, ret);
+    }
+    luv_init_internal_handle((uv_handle_t*)&capture->pipes[i].handle);
+    capture->pipes[i].capture = capture;
+    capture->handles++;
+  }
+
+  options.exit_cb = luv_capture_exit_cb;
+  stdio[0].flags = input ? (uv_stdio_flags)(UV_CREATE_PIPE | UV_READABLE_PIPE) : UV_IGNORE;
+  stdio[0].data.stream = (uv_stream_t*)&capture->pipes[0].handle;
+  for (i = 1; i < 3; i++) {
+    stdio[i].flags = (uv_stdio_flags)(UV_CREATE_PIPE | UV_WRITABLE_PIPE);
+    stdio[i].data.stream = (uv_stream_t*)&capture->pipes[i].handle;
+  }
+  options.stdio = stdio;
+  options.stdio_count = 3;
+
+  ret = uv_spawn(ctx->loop, &capture->process, &options);
+  options.stdio = NULL;
+  luv_clean_options(L, &options, args_refs);
+  luv_init_internal_handle((uv_handle_t*)&capture->process);
+  if (ret < 0) {
+    // libuv needs the process handle closed even when the spawn failed
+    capture->handles++;
+    uv_close((uv_handle_t*)&capture->process, luv_capture_close_cb);
+    for (i = 0; i < 3; i++)
+      luv_capture_close(capture, (uv_handle_t*)&capture->pipes[i].handle);
+    return luv_error(L, ret);
+  }
+  capture->handles++;
+
+  for (i = 1; i < 3; i++) {
+    uv_read_start((uv_stream_t*)&capture->pipes[i].handle, luv_capture_alloc_cb, luv_capture_read_cb);
+    capture->reading++;
+  }
+  if (input) {
+    uv_buf_t buf = uv_buf_init((char*)input, (unsigned int)input_len);
+    ret = uv_write(&capture->write_req, (uv_stream_t*)&capture->pipes[0].handle, &buf, 1, luv_capture_write_cb);
+    if (ret == 0) {
+      lua_pushvalue(L, input_index);
+      capture->input_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+    }
+    else {
+      luv_capture_close(capture, (uv_handle_t*)&capture->pipes[0].handle);
+    }
+  }
+  else {
+    luv_capture_close(capture, (uv_handle_t*)&capture->pipes[0].handle);
+  }
+
+  lua_pushvalue(L, 3);
+  capture->cb_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+  capture->anchor = luv_anchor_internal(L, capture, "luv_capture");
+  lua_pushinteger(L, capture->process.pid);
+  return 1;
+}
+
+/* Spawn templates
+
+   uv.spawn_template() parses the options once and keeps private copies of
+   file, args, env, cwd and the stdio fds in one block, so template:spawn()
+   passes them to uv_spawn as they are and only builds what an override
+   replaces.
+*/
+
+typedef struct {
+  uv_process_options_t options;   /* everything points into block */
+  void* block;
+  luv_ctx_t* ctx;
+} luv_spawn_template_t;
+
+static luv_spawn_template_t* luv_check_spawn_template(lua_State* L, int index) {
+  return (luv_spawn_template_t*)luaL_checkudata(L, index, "luv_spawn_template");
+}
+
+// Counts the strings of a NULL terminated list and adds their bytes to *size
+static size_t luv_strv_count(char** strv, size_t* size) {
+  size_t n = 0;
+  if (!strv) return 0;
+  for (; strv[n]; n++) *size += strlen(strv[n]) + 1;
+  return n;
+}
+
+static char* luv_strv_copy(char** cursor, const char* str) {
+  char* copy = *cursor;
+  size_t len = strlen(str) + 1;
+  memcpy(copy, str, len);
+  *cursor += len;
+  return copy;
+}
+
+static int luv_spawn_template(lua_State* L) {
+  luv_ctx_t* ctx = luv_upvalue_context(L);
+  uv_process_options_t options;
+  luv_spawn_template_t* tmpl;
+  int* args_refs = NULL;
+  size_t i, nargs, nenv, size, strings = 0;
+  char** ptrs;
+  char* cursor;
+
+  luv_check_spawn_options(L, &options, &args_refs);
+  for (i = 0; i < (size_t)options.stdio_count; i++) {
+    if (options.stdio[i].flags & (UV_CREATE_PIPE | UV_INHERIT_STREAM)) {
+      luv_clean_options(L, &options, args_refs);
+      return luaL_argerror(L, 2, "stdio streams belong to one process, pass them to template:spawn()");
+    }
+  }
+
+  strings += strlen(options.file) + 1;
+  if (options.cwd) strings += strlen(options.cwd) + 1;
+  nargs = luv_strv_count(options.args, &strings);
+  nenv = luv_strv_count(options.env, &strings);
+  size = (nargs + 1) * sizeof(char*);
+  if (options.env) size += (nenv + 1) * sizeof(char*);
+  size += options.stdio_count * sizeof(uv_stdio_container_t);
+
+  tmpl = (luv_spawn_template_t*)lua_newuserdata(L, sizeof(*tmpl));
+  memset(tmpl, 0, sizeof(*tmpl));
+  luaL_getmetatable(L, "luv_spawn_template");
+  lua_setmetatable(L, -2);
+  tmpl->block = luv_malloc(size + strings, LUV_MEM_OTHER);
+  if (!tmpl->block) {
+    luv_clean_options(L, &options, args_refs);
+    return luaL_error(L, "Can't allocate spawn template");
+  }
+  tmpl->ctx = ctx;
+  tmpl->options = options;
+  tmpl->options.exit_cb = exit_cb;
+
+  // pointer arrays first, then the stdio containers and the strings
+  ptrs = (char**)tmpl->block;
+  cursor = (char*)tmpl->block + size;
+  tmpl->options.file = luv_strv_copy(&cursor, options.file);
+  tmpl->options.args = ptrs;
+  for (i = 0; i < nargs; i++) ptrs[i] = luv_strv_copy(&cursor, options.args[i]);
+  ptrs[nargs] = NULL;
+  ptrs += nargs + 1;
+  if (options.env) {
+    tmpl->options.env = ptrs;
+    for (i = 0; i < nenv; i++) ptrs[i] = luv_strv_copy(&cursor, options.env[i]);
+    ptrs[nenv] = NULL;
+    ptrs += nenv + 1;
+  }
+  if (options.stdio_count) {
+    tmpl->options.stdio = (uv_stdio_container_t*)ptrs;
+    memcpy(tmpl->options.stdio, options.stdio, options.stdio_count * sizeof(uv_stdio_container_t));
+  }
+  if (options.cwd) tmpl->options.cwd = luv_strv_copy(&cursor, options.cwd);
+
+  luv_clean_options(L, &options, args_refs);
+  return 1;
+}
+
+// Builds a NULL terminated list from the table at index, with first in front
+// when it is not NULL. The strings are left on the stack to keep them alive.
+static char** luv_spawn_strv(lua_State* L, int index, const char* first) {
+  size_t i, len = lua_rawlen(L, index), offset = first ? 1 : 0;
+  char** strv;
+  luaL_checkstack(L, (int)len, "too many strings");
+  strv = (char**)luv_malloc((len + offset + 1) * sizeof(*strv), LUV_MEM_OTHER);
+  if (!strv) return NULL;
+  if (first) strv[0] = (char*)first;
+  for (i = 0; i < len; i++) {
+    lua_rawgeti(L, index, i + 1);
+    strv[i + offset] = (char*)lua_tostring(L, -1);
+  }
+  strv[len + offset] = NULL;
+  return strv;
+}
+
+static int luv_spawn_template_spawn(lua_State* L) {
+  luv_spawn_template_t* tmpl = luv_check_spawn_template(L, 1);
+  uv_process_options_t options = tmpl->options;
+  uv_process_t* handle;
+  const char* err = NULL;
+  int ret = 0;
+
+  lua_settop(L, 3);
+  if (!lua_isnil(L, 3)) luv_check_callable(L, 3);
+  if (!lua_isnil(L, 2)) {
+    luaL_checktype(L, 2, LUA_TTABLE);
+    // slots 4 to 7, the override values stay there until uv_spawn returns
+    lua_getfield(L, 2, "args");
+    lua_getfield(L, 2, "env");
+    lua_getfield(L, 2, "cwd");
+    lua_getfield(L, 2, "stdio");
+    luaL_argcheck(L, lua_isnil(L, 4) || lua_istable(L, 4), 2, "args option must be table");
+    luaL_argcheck(L, lua_isnil(L, 5) || lua_istable(L, 5), 2, "env option must be table");
+    luaL_argcheck(L, lua_isnil(L, 6) || lua_type(L, 6) == LUA_TSTRING, 2, "cwd option must be string");
+    luaL_argcheck(L, lua_isnil(L, 7) || lua_istable(L, 7), 2, "stdio option must be table");
+    if (!lua_isnil(L, 6)) options.cwd = lua_tostring(L, 6);
+    // stdio first, sparse_rawlen needs the table at the top
+    if (!lua_isnil(L, 7)) {
+      options.stdio_count = (int)sparse_rawlen(L, 7);
+      options.stdio = (uv_stdio_container_t*)luv_malloc(options.stdio_count * sizeof(*options.stdio), LUV_MEM_OTHER);
+      if (!options.stdio && options.stdio_count) err = "Problem allocating stdio";
+      else err = luv_check_spawn_stdio(L, 7, options.stdio, options.stdio_count);
+    }
+    if (!err && !lua_isnil(L, 4)) {
+      options.args = luv_spawn_strv(L, 4, options.file);
+      if (!options.args) err = "Problem allocating args";
+    }
+    if (!err && !lua_isnil(L, 5)) {
+      options.env = luv_spawn_strv(L, 5, NULL);
+      if (!options.env) err = "Problem allocating env";
+    }
+  }
+  if (!err) {
+    handle = (uv_process_t*)luv_newuserdata(L, sizeof(*handle));
+    handle->type = UV_PROCESS;
+    handle->data = luv_setup_handle(L, tmpl->ctx);
+    if (!lua_isnil(L, 3)) {
+      luv_check_callback(L, (luv_handle_t*)handle->data, LUV_EXIT, 3);
+    }
+    ret = uv_spawn(tmpl->ctx->loop, handle, &options);
+    if (ret < 0) {
+      uv_close((uv_handle_t*)handle, luv_spawn_close_cb);
+    }
+    else {
+      lua_pushinteger(L, handle->pid);
+    }
+  }
+
+  if (options.args != tmpl->options.args) luv_free(options.args);
+  if (options.env != tmpl->options.env) luv_free(options.env);
+  if (options.stdio != tmpl->options.stdio) luv_free(options.stdio);
+  if (err) return luaL_argerror(L, 2, err);
+  if (ret < 0) return luv_error(L, ret);
+  return 2;
+}
+
+// Starts an internal process from the template at index with the given stdio
+// and exit callback instead of the template's
+static int luv_spawn_template_start(lua_State* L, int index, uv_process_t* process,
+                                    uv_stdio_container_t* stdio, int stdio_count, uv_exit_cb exit_cb) {
+  luv_spawn_template_t* tmpl = luv_check_spawn_template(L, index);
+  uv_process_options_t options = tmpl->options;
+  options.stdio = stdio;
+  options.stdio_count = stdio_count;
+  options.exit_cb = exit_cb;
+  return uv_spawn(tmpl->ctx->loop, process, &options);
+}
+
+static int luv_spawn_template_gc(lua_State* L) {
+  luv_spawn_template_t* tmpl = luv_check_spawn_template(L, 1);
+  luv_free(tmpl->block);
+  tmpl->block = NULL;
+  return 0;
+}
+
+static int luv_spawn_template_tostring(lua_State* L) {
+  luv_spawn_template_t* tmpl = luv_check_spawn_template(L, 1);
+  lua_pushfstring(L, "luv_spawn_template_t: %p", tmpl);
+  return 1;
+}
+
+static const luaL_Reg luv_spawn_template_methods[] = {
+  {"spawn", luv_spawn_template_spawn},
+  {NULL, NULL}
+};
+
+static void luv_process_init(lua_State* L) {
+  luaL_newmetatable(L, "luv_spawn_template");
+  lua_pushcfunction(L, luv_spawn_template_tostring);
+  lua_setfield(L, -2, "__tostring");
+  lua_pushcfunction(L, luv_spawn_template_gc);
+  lua_setfield(L, -2, "__gc");
+  luaL_newlib(L, luv_spawn_template_methods);
+  lua_setfield(L, -2, "__index");
+  lua_pop(L, 1);
+
+  luaL_newmetatable(L, "luv_capture");
+  lua_pushcfunction(L, luv_capture_gc);
+  lua_setfield(L, -2, "__gc");
+  lua_pop(L, 1);
+}
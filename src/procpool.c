@@ -0,0 +1,695 @@
+/*
+ *  Copyright 2014 The Luvit Authors. All Rights Reserved.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ */
+#include "private.h"
+
+/* Process pools
+
+   uv.new_process_pool() keeps `size` child processes started from a spawn
+   template, each with a pipe on fd 3. Tasks are strings sent as frames to the
+   child with the fewest tasks in flight, the child answers every frame from
+   uv.process_pool_serve(). A frame is a 4 byte big endian length followed by
+   that many bytes: the task id (4 bytes), for answers a status byte (0 for a
+   result, 1 for an error message), then the payload.
+
+   A child that dies fails its tasks in flight and is replaced, a child that
+   ran `max_tasks` tasks is replaced first and then retired once its last
+   answer arrived. Children dying right after their start or failing to spawn
+   are replaced with a growing delay, the pool gives up on them after
+   LUV_POOL_MAX_CRASHES in a row. A child announcing a frame over `max_frame`
+   bytes is killed.
+*/
+
+#define LUV_POOL_HEADER 8           /* length and task id */
+#define LUV_POOL_CHUNK 65536
+#define LUV_POOL_FD 3
+#define LUV_POOL_MAX_FRAME (64 * 1024 * 1024)
+#define LUV_POOL_STARTUP 1000       /* ms, exits before count as crashes */
+#define LUV_POOL_RESPAWN_DELAY 100  /* ms, doubled with every crash */
+#define LUV_POOL_MAX_CRASHES 5
+
+typedef struct luv_pool_s luv_pool_t;
+typedef struct luv_pool_worker_s luv_pool_worker_t;
+
+// Growable read buffer of one end of a pool pipe
+typedef struct {
+  char* data;
+  size_t len;
+  size_t size;
+} luv_pool_buf_t;
+
+typedef struct {
+  uv_pipe_t handle;                 /* internal handle, must stay the first member */
+  luv_pool_worker_t* worker;
+} luv_pool_pipe_t;
+
+struct luv_pool_worker_s {
+  uv_process_t process;             /* internal handle, must stay the first member */
+  luv_pool_pipe_t pipe;
+  luv_pool_t* pool;
+  luv_pool_worker_t* next;
+  luv_pool_buf_t buf;
+  int tasks_ref;                    /* task id -> callback */
+  uint64_t started;                 /* loop time of the spawn */
+  int inflight;
+  int sent;
+  int answered;
+  int retiring;                     /* takes no new tasks */
+  int handles;                      /* still to be closed */
+};
+
+struct luv_pool_s {
+  luv_ctx_t* ctx;
+  int self_ref;                     /* keeps the pool alive until it is closed */
+  int template_ref;
+  int close_ref;
+  luv_pool_worker_t* workers;
+  struct luv_pool_timer_s* respawn; /* delays replacing crashed children */
+  int size;
+  int max_tasks;
+  uint32_t max_frame;
+  int nworkers;                     /* started and not retiring */
+  int missing;                      /* children waiting for respawn */
+  int crashes;                      /* early exits in a row */
+  int closing;
+  int dead;                         /* state closing, nothing is called back */
+  uint32_t next_id;
+  uint64_t submitted, completed, failed, respawns, recycled;
+};
+
+typedef struct luv_pool_timer_s {
+  uv_timer_t handle;                /* internal handle, must stay the first member */
+  luv_pool_t* pool;
+} luv_pool_timer_t;
+
+typedef struct {
+  uv_write_t req;
+  char data[1];                     /* the frame */
+} luv_pool_write_t;
+
+static uint32_t luv_pool_get32(const char* p) {
+  const unsigned char* u = (const unsigned char*)p;
+  return ((uint32_t)u[0] << 24) | ((uint32_t)u[1] << 16) | ((uint32_t)u[2] << 8) | u[3];
+}
+
+static void luv_pool_put32(char* p, uint32_t n) {
+  p[0] = (char)(n >> 24);
+  p[1] = (char)(n >> 16);
+  p[2] = (char)(n >> 8);
+  p[3] = (char)n;
+}
+
+static void luv_pool_buf_alloc(luv_pool_buf_t* buf, uv_buf_t* out) {
+  if (buf->size - buf->len < LUV_POOL_CHUNK / 4) {
+    size_t size = buf->size ? buf->size * 2 : LUV_POOL_CHUNK;
+    char* data = (char*)luv_malloc(size, LUV_MEM_READ_BUF);
+    if (!data) {
+      *out = uv_buf_init(NULL, 0);
+      return;
+    }
+    if (buf->len) memcpy(data, buf->data, buf->len);
+    luv_free(buf->data);
+    buf->data = data;
+    buf->size = size;
+  }
+  *out = uv_buf_init(buf->data + buf->len, (unsigned int)(buf->size - buf->len));
+}
+
+// Size of the first complete frame in buf with its length, 0 if there is
+// none yet
+static size_t luv_pool_frame(luv_pool_buf_t* buf) {
+  size_t size;
+  if (buf->len < 4) return 0;
+  size = 4 + (size_t)luv_pool_get32(buf->data);
+  return buf->len < size ? 0 : size;
+}
+
+static void luv_pool_consume(luv_pool_buf_t* buf, size_t n) {
+  buf->len -= n;
+  if (buf->len) memmove(buf->data, buf->data + n, buf->len);
+}
+
+static void luv_pool_write_cb(uv_write_t* req, int status) {
+  (void)status;
+  luv_free(req);
+}
+
+// Sends a frame, extra is the status byte of answers or -1 for requests
+static int luv_pool_send(uv_stream_t* stream, uint32_t id, int extra, const char* payload, size_t len) {
+  size_t head = LUV_POOL_HEADER + (extra >= 0 ? 1 : 0);
+  luv_pool_write_t* write;
+  uv_buf_t buf;
+  int ret;
+  if (len > 0xffffffffu - head) return UV_E2BIG;
+  write = (luv_pool_write_t*)luv_malloc(sizeof(*write) + head + len, LUV_MEM_BUFS);
+  if (!write) return UV_ENOMEM;
+  luv_pool_put32(write->data, (uint32_t)(head - 4 + len));
+  luv_pool_put32(write->data + 4, id);
+  if (extra >= 0) write->data[LUV_POOL_HEADER] = (char)extra;
+  memcpy(write->data + head, payload, len);
+  buf = uv_buf_init(write->data, (unsigned int)(head + len));
+  ret = uv_write(&write->req, stream, &buf, 1, luv_pool_write_cb);
+  if (ret < 0) luv_free(write);
+  return ret;
+}
+
+static luv_pool_t* luv_check_pool(lua_State* L, int index) {
+  luv_pool_t* pool = (luv_pool_t*)luaL_checkudata(L, index, "luv_process_pool");
+  return pool;
+}
+
+static int luv_pool_spawn(lua_State* L, luv_pool_t* pool);
+
+// Runs once the last child of a closed pool is gone
+static void luv_pool_closed(luv_pool_t* pool) {
+  lua_State* L = pool->ctx->L;
+  int close_ref = pool->close_ref;
+  if (pool->dead) return;
+  luaL_unref(L, LUA_REGISTRYINDEX, pool->template_ref);
+  pool->template_ref = LUA_NOREF;
+  pool->close_ref = LUA_NOREF;
+  luaL_unref(L, LUA_REGISTRYINDEX, pool->self_ref);
+  pool->self_ref = LUA_NOREF;
+  if (close_ref != LUA_NOREF) {
+    lua_rawgeti(L, LUA_REGISTRYINDEX, close_ref);
+    luaL_unref(L, LUA_REGISTRYINDEX, close_ref);
+    pool->ctx->pcall(L, 0, 0, 0);
+  }
+}
+
+static void luv_pool_worker_close_cb(uv_handle_t* handle) {
+  luv_pool_worker_t* worker = handle->type == UV_PROCESS
+    ? (luv_pool_worker_t*)handle
+    : ((luv_pool_pipe_t*)handle)->worker;
+  luv_pool_t* pool = worker->pool;
+  luv_pool_worker_t** link = &pool->workers;
+  if (--worker->handles) return;
+  while (*link && *link != worker) link = &(*link)->next;
+  if (*link) *link = worker->next;
+  luaL_unref(pool->ctx->L, LUA_REGISTRYINDEX, worker->tasks_ref);
+  luv_free(worker->buf.data);
+  luv_free(worker);
+  if (pool->closing && !pool->workers && !pool->respawn) luv_pool_closed(pool);
+}
+
+static void luv_pool_respawn_close_cb(uv_handle_t* handle) {
+  luv_pool_t* pool = ((luv_pool_timer_t*)handle)->pool;
+  luv_free(handle);
+  pool->respawn = NULL;
+  if (!pool->workers) luv_pool_closed(pool);
+}
+
+// Calls back every task in flight on the worker with status
+static void luv_pool_worker_fail(luv_pool_worker_t* worker, int status) {
+  luv_pool_t* pool = worker->pool;
+  lua_State* L = pool->ctx->L;
+  if (!worker->inflight) return;
+  // swap the table first, callbacks may submit again
+  lua_rawgeti(L, LUA_REGISTRYINDEX, worker->tasks_ref);
+  lua_newtable(L);
+  lua_rawseti(L, LUA_REGISTRYINDEX, worker->tasks_ref);
+  pool->failed += worker->inflight;
+  worker->inflight = 0;
+  lua_pushnil(L);
+  while (lua_next(L, -2)) {
+    luv_status(L, status);
+    pool->ctx->pcall(L, 1, 0, 0);
+  }
+  lua_pop(L, 1);
+}
+
+static void luv_pool_respawn_cb(uv_timer_t* handle);
+
+// Spawns the missing children later, waiting longer after every crash
+static void luv_pool_respawn_later(luv_pool_t* pool) {
+  uint64_t delay = (uint64_t)LUV_POOL_RESPAWN_DELAY << (pool->crashes ? pool->crashes - 1 : 0);
+  if (!uv_is_active((uv_handle_t*)&pool->respawn->handle))
+    uv_timer_start(&pool->respawn->handle, luv_pool_respawn_cb, delay, 0);
+}
+
+// Stops using the worker and lets the child exit by closing its pipe once
+// the tasks in flight are answered
+static void luv_pool_worker_retire(lua_State* L, luv_pool_worker_t* worker, int replace) {
+  luv_pool_t* pool = worker->pool;
+  if (!worker->retiring) {
+    worker->retiring = 1;
+    pool->nworkers--;
+    if (replace && !pool->closing && luv_pool_spawn(L, pool) < 0) {
+      pool->missing++;
+      luv_pool_respawn_later(pool);
+    }
+  }
+  if (!worker->inflight && !uv_is_closing((uv_handle_t*)&worker->pipe.handle))
+    uv_close((uv_handle_t*)&worker->pipe.handle, luv_pool_worker_close_cb);
+}
+
+// No more children from here on, the pool is closed once they are all gone
+static void luv_pool_stop(lua_State* L, luv_pool_t* pool) {
+  luv_pool_worker_t* worker;
+  pool->closing = 1;
+  pool->missing = 0;
+  // running tasks still complete, the children exit when their pipe closes
+  for (worker = pool->workers; worker; worker = worker->next)
+    luv_pool_worker_retire(L, worker, 0);
+  luv_close_internal_handle((uv_handle_t*)&pool->respawn->handle, luv_pool_respawn_close_cb);
+}
+
+static void luv_pool_respawn_cb(uv_timer_t* handle) {
+  luv_pool_t* pool = ((luv_pool_timer_t*)handle)->pool;
+  lua_State* L = pool->ctx->L;
+  int missing = pool->missing;
+  pool->missing = 0;
+  while (missing-- > 0) {
+    if (luv_pool_spawn(L, pool) < 0) pool->missing++;
+  }
+  if (!pool->missing) return;
+  // a child that can't be spawned counts as one that crashed
+  if (++pool->crashes >= LUV_POOL_MAX_CRASHES) {
+    pool->missing = 0;
+    return;
+  }
+  luv_pool_respawn_later(pool);
+}
+
+// A child that was not asked to go died or closed its pipe, replace it. One
+// that dies before it answered anything or ran for long likely can't start
+// at all: wait longer each time and stop after LUV_POOL_MAX_CRASHES.
+static void luv_pool_worker_lost(lua_State* L, luv_pool_worker_t* worker) {
+  luv_pool_t* pool = worker->pool;
+  if (worker->retiring) return;
+  worker->retiring = 1;
+  pool->nworkers--;
+  if (pool->closing) return;
+  if (worker->answered || uv_now(pool->ctx->loop) - worker->started >= LUV_POOL_STARTUP)
+    pool->crashes = 0;
+  else if (++pool->crashes >= LUV_POOL_MAX_CRASHES)
+    return;
+  pool->respawns++;
+  if (!pool->crashes && luv_pool_spawn(L, pool) == 0) return;
+  pool->missing++;
+  luv_pool_respawn_later(pool);
+}
+
+static void luv_pool_exit_cb(uv_process_t* process, int64_t exit_status, int term_signal) {
+  luv_pool_worker_t* worker = (luv_pool_worker_t*)process;
+  lua_State* L = worker->pool->ctx->L;
+  (void)exit_status;
+  (void)term_signal;
+  luv_pool_worker_lost(L, worker);
+  if (!uv_is_closing((uv_handle_t*)&worker->pipe.handle))
+    uv_close((uv_handle_t*)&worker->pipe.handle, luv_pool_worker_close_cb);
+  uv_close((uv_handle_t*)process, luv_pool_worker_close_cb);
+  luv_pool_worker_fail(worker, UV_EPIPE);
+}
+
+static void luv_pool_alloc_cb(uv_handle_t* handle, size_t suggested_size, uv_buf_t* buf) {
+  (void)suggested_size;
+  luv_pool_buf_alloc(&((luv_pool_pipe_t*)handle)->worker->buf, buf);
+}
+
+static void luv_pool_read_cb(uv_stream_t* stream, ssize_t nread, const uv_buf_t* buf) {
+  luv_pool_worker_t* worker = ((luv_pool_pipe_t*)stream)->worker;
+  luv_pool_t* pool = worker->pool;
+  lua_State* L = pool->ctx->L;
+  size_t size;
+  (void)buf;
+  if (nread < 0) {
+    // the child closed its end, it can't answer anymore
+    uv_read_stop(stream);
+    luv_pool_worker_lost(L, worker);
+    luv_pool_worker_fail(worker, UV_EPIPE);
+    luv_pool_worker_retire(L, worker, 0);
+    return;
+  }
+  worker->buf.len += nread;
+  for (;;) {
+    const char* frame;
+    size_t body;
+    uint32_t id;
+    // don't buffer toward whatever length a broken child announces
+    if (worker->buf.len >= 4 && luv_pool_get32(worker->buf.data) > pool->max_frame) {
+      uv_read_stop(stream);
+      if (!uv_is_closing((uv_handle_t*)&worker->process))
+        uv_process_kill(&worker->process, SIGKILL);
+      // it did start, replace it right away
+      worker->answered++;
+      luv_pool_worker_lost(L, worker);
+      luv_pool_worker_fail(worker, UV_E2BIG);
+      luv_pool_worker_retire(L, worker, 0);
+      return;
+    }
+    size = luv_pool_frame(&worker->buf);
+    if (!size) break;
+    frame = worker->buf.data + 4;
+    body = size - 4;
+    if (body < 5) {
+      luv_pool_consume(&worker->buf, size);
+      continue;
+    }
+    id = luv_pool_get32(frame);
+    lua_rawgeti(L, LUA_REGISTRYINDEX, worker->tasks_ref);
+    lua_rawgeti(L, -1, id);
+    if (lua_isnil(L, -1)) {
+      lua_pop(L, 2);
+      luv_pool_consume(&worker->buf, size);
+      continue;
+    }
+    lua_pushnil(L);
+    lua_rawseti(L, -3, id);
+    lua_remove(L, -2);
+    if (frame[4] == 0) {
+      lua_pushnil(L);
+      lua_pushlstring(L, frame + 5, body - 5);
+    }
+    else {
+      lua_pushlstring(L, frame + 5, body - 5);
+      lua_pushnil(L);
+    }
+    luv_pool_consume(&worker->buf, size);
+    worker->inflight--;
+    worker->answered++;
+    pool->completed++;
+    pool->crashes = 0;
+    if (worker->retiring) luv_pool_worker_retire(L, worker, 0);
+    pool->ctx->pcall(L, 2, 0, 0);
+    // the callback may have closed the pool and with it this pipe
+    if (uv_is_closing((uv_handle_t*)stream)) return;
+  }
+}
+
+static int luv_pool_spawn(lua_State* L, luv_pool_t* pool) {
+  luv_pool_worker_t* worker;
+  uv_stdio_container_t stdio[LUV_POOL_FD + 1];
+  int ret;
+
+  worker = (luv_pool_worker_t*)luv_malloc(sizeof(*worker), LUV_MEM_HANDLE);
+  if (!worker) return UV_ENOMEM;
+  memset(worker, 0, sizeof(*worker));
+  worker->pool = pool;
+  uv_pipe_init(pool->ctx->loop, &worker->pipe.handle, 0);
+  luv_init_internal_handle((uv_handle_t*)&worker->pipe.handle);
+  worker->pipe.worker = worker;
+  worker->handles = 2;
+  worker->started = uv_now(pool->ctx->loop);
+  lua_newtable(L);
+  worker->tasks_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+  worker->next = pool->workers;
+  pool->workers = worker;
+
+  stdio[0].flags = UV_IGNORE;
+  stdio[1].flags = UV_INHERIT_FD;
+  stdio[1].data.fd = 1;
+  stdio[2].flags = UV_INHERIT_FD;
+  stdio[2].data.fd = 2;
+  stdio[LUV_POOL_FD].flags = (uv_stdio_flags)(UV_CREATE_PIPE | UV_READABLE_PIPE | UV_WRITABLE_PIPE);
+  stdio[LUV_POOL_FD].data.stream = (uv_stream_t*)&worker->pipe.handle;
+
+  lua_rawgeti(L, LUA_REGISTRYINDEX, pool->template_ref);
+  ret = luv_spawn_template_start(L, -1, &worker->process, stdio, LUV_POOL_FD + 1, luv_pool_exit_cb);
+  lua_pop(L, 1);
+  luv_init_internal_handle((uv_handle_t*)&worker->process);
+  if (ret < 0) {
+    worker->retiring = 1;
+    // libuv needs the process handle closed even when the spawn failed
+    uv_close((uv_handle_t*)&worker->process, luv_pool_worker_close_cb);
+    uv_close((uv_handle_t*)&worker->pipe.handle, luv_pool_worker_close_cb);
+    return ret;
+  }
+  uv_read_start((uv_stream_t*)&worker->pipe.handle, luv_pool_alloc_cb, luv_pool_read_cb);
+  pool->nworkers++;
+  return 0;
+}
+
+static int luv_new_process_pool(lua_State* L) {
+  luv_ctx_t* ctx = luv_upvalue_context(L);
+  luv_pool_t* pool;
+  lua_Integer size = 4, max_tasks = 0, max_frame = LUV_POOL_MAX_FRAME;
+  int i, ret = 0;
+
+  luaL_checkstring(L, 1);
+  luaL_checktype(L, 2, LUA_TTABLE);
+  lua_settop(L, 2);
+  lua_getfield(L, 2, "stdio");
+  luaL_argcheck(L, lua_isnil(L, -1), 2, "stdio option is not supported, the pipe is created internally");
+  lua_getfield(L, 2, "size");
+  size = luaL_optinteger(L, -1, size);
+  lua_getfield(L, 2, "max_tasks");
+  max_tasks = luaL_optinteger(L, -1, max_tasks);
+  lua_getfield(L, 2, "max_frame");
+  max_frame = luaL_optinteger(L, -1, max_frame);
+  lua_pop(L, 4);
+  luaL_argcheck(L, size > 0 && size <= 1024, 2, "size must be between 1 and 1024");
+  luaL_argcheck(L, max_tasks >= 0, 2, "max_tasks must not be negative");
+  luaL_argcheck(L, max_frame > 0 && max_frame <= 0xffffffff - 4, 2, "max_frame out of range");
+
+  luv_spawn_template(L);
+  pool = (luv_pool_t*)lua_newuserdata(L, sizeof(*pool));
+  memset(pool, 0, sizeof(*pool));
+  luaL_getmetatable(L, "luv_process_pool");
+  lua_setmetatable(L, -2);
+  pool->ctx = ctx;
+  pool->size = (int)size;
+  pool->max_tasks = (int)max_tasks;
+  pool->max_frame = (uint32_t)max_frame;
+  pool->close_ref = LUA_NOREF;
+  pool->respawn = (luv_pool_timer_t*)luv_malloc(sizeof(*pool->respawn), LUV_MEM_HANDLE);
+  if (!pool->respawn) return luaL_error(L, "Can't allocate process pool");
+  uv_timer_init(ctx->loop, &pool->respawn->handle);
+  luv_init_internal_handle((uv_handle_t*)&pool->respawn->handle);
+  pool->respawn->pool = pool;
+  lua_pushvalue(L, -1);
+  pool->self_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+  lua_pushvalue(L, -2);
+  pool->template_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+
+  for (i = 0; i < pool->size && ret == 0; i++)
+    ret = luv_pool_spawn(L, pool);
+  if (ret < 0) {
+    luv_pool_stop(L, pool);
+    return luv_error(L, ret);
+  }
+  return 1;
+}
+
+static int luv_process_pool_submit(lua_State* L) {
+  luv_pool_t* pool = luv_check_pool(L, 1);
+  size_t len;
+  const char* payload = luaL_checklstring(L, 2, &len);
+  luv_pool_worker_t* best = NULL;
+  luv_pool_worker_t* worker;
+  uint32_t id;
+  int ret;
+
+  luv_check_callable(L, 3);
+  if (pool->closing) return luv_error(L, UV_ECANCELED);
+  for (worker = pool->workers; worker; worker = worker->next) {
+    if (!worker->retiring && (!best || worker->inflight < best->inflight))
+      best = worker;
+  }
+  if (!best) return luv_error(L, UV_ESRCH);
+
+  id = ++pool->next_id;
+  ret = luv_pool_send((uv_stream_t*)&best->pipe.handle, id, -1, payload, len);
+  if (ret < 0) return luv_error(L, ret);
+  lua_rawgeti(L, LUA_REGISTRYINDEX, best->tasks_ref);
+  lua_pushvalue(L, 3);
+  lua_rawseti(L, -2, id);
+  lua_pop(L, 1);
+  best->inflight++;
+  best->sent++;
+  pool->submitted++;
+  if (pool->max_tasks && best->sent >= pool->max_tasks) {
+    pool->recycled++;
+    luv_pool_worker_retire(L, best, 1);
+  }
+  lua_pushboolean(L, 1);
+  return 1;
+}
+
+static int luv_process_pool_close(lua_State* L) {
+  luv_pool_t* pool = luv_check_pool(L, 1);
+  if (!lua_isnoneornil(L, 2)) luv_check_callable(L, 2);
+  if (pool->closing) return luv_error(L, UV_EALREADY);
+  if (!lua_isnoneornil(L, 2)) {
+    lua_pushvalue(L, 2);
+    pool->close_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+  }
+  luv_pool_stop(L, pool);
+  lua_pushinteger(L, 0);
+  return 1;
+}
+
+static int luv_process_pool_stats(lua_State* L) {
+  luv_pool_t* pool = luv_check_pool(L, 1);
+  luv_pool_worker_t* worker;
+  int inflight = 0;
+  for (worker = pool->workers; worker; worker = worker->next) inflight += worker->inflight;
+  lua_createtable(L, 0, 8);
+  lua_pushinteger(L, pool->nworkers);
+  lua_setfield(L, -2, "workers");
+  lua_pushinteger(L, inflight);
+  lua_setfield(L, -2, "inflight");
+  lua_pushinteger(L, pool->submitted);
+  lua_setfield(L, -2, "submitted");
+  lua_pushinteger(L, pool->completed);
+  lua_setfield(L, -2, "completed");
+  lua_pushinteger(L, pool->failed);
+  lua_setfield(L, -2, "failed");
+  lua_pushinteger(L, pool->respawns);
+  lua_setfield(L, -2, "respawns");
+  lua_pushinteger(L, pool->recycled);
+  lua_setfield(L, -2, "recycled");
+  lua_pushinteger(L, pool->crashes);
+  lua_setfield(L, -2, "crashes");
+  return 1;
+}
+
+// A pool stays referenced until it is closed, so this runs at lua_close for
+// one still open, before loop_gc. The children see their pipe close and exit,
+// the close callbacks free the workers and nothing is called back anymore.
+static int luv_process_pool_gc(lua_State* L) {
+  luv_pool_t* pool = (luv_pool_t*)lua_touserdata(L, 1);
+  luv_pool_worker_t* worker;
+  if (pool->dead) return 0;
+  pool->dead = 1;
+  pool->closing = 1;
+  pool->missing = 0;
+  for (worker = pool->workers; worker; worker = worker->next) {
+    luaL_unref(L, LUA_REGISTRYINDEX, worker->tasks_ref);
+    worker->tasks_ref = LUA_NOREF;
+    worker->inflight = 0;
+    if (!worker->retiring) {
+      worker->retiring = 1;
+      pool->nworkers--;
+    }
+    if (!uv_is_closing((uv_handle_t*)&worker->pipe.handle))
+      uv_close((uv_handle_t*)&worker->pipe.handle, luv_pool_worker_close_cb);
+    if (!uv_is_closing((uv_handle_t*)&worker->process))
+      uv_close((uv_handle_t*)&worker->process, luv_pool_worker_close_cb);
+  }
+  if (pool->respawn)
+    luv_close_internal_handle((uv_handle_t*)&pool->respawn->handle, luv_pool_respawn_close_cb);
+  luaL_unref(L, LUA_REGISTRYINDEX, pool->template_ref);
+  luaL_unref(L, LUA_REGISTRYINDEX, pool->close_ref);
+  luaL_unref(L, LUA_REGISTRYINDEX, pool->self_ref);
+  pool->template_ref = pool->close_ref = pool->self_ref = LUA_NOREF;
+  return 0;
+}
+
+static int luv_process_pool_tostring(lua_State* L) {
+  luv_pool_t* pool = luv_check_pool(L, 1);
+  lua_pushfstring(L, "luv_process_pool_t: %p", pool);
+  return 1;
+}
+
+/* Child side */
+
+typedef struct {
+  uv_pipe_t handle;                 /* internal handle, must stay the first member */
+  luv_ctx_t* ctx;
+  int handler_ref;
+  luv_pool_buf_t buf;
+} luv_pool_serve_t;
+
+static void luv_pool_serve_close_cb(uv_handle_t* handle) {
+  luv_pool_serve_t* serve = (luv_pool_serve_t*)handle;
+  luaL_unref(serve->ctx->L, LUA_REGISTRYINDEX, serve->handler_ref);
+  luv_free(serve->buf.data);
+  luv_free(serve);
+}
+
+static void luv_pool_serve_alloc_cb(uv_handle_t* handle, size_t suggested_size, uv_buf_t* buf) {
+  (void)suggested_size;
+  luv_pool_buf_alloc(&((luv_pool_serve_t*)handle)->buf, buf);
+}
+
+static void luv_pool_serve_read_cb(uv_stream_t* stream, ssize_t nread, const uv_buf_t* buf) {
+  luv_pool_serve_t* serve = (luv_pool_serve_t*)stream;
+  lua_State* L = serve->ctx->L;
+  size_t size;
+  (void)buf;
+  if (nread < 0) {
+    // the pool closed the pipe, nothing keeps the loop alive anymore
+    uv_close((uv_handle_t*)stream, luv_pool_serve_close_cb);
+    return;
+  }
+  serve->buf.len += nread;
+  while ((size = luv_pool_frame(&serve->buf)) > 0) {
+    uint32_t id;
+    size_t len;
+    const char* result;
+    int status;
+    if (size < LUV_POOL_HEADER) {
+      luv_pool_consume(&serve->buf, size);
+      continue;
+    }
+    id = luv_pool_get32(serve->buf.data + 4);
+    lua_rawgeti(L, LUA_REGISTRYINDEX, serve->handler_ref);
+    lua_pushlstring(L, serve->buf.data + LUV_POOL_HEADER, size - LUV_POOL_HEADER);
+    luv_pool_consume(&serve->buf, size);
+    status = lua_pcall(L, 1, 1, 0) == 0 ? 0 : 1;
+    result = lua_tolstring(L, -1, &len);
+    if (!result) {
+      result = status ? "error object is not a string" : "";
+      len = strlen(result);
+    }
+    luv_pool_send(stream, id, status, result, len);
+    lua_pop(L, 1);
+  }
+}
+
+static int luv_process_pool_serve(lua_State* L) {
+  luv_ctx_t* ctx = luv_upvalue_context(L);
+  luv_pool_serve_t* serve;
+  int ret;
+  luv_check_callable(L, 1);
+  serve = (luv_pool_serve_t*)luv_malloc(sizeof(*serve), LUV_MEM_HANDLE);
+  if (!serve) return luaL_error(L, "Can't allocate pool server");
+  memset(serve, 0, sizeof(*serve));
+  serve->ctx = ctx;
+  serve->handler_ref = LUA_NOREF;
+  uv_pipe_init(ctx->loop, &serve->handle, 0);
+  luv_init_internal_handle((uv_handle_t*)&serve->handle);
+  ret = uv_pipe_open(&serve->handle, LUV_POOL_FD);
+  if (ret == 0)
+    ret = uv_read_start((uv_stream_t*)&serve->handle, luv_pool_serve_alloc_cb, luv_pool_serve_read_cb);
+  if (ret < 0) {
+    uv_close((uv_handle_t*)&serve->handle, luv_pool_serve_close_cb);
+    return luv_error(L, ret);
+  }
+  lua_pushvalue(L, 1);
+  serve->handler_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+  lua_pushinteger(L, 0);
+  return 1;
+}
+
+static const luaL_Reg luv_process_pool_methods[] = {
+  {"submit", luv_process_pool_submit},
+  {"close", luv_process_pool_close},
+  {"stats", luv_process_pool_stats},
+  {NULL, NULL}
+};
+
+static void luv_procpool_init(lua_State* L) {
+  luaL_newmetatable(L, "luv_process_pool");
+  lua_pushcfunction(L, luv_process_pool_tostring);
+  lua_setfield(L, -2, "__tostring");
+  lua_pushcfunction(L, luv_process_pool_gc);
+  lua_setfield(L, -2, "__gc");
+  luaL_newlib(L, luv_process_pool_methods);
+  lua_setfield(L, -2, "__index");
+  lua_pop(L, 1);
+}
@@ -0,0 +1,1031 @@
+/*
+ *  Copyright 2014 The Luvit Authors. All Rights Reserved.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ */
+#include "private.h"
+#include <ctype.h>
+#include <stdio.h>
+
+/* Stub resolver
+
+   Resolves names without the threadpool: numeric addresses and the hosts
+   file are answered directly, everything else is sent as A/AAAA queries over
+   UDP to the nameservers of resolv.conf, retried over TCP when the answer is
+   truncated. Results have the same shape as uv.getaddrinfo() results.
+*/
+
+#define LUV_RESOLVER_MAXNS      3   /* same as MAXNS of the libc resolver */
+#define LUV_RESOLVER_MAXSEARCH  6
+#define LUV_DNS_NAME_SIZE       256
+#define LUV_DNS_UDP_SIZE        4096
+#define LUV_DNS_TCP_SIZE        (65535 + 2)
+
+#define LUV_DNS_TYPE_A          1
+#define LUV_DNS_TYPE_AAAA       28
+#define LUV_DNS_CLASS_IN        1
+
+// Outcome of a single query
+enum {
+  LUV_DNS_OK = 0,
+  LUV_DNS_NXDOMAIN,
+  LUV_DNS_SERVFAIL,
+  LUV_DNS_TIMEOUT
+};
+
+typedef struct {
+  luv_ctx_t* ctx;
+  struct sockaddr_storage servers[LUV_RESOLVER_MAXNS];
+  int nservers;
+  char search[LUV_RESOLVER_MAXSEARCH][LUV_DNS_NAME_SIZE];
+  int nsearch;
+  int ndots;
+  uint64_t timeout;   /* per attempt, in ms */
+  int attempts;       /* per nameserver */
+  int hosts_ref;      /* lower case name -> array of address strings */
+} luv_resolver_t;
+
+typedef struct {
+  int family;
+  unsigned char addr[16];
+} luv_dns_addr_t;
+
+typedef struct luv_dns_lookup_s luv_dns_lookup_t;
+typedef struct luv_dns_query_s luv_dns_query_t;
+
+// Internal handles keep data NULL, the query is found through the wrapper
+typedef struct {
+  uv_udp_t handle;    /* must stay the first member */
+  luv_dns_query_t* query;
+  int open;
+} luv_dns_udp_t;
+
+struct luv_dns_query_s {
+  luv_dns_lookup_t* lookup;   /* NULL once it reported back */
+  luv_dns_query_t* next;      /* in the running queries of the lookup */
+  luv_resolver_t* resolver;
+  int qtype;
+  int tries;                  /* sends so far, over all nameservers */
+  int server;                 /* index of the nameserver in use */
+  int last;                   /* outcome of the last failed try */
+  int done;
+  int handles;                /* open handles, freed once all are closed */
+  int sending;
+  int tcp_mode;
+  uv_timer_t timer;
+  luv_dns_udp_t udp[2];       /* inet and inet6 nameservers */
+  uv_udp_send_t sendreq;
+  uv_tcp_t tcp;
+  uv_connect_t connreq;
+  uv_write_t writereq;
+  unsigned char* tcpbuf;
+  size_t tcplen;
+  size_t plen;                /* query length, without the tcp prefix */
+  unsigned char packet[2 + 12 + LUV_DNS_NAME_SIZE + 4];
+  unsigned char recvbuf[LUV_DNS_UDP_SIZE];
+};
+
+struct luv_dns_lookup_s {
+  uv_timer_t timer;           /* completes lookups that need no query */
+  luv_resolver_t* resolver;
+  int resolver_ref;
+  int cb_ref;
+  int family;
+  int socktype;
+  int protocol;
+  int port;
+  int format;                 /* of the result, see the `result` hint */
+  int status;                 /* result of a lookup completed by the timer */
+  char names[LUV_RESOLVER_MAXSEARCH + 1][LUV_DNS_NAME_SIZE];
+  int nnames;
+  int name_index;
+  int pending;                /* queries running for the current name */
+  luv_dns_query_t* queries;   /* the running ones */
+  int anchor;                 /* tears it down when the state closes */
+  int timeouts, failures;
+  luv_dns_addr_t* addrs;
+  int naddrs, addrs_size;
+};
+
+static luv_resolver_t* luv_check_resolver(lua_State* L, int index) {
+  return (luv_resolver_t*)luaL_checkudata(L, index, "luv_resolver");
+}
+
+static uint16_t luv_dns_id(void) {
+  static uint32_t state = 0;
+  uint16_t id;
+#if LUV_UV_VERSION_GEQ(1, 33, 0)
+  if (uv_random(NULL, NULL, &id, sizeof(id), 0, NULL) == 0) return id;
+#endif
+  if (!state) state = (uint32_t)uv_hrtime() | 1;
+  state ^= state << 13;
+  state ^= state >> 17;
+  state ^= state << 5;
+  id = (uint16_t)state;
+  return id;
+}
+
+// Splits the next whitespace separated token off *p, NULL at the end
+static char* luv_dns_token(char** p) {
+  char* s = *p;
+  char* start;
+  while (*s && isspace((unsigned char)*s)) s++;
+  if (!*s) return NULL;
+  start = s;
+  while (*s && !isspace((unsigned char)*s)) s++;
+  if (*s) *s++ = '\0';
+  *p = s;
+  return start;
+}
+
+// "ip", "ip:port", "[ip6]:port" or a bare ip6 address
+static int luv_dns_parse_server(const char* s, struct sockaddr_storage* addr) {
+  char ip[64];
+  const char* colon = strchr(s, ':');
+  const char* end;
+  int port = 53;
+  size_t len;
+  if (s[0] == '[') {
+    end = strchr(s, ']');
+    if (!end) return UV_EINVAL;
+    len = end - s - 1;
+    if (end[1] == ':') port = atoi(end + 2);
+    else if (end[1]) return UV_EINVAL;
+    s++;
+  }
+  else if (colon && !strchr(colon + 1, ':')) {
+    len = colon - s;
+    port = atoi(colon + 1);
+  }
+  else {
+    len = strlen(s);
+  }
+  if (len >= sizeof(ip) || port <= 0 || port > 65535) return UV_EINVAL;
+  memcpy(ip, s, len);
+  ip[len] = '\0';
+  if (uv_ip4_addr(ip, port, (struct sockaddr_in*)addr) == 0) return 0;
+  if (uv_ip6_addr(ip, port, (struct sockaddr_in6*)addr) == 0) return 0;
+  return UV_EINVAL;
+}
+
+static void luv_resolver_add_search(luv_resolver_t* resolver, const char* domain) {
+  size_t len = strlen(domain);
+  if (resolver->nsearch == LUV_RESOLVER_MAXSEARCH || len >= LUV_DNS_NAME_SIZE) return;
+  if (len && domain[len - 1] == '.') len--;
+  if (!len) return;
+  memcpy(resolver->search[resolver->nsearch], domain, len);
+  resolver->search[resolver->nsearch][len] = '\0';
+  resolver->nsearch++;
+}
+
+// Missing files are fine, the defaults apply
+static void luv_resolver_read_conf(luv_resolver_t* resolver, const char* path) {
+  char line[1024];
+  FILE* file = fopen(path, "r");
+  if (!file) return;
+  while (fgets(line, sizeof(line), file)) {
+    char* p = line;
+    char* key;
+    char* value;
+    line[strcspn(line, "#;")] = '\0';
+    key = luv_dns_token(&p);
+    if (!key) continue;
+    if (!strcmp(key, "nameserver")) {
+      value = luv_dns_token(&p);
+      if (value && resolver->nservers < LUV_RESOLVER_MAXNS &&
+          luv_dns_parse_server(value, &resolver->servers[resolver->nservers]) == 0)
+        resolver->nservers++;
+    }
+    else if (!strcmp(key, "search") || !strcmp(key, "domain")) {
+      // the last one of them wins
+      resolver->nsearch = 0;
+      while ((value = luv_dns_token(&p)))
+        luv_resolver_add_search(resolver, value);
+    }
+    else if (!strcmp(key, "options")) {
+      while ((value = luv_dns_token(&p))) {
+        if (!strncmp(value, "ndots:", 6))
+          resolver->ndots = atoi(value + 6);
+        else if (!strncmp(value, "timeout:", 8) && atoi(value + 8) > 0)
+          resolver->timeout = (uint64_t)atoi(value + 8) * 1000;
+        else if (!strncmp(value, "attempts:", 9) && atoi(value + 9) > 0)
+          resolver->attempts = atoi(value + 9);
+      }
+    }
+  }
+  fclose(file);
+}
+
+// Fills the table at the top of the stack with name -> array of addresses
+static void luv_resolver_read_hosts(lua_State* L, const char* path) {
+  char line[1024];
+  FILE* file = fopen(path, "r");
+  if (!file) return;
+  while (fgets(line, sizeof(line), file)) {
+    unsigned char addr[16];
+    char* p = line;
+    char* ip;
+    char* name;
+    line[strcspn(line, "#")] = '\0';
+    ip = luv_dns_token(&p);
+    if (!ip) continue;
+    if (uv_inet_pton(AF_INET, ip, addr) != 0 && uv_inet_pton(AF_INET6, ip, addr) != 0)
+      continue;
+    while ((name = luv_dns_token(&p))) {
+      char* c;
+      int n;
+      for (c = name; *c; c++) *c = tolower((unsigned char)*c);
+      lua_getfield(L, -1, name);
+      if (lua_isnil(L, -1)) {
+        lua_pop(L, 1);
+        lua_newtable(L);
+        lua_pushvalue(L, -1);
+        lua_setfield(L, -3, name);
+      }
+      n = (int)lua_rawlen(L, -1);
+      lua_pushstring(L, ip);
+      lua_rawseti(L, -2, n + 1);
+      lua_pop(L, 1);
+    }
+  }
+  fclose(file);
+}
+
+static int luv_resolver_gc(lua_State* L) {
+  luv_resolver_t* resolver = luv_check_resolver(L, 1);
+  luaL_unref(L, LUA_REGISTRYINDEX, resolver->hosts_ref);
+  resolver->hosts_ref = LUA_NOREF;
+  return 0;
+}
+
+static int luv_resolver_tostring(lua_State* L) {
+  luv_resolver_t* resolver = luv_check_resolver(L, 1);
+  lua_pushfstring(L, "luv_resolver_t: %p", resolver);
+  return 1;
+}
+
+static int luv_new_resolver(lua_State* L) {
+  luv_resolver_t* resolver;
+  const char* path;
+  int i, n;
+
+  if (!lua_isnoneornil(L, 1)) luaL_checktype(L, 1, LUA_TTABLE);
+  lua_settop(L, 1);
+
+  resolver = (luv_resolver_t*)lua_newuserdata(L, sizeof(*resolver));
+  memset(resolver, 0, sizeof(*resolver));
+  resolver->ctx = luv_upvalue_context(L);
+  resolver->ndots = 1;
+  resolver->timeout = 5000;
+  resolver->attempts = 2;
+  resolver->hosts_ref = LUA_NOREF;
+  luaL_getmetatable(L, "luv_resolver");
+  lua_setmetatable(L, -2);
+
+  // resolv.conf first, the options override what it says
+  path = "/etc/resolv.conf";
+  if (lua_istable(L, 1)) {
+    lua_getfield(L, 1, "resolv_conf");
+    if (lua_isboolean(L, -1) && !lua_toboolean(L, -1)) path = NULL;
+    else if (!lua_isnil(L, -1)) path = luaL_checkstring(L, -1);
+  }
+  if (path) luv_resolver_read_conf(resolver, path);
+  if (lua_istable(L, 1)) lua_pop(L, 1);
+
+  path = "/etc/hosts";
+  if (lua_istable(L, 1)) {
+    lua_getfield(L, 1, "hosts");
+    if (lua_isboolean(L, -1) && !lua_toboolean(L, -1)) path = NULL;
+    else if (!lua_isnil(L, -1)) path = luaL_checkstring(L, -1);
+  }
+  lua_newtable(L);
+  if (path) luv_resolver_read_hosts(L, path);
+  resolver->hosts_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+  if (lua_istable(L, 1)) lua_pop(L, 1);
+
+  if (lua_istable(L, 1)) {
+    lua_getfield(L, 1, "nameservers");
+    if (!lua_isnil(L, -1)) {
+      luaL_checktype(L, -1, LUA_TTABLE);
+      n = (int)lua_rawlen(L, -1);
+      luaL_argcheck(L, n > 0 && n <= LUV_RESOLVER_MAXNS, 1, "nameservers must list 1 to 3 addresses");
+      for (i = 0; i < n; i++) {
+        lua_rawgeti(L, -1, i + 1);
+        if (!lua_isstring(L, -1) || luv_dns_parse_server(lua_tostring(L, -1), &resolver->servers[i]) < 0)
+          return luaL_argerror(L, 1, lua_pushfstring(L, "invalid nameserver at index %d", i + 1));
+        lua_pop(L, 1);
+      }
+      resolver->nservers = n;
+    }
+    lua_pop(L, 1);
+
+    lua_getfield(L, 1, "search");
+    if (!lua_isnil(L, -1)) {
+      luaL_checktype(L, -1, LUA_TTABLE);
+      resolver->nsearch = 0;
+      n = (int)lua_rawlen(L, -1);
+      for (i = 0; i < n; i++) {
+        lua_rawgeti(L, -1, i + 1);
+        luv_resolver_add_search(resolver, luaL_checkstring(L, -1));
+        lua_pop(L, 1);
+      }
+    }
+    lua_pop(L, 1);
+
+    lua_getfield(L, 1, "ndots");
+    resolver->ndots = (int)luaL_optinteger(L, -1, resolver->ndots);
+    lua_getfield(L, 1, "timeout");
+    resolver->timeout = luaL_optinteger(L, -1, resolver->timeout);
+    lua_getfield(L, 1, "attempts");
+    resolver->attempts = (int)luaL_optinteger(L, -1, resolver->attempts);
+    lua_pop(L, 3);
+    luaL_argcheck(L, resolver->timeout > 0, 1, "timeout must be positive");
+    luaL_argcheck(L, resolver->attempts > 0, 1, "attempts must be positive");
+  }
+
+  // same default as the libc resolver
+  if (!resolver->nservers) {
+    uv_ip4_addr("127.0.0.1", 53, (struct sockaddr_in*)&resolver->servers[0]);
+    resolver->nservers = 1;
+  }
+  return 1;
+}
+
+static void luv_dns_add_addr(luv_dns_lookup_t* lookup, int family, const unsigned char* addr) {
+  luv_dns_addr_t* entry;
+  if (lookup->family != AF_UNSPEC && lookup->family != family) return;
+  if (lookup->naddrs == lookup->addrs_size) {
+    int size = lookup->addrs_size ? lookup->addrs_size * 2 : 8;
+    luv_dns_addr_t* addrs = (luv_dns_addr_t*)luv_malloc(size * sizeof(*addrs), LUV_MEM_OTHER);
+    if (!addrs) return;
+    if (lookup->naddrs) memcpy(addrs, lookup->addrs, lookup->naddrs * sizeof(*addrs));
+    luv_free(lookup->addrs);
+    lookup->addrs = addrs;
+    lookup->addrs_size = size;
+  }
+  entry = &lookup->addrs[lookup->naddrs++];
+  entry->family = family;
+  memcpy(entry->addr, addr, family == AF_INET ? 4 : 16);
+}
+
+// Same shape as getaddrinfo results: one entry per address and socket type,
+// inet addresses first
+static void luv_dns_push_addrs(lua_State* L, luv_dns_lookup_t* lookup) {
+  static const int types[][2] = {
+    { SOCK_STREAM, IPPROTO_TCP },
+    { SOCK_DGRAM, IPPROTO_UDP },
+  };
+  struct addrinfo* infos;
+  struct sockaddr_storage* addrs;
+  int ntypes = lookup->socktype ? 1 : 2;
+  int count = lookup->naddrs * ntypes;
+  int pass, i, t, n = 0;
+
+  infos = (struct addrinfo*)luv_malloc(count * (sizeof(*infos) + sizeof(*addrs)), LUV_MEM_OTHER);
+  if (!infos) {
+    lua_newtable(L);
+    return;
+  }
+  addrs = (struct sockaddr_storage*)(infos + count);
+  memset(infos, 0, count * (sizeof(*infos) + sizeof(*addrs)));
+  for (pass = 0; pass < 2; pass++) {
+    int family = pass == 0 ? AF_INET : AF_INET6;
+    for (i = 0; i < lookup->naddrs; i++) {
+      luv_dns_addr_t* entry = &lookup->addrs[i];
+      if (entry->family != family) continue;
+      for (t = 0; t < ntypes; t++) {
+        struct addrinfo* info = &infos[n];
+        struct sockaddr_storage* addr = &addrs[n];
+        if (family == AF_INET) {
+          struct sockaddr_in* in = (struct sockaddr_in*)addr;
+          in->sin_family = AF_INET;
+          in->sin_port = htons(lookup->port);
+          memcpy(&in->sin_addr, entry->addr, 4);
+          info->ai_addrlen = sizeof(*in);
+        }
+        else {
+          struct sockaddr_in6* in6 = (struct sockaddr_in6*)addr;
+          in6->sin6_family = AF_INET6;
+          in6->sin6_port = htons(lookup->port);
+          memcpy(&in6->sin6_addr, entry->addr, 16);
+          info->ai_addrlen = sizeof(*in6);
+        }
+        info->ai_family = family;
+        info->ai_addr = (struct sockaddr*)addr;
+        if (lookup->socktype) {
+          info->ai_socktype = lookup->socktype;
+          info->ai_protocol = lookup->protocol;
+        }
+        else {
+          info->ai_socktype = types[t][0];
+          info->ai_protocol = lookup->protocol ? lookup->protocol : types[t][1];
+        }
+        if (n) infos[n - 1].ai_next = info;
+        n++;
+      }
+    }
+  }
+  luv_pushaddrinfo_format(L, n ? infos : NULL, lookup->format);
+  luv_free(infos);
+}
+
+static void luv_dns_lookup_close_cb(uv_handle_t* handle) {
+  luv_dns_lookup_t* lookup = (luv_dns_lookup_t*)handle;
+  luv_free(lookup->addrs);
+  luv_free(lookup);
+}
+
+static void luv_dns_lookup_finish(luv_dns_lookup_t* lookup, int status) {
+  luv_ctx_t* ctx = lookup->resolver->ctx;
+  lua_State* L = ctx->L;
+  int nargs;
+  lua_rawgeti(L, LUA_REGISTRYINDEX, lookup->cb_ref);
+  if (status < 0 || !lookup->naddrs) {
+    luv_status(L, status < 0 ? status : UV_EAI_NONAME);
+    nargs = 1;
+  }
+  else {
+    lua_pushnil(L);
+    luv_dns_push_addrs(L, lookup);
+    nargs = 2;
+  }
+  luaL_unref(L, LUA_REGISTRYINDEX, lookup->cb_ref);
+  luaL_unref(L, LUA_REGISTRYINDEX, lookup->resolver_ref);
+  luv_unanchor_internal(L, lookup->anchor);
+  // loop_gc closed the timer, the state is going away
+  if (!luv_close_internal_handle((uv_handle_t*)&lookup->timer, luv_dns_lookup_close_cb)) {
+    lua_pop(L, nargs + 1);
+    return;
+  }
+  ctx->pcall(L, nargs, 0, 0);
+}
+
+static void luv_dns_lookup_timer_cb(uv_timer_t* handle) {
+  luv_dns_lookup_t* lookup = (luv_dns_lookup_t*)handle;
+  luv_dns_lookup_finish(lookup, lookup->status);
+}
+
+// Completes the lookup from the loop, never from within uv.resolve itself
+static void luv_dns_lookup_defer(luv_dns_lookup_t* lookup, int status) {
+  lookup->status = status;
+  uv_timer_start(&lookup->timer, luv_dns_lookup_timer_cb, 0, 0);
+}
+
+static void luv_dns_query_send(luv_dns_query_t* query);
+static int luv_dns_lookup_start(luv_dns_lookup_t* lookup);
+
+static void luv_dns_lookup_done(luv_dns_lookup_t* lookup, int outcome) {
+  if (outcome == LUV_DNS_TIMEOUT) lookup->timeouts++;
+  else if (outcome == LUV_DNS_SERVFAIL) lookup->failures++;
+  if (--lookup->pending > 0) return;
+  if (lookup->naddrs) {
+    luv_dns_lookup_finish(lookup, 0);
+    return;
+  }
+  // nothing for this name, on to the next one
+  while (++lookup->name_index < lookup->nnames) {
+    if (luv_dns_lookup_start(lookup)) return;
+  }
+  luv_dns_lookup_finish(lookup, lookup->timeouts ? UV_EAI_AGAIN :
+                                lookup->failures ? UV_EAI_FAIL : UV_EAI_NONAME);
+}
+
+static luv_dns_query_t* luv_dns_query_container(uv_handle_t* handle, size_t offset) {
+  return (luv_dns_query_t*)((char*)handle - offset);
+}
+
+static void luv_dns_query_release(luv_dns_query_t* query) {
+  if (--query->handles > 0) return;
+  luv_free(query->tcpbuf);
+  luv_free(query);
+}
+
+static void luv_dns_udp_close_cb(uv_handle_t* handle) {
+  luv_dns_query_release(((luv_dns_udp_t*)handle)->query);
+}
+
+static void luv_dns_timer_close_cb(uv_handle_t* handle) {
+  luv_dns_query_release(luv_dns_query_container(handle, offsetof(luv_dns_query_t, timer)));
+}
+
+static void luv_dns_tcp_close_cb(uv_handle_t* handle) {
+  luv_dns_query_release(luv_dns_query_container(handle, offsetof(luv_dns_query_t, tcp)));
+}
+
+// Closes the handles of a query, the last close callback frees it. Returns
+// how many loop_gc had closed already, those never call back.
+static int luv_dns_query_close(luv_dns_query_t* query) {
+  luv_dns_query_t** link = &query->lookup->queries;
+  int closed = 0, i;
+  while (*link && *link != query) link = &(*link)->next;
+  if (*link) *link = query->next;
+  query->done = 1;
+  query->lookup = NULL;
+  closed += !luv_close_internal_handle((uv_handle_t*)&query->timer, luv_dns_timer_close_cb);
+  for (i = 0; i < 2; i++) {
+    if (query->udp[i].open)
+      closed += !luv_close_internal_handle((uv_handle_t*)&query->udp[i].handle, luv_dns_udp_close_cb);
+  }
+  if (query->tcp_mode)
+    closed += !luv_close_internal_handle((uv_handle_t*)&query->tcp, luv_dns_tcp_close_cb);
+  return closed;
+}
+
+static void luv_dns_query_finish(luv_dns_query_t* query, int outcome) {
+  luv_dns_lookup_t* lookup = query->lookup;
+  if (query->done) return;
+  // the connect and write callbacks of a tcp fallback run with UV_ECANCELED
+  // once loop_gc closed the handles, nothing is reported then
+  if (luv_dns_query_close(query)) return;
+  luv_dns_lookup_done(lookup, outcome);
+}
+
+// Runs when the state closes with the lookup still going, drops it without
+// calling back
+static int luv_dns_lookup_gc(lua_State* L) {
+  luv_dns_lookup_t** udata = (luv_dns_lookup_t**)lua_touserdata(L, 1);
+  luv_dns_lookup_t* lookup = *udata;
+  if (!lookup) return 0;
+  *udata = NULL;
+  while (lookup->queries) {
+    luv_dns_query_t* query = lookup->queries;
+    // after loop_gc nothing is left to call back, free it right away
+    query->handles -= luv_dns_query_close(query);
+    if (!query->handles) {
+      luv_free(query->tcpbuf);
+      luv_free(query);
+    }
+  }
+  luaL_unref(L, LUA_REGISTRYINDEX, lookup->cb_ref);
+  luaL_unref(L, LUA_REGISTRYINDEX, lookup->resolver_ref);
+  if (!luv_close_internal_handle((uv_handle_t*)&lookup->timer, luv_dns_lookup_close_cb))
+    luv_dns_lookup_close_cb((uv_handle_t*)&lookup->timer);
+  return 0;
+}
+
+// Next nameserver in turn, or the end once every try is used up
+static void luv_dns_query_retry(luv_dns_query_t* query, int outcome) {
+  luv_resolver_t* resolver = query->resolver;
+  query->last = outcome;
+  if (query->tries >= resolver->attempts * resolver->nservers) {
+    luv_dns_query_finish(query, query->last);
+    return;
+  }
+  query->server = (query->server + 1) % resolver->nservers;
+  luv_dns_query_send(query);
+}
+
+static void luv_dns_timeout_cb(uv_timer_t* handle) {
+  luv_dns_query_t* query = luv_dns_query_container((uv_handle_t*)handle, offsetof(luv_dns_query_t, timer));
+  if (query->tcp_mode) luv_dns_query_finish(query, LUV_DNS_TIMEOUT);
+  else luv_dns_query_retry(query, LUV_DNS_TIMEOUT);
+}
+
+// Offset past the name at off, 0 if it runs out of the message
+static size_t luv_dns_skip_name(const unsigned char* msg, size_t len, size_t off) {
+  while (off < len) {
+    unsigned char c = msg[off];
+    if (c == 0) return off + 1;
+    if ((c & 0xc0) == 0xc0) return off + 2 <= len ? off + 2 : 0;
+    off += c + 1;
+  }
+  return 0;
+}
+
+static void luv_dns_tcp_start(luv_dns_query_t* query, const struct sockaddr* addr);
+
+// Handles a response, returns 0 when it doesn't answer this query
+static int luv_dns_query_response(luv_dns_query_t* query, const unsigned char* msg, size_t len, const struct sockaddr* from) {
+  const unsigned char* question = query->packet + 2 + 12;
+  size_t qlen = query->plen - 12;
+  size_t off, i;
+  int ancount, rcode;
+
+  if (len < 12 + qlen) return 0;
+  if (msg[0] != query->packet[2] || msg[1] != query->packet[3]) return 0;
+  if (!(msg[2] & 0x80)) return 0;
+  if (msg[4] != 0 || msg[5] != 1) return 0;
+  // the name compares case-insensitively, label lengths stay below 'A'
+  for (i = 0; i < qlen; i++) {
+    if (tolower(msg[12 + i]) != tolower(question[i])) return 0;
+  }
+
+  if (msg[2] & 0x02) {
+    // truncated, only tcp can carry the full answer
+    if (!query->tcp_mode) {
+      luv_dns_tcp_start(query, from);
+      return 1;
+    }
+  }
+
+  rcode = msg[3] & 0x0f;
+  if (rcode == 3) {
+    luv_dns_query_finish(query, LUV_DNS_NXDOMAIN);
+    return 1;
+  }
+  if (rcode != 0) {
+    if (query->tcp_mode) luv_dns_query_finish(query, LUV_DNS_SERVFAIL);
+    else luv_dns_query_retry(query, LUV_DNS_SERVFAIL);
+    return 1;
+  }
+
+  // any record of the asked type counts, CNAME chains come with their targets
+  ancount = (msg[6] << 8) | msg[7];
+  off = 12 + qlen;
+  while (ancount-- > 0) {
+    int type, class;
+    size_t rdlen;
+    off = luv_dns_skip_name(msg, len, off);
+    if (!off || off + 10 > len) break;
+    type = (msg[off] << 8) | msg[off + 1];
+    class = (msg[off + 2] << 8) | msg[off + 3];
+    rdlen = (msg[off + 8] << 8) | msg[off + 9];
+    off += 10;
+    if (off + rdlen > len) break;
+    if (class == LUV_DNS_CLASS_IN && type == query->qtype) {
+      if (type == LUV_DNS_TYPE_A && rdlen == 4)
+        luv_dns_add_addr(query->lookup, AF_INET, msg + off);
+      else if (type == LUV_DNS_TYPE_AAAA && rdlen == 16)
+        luv_dns_add_addr(query->lookup, AF_INET6, msg + off);
+    }
+    off += rdlen;
+  }
+  luv_dns_query_finish(query, LUV_DNS_OK);
+  return 1;
+}
+
+static void luv_dns_alloc_cb(uv_handle_t* handle, size_t suggested_size, uv_buf_t* buf) {
+  luv_dns_query_t* query = ((luv_dns_udp_t*)handle)->query;
+  (void)suggested_size;
+  buf->base = (char*)query->recvbuf;
+  buf->len = sizeof(query->recvbuf);
+}
+
+static int luv_dns_is_server(luv_resolver_t* resolver, const struct sockaddr* addr) {
+  int i;
+  for (i = 0; i < resolver->nservers; i++) {
+    const struct sockaddr* server = (const struct sockaddr*)&resolver->servers[i];
+    if (server->sa_family != addr->sa_family) continue;
+    if (addr->sa_family == AF_INET) {
+      const struct sockaddr_in* a = (const struct sockaddr_in*)addr;
+      const struct sockaddr_in* b = (const struct sockaddr_in*)server;
+      if (a->sin_port == b->sin_port && !memcmp(&a->sin_addr, &b->sin_addr, sizeof(a->sin_addr)))
+        return 1;
+    }
+    else if (addr->sa_family == AF_INET6) {
+      const struct sockaddr_in6* a = (const struct sockaddr_in6*)addr;
+      const struct sockaddr_in6* b = (const struct sockaddr_in6*)server;
+      if (a->sin6_port == b->sin6_port && !memcmp(&a->sin6_addr, &b->sin6_addr, sizeof(a->sin6_addr)))
+        return 1;
+    }
+  }
+  return 0;
+}
+
+static void luv_dns_udp_recv_cb(uv_udp_t* handle, ssize_t nread, const uv_buf_t* buf, const struct sockaddr* addr, unsigned flags) {
+  luv_dns_query_t* query = ((luv_dns_udp_t*)handle)->query;
+  (void)flags;
+  if (query->done || query->tcp_mode || nread <= 0 || !addr) return;
+  // answers from anywhere else are spoofing attempts or stray packets
+  if (!luv_dns_is_server(query->resolver, addr)) return;
+  luv_dns_query_response(query, (const unsigned char*)buf->base, nread, addr);
+}
+
+static void luv_dns_send_cb(uv_udp_send_t* req, int status) {
+  luv_dns_query_t* query = (luv_dns_query_t*)req->data;
+  query->sending = 0;
+  // a failed send is retried when the attempt times out
+  (void)status;
+}
+
+static int luv_dns_udp_open(luv_dns_query_t* query, luv_dns_udp_t* udp, int family) {
+  struct sockaddr_storage any;
+  int ret;
+  ret = uv_udp_init(query->resolver->ctx->loop, &udp->handle);
+  if (ret < 0) return ret;
+  luv_init_internal_handle((uv_handle_t*)&udp->handle);
+  udp->query = query;
+  udp->open = 1;
+  query->handles++;
+  if (family == AF_INET6) uv_ip6_addr("::", 0, (struct sockaddr_in6*)&any);
+  else uv_ip4_addr("0.0.0.0", 0, (struct sockaddr_in*)&any);
+  ret = uv_udp_bind(&udp->handle, (const struct sockaddr*)&any, 0);
+  if (ret < 0) return ret;
+  return uv_udp_recv_start(&udp->handle, luv_dns_alloc_cb, luv_dns_udp_recv_cb);
+}
+
+static void luv_dns_query_send(luv_dns_query_t* query) {
+  luv_resolver_t* resolver = query->resolver;
+  const struct sockaddr* addr = (const struct sockaddr*)&resolver->servers[query->server];
+  luv_dns_udp_t* udp = &query->udp[addr->sa_family == AF_INET6];
+  uv_buf_t buf;
+  int ret = 0;
+  query->tries++;
+  if (!udp->open) ret = luv_dns_udp_open(query, udp, addr->sa_family);
+  if (ret == 0 && !query->sending) {
+    buf = uv_buf_init((char*)query->packet + 2, (unsigned int)query->plen);
+    query->sendreq.data = query;
+    ret = uv_udp_send(&query->sendreq, &udp->handle, &buf, 1, addr, luv_dns_send_cb);
+    if (ret == 0) query->sending = 1;
+  }
+  // a try that couldn't be sent fails right away
+  uv_timer_start(&query->timer, luv_dns_timeout_cb, ret < 0 ? 0 : resolver->timeout, 0);
+}
+
+static void luv_dns_tcp_alloc_cb(uv_handle_t* handle, size_t suggested_size, uv_buf_t* buf) {
+  luv_dns_query_t* query = luv_dns_query_container(handle, offsetof(luv_dns_query_t, tcp));
+  (void)suggested_size;
+  buf->base = (char*)query->tcpbuf + query->tcplen;
+  buf->len = LUV_DNS_TCP_SIZE - query->tcplen;
+}
+
+static void luv_dns_tcp_read_cb(uv_stream_t* stream, ssize_t nread, const uv_buf_t* buf) {
+  luv_dns_query_t* query = luv_dns_query_container((uv_handle_t*)stream, offsetof(luv_dns_query_t, tcp));
+  size_t need;
+  (void)buf;
+  if (query->done) return;
+  if (nread < 0) {
+    luv_dns_query_finish(query, LUV_DNS_SERVFAIL);
+    return;
+  }
+  query->tcplen += nread;
+  if (query->tcplen < 2) return;
+  need = ((query->tcpbuf[0] << 8) | query->tcpbuf[1]) + 2;
+  if (query->tcplen < need) return;
+  if (!luv_dns_query_response(query, query->tcpbuf + 2, need - 2, NULL))
+    luv_dns_query_finish(query, LUV_DNS_SERVFAIL);
+}
+
+static void luv_dns_write_cb(uv_write_t* req, int status) {
+  luv_dns_query_t* query = (luv_dns_query_t*)req->data;
+  if (status < 0 && !query->done) luv_dns_query_finish(query, LUV_DNS_SERVFAIL);
+}
+
+static void luv_dns_connect_cb(uv_connect_t* req, int status) {
+  luv_dns_query_t* query = (luv_dns_query_t*)req->data;
+  uv_buf_t buf;
+  if (query->done) return;
+  if (status == 0) {
+    query->packet[0] = (unsigned char)(query->plen >> 8);
+    query->packet[1] = (unsigned char)query->plen;
+    buf = uv_buf_init((char*)query->packet, (unsigned int)query->plen + 2);
+    query->writereq.data = query;
+    status = uv_write(&query->writereq, (uv_stream_t*)&query->tcp, &buf, 1, luv_dns_write_cb);
+  }
+  if (status == 0)
+    status = uv_read_start((uv_stream_t*)&query->tcp, luv_dns_tcp_alloc_cb, luv_dns_tcp_read_cb);
+  if (status < 0) luv_dns_query_finish(query, LUV_DNS_SERVFAIL);
+}
+
+static void luv_dns_tcp_start(luv_dns_query_t* query, const struct sockaddr* addr) {
+  int ret;
+  query->tcpbuf = (unsigned char*)luv_malloc(LUV_DNS_TCP_SIZE, LUV_MEM_OTHER);
+  if (!query->tcpbuf) {
+    luv_dns_query_finish(query, LUV_DNS_SERVFAIL);
+    return;
+  }
+  ret = uv_tcp_init(query->resolver->ctx->loop, &query->tcp);
+  if (ret < 0) {
+    luv_dns_query_finish(query, LUV_DNS_SERVFAIL);
+    return;
+  }
+  luv_init_internal_handle((uv_handle_t*)&query->tcp);
+  query->tcp_mode = 1;
+  query->handles++;
+  query->connreq.data = query;
+  ret = uv_tcp_connect(&query->connreq, &query->tcp, addr, luv_dns_connect_cb);
+  if (ret < 0) {
+    luv_dns_query_finish(query, LUV_DNS_SERVFAIL);
+    return;
+  }
+  uv_timer_start(&query->timer, luv_dns_timeout_cb, query->resolver->timeout, 0);
+}
+
+// Encodes the query for name, 0 if it isn't a valid domain name
+static size_t luv_dns_encode(unsigned char* packet, const char* name, int qtype) {
+  unsigned char* p = packet + 12;
+  const char* label = name;
+  uint16_t id = luv_dns_id();
+  memset(packet, 0, 12);
+  packet[0] = (unsigned char)(id >> 8);
+  packet[1] = (unsigned char)id;
+  packet[2] = 0x01;   /* recursion desired */
+  packet[5] = 1;      /* one question */
+  while (*label) {
+    const char* dot = strchr(label, '.');
+    size_t len = dot ? (size_t)(dot - label) : strlen(label);
+    if (len == 0 || len > 63) return 0;
+    *p++ = (unsigned char)len;
+    memcpy(p, label, len);
+    p += len;
+    label += len;
+    if (*label) label++;
+  }
+  *p++ = 0;
+  *p++ = (unsigned char)(qtype >> 8);
+  *p++ = (unsigned char)qtype;
+  *p++ = 0;
+  *p++ = LUV_DNS_CLASS_IN;
+  return p - packet;
+}
+
+static int luv_dns_query_start(luv_dns_lookup_t* lookup, int qtype) {
+  luv_resolver_t* resolver = lookup->resolver;
+  luv_dns_query_t* query = (luv_dns_query_t*)luv_malloc(sizeof(*query), LUV_MEM_OTHER);
+  if (!query) return UV_ENOMEM;
+  memset(query, 0, sizeof(*query));
+  query->plen = luv_dns_encode(query->packet + 2, lookup->names[lookup->name_index], qtype);
+  if (!query->plen) {
+    luv_free(query);
+    return UV_EINVAL;
+  }
+  if (uv_timer_init(resolver->ctx->loop, &query->timer) < 0) {
+    luv_free(query);
+    return UV_ENOMEM;
+  }
+  luv_init_internal_handle((uv_handle_t*)&query->timer);
+  query->handles = 1;
+  query->lookup = lookup;
+  query->resolver = resolver;
+  query->qtype = qtype;
+  query->last = LUV_DNS_TIMEOUT;
+  query->next = lookup->queries;
+  lookup->queries = query;
+  lookup->pending++;
+  luv_dns_query_send(query);
+  return 0;
+}
+
+// Queries the current name, A and AAAA at the same time. Returns the number
+// of queries started, none of them completes before the loop runs.
+static int luv_dns_lookup_start(luv_dns_lookup_t* lookup) {
+  int started = 0;
+  if (lookup->family != AF_INET6 && luv_dns_query_start(lookup, LUV_DNS_TYPE_A) == 0)
+    started++;
+  if (lookup->family != AF_INET && luv_dns_query_start(lookup, LUV_DNS_TYPE_AAAA) == 0)
+    started++;
+  return started;
+}
+
+// Fills in the names to query, search domains first for short names
+static void luv_dns_lookup_names(luv_dns_lookup_t* lookup, const char* host, size_t len) {
+  luv_resolver_t* resolver = lookup->resolver;
+  int absolute = len > 0 && host[len - 1] == '.';
+  int dots = 0, i;
+  size_t j;
+  if (absolute) len--;
+  if (len == 0 || len > 253) return;
+  for (j = 0; j < len; j++) dots += host[j] == '.';
+  if (absolute || dots >= resolver->ndots) {
+    memcpy(lookup->names[lookup->nnames], host, len);
+    lookup->names[lookup->nnames++][len] = '\0';
+  }
+  for (i = 0; !absolute && i < resolver->nsearch; i++) {
+    size_t slen = strlen(resolver->search[i]);
+    if (len + 1 + slen > 253) continue;
+    memcpy(lookup->names[lookup->nnames], host, len);
+    lookup->names[lookup->nnames][len] = '.';
+    memcpy(lookup->names[lookup->nnames] + len + 1, resolver->search[i], slen + 1);
+    lookup->nnames++;
+  }
+  if (!absolute && dots < resolver->ndots) {
+    memcpy(lookup->names[lookup->nnames], host, len);
+    lookup->names[lookup->nnames++][len] = '\0';
+  }
+}
+
+// Numeric addresses and hosts file entries, returns 1 if the lookup is done
+static int luv_dns_lookup_local(lua_State* L, luv_dns_lookup_t* lookup, const char* host, size_t len) {
+  char name[LUV_DNS_NAME_SIZE];
+  unsigned char addr[16];
+  size_t i;
+  int n;
+  if (uv_inet_pton(AF_INET, host, addr) == 0) {
+    luv_dns_add_addr(lookup, AF_INET, addr);
+    return 1;
+  }
+  if (uv_inet_pton(AF_INET6, host, addr) == 0) {
+    luv_dns_add_addr(lookup, AF_INET6, addr);
+    return 1;
+  }
+  if (len && host[len - 1] == '.') len--;
+  if (len >= sizeof(name)) return 0;
+  for (i = 0; i < len; i++) name[i] = tolower((unsigned char)host[i]);
+  name[len] = '\0';
+  lua_rawgeti(L, LUA_REGISTRYINDEX, lookup->resolver->hosts_ref);
+  lua_getfield(L, -1, name);
+  if (lua_istable(L, -1)) {
+    n = (int)lua_rawlen(L, -1);
+    for (i = 1; i <= (size_t)n; i++) {
+      const char* ip;
+      lua_rawgeti(L, -1, (int)i);
+      ip = lua_tostring(L, -1);
+      if (uv_inet_pton(AF_INET, ip, addr) == 0)
+        luv_dns_add_addr(lookup, AF_INET, addr);
+      else if (uv_inet_pton(AF_INET6, ip, addr) == 0)
+        luv_dns_add_addr(lookup, AF_INET6, addr);
+      lua_pop(L, 1);
+    }
+  }
+  lua_pop(L, 2);
+  // entries of the other family only fall through to DNS
+  return lookup->naddrs > 0;
+}
+
+static int luv_resolve(lua_State* L) {
+  luv_resolver_t* resolver = luv_check_resolver(L, 1);
+  size_t len;
+  const char* host = luaL_checklstring(L, 2, &len);
+  int family = AF_UNSPEC, socktype = 0, protocol = 0, port = 0;
+  luv_dns_lookup_t* lookup;
+  int ret;
+
+  if (!lua_isnoneornil(L, 3)) {
+    luaL_checktype(L, 3, LUA_TTABLE);
+    lua_getfield(L, 3, "family");
+    if (lua_isnumber(L, -1)) family = (int)lua_tointeger(L, -1);
+    else if (lua_isstring(L, -1)) family = luv_af_string_to_num(lua_tostring(L, -1));
+    else if (!lua_isnil(L, -1)) return luaL_argerror(L, 3, "family hint must be string if set");
+    lua_getfield(L, 3, "socktype");
+    if (lua_isnumber(L, -1)) socktype = (int)lua_tointeger(L, -1);
+    else if (lua_isstring(L, -1)) socktype = luv_sock_string_to_num(lua_tostring(L, -1));
+    else if (!lua_isnil(L, -1)) return luaL_argerror(L, 3, "socktype hint must be string if set");
+    lua_getfield(L, 3, "protocol");
+    if (lua_isnumber(L, -1)) protocol = (int)lua_tointeger(L, -1);
+    else if (lua_isstring(L, -1)) protocol = luv_proto_string_to_num(lua_tostring(L, -1));
+    else if (!lua_isnil(L, -1)) return luaL_argerror(L, 3, "protocol hint must be string if set");
+    lua_getfield(L, 3, "port");
+    port = (int)luaL_optinteger(L, -1, 0);
+    lua_pop(L, 4);
+    luaL_argcheck(L, family == AF_UNSPEC || family == AF_INET || family == AF_INET6, 3, "family must be inet or inet6");
+    luaL_argcheck(L, protocol >= 0, 3, "invalid protocol");
+    luaL_argcheck(L, port >= 0 && port <= 65535, 3, "port out of range");
+  }
+  luv_check_callable(L, 4);
+
+  lookup = (luv_dns_lookup_t*)luv_malloc(sizeof(*lookup), LUV_MEM_OTHER);
+  if (!lookup) return luaL_error(L, "Can't allocate lookup");
+  memset(lookup, 0, sizeof(*lookup));
+  ret = uv_timer_init(luv_loop(L), &lookup->timer);
+  if (ret < 0) {
+    luv_free(lookup);
+    return luv_error(L, ret);
+  }
+  luv_init_internal_handle((uv_handle_t*)&lookup->timer);
+  lookup->resolver = resolver;
+  lookup->family = family;
+  lookup->socktype = socktype;
+  lookup->protocol = protocol;
+  lookup->port = port;
+  lookup->format = luv_check_addrinfo_format(L, 3);
+  lua_pushvalue(L, 1);
+  lookup->resolver_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+  lua_pushvalue(L, 4);
+  lookup->cb_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+  lookup->anchor = luv_anchor_internal(L, lookup, "luv_dns_lookup");
+
+  if (luv_dns_lookup_local(L, lookup, host, len)) {
+    luv_dns_lookup_defer(lookup, 0);
+  }
+  else {
+    luv_dns_lookup_names(lookup, host, len);
+    while (lookup->name_index < lookup->nnames && !luv_dns_lookup_start(lookup))
+      lookup->name_index++;
+    if (lookup->name_index == lookup->nnames)
+      luv_dns_lookup_defer(lookup, UV_EAI_NONAME);
+  }
+  lua_pushboolean(L, 1);
+  return 1;
+}
+
+static const luaL_Reg luv_resolver_methods[] = {
+  {"resolve", luv_resolve},
+  {NULL, NULL}
+};
+
+static void luv_resolver_init(lua_State* L) {
+  luaL_newmetatable(L, "luv_resolver");
+  lua_pushcfunction(L, luv_resolver_tostring);
+  lua_setfield(L, -2, "__tostring");
+  lua_pushcfunction(L, luv_resolver_gc);
+  lua_setfield(L, -2, "__gc");
+  luaL_newlib(L, luv_resolver_methods);
+  lua_setfield(L, -2, "__index");
+  lua_pop(L, 1);
+
+  luaL_newmetatable(L, "luv_dns_lookup");
+  lua_pushcfunction(L, luv_dns_lookup_gc);
+  lua_setfield(L, -2, "__gc");
+  lua_pop(L, 1);
+}
@@ -0,0 +1,463 @@
+/*
+ *  Copyright 2014 The Luvit Authors. All Rights Reserved.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ */
+#include "private.h"
+
+// Maps shared by every lua_State of the process, found by name. Entries are
+// spread over stripes with their own lock so threads working on different
+// keys rarely wait for each other.
+
+#define LUV_SMAP_STRIPES 16
+#define LUV_SMAP_COPY 256     /* strings read into a stack buffer up to this */
+
+typedef struct {
+  int type;                   /* LUA_TBOOLEAN, LUA_TNUMBER or LUA_TSTRING */
+  int isint;                  /* number stored as integer, Lua 5.3+ */
+  union {
+    int boolean;
+    lua_Number num;
+    lua_Integer integer;
+    struct {
+      char* base;
+      size_t len;
+    } str;
+  } val;
+} luv_smap_value_t;
+
+typedef struct luv_smap_entry_s {
+  struct luv_smap_entry_s* next;
+  uint32_t hash;
+  luv_smap_value_t value;
+  size_t keylen;
+  char key[1];
+} luv_smap_entry_t;
+
+typedef struct {
+  uv_rwlock_t lock;
+  size_t count;
+  size_t nbuckets;            /* power of two */
+  luv_smap_entry_t** buckets;
+} luv_smap_stripe_t;
+
+typedef struct luv_smap_s {
+  struct luv_smap_s* next;    /* in luv_smaps */
+  int refs;                   /* userdata pointing here, under luv_smaps_lock */
+  luv_smap_stripe_t stripes[LUV_SMAP_STRIPES];
+  size_t namelen;
+  char name[1];
+} luv_smap_t;
+
+static uv_once_t luv_smaps_once = UV_ONCE_INIT;
+static uv_mutex_t luv_smaps_lock;
+static luv_smap_t* luv_smaps;
+
+static void luv_smaps_init(void) {
+  if (uv_mutex_init(&luv_smaps_lock) < 0) abort();
+}
+
+static luv_smap_t* luv_check_smap(lua_State* L, int index) {
+  luv_smap_t** udata = (luv_smap_t**)luaL_checkudata(L, index, "luv_shared_map");
+  return *udata;
+}
+
+static void luv_smap_value_free(luv_smap_value_t* value) {
+  if (value->type == LUA_TSTRING) luv_free(value->val.str.base);
+  value->type = LUA_TNIL;
+}
+
+// Reads a storable value at index into value, strings are copied
+static void luv_smap_check_value(lua_State* L, int index, luv_smap_value_t* value) {
+  const char* str;
+  value->type = lua_type(L, index);
+  value->isint = 0;
+  switch (value->type) {
+    case LUA_TNIL:
+      break;
+    case LUA_TBOOLEAN:
+      value->val.boolean = lua_toboolean(L, index);
+      break;
+    case LUA_TNUMBER:
+#if LUA_VERSION_NUM >= 503
+      if (lua_isinteger(L, index)) {
+        value->isint = 1;
+        value->val.integer = lua_tointeger(L, index);
+        break;
+      }
+#endif
+      value->val.num = lua_tonumber(L, index);
+      break;
+    case LUA_TSTRING:
+      str = lua_tolstring(L, index, &value->val.str.len);
+      value->val.str.base = (char*)luv_malloc(value->val.str.len + 1, LUV_MEM_OTHER);
+      if (!value->val.str.base) luaL_error(L, "Can't allocate shared map value");
+      memcpy(value->val.str.base, str, value->val.str.len);
+      break;
+    default:
+      luaL_argerror(L, index, "expected nil, boolean, number or string");
+  }
+}
+
+// Compares without copying, for cas
+static int luv_smap_value_eq(lua_State* L, int index, const luv_smap_value_t* value) {
+  int type = lua_type(L, index);
+  const char* str;
+  size_t len;
+  if (type != value->type) return 0;
+  switch (type) {
+    case LUA_TNIL:
+      return 1;
+    case LUA_TBOOLEAN:
+      return lua_toboolean(L, index) == value->val.boolean;
+    case LUA_TNUMBER:
+      if (value->isint) return lua_tonumber(L, index) == (lua_Number)value->val.integer;
+      return lua_tonumber(L, index) == value->val.num;
+    case LUA_TSTRING:
+      str = lua_tolstring(L, index, &len);
+      return len == value->val.str.len && memcmp(str, value->val.str.base, len) == 0;
+  }
+  return 0;
+}
+
+static luv_smap_stripe_t* luv_smap_stripe(luv_smap_t* map, uint32_t hash) {
+  return &map->stripes[hash & (LUV_SMAP_STRIPES - 1)];
+}
+
+static luv_smap_entry_t** luv_smap_slot(luv_smap_stripe_t* stripe, const char* key, size_t keylen, uint32_t hash) {
+  luv_smap_entry_t** slot;
+  if (!stripe->nbuckets) return NULL;
+  slot = &stripe->buckets[(hash / LUV_SMAP_STRIPES) & (stripe->nbuckets - 1)];
+  while (*slot) {
+    luv_smap_entry_t* entry = *slot;
+    if (entry->hash == hash && entry->keylen == keylen && memcmp(entry->key, key, keylen) == 0)
+      return slot;
+    slot = &entry->next;
+  }
+  return slot;
+}
+
+// Called with the stripe locked for writing
+static int luv_smap_grow(luv_smap_stripe_t* stripe) {
+  size_t nbuckets = stripe->nbuckets ? stripe->nbuckets * 2 : 8;
+  luv_smap_entry_t** buckets;
+  size_t i;
+  buckets = (luv_smap_entry_t**)luv_malloc(nbuckets * sizeof(*buckets), LUV_MEM_OTHER);
+  if (!buckets) return UV_ENOMEM;
+  memset(buckets, 0, nbuckets * sizeof(*buckets));
+  for (i = 0; i < stripe->nbuckets; i++) {
+    luv_smap_entry_t* entry = stripe->buckets[i];
+    while (entry) {
+      luv_smap_entry_t* next = entry->next;
+      luv_smap_entry_t** head = &buckets[(entry->hash / LUV_SMAP_STRIPES) & (nbuckets - 1)];
+      entry->next = *head;
+      *head = entry;
+      entry = next;
+    }
+  }
+  luv_free(stripe->buckets);
+  stripe->buckets = buckets;
+  stripe->nbuckets = nbuckets;
+  return 0;
+}
+
+// Stores value (taking over its string) under key, NULL value or nil
+// deletes. Called with the stripe locked for writing.
+static int luv_smap_store(luv_smap_stripe_t* stripe, const char* key, size_t keylen, uint32_t hash,
+                          luv_smap_value_t* value) {
+  luv_smap_entry_t** slot = luv_smap_slot(stripe, key, keylen, hash);
+  luv_smap_entry_t* entry = slot ? *slot : NULL;
+  if (value->type == LUA_TNIL) {
+    if (!entry) return 0;
+    *slot = entry->next;
+    luv_smap_value_free(&entry->value);
+    luv_free(entry);
+    stripe->count--;
+    return 0;
+  }
+  if (entry) {
+    luv_smap_value_free(&entry->value);
+    entry->value = *value;
+    return 0;
+  }
+  if (stripe->count >= stripe->nbuckets) {
+    int ret = luv_smap_grow(stripe);
+    if (ret < 0) return ret;
+    slot = luv_smap_slot(stripe, key, keylen, hash);
+  }
+  entry = (luv_smap_entry_t*)luv_malloc(sizeof(*entry) + keylen, LUV_MEM_OTHER);
+  if (!entry) return UV_ENOMEM;
+  entry->next = NULL;
+  entry->hash = hash;
+  entry->value = *value;
+  entry->keylen = keylen;
+  memcpy(entry->key, key, keylen);
+  *slot = entry;
+  stripe->count++;
+  return 0;
+}
+
+static void luv_smap_push_value(lua_State* L, const luv_smap_value_t* value) {
+  switch (value->type) {
+    case LUA_TBOOLEAN:
+      lua_pushboolean(L, value->val.boolean);
+      break;
+    case LUA_TNUMBER:
+      if (value->isint) lua_pushinteger(L, value->val.integer);
+      else lua_pushnumber(L, value->val.num);
+      break;
+    case LUA_TSTRING:
+      lua_pushlstring(L, value->val.str.base, value->val.str.len);
+      break;
+    default:
+      lua_pushnil(L);
+  }
+}
+
+static int luv_shared_map_get(lua_State* L) {
+  luv_smap_t* map = luv_check_smap(L, 1);
+  size_t keylen;
+  const char* key = luaL_checklstring(L, 2, &keylen);
+  uint32_t hash = luv_dns_hash(key, keylen);
+  luv_smap_stripe_t* stripe = luv_smap_stripe(map, hash);
+  luv_smap_entry_t** slot;
+  luv_smap_value_t value;
+  char buf[LUV_SMAP_COPY];
+
+  // copied out first, pushing may run finalizers that use the map
+  uv_rwlock_rdlock(&stripe->lock);
+  slot = luv_smap_slot(stripe, key, keylen, hash);
+  if (slot && *slot) {
+    value = (*slot)->value;
+    if (value.type == LUA_TSTRING) {
+      char* copy = value.val.str.len <= sizeof(buf) ? buf
+        : (char*)luv_malloc(value.val.str.len, LUV_MEM_OTHER);
+      if (copy) memcpy(copy, value.val.str.base, value.val.str.len);
+      value.val.str.base = copy;
+    }
+  } else {
+    value.type = LUA_TNIL;
+  }
+  uv_rwlock_rdunlock(&stripe->lock);
+
+  if (value.type == LUA_TSTRING) {
+    if (!value.val.str.base) return luaL_error(L, "Can't allocate shared map value");
+    lua_pushlstring(L, value.val.str.base, value.val.str.len);
+    if (value.val.str.base != buf) luv_free(value.val.str.base);
+    return 1;
+  }
+  luv_smap_push_value(L, &value);
+  return 1;
+}
+
+static int luv_shared_map_set(lua_State* L) {
+  luv_smap_t* map = luv_check_smap(L, 1);
+  size_t keylen;
+  const char* key = luaL_checklstring(L, 2, &keylen);
+  uint32_t hash = luv_dns_hash(key, keylen);
+  luv_smap_stripe_t* stripe = luv_smap_stripe(map, hash);
+  luv_smap_value_t value;
+  int ret;
+
+  luv_smap_check_value(L, 3, &value);
+  uv_rwlock_wrlock(&stripe->lock);
+  ret = luv_smap_store(stripe, key, keylen, hash, &value);
+  uv_rwlock_wrunlock(&stripe->lock);
+  if (ret < 0) luv_smap_value_free(&value);
+  return luv_result(L, ret);
+}
+
+static int luv_shared_map_cas(lua_State* L) {
+  luv_smap_t* map = luv_check_smap(L, 1);
+  size_t keylen;
+  const char* key = luaL_checklstring(L, 2, &keylen);
+  uint32_t hash = luv_dns_hash(key, keylen);
+  luv_smap_stripe_t* stripe = luv_smap_stripe(map, hash);
+  luv_smap_entry_t** slot;
+  luv_smap_value_t value, nil;
+  int ret = 0, swapped;
+
+  luaL_checkany(L, 3);
+  luv_smap_check_value(L, 4, &value);
+  nil.type = LUA_TNIL;
+  uv_rwlock_wrlock(&stripe->lock);
+  slot = luv_smap_slot(stripe, key, keylen, hash);
+  swapped = luv_smap_value_eq(L, 3, slot && *slot ? &(*slot)->value : &nil);
+  if (swapped) ret = luv_smap_store(stripe, key, keylen, hash, &value);
+  uv_rwlock_wrunlock(&stripe->lock);
+  if (!swapped || ret < 0) luv_smap_value_free(&value);
+  if (ret < 0) return luv_error(L, ret);
+  lua_pushboolean(L, swapped);
+  return 1;
+}
+
+static int luv_shared_map_incr(lua_State* L) {
+  luv_smap_t* map = luv_check_smap(L, 1);
+  size_t keylen;
+  const char* key = luaL_checklstring(L, 2, &keylen);
+  uint32_t hash = luv_dns_hash(key, keylen);
+  luv_smap_stripe_t* stripe = luv_smap_stripe(map, hash);
+  luv_smap_entry_t** slot;
+  luv_smap_value_t value;
+  int ret = 0;
+
+  if (lua_isnoneornil(L, 3)) {
+    lua_settop(L, 2);
+    lua_pushinteger(L, 1);
+  }
+  luaL_checktype(L, 3, LUA_TNUMBER);
+  luv_smap_check_value(L, 3, &value);
+  uv_rwlock_wrlock(&stripe->lock);
+  slot = luv_smap_slot(stripe, key, keylen, hash);
+  if (slot && *slot) {
+    luv_smap_value_t* current = &(*slot)->value;
+    if (current->type != LUA_TNUMBER) {
+      ret = UV_EINVAL;
+    } else if (current->isint && value.isint) {
+      // wraps around like Lua integers
+      current->val.integer = (lua_Integer)((unsigned long long)current->val.integer + (unsigned long long)value.val.integer);
+    } else {
+      lua_Number a = current->isint ? (lua_Number)current->val.integer : current->val.num;
+      lua_Number b = value.isint ? (lua_Number)value.val.integer : value.val.num;
+      current->isint = 0;
+      current->val.num = a + b;
+    }
+    value = *current;
+  } else {
+    ret = luv_smap_store(stripe, key, keylen, hash, &value);
+  }
+  uv_rwlock_wrunlock(&stripe->lock);
+  if (ret < 0) return luv_error(L, ret);
+  luv_smap_push_value(L, &value);
+  return 1;
+}
+
+static int luv_shared_map_count(lua_State* L) {
+  luv_smap_t* map = luv_check_smap(L, 1);
+  size_t count = 0;
+  int i;
+  for (i = 0; i < LUV_SMAP_STRIPES; i++) {
+    uv_rwlock_rdlock(&map->stripes[i].lock);
+    count += map->stripes[i].count;
+    uv_rwlock_rdunlock(&map->stripes[i].lock);
+  }
+  lua_pushinteger(L, count);
+  return 1;
+}
+
+static void luv_smap_free(luv_smap_t* map) {
+  int i;
+  size_t j;
+  for (i = 0; i < LUV_SMAP_STRIPES; i++) {
+    luv_smap_stripe_t* stripe = &map->stripes[i];
+    for (j = 0; j < stripe->nbuckets; j++) {
+      luv_smap_entry_t* entry = stripe->buckets[j];
+      while (entry) {
+        luv_smap_entry_t* next = entry->next;
+        luv_smap_value_free(&entry->value);
+        luv_free(entry);
+        entry = next;
+      }
+    }
+    luv_free(stripe->buckets);
+    uv_rwlock_destroy(&stripe->lock);
+  }
+  luv_free(map);
+}
+
+// Finds or creates the map, with luv_smaps_lock held
+static luv_smap_t* luv_smap_acquire(const char* name, size_t namelen) {
+  luv_smap_t* map;
+  int i;
+  for (map = luv_smaps; map; map = map->next) {
+    if (map->namelen == namelen && memcmp(map->name, name, namelen) == 0) {
+      map->refs++;
+      return map;
+    }
+  }
+  map = (luv_smap_t*)luv_malloc(sizeof(*map) + namelen, LUV_MEM_OTHER);
+  if (!map) return NULL;
+  memset(map, 0, sizeof(*map));
+  for (i = 0; i < LUV_SMAP_STRIPES; i++) {
+    if (uv_rwlock_init(&map->stripes[i].lock) < 0) {
+      while (i--) uv_rwlock_destroy(&map->stripes[i].lock);
+      luv_free(map);
+      return NULL;
+    }
+  }
+  map->refs = 1;
+  map->namelen = namelen;
+  memcpy(map->name, name, namelen);
+  map->next = luv_smaps;
+  luv_smaps = map;
+  return map;
+}
+
+static int luv_shared_map(lua_State* L) {
+  size_t namelen;
+  const char* name = luaL_checklstring(L, 1, &namelen);
+  luv_smap_t** udata = (luv_smap_t**)lua_newuserdata(L, sizeof(*udata));
+  *udata = NULL;
+  luaL_getmetatable(L, "luv_shared_map");
+  lua_setmetatable(L, -2);
+  uv_once(&luv_smaps_once, luv_smaps_init);
+  uv_mutex_lock(&luv_smaps_lock);
+  *udata = luv_smap_acquire(name, namelen);
+  uv_mutex_unlock(&luv_smaps_lock);
+  if (!*udata) return luaL_error(L, "Can't allocate shared map");
+  return 1;
+}
+
+static int luv_shared_map_gc(lua_State* L) {
+  luv_smap_t** udata = (luv_smap_t**)lua_touserdata(L, 1);
+  luv_smap_t* map = *udata;
+  luv_smap_t** link;
+  if (!map) return 0;
+  *udata = NULL;
+  uv_mutex_lock(&luv_smaps_lock);
+  if (--map->refs > 0) map = NULL;
+  else {
+    for (link = &luv_smaps; *link != map; link = &(*link)->next);
+    *link = map->next;
+  }
+  uv_mutex_unlock(&luv_smaps_lock);
+  if (map) luv_smap_free(map);
+  return 0;
+}
+
+static int luv_shared_map_tostring(lua_State* L) {
+  luv_smap_t* map = luv_check_smap(L, 1);
+  lua_pushfstring(L, "luv_shared_map_t: %p", map);
+  return 1;
+}
+
+static const luaL_Reg luv_shared_map_methods[] = {
+  {"get", luv_shared_map_get},
+  {"set", luv_shared_map_set},
+  {"cas", luv_shared_map_cas},
+  {"incr", luv_shared_map_incr},
+  {"count", luv_shared_map_count},
+  {NULL, NULL}
+};
+
+static void luv_sharedmap_init(lua_State* L) {
+  luaL_newmetatable(L, "luv_shared_map");
+  lua_pushcfunction(L, luv_shared_map_tostring);
+  lua_setfield(L, -2, "__tostring");
+  lua_pushcfunction(L, luv_shared_map_gc);
+  lua_setfield(L, -2, "__gc");
+  luaL_newlib(L, luv_shared_map_methods);
+  lua_setfield(L, -2, "__index");
+  lua_pop(L, 1);
+}
@@ -17,13 +17,13 @@
 #include "private.h"
 
 static uv_signal_t* luv_check_signal(lua_State* L, int index) {
-  uv_signal_t* handle = (uv_signal_t*)luv_checkudata(L, index, "uv_signal");
+  uv_signal_t* handle = (uv_signal_t*)luv_checkudata(L, index, UV_SIGNAL, "uv_signal");
   luaL_argcheck(L, handle->type == UV_SIGNAL && handle->data, index, "Expected uv_signal_t");
   return handle;
 }
 
 static int luv_new_signal(lua_State* L) {
-  luv_ctx_t* ctx = luv_context(L);
+  luv_ctx_t* ctx = luv_upvalue_context(L);
   uv_signal_t* handle = (uv_signal_t*)luv_newuserdata(L, sizeof(*handle));
   int ret = uv_signal_init(ctx->loop, handle);
   if (ret < 0) {
@@ -17,18 +17,17 @@
 #include "private.h"
 
 static uv_stream_t* luv_check_stream(lua_State* L, int index) {
-  int isStream;
-  void *udata;
+  luv_ctx_t* ctx = luv_upvalue_context(L);
+  void* udata = lua_touserdata(L, index);
+  const void* mt;
   uv_stream_t* handle;
-  if (!(udata = lua_touserdata(L, index))) { goto fail; }
+  if (!udata || !(mt = luv_metatable_ptr(L, index))) { goto fail; }
+  if (mt != ctx->handle_mt[UV_TCP] &&
+      mt != ctx->handle_mt[UV_NAMED_PIPE] &&
+      mt != ctx->handle_mt[UV_TTY]) { goto fail; }
   if (!(handle = *(uv_stream_t**) udata)) { goto fail; }
   if (!handle->data) { goto fail; }
-  lua_getfield(L, LUA_REGISTRYINDEX, "uv_stream");
-  lua_getmetatable(L, index < 0 ? index - 1 : index);
-  lua_rawget(L, -2);
-  isStream = lua_toboolean(L, -1);
-  lua_pop(L, 2);
-  if (isStream) { return handle; }
+  return handle;
   fail: luaL_argerror(L, index, "Expected uv_stream userdata");
   return NULL;
 }
@@ -83,7 +82,7 @@ static int luv_accept(lua_State* L) {
 
 static void luv_alloc_cb(uv_handle_t* handle, size_t suggested_size, uv_buf_t* buf) {
   (void)handle;
-  buf->base = (char*)malloc(suggested_size);
+  buf->base = (char*)luv_malloc(suggested_size, LUV_MEM_READ_BUF);
   assert(buf->base);
   buf->len = suggested_size;
 }
@@ -99,7 +98,7 @@ static void luv_read_cb(uv_stream_t* handle, ssize_t nread, const uv_buf_t* buf)
     nargs = 2;
   }
 
-  free(buf->base);
+  luv_free(buf->base);
   if (nread == 0) return;
 
   if (nread == UV_EOF) {
@@ -147,7 +146,7 @@ static int luv_write(lua_State* L) {
   size_t count;
   uv_buf_t* bufs = luv_check_bufs(L, 2, &count, (luv_req_t*)req->data);
   ret = uv_write(req, handle, bufs, count, luv_write_cb);
-  free(bufs);
+  luv_free(bufs);
   if (ret < 0) {
     luv_cleanup_req(L, (luv_req_t*)req->data);
     lua_pop(L, 1);
@@ -169,7 +168,7 @@ static int luv_write2(lua_State* L) {
   size_t count;
   uv_buf_t* bufs = luv_check_bufs(L, 2, &count, (luv_req_t*)req->data);
   ret = uv_write2(req, handle, bufs, count, send_handle, luv_write_cb);
-  free(bufs);
+  luv_free(bufs);
   if (ret < 0) {
     luv_cleanup_req(L, (luv_req_t*)req->data);
     lua_pop(L, 1);
@@ -182,10 +181,11 @@ static int luv_try_write(lua_State* L) {
   uv_stream_t* handle = luv_check_stream(L, 1);
   int err_or_num_bytes;
   size_t count;
-  uv_buf_t* bufs = luv_check_bufs_noref(L, 2, &count);
+  uv_buf_t buf;
+  uv_buf_t* bufs = luv_check_bufs_noref(L, 2, &count, &buf);
   err_or_num_bytes = uv_try_write(handle, bufs, count);
-  free(bufs);
-  if (err_or_num_bytes < 0) return luv_error(L, err_or_num_bytes);
+  if (bufs != &buf) luv_free(bufs);
+  if (err_or_num_bytes < 0) return luv_try_error(L, err_or_num_bytes);
   lua_pushinteger(L, err_or_num_bytes);
   return 1;
 }
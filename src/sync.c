@@ -0,0 +1,315 @@
+/*
+ *  Copyright 2014 The Luvit Authors. All Rights Reserved.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ */
+#include "private.h"
+
+// Synchronization primitives for Lua states running in different threads.
+// The userdata only holds a pointer to a refcounted object, so copies passed
+// through thread and work arguments share it (see luv_sync_retain).
+
+enum {
+  LUV_SYNC_MUTEX = 0,
+  LUV_SYNC_SEM,
+  LUV_SYNC_COND,
+  LUV_SYNC_BARRIER,
+  LUV_SYNC_COUNTER,
+  LUV_SYNC_MAX
+};
+
+static const char* const luv_sync_names[LUV_SYNC_MAX] = {
+  "luv_mutex", "luv_sem", "luv_cond", "luv_barrier", "luv_counter"
+};
+
+typedef struct {
+  int64_t refs;
+  int kind;
+  union {
+    uv_mutex_t mutex;
+    uv_sem_t sem;
+    uv_cond_t cond;
+    uv_barrier_t barrier;
+    int64_t counter;
+  } u;
+} luv_sync_t;
+
+static luv_sync_t* luv_check_sync(lua_State* L, int index, int kind) {
+  luv_sync_t** udata = (luv_sync_t**)luaL_checkudata(L, index, luv_sync_names[kind]);
+  luaL_argcheck(L, *udata != NULL, index, "released object");
+  return *udata;
+}
+
+// Pushes a userdata for a new object, the caller initializes the union
+static luv_sync_t* luv_new_sync(lua_State* L, int kind) {
+  luv_sync_t** udata = (luv_sync_t**)lua_newuserdata(L, sizeof(*udata));
+  *udata = NULL;
+  luaL_getmetatable(L, luv_sync_names[kind]);
+  lua_setmetatable(L, -2);
+  *udata = (luv_sync_t*)luv_malloc(sizeof(**udata), LUV_MEM_OTHER);
+  if (!*udata) luaL_error(L, "Can't allocate %s", luv_sync_names[kind]);
+  (*udata)->refs = 1;
+  (*udata)->kind = -1;  // not initialized yet, nothing to destroy
+  return *udata;
+}
+
+// Drops one reference, the last one destroys the object
+static void luv_sync_release(void* ptr) {
+  luv_sync_t* sync = (luv_sync_t*)ptr;
+  if (!sync || luv_atomic_addref(&sync->refs, -1) > 0) return;
+  switch (sync->kind) {
+    case LUV_SYNC_MUTEX: uv_mutex_destroy(&sync->u.mutex); break;
+    case LUV_SYNC_SEM: uv_sem_destroy(&sync->u.sem); break;
+    case LUV_SYNC_COND: uv_cond_destroy(&sync->u.cond); break;
+    case LUV_SYNC_BARRIER: uv_barrier_destroy(&sync->u.barrier); break;
+    default: break;
+  }
+  luv_free(sync);
+}
+
+static int luv_sync_gc(lua_State* L) {
+  luv_sync_t** udata = (luv_sync_t**)lua_touserdata(L, 1);
+  luv_sync_t* sync = *udata;
+  *udata = NULL;
+  luv_sync_release(sync);
+  return 0;
+}
+
+// The kind is the upvalue
+static int luv_sync_tostring(lua_State* L) {
+  int kind = (int)lua_tointeger(L, lua_upvalueindex(1));
+  luv_sync_t* sync = luv_check_sync(L, 1, kind);
+  lua_pushfstring(L, "%s_t: %p", luv_sync_names[kind], sync);
+  return 1;
+}
+
+// Called by luv_thread_arg_set while the value is still owned by the setting
+// state, the reference keeps the object alive until the copy adopts it.
+static void* luv_sync_retain(lua_State* L, int index) {
+  int kind;
+  for (kind = 0; kind < LUV_SYNC_MAX; kind++) {
+    luv_sync_t** udata = (luv_sync_t**)luaL_testudata(L, index, luv_sync_names[kind]);
+    if (!udata || !*udata || (*udata)->kind < 0) continue;
+    luv_atomic_addref(&(*udata)->refs, 1);
+    return *udata;
+  }
+  return NULL;
+}
+
+// Pushes the copy of a retained object, its __gc drops the adopted reference
+static void luv_sync_push(lua_State* L, void* ptr) {
+  luv_sync_t* sync = (luv_sync_t*)ptr;
+  luv_sync_t** udata = (luv_sync_t**)lua_newuserdata(L, sizeof(*udata));
+  *udata = sync;
+  luaL_getmetatable(L, luv_sync_names[sync->kind]);
+  lua_setmetatable(L, -2);
+}
+
+static int luv_new_mutex(lua_State* L) {
+  luv_sync_t* sync = luv_new_sync(L, LUV_SYNC_MUTEX);
+  int ret = uv_mutex_init(&sync->u.mutex);
+  if (ret < 0) return luv_error(L, ret);
+  sync->kind = LUV_SYNC_MUTEX;
+  return 1;
+}
+
+static int luv_mutex_lock(lua_State* L) {
+  uv_mutex_lock(&luv_check_sync(L, 1, LUV_SYNC_MUTEX)->u.mutex);
+  return 0;
+}
+
+static int luv_mutex_trylock(lua_State* L) {
+  lua_pushboolean(L, uv_mutex_trylock(&luv_check_sync(L, 1, LUV_SYNC_MUTEX)->u.mutex) == 0);
+  return 1;
+}
+
+static int luv_mutex_unlock(lua_State* L) {
+  uv_mutex_unlock(&luv_check_sync(L, 1, LUV_SYNC_MUTEX)->u.mutex);
+  return 0;
+}
+
+static int luv_new_sem(lua_State* L) {
+  lua_Integer value = luaL_optinteger(L, 1, 0);
+  luv_sync_t* sync;
+  int ret;
+  luaL_argcheck(L, value >= 0 && value <= INT_MAX, 1, "value out of range");
+  sync = luv_new_sync(L, LUV_SYNC_SEM);
+  ret = uv_sem_init(&sync->u.sem, (unsigned int)value);
+  if (ret < 0) return luv_error(L, ret);
+  sync->kind = LUV_SYNC_SEM;
+  return 1;
+}
+
+static int luv_sem_post(lua_State* L) {
+  uv_sem_post(&luv_check_sync(L, 1, LUV_SYNC_SEM)->u.sem);
+  return 0;
+}
+
+static int luv_sem_wait(lua_State* L) {
+  uv_sem_wait(&luv_check_sync(L, 1, LUV_SYNC_SEM)->u.sem);
+  return 0;
+}
+
+static int luv_sem_trywait(lua_State* L) {
+  lua_pushboolean(L, uv_sem_trywait(&luv_check_sync(L, 1, LUV_SYNC_SEM)->u.sem) == 0);
+  return 1;
+}
+
+static int luv_new_cond(lua_State* L) {
+  luv_sync_t* sync = luv_new_sync(L, LUV_SYNC_COND);
+  int ret = uv_cond_init(&sync->u.cond);
+  if (ret < 0) return luv_error(L, ret);
+  sync->kind = LUV_SYNC_COND;
+  return 1;
+}
+
+static int luv_cond_signal(lua_State* L) {
+  uv_cond_signal(&luv_check_sync(L, 1, LUV_SYNC_COND)->u.cond);
+  return 0;
+}
+
+static int luv_cond_broadcast(lua_State* L) {
+  uv_cond_broadcast(&luv_check_sync(L, 1, LUV_SYNC_COND)->u.cond);
+  return 0;
+}
+
+// With a timeout in ms returns false when it expired
+static int luv_cond_wait(lua_State* L) {
+  luv_sync_t* cond = luv_check_sync(L, 1, LUV_SYNC_COND);
+  luv_sync_t* mutex = luv_check_sync(L, 2, LUV_SYNC_MUTEX);
+  if (lua_isnoneornil(L, 3)) {
+    uv_cond_wait(&cond->u.cond, &mutex->u.mutex);
+    lua_pushboolean(L, 1);
+  } else {
+    lua_Integer timeout = luaL_checkinteger(L, 3);
+    luaL_argcheck(L, timeout >= 0, 3, "timeout must not be negative");
+    lua_pushboolean(L, uv_cond_timedwait(&cond->u.cond, &mutex->u.mutex,
+                                         (uint64_t)timeout * 1000000) == 0);
+  }
+  return 1;
+}
+
+static int luv_new_barrier(lua_State* L) {
+  lua_Integer count = luaL_checkinteger(L, 1);
+  luv_sync_t* sync;
+  int ret;
+  luaL_argcheck(L, count > 0 && count <= INT_MAX, 1, "count must be positive");
+  sync = luv_new_sync(L, LUV_SYNC_BARRIER);
+  ret = uv_barrier_init(&sync->u.barrier, (unsigned int)count);
+  if (ret < 0) return luv_error(L, ret);
+  sync->kind = LUV_SYNC_BARRIER;
+  return 1;
+}
+
+// true in exactly one of the threads released together
+static int luv_barrier_wait(lua_State* L) {
+  lua_pushboolean(L, uv_barrier_wait(&luv_check_sync(L, 1, LUV_SYNC_BARRIER)->u.barrier) > 0);
+  return 1;
+}
+
+static int luv_new_counter(lua_State* L) {
+  lua_Integer value = luaL_optinteger(L, 1, 0);
+  luv_sync_t* sync = luv_new_sync(L, LUV_SYNC_COUNTER);
+  sync->u.counter = value;
+  sync->kind = LUV_SYNC_COUNTER;
+  return 1;
+}
+
+static int luv_counter_get(lua_State* L) {
+  luv_sync_t* sync = luv_check_sync(L, 1, LUV_SYNC_COUNTER);
+  lua_pushinteger(L, (lua_Integer)luv_atomic_load(&sync->u.counter));
+  return 1;
+}
+
+static int luv_counter_add(lua_State* L) {
+  luv_sync_t* sync = luv_check_sync(L, 1, LUV_SYNC_COUNTER);
+  int64_t delta = (int64_t)luaL_optinteger(L, 2, 1);
+  lua_pushinteger(L, (lua_Integer)luv_atomic_add(&sync->u.counter, delta));
+  return 1;
+}
+
+// Returns the previous value
+static int luv_counter_set(lua_State* L) {
+  luv_sync_t* sync = luv_check_sync(L, 1, LUV_SYNC_COUNTER);
+  int64_t value = (int64_t)luaL_checkinteger(L, 2);
+  int64_t old = luv_atomic_load(&sync->u.counter);
+  while (!luv_atomic_cas(&sync->u.counter, old, value));
+  lua_pushinteger(L, (lua_Integer)old);
+  return 1;
+}
+
+static int luv_counter_cas(lua_State* L) {
+  luv_sync_t* sync = luv_check_sync(L, 1, LUV_SYNC_COUNTER);
+  int64_t expected = (int64_t)luaL_checkinteger(L, 2);
+  int64_t value = (int64_t)luaL_checkinteger(L, 3);
+  lua_pushboolean(L, luv_atomic_cas(&sync->u.counter, expected, value));
+  return 1;
+}
+
+static const luaL_Reg luv_mutex_methods[] = {
+  {"lock", luv_mutex_lock},
+  {"trylock", luv_mutex_trylock},
+  {"unlock", luv_mutex_unlock},
+  {NULL, NULL}
+};
+
+static const luaL_Reg luv_sem_methods[] = {
+  {"post", luv_sem_post},
+  {"wait", luv_sem_wait},
+  {"trywait", luv_sem_trywait},
+  {NULL, NULL}
+};
+
+static const luaL_Reg luv_cond_methods[] = {
+  {"signal", luv_cond_signal},
+  {"broadcast", luv_cond_broadcast},
+  {"wait", luv_cond_wait},
+  {NULL, NULL}
+};
+
+static const luaL_Reg luv_barrier_methods[] = {
+  {"wait", luv_barrier_wait},
+  {NULL, NULL}
+};
+
+static const luaL_Reg luv_counter_methods[] = {
+  {"get", luv_counter_get},
+  {"add", luv_counter_add},
+  {"set", luv_counter_set},
+  {"cas", luv_counter_cas},
+  {NULL, NULL}
+};
+
+static void luv_sync_init(lua_State* L) {
+  const luaL_Reg* methods[LUV_SYNC_MAX] = {
+    luv_mutex_methods, luv_sem_methods, luv_cond_methods,
+    luv_barrier_methods, luv_counter_methods
+  };
+  int kind;
+  for (kind = 0; kind < LUV_SYNC_MAX; kind++) {
+    luaL_newmetatable(L, luv_sync_names[kind]);
+    // thread arguments find the metatable again by this name
+    lua_pushstring(L, luv_sync_names[kind]);
+    lua_setfield(L, -2, "__name");
+    lua_pushinteger(L, kind);
+    lua_pushcclosure(L, luv_sync_tostring, 1);
+    lua_setfield(L, -2, "__tostring");
+    lua_pushcfunction(L, luv_sync_gc);
+    lua_setfield(L, -2, "__gc");
+    lua_newtable(L);
+    luaL_setfuncs(L, methods[kind], 0);
+    lua_setfield(L, -2, "__index");
+    lua_pop(L, 1);
+  }
+}
@@ -17,7 +17,7 @@
 #include "private.h"
 
 static uv_tcp_t* luv_check_tcp(lua_State* L, int index) {
-  uv_tcp_t* handle = (uv_tcp_t*)luv_checkudata(L, index, "uv_tcp");
+  uv_tcp_t* handle = (uv_tcp_t*)luv_checkudata(L, index, UV_TCP, "uv_tcp");
   luaL_argcheck(L, handle->type == UV_TCP && handle->data, index, "Expected uv_tcp_t");
   return handle;
 }
@@ -25,7 +25,7 @@ static uv_tcp_t* luv_check_tcp(lua_State* L, int index) {
 static int luv_new_tcp(lua_State* L) {
   uv_tcp_t* handle;
   int ret;
-  luv_ctx_t* ctx = luv_context(L);
+  luv_ctx_t* ctx = luv_upvalue_context(L);
   lua_settop(L, 1);
   handle = (uv_tcp_t*)luv_newuserdata(L, sizeof(*handle));
 #if LUV_UV_VERSION_GEQ(1, 7, 0)
@@ -178,15 +178,17 @@ static int luv_write_queue_size(lua_State* L) {
 
 static int luv_tcp_connect(lua_State* L) {
   uv_tcp_t* handle = luv_check_tcp(L, 1);
-  const char* host = luaL_checkstring(L, 2);
-  int port = luaL_checkinteger(L, 3);
   struct sockaddr_storage addr;
   uv_connect_t* req;
   int ret, ref;
   luv_handle_t* lhandle = handle->data;
-  if (uv_ip4_addr(host, port, (struct sockaddr_in*)&addr) &&
-      uv_ip6_addr(host, port, (struct sockaddr_in6*)&addr)) {
-    return luaL_error(L, "Invalid IP address or port [%s:%d]", host, port);
+  if (!luv_test_sockaddr(L, 2, 3, &addr)) {
+    const char* host = luaL_checkstring(L, 2);
+    int port = luaL_checkinteger(L, 3);
+    if (uv_ip4_addr(host, port, (struct sockaddr_in*)&addr) &&
+        uv_ip6_addr(host, port, (struct sockaddr_in6*)&addr)) {
+      return luaL_error(L, "Invalid IP address or port [%s:%d]", host, port);
+    }
   }
   ref = luv_check_continuation(L, 4);
 
@@ -284,3 +286,350 @@ static int luv_socketpair(lua_State* L) {
   return 1;
 }
 #endif
+
+/* Happy eyeballs (RFC 8305)
+
+   uv.tcp_connect_host() resolves a host and races connects over its
+   addresses: they are tried in the order getaddrinfo returned them with the
+   families interleaved, a new attempt starts every `delay` ms or as soon as
+   the previous one fails, and the first connected socket wins. A dead IPv6
+   route costs `delay` instead of a connect timeout.
+*/
+
+#define LUV_HAPPY_DELAY 250
+#define LUV_HAPPY_MIN_DELAY 10
+
+typedef struct luv_happy_s luv_happy_t;
+
+typedef struct {
+  uv_timer_t handle;          /* internal handle, must stay the first member */
+  luv_happy_t* happy;
+} luv_happy_timer_t;
+
+typedef struct luv_happy_attempt_s {
+  uv_connect_t req;
+  uv_tcp_t* tcp;              /* luv handle, anchored by its own ref */
+  luv_happy_t* happy;
+  struct luv_happy_attempt_s* next;
+} luv_happy_attempt_t;
+
+struct luv_happy_s {
+  luv_ctx_t* ctx;
+  luv_happy_timer_t delay;    /* staggers the attempts */
+  luv_happy_timer_t timeout;  /* overall deadline */
+  uv_getaddrinfo_t gai;
+  uint64_t submitted;
+  int cb_ref;
+  int port;
+  uint64_t delay_ms;
+  struct addrinfo* res;
+  struct addrinfo** order;
+  size_t naddrs;
+  size_t next;
+  luv_happy_attempt_t* attempts;
+  int resolving;
+  int pending;                /* libuv callbacks still to come */
+  int done;
+  int last_error;
+  int anchor;                 /* tears it down when the state closes */
+};
+
+static void luv_happy_release(luv_happy_t* happy) {
+  if (!happy->done || happy->pending) return;
+  if (happy->res) uv_freeaddrinfo(happy->res);
+  luv_free(happy->order);
+  luv_free(happy);
+}
+
+static void luv_happy_timer_close_cb(uv_handle_t* handle) {
+  luv_happy_t* happy = ((luv_happy_timer_t*)handle)->happy;
+  happy->pending--;
+  luv_happy_release(happy);
+}
+
+// Drops the attempts and closes the timers, returns how many timers loop_gc
+// had closed already. Those never call back and keep their pending count.
+static int luv_happy_stop(luv_happy_t* happy) {
+  luv_happy_attempt_t* attempt;
+  int closed = 0;
+  happy->done = 1;
+  // their connect callbacks run with UV_ECANCELED, at lua_close loop_gc may
+  // have closed the sockets already
+  for (attempt = happy->attempts; attempt; attempt = attempt->next) {
+    if (!uv_is_closing((uv_handle_t*)attempt->tcp))
+      uv_close((uv_handle_t*)attempt->tcp, luv_close_cb);
+  }
+  if (happy->resolving) uv_cancel((uv_req_t*)&happy->gai);
+  closed += !luv_close_internal_handle((uv_handle_t*)&happy->delay.handle, luv_happy_timer_close_cb);
+  closed += !luv_close_internal_handle((uv_handle_t*)&happy->timeout.handle, luv_happy_timer_close_cb);
+  return closed;
+}
+
+// Runs when the state closes during the attempt, the pending callbacks
+// free it without calling back
+static int luv_happy_gc(lua_State* L) {
+  luv_happy_t** udata = (luv_happy_t**)lua_touserdata(L, 1);
+  luv_happy_t* happy = *udata;
+  if (!happy) return 0;
+  *udata = NULL;
+  luaL_unref(L, LUA_REGISTRYINDEX, happy->cb_ref);
+  happy->cb_ref = LUA_NOREF;
+  // after loop_gc nothing is left to call back
+  happy->pending -= luv_happy_stop(happy);
+  luv_happy_release(happy);
+  return 0;
+}
+
+// Calls back with the winner or the error and drops everything else. The
+// state is freed by luv_happy_release once libuv is done with it.
+static void luv_happy_finish(luv_happy_t* happy, int status, uv_tcp_t* winner) {
+  lua_State* L = happy->ctx->L;
+  luv_unanchor_internal(L, happy->anchor);
+  // loop_gc closed the timers, the state is going away
+  if (luv_happy_stop(happy)) {
+    luaL_unref(L, LUA_REGISTRYINDEX, happy->cb_ref);
+    return;
+  }
+
+  lua_rawgeti(L, LUA_REGISTRYINDEX, happy->cb_ref);
+  luaL_unref(L, LUA_REGISTRYINDEX, happy->cb_ref);
+  if (winner) {
+    lua_pushnil(L);
+    luv_find_handle(L, (luv_handle_t*)winner->data);
+    happy->ctx->pcall(L, 2, 0, 0);
+  }
+  else {
+    luv_status(L, status);
+    happy->ctx->pcall(L, 1, 0, 0);
+  }
+}
+
+static void luv_happy_connect_cb(uv_connect_t* req, int status);
+static void luv_happy_delay_cb(uv_timer_t* handle);
+
+// Starts the attempt for the next address, or reports the last error once
+// every address failed
+static void luv_happy_next(luv_happy_t* happy) {
+  lua_State* L = happy->ctx->L;
+  // only loop_gc closes the timers before the attempt is done, no new sockets
+  // while the state closes
+  if (uv_is_closing((uv_handle_t*)&happy->delay.handle)) {
+    happy->next = happy->naddrs;
+    happy->last_error = UV_ECANCELED;
+  }
+  while (happy->next < happy->naddrs) {
+    struct addrinfo* ai = happy->order[happy->next++];
+    luv_happy_attempt_t* attempt;
+    uv_tcp_t* tcp;
+    int ret;
+
+    tcp = (uv_tcp_t*)luv_newuserdata(L, sizeof(*tcp));
+    if (!tcp) {
+      happy->last_error = UV_ENOMEM;
+      continue;
+    }
+    ret = uv_tcp_init(happy->ctx->loop, tcp);
+    if (ret < 0) {
+      lua_pop(L, 1);
+      happy->last_error = ret;
+      continue;
+    }
+    tcp->data = luv_setup_handle(L, happy->ctx);
+    lua_pop(L, 1);
+
+    attempt = (luv_happy_attempt_t*)luv_malloc(sizeof(*attempt), LUV_MEM_REQ);
+    ret = attempt ? uv_tcp_connect(&attempt->req, tcp, ai->ai_addr, luv_happy_connect_cb) : UV_ENOMEM;
+    if (ret < 0) {
+      luv_free(attempt);
+      uv_close((uv_handle_t*)tcp, luv_close_cb);
+      happy->last_error = ret;
+      continue;
+    }
+    attempt->tcp = tcp;
+    attempt->happy = happy;
+    attempt->next = happy->attempts;
+    happy->attempts = attempt;
+    happy->pending++;
+    if (happy->next < happy->naddrs)
+      uv_timer_start(&happy->delay.handle, luv_happy_delay_cb, happy->delay_ms, 0);
+    return;
+  }
+  uv_timer_stop(&happy->delay.handle);
+  if (!happy->attempts)
+    luv_happy_finish(happy, happy->last_error, NULL);
+}
+
+static void luv_happy_delay_cb(uv_timer_t* handle) {
+  luv_happy_next(((luv_happy_timer_t*)handle)->happy);
+}
+
+static void luv_happy_timeout_cb(uv_timer_t* handle) {
+  luv_happy_finish(((luv_happy_timer_t*)handle)->happy, UV_ETIMEDOUT, NULL);
+}
+
+static void luv_happy_connect_cb(uv_connect_t* req, int status) {
+  luv_happy_attempt_t* attempt = (luv_happy_attempt_t*)req;
+  luv_happy_t* happy = attempt->happy;
+  uv_tcp_t* tcp = attempt->tcp;
+  luv_happy_attempt_t** link = &happy->attempts;
+
+  happy->pending--;
+  while (*link && *link != attempt) link = &(*link)->next;
+  if (*link) *link = attempt->next;
+  luv_free(attempt);
+
+  if (!happy->done) {
+    if (status == 0) {
+      luv_happy_finish(happy, 0, tcp);
+    }
+    else {
+      happy->last_error = status;
+      if (!uv_is_closing((uv_handle_t*)tcp))
+        uv_close((uv_handle_t*)tcp, luv_close_cb);
+      luv_happy_next(happy);
+    }
+  }
+  luv_happy_release(happy);
+}
+
+// Orders the addresses as RFC 8305 section 4 asks: keep the order of
+// getaddrinfo, alternating families starting with the first one
+static size_t luv_happy_sort(luv_happy_t* happy) {
+  struct addrinfo* ai;
+  struct addrinfo* lists[2] = { NULL, NULL };
+  size_t count = 0, i = 0;
+  int first = 0;
+  for (ai = happy->res; ai; ai = ai->ai_next) {
+    if (ai->ai_family == AF_INET || ai->ai_family == AF_INET6) count++;
+  }
+  if (!count) return 0;
+  happy->order = (struct addrinfo**)luv_malloc(count * sizeof(*happy->order), LUV_MEM_OTHER);
+  if (!happy->order) return 0;
+
+  for (ai = happy->res; ai; ai = ai->ai_next) {
+    if (ai->ai_family == AF_INET || ai->ai_family == AF_INET6) {
+      first = ai->ai_family;
+      break;
+    }
+  }
+  while (i < count) {
+    int pass;
+    for (pass = 0; pass < 2 && i < count; pass++) {
+      int family = (pass == 0) == (first == AF_INET) ? AF_INET : AF_INET6;
+      ai = lists[pass] ? lists[pass]->ai_next : happy->res;
+      while (ai && ai->ai_family != family) ai = ai->ai_next;
+      if (!ai) continue;
+      lists[pass] = ai;
+      if (family == AF_INET)
+        ((struct sockaddr_in*)ai->ai_addr)->sin_port = htons((unsigned short)happy->port);
+      else
+        ((struct sockaddr_in6*)ai->ai_addr)->sin6_port = htons((unsigned short)happy->port);
+      happy->order[i++] = ai;
+    }
+  }
+  return count;
+}
+
+static void luv_happy_getaddrinfo_cb(uv_getaddrinfo_t* req, int status, struct addrinfo* res) {
+  luv_happy_t* happy = (luv_happy_t*)((char*)req - offsetof(luv_happy_t, gai));
+  luv_threadpool_complete(happy->ctx, LUV_TP_GETADDRINFO, happy->submitted, 0, 0);
+  happy->pending--;
+  happy->resolving = 0;
+  happy->res = res;
+  if (!happy->done) {
+    if (status < 0) {
+      luv_happy_finish(happy, status, NULL);
+    }
+    else {
+      happy->naddrs = luv_happy_sort(happy);
+      happy->last_error = happy->naddrs ? 0 : UV_EAI_NODATA;
+      luv_happy_next(happy);
+    }
+  }
+  luv_happy_release(happy);
+}
+
+static int luv_tcp_connect_host(lua_State* L) {
+  luv_ctx_t* ctx = luv_upvalue_context(L);
+  const char* host = luaL_checkstring(L, 1);
+  int port = luaL_checkinteger(L, 2);
+  struct addrinfo hints;
+  luv_happy_t* happy;
+  lua_Integer timeout = 0;
+  lua_Integer delay = LUV_HAPPY_DELAY;
+  int ret;
+
+  luaL_argcheck(L, port >= 0 && port <= 65535, 2, "port out of range");
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  hints.ai_protocol = IPPROTO_TCP;
+  if (!lua_isnoneornil(L, 3)) {
+    luaL_checktype(L, 3, LUA_TTABLE);
+    lua_getfield(L, 3, "family");
+    if (lua_isnumber(L, -1)) {
+      hints.ai_family = lua_tointeger(L, -1);
+    }
+    else if (lua_isstring(L, -1)) {
+      hints.ai_family = luv_af_string_to_num(lua_tostring(L, -1));
+    }
+    else if (!lua_isnil(L, -1)) {
+      return luaL_argerror(L, 3, "family option must be string or integer");
+    }
+    luaL_argcheck(L, hints.ai_family == AF_UNSPEC || hints.ai_family == AF_INET ||
+                     hints.ai_family == AF_INET6, 3, "family must be inet or inet6");
+    lua_pop(L, 1);
+
+    lua_getfield(L, 3, "delay");
+    delay = luaL_optinteger(L, -1, delay);
+    lua_pop(L, 1);
+    // RFC 8305 section 5, attempts are never closer than 10 ms
+    if (delay < LUV_HAPPY_MIN_DELAY) delay = LUV_HAPPY_MIN_DELAY;
+
+    lua_getfield(L, 3, "timeout");
+    timeout = luaL_optinteger(L, -1, 0);
+    lua_pop(L, 1);
+    luaL_argcheck(L, timeout >= 0, 3, "timeout must not be negative");
+  }
+  luv_check_callable(L, 4);
+
+  happy = (luv_happy_t*)luv_malloc(sizeof(*happy), LUV_MEM_OTHER);
+  if (!happy) return luaL_error(L, "Can't allocate connect state");
+  memset(happy, 0, sizeof(*happy));
+  happy->ctx = ctx;
+  happy->port = port;
+  happy->delay_ms = delay;
+  happy->cb_ref = LUA_NOREF;
+  uv_timer_init(ctx->loop, &happy->delay.handle);
+  uv_timer_init(ctx->loop, &happy->timeout.handle);
+  luv_init_internal_handle((uv_handle_t*)&happy->delay.handle);
+  luv_init_internal_handle((uv_handle_t*)&happy->timeout.handle);
+  happy->delay.happy = happy;
+  happy->timeout.happy = happy;
+  happy->pending = 2;
+
+  ret = uv_getaddrinfo(ctx->loop, &happy->gai, luv_happy_getaddrinfo_cb, host, NULL, &hints);
+  if (ret < 0) {
+    happy->done = 1;
+    uv_close((uv_handle_t*)&happy->delay.handle, luv_happy_timer_close_cb);
+    uv_close((uv_handle_t*)&happy->timeout.handle, luv_happy_timer_close_cb);
+    return luv_error(L, ret);
+  }
+  luv_threadpool_submit(ctx, LUV_TP_GETADDRINFO, &happy->submitted);
+  happy->resolving = 1;
+  happy->pending++;
+  if (timeout > 0)
+    uv_timer_start(&happy->timeout.handle, luv_happy_timeout_cb, timeout, 0);
+  lua_pushvalue(L, 4);
+  happy->cb_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+  happy->anchor = luv_anchor_internal(L, happy, "luv_happy");
+  lua_pushboolean(L, 1);
+  return 1;
+}
+
+static void luv_tcp_init(lua_State* L) {
+  luaL_newmetatable(L, "luv_happy");
+  lua_pushcfunction(L, luv_happy_gc);
+  lua_setfield(L, -2, "__gc");
+  lua_pop(L, 1);
+}
@@ -62,6 +62,17 @@ static int luv_thread_arg_set(lua_State* L, luv_thread_arg_t* args, int idx, int
   int side = LUVF_THREAD_SIDE(flags);
   int async = LUVF_THREAD_ASYNC(flags);
 
+  // async arguments are set again before the other side took the last ones
+  if (async) {
+    for (i = 0; i < args->argc; i++) {
+      luv_val_t* arg = args->argv + i;
+      if (arg->type == LUV_THREAD_TSYNC && arg->val.udata.data) {
+        luv_sync_release((void*)arg->val.udata.data);
+        arg->val.udata.data = NULL;
+      }
+    }
+  }
+
   idx = idx > 0 ? idx : 1;
   i = idx;
   args->flags = flags;
@@ -84,7 +95,7 @@ static int luv_thread_arg_set(lua_State* L, luv_thread_arg_t* args, int idx, int
       if (async)
       {
         const char* p = lua_tolstring(L, i, &arg->val.str.len);
-        arg->val.str.base = malloc(arg->val.str.len);
+        arg->val.str.base = (const char*)luv_malloc(arg->val.str.len, LUV_MEM_THREAD_ARG);
         memcpy((void*)arg->val.str.base, p, arg->val.str.len);
       } else {
         arg->val.str.base = lua_tolstring(L, i, &arg->val.str.len);
@@ -93,6 +104,12 @@ static int luv_thread_arg_set(lua_State* L, luv_thread_arg_t* args, int idx, int
       }
       break;
     case LUA_TUSERDATA:
+      // the setting side may drop its own reference before the copy is made
+      arg->val.udata.data = luv_sync_retain(L, i);
+      if (arg->val.udata.data) {
+        arg->type = LUV_THREAD_TSYNC;
+        break;
+      }
       arg->val.udata.data = lua_topointer(L, i);
       arg->val.udata.size = lua_rawlen(L, i);
       arg->val.udata.metaname = luv_getmtname(L, i);
@@ -135,7 +152,7 @@ static void luv_thread_arg_clear(lua_State* L, luv_thread_arg_t* args, int flags
       } else {
         if(async && set!=side)
         {
-          free((void*)arg->val.str.base);
+          luv_free((void*)arg->val.str.base);
           arg->val.str.base = NULL;
           arg->val.str.len = 0;
         }
@@ -156,6 +173,13 @@ static void luv_thread_arg_clear(lua_State* L, luv_thread_arg_t* args, int flags
         arg->ref[side] = LUA_NOREF;
       }
       break;
+    case LUV_THREAD_TSYNC:
+      // the last clear releases the reference when no copy adopted it
+      if ((async ? side != set : side == set) && arg->val.udata.data) {
+        luv_sync_release((void*)arg->val.udata.data);
+        arg->val.udata.data = NULL;
+      }
+      break;
     default:
       break;
     }
@@ -198,6 +222,14 @@ static int luv_thread_arg_push(lua_State* L, luv_thread_arg_t* args, int flags)
         lua_pushlightuserdata(L, (void*)arg->val.udata.data);
       }
       break;
+    case LUV_THREAD_TSYNC:
+      if (arg->val.udata.data) {
+        luv_sync_push(L, (void*)arg->val.udata.data);
+        arg->val.udata.data = NULL;
+      } else {
+        lua_pushnil(L);
+      }
+      break;
     default:
       fprintf(stderr, "Error: thread arg not support type %s at %d",
         lua_typename(L, arg->type), i + 1);
@@ -253,7 +285,7 @@ static luv_thread_t* luv_check_thread(lua_State* L, int index) {
 
 static int luv_thread_gc(lua_State* L) {
   luv_thread_t* tid = luv_check_thread(L, 1);
-  free(tid->code);
+  luv_free(tid->code);
   tid->code = NULL;
   tid->len = 0;
   luv_thread_arg_clear(L, &tid->args, LUVF_THREAD_SIDE_MAIN);
@@ -318,7 +350,7 @@ static int luv_new_thread(lua_State* L) {
 
   luv_thread_dumped(L, cbidx);
   len = lua_rawlen(L, -1);
-  code = malloc(len);
+  code = (char*)luv_malloc(len, LUV_MEM_OTHER);
   memcpy(code, lua_tostring(L, -1), len);
 
   thread = (luv_thread_t*)lua_newuserdata(L, sizeof(*thread));
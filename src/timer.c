@@ -17,13 +17,13 @@
 #include "private.h"
 
 static uv_timer_t* luv_check_timer(lua_State* L, int index) {
-  uv_timer_t* handle = (uv_timer_t*) luv_checkudata(L, index, "uv_timer");
+  uv_timer_t* handle = (uv_timer_t*) luv_checkudata(L, index, UV_TIMER, "uv_timer");
   luaL_argcheck(L, handle->type == UV_TIMER && handle->data, index, "Expected uv_timer_t");
   return handle;
 }
 
 static int luv_new_timer(lua_State* L) {
-  luv_ctx_t* ctx = luv_context(L);
+  luv_ctx_t* ctx = luv_upvalue_context(L);
   uv_timer_t* handle = (uv_timer_t*) luv_newuserdata(L, sizeof(*handle));
   int ret = uv_timer_init(ctx->loop, handle);
   if (ret < 0) {
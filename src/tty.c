@@ -17,7 +17,7 @@
 #include "private.h"
 
 static uv_tty_t* luv_check_tty(lua_State* L, int index) {
-  uv_tty_t* handle = (uv_tty_t*)luv_checkudata(L, index, "uv_tty");
+  uv_tty_t* handle = (uv_tty_t*)luv_checkudata(L, index, UV_TTY, "uv_tty");
   luaL_argcheck(L, handle->type == UV_TTY && handle->data, index, "Expected uv_tty_t");
   return handle;
 }
@@ -25,7 +25,7 @@ static uv_tty_t* luv_check_tty(lua_State* L, int index) {
 static int luv_new_tty(lua_State* L) {
   int readable, ret;
   uv_tty_t* handle;
-  luv_ctx_t* ctx = luv_context(L);
+  luv_ctx_t* ctx = luv_upvalue_context(L);
   uv_file fd = luaL_checkinteger(L, 1);
   luaL_checktype(L, 2, LUA_TBOOLEAN);
   readable = lua_toboolean(L, 2);
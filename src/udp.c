@@ -17,13 +17,13 @@
 #include "private.h"
 
 static uv_udp_t* luv_check_udp(lua_State* L, int index) {
-  uv_udp_t* handle = (uv_udp_t*)luv_checkudata(L, index, "uv_udp");
+  uv_udp_t* handle = (uv_udp_t*)luv_checkudata(L, index, UV_UDP, "uv_udp");
   luaL_argcheck(L, handle->type == UV_UDP && handle->data, index, "Expected uv_udp_t");
   return handle;
 }
 
 static int luv_new_udp(lua_State* L) {
-  luv_ctx_t* ctx = luv_context(L);
+  luv_ctx_t* ctx = luv_upvalue_context(L);
   lua_settop(L, 1);
   uv_udp_t* handle = (uv_udp_t*)luv_newuserdata(L, sizeof(*handle));
   int ret;
@@ -101,11 +101,11 @@ static int luv_new_udp(lua_State* L) {
 #if LUV_UV_VERSION_GEQ(1, 39, 0)
   if (flags & UV_UDP_RECVMMSG) {
     // store the number of msgs to be received for use in alloc_cb
-    int* extra_data = malloc(sizeof(int));
+    int* extra_data = (int*)luv_malloc(sizeof(int), LUV_MEM_OTHER);
     assert(extra_data);
     *extra_data = mmsg_num_msgs;
     ((luv_handle_t*)handle->data)->extra = extra_data;
-    ((luv_handle_t*)handle->data)->extra_gc = free;
+    ((luv_handle_t*)handle->data)->extra_gc = luv_free;
   }
 #endif
   return 1;
@@ -247,6 +247,9 @@ static struct sockaddr* luv_check_addr(lua_State *L, struct sockaddr_storage* ad
   int port;
 #if LUV_UV_VERSION_GEQ(1, 27, 0)
   int host_type, port_type;
+  if (luv_test_sockaddr(L, hostidx, portidx, addr)) {
+    return (struct sockaddr*)addr;
+  }
   host_type = lua_type(L, hostidx);
   port_type = lua_type(L, portidx);
   if (host_type == LUA_TNIL && port_type == LUA_TNIL) {
@@ -274,6 +277,9 @@ static struct sockaddr* luv_check_addr(lua_State *L, struct sockaddr_storage* ad
     return NULL;
   }
 #else
+  if (luv_test_sockaddr(L, hostidx, portidx, addr)) {
+    return (struct sockaddr*)addr;
+  }
   host = luaL_checkstring(L, hostidx);
   port = luaL_checkinteger(L, portidx);
   if (uv_ip4_addr(host, port, (struct sockaddr_in*)addr) &&
@@ -299,7 +305,7 @@ static int luv_udp_send(lua_State* L) {
   size_t count;
   uv_buf_t* bufs = luv_check_bufs(L, 2, &count, (luv_req_t*)req->data);
   ret = uv_udp_send(req, handle, bufs, count, addr_ptr, luv_udp_send_cb);
-  free(bufs);
+  luv_free(bufs);
   if (ret < 0) {
     luv_cleanup_req(L, (luv_req_t*)req->data);
     lua_pop(L, 1);
@@ -315,11 +321,12 @@ static int luv_udp_try_send(lua_State* L) {
   struct sockaddr_storage addr;
   struct sockaddr* addr_ptr;
   size_t count;
-  uv_buf_t* bufs = luv_check_bufs_noref(L, 2, &count);
+  uv_buf_t buf;
+  uv_buf_t* bufs = luv_check_bufs_noref(L, 2, &count, &buf);
   addr_ptr = luv_check_addr(L, &addr, 3, 4);
   err_or_num_bytes = uv_udp_try_send(handle, bufs, count, addr_ptr);
-  free(bufs);
-  if (err_or_num_bytes < 0) return luv_error(L, err_or_num_bytes);
+  if (bufs != &buf) luv_free(bufs);
+  if (err_or_num_bytes < 0) return luv_try_error(L, err_or_num_bytes);
   lua_pushinteger(L, err_or_num_bytes);
   return 1;
 }
@@ -333,7 +340,7 @@ static void luv_udp_recv_cb(uv_udp_t* handle, ssize_t nread, const uv_buf_t* buf
   // and return early because we know the only purpose of this recv_cb call
   // is to free the buffer that was being used by recvmmsg
   if (flags & UV_UDP_MMSG_FREE) {
-    free(buf->base);
+    luv_free(buf->base);
     return;
   }
 #endif
@@ -365,10 +372,10 @@ static void luv_udp_recv_cb(uv_udp_t* handle, ssize_t nread, const uv_buf_t* buf
   // UV_UDP_MMSG_CHUNK Indicates that the message was received by recvmmsg, so the buffer provided
   // must not be freed by the recv_cb callback.
   if (buf && !(flags & UV_UDP_MMSG_CHUNK)) {
-    free(buf->base);
+    luv_free(buf->base);
   }
 #else
-  if (buf) free(buf->base);
+  if (buf) luv_free(buf->base);
 #endif
 
   // address
@@ -400,11 +407,13 @@ static void luv_udp_recv_cb(uv_udp_t* handle, ssize_t nread, const uv_buf_t* buf
 
 static void luv_udp_alloc_cb(uv_handle_t* handle, size_t suggested_size, uv_buf_t* buf) {
   size_t buffer_size = suggested_size;
+  luv_mem_category category = LUV_MEM_READ_BUF;
   if (uv_udp_using_recvmmsg((uv_udp_t*)handle)) {
     int num_msgs = *(int*)(((luv_handle_t*)handle->data)->extra);
     buffer_size = MAX_DGRAM_SIZE * num_msgs;
+    category = LUV_MEM_MMSG_BUF;
   }
-  buf->base = (char*)malloc(buffer_size);
+  buf->base = (char*)luv_malloc(buffer_size, category);
   assert(buf->base);
   buf->len = buffer_size;
 }
@@ -47,6 +47,56 @@ static int luv_error(lua_State* L, int status) {
   return 3;
 }
 
+static const char *const luv_try_error_modes[] = {
+  "message", "name", "code", NULL
+};
+
+// Pushes the name of status from a registry table keyed by status. Only the
+// first failure with a given code creates the string, so the later ones don't
+// allocate.
+static void luv_push_try_name(lua_State* L, luv_ctx_t* ctx, int status) {
+  lua_rawgeti(L, LUA_REGISTRYINDEX, ctx->try_names_ref);
+  lua_rawgeti(L, -1, status);
+  if (lua_isnil(L, -1)) {
+    lua_pop(L, 1);
+    lua_pushstring(L, uv_err_name(status));
+    lua_pushvalue(L, -1);
+    lua_rawseti(L, -3, status);
+  }
+  lua_remove(L, -2);
+}
+
+// Failure of the non-blocking try_* calls, where EAGAIN is an expected result
+// on the hot path. Depending on the mode set with uv.set_try_error_mode this
+// is the usual fail tuple, `nil, name` with the name cached per error code, or
+// the bare negative error code, the last two don't allocate.
+static int luv_try_error(lua_State* L, int status) {
+  luv_ctx_t* ctx = luv_upvalue_context(L);
+  switch (ctx->try_errors) {
+    case LUV_TRY_ERRORS_CODE:
+      lua_pushinteger(L, status);
+      return 1;
+    case LUV_TRY_ERRORS_NAME:
+      lua_pushnil(L);
+      luv_push_try_name(L, ctx, status);
+      return 2;
+    default:
+      return luv_error(L, status);
+  }
+}
+
+static int luv_set_try_error_mode(lua_State* L) {
+  luv_ctx_t* ctx = luv_upvalue_context(L);
+  int mode = luaL_checkoption(L, 1, NULL, luv_try_error_modes);
+  if (mode == LUV_TRY_ERRORS_NAME && !ctx->try_names_ref) {
+    lua_newtable(L);
+    ctx->try_names_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+  }
+  lua_pushstring(L, luv_try_error_modes[ctx->try_errors]);
+  ctx->try_errors = mode;
+  return 1;
+}
+
 static int luv_result(lua_State* L, int status) {
   if (status < 0) return luv_error(L, status);
   lua_pushinteger(L, status);
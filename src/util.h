@@ -25,6 +25,13 @@
 #define LUV_UV_VERSION_LEQ(major, minor, patch) \
   (((major)<<16 | (minor)<<8 | (patch)) >= UV_VERSION_HEX)
 
+/* Modes of uv.set_try_error_mode, indexes of luv_try_error_modes */
+enum {
+  LUV_TRY_ERRORS_MESSAGE = 0,
+  LUV_TRY_ERRORS_NAME,
+  LUV_TRY_ERRORS_CODE
+};
+
 void luv_stack_dump(lua_State* L, const char* name);
 
 #endif
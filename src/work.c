@@ -16,22 +16,47 @@
 */
 #include "private.h"
 
+struct luv_work_s;
+
+/* A vm dedicated to the keys hashing to it, see queue_keyed */
+typedef struct {
+  lua_State* L;       /* created with the first job */
+  int busy;           /* a job of the slot is queued or running */
+  struct luv_work_s* head;  /* jobs waiting for the vm */
+  struct luv_work_s* tail;
+} luv_work_slot_t;
+
 typedef struct {
   lua_State* L;       /* vm in main */
   char* code;         /* thread entry code */
   size_t len;
+  char* init_code;    /* run once in every vm of the ctx, or NULL */
+  size_t init_len;
+  int64_t init_id;    /* tells apart contexts reusing a freed address */
 
   int after_work_cb;  /* ref, run in main ,call after work cb*/
   int pool_ref;       /* ref of lua_State cache array */
+
+  luv_work_slot_t* slots;
+  int nslots;
+
+  int pending;        /* jobs queued or running, each refs the ctx */
+  int dead;           /* collected at lua_close with jobs still pending */
 } luv_work_ctx_t;
 
-typedef struct {
+typedef struct luv_work_s {
   uv_work_t work;
   luv_work_ctx_t* ctx;
+  luv_work_slot_t* slot;    /* NULL for jobs on any pooled vm */
+  struct luv_work_s* next;  /* in the queue of the slot */
 
   luv_thread_arg_t args;
   luv_thread_arg_t rets;
   int ref;            /* ref to luv_work_ctx_t, which create a new uv_work_t*/
+
+  uint64_t submitted; /* uv_hrtime() at luv_queue_work */
+  uint64_t started;   /* uv_hrtime() when a worker picked it up */
+  uint64_t finished;  /* uv_hrtime() when the worker was done */
 } luv_work_t;
 
 static luv_work_ctx_t* luv_check_work_ctx(lua_State* L, int index) {
@@ -39,12 +64,29 @@ static luv_work_ctx_t* luv_check_work_ctx(lua_State* L, int index) {
   return ctx;
 }
 
+// Frees what the jobs share, once none of them is left
+static void luv_work_ctx_free(luv_work_ctx_t* ctx) {
+  int i;
+  for (i = 0; i < ctx->nslots; i++) {
+    if (ctx->slots[i].L) release_vm_cb(ctx->slots[i].L);
+  }
+  luv_free(ctx->slots);
+  ctx->slots = NULL;
+  luv_free(ctx->code);
+  luv_free(ctx->init_code);
+}
+
 static int luv_work_ctx_gc(lua_State *L) {
   int i, n;
   luv_work_ctx_t* ctx = luv_check_work_ctx(L, 1);
-  free(ctx->code);
   luaL_unref(L, LUA_REGISTRYINDEX, ctx->after_work_cb);
 
+  // Pending jobs ref the ctx, so it only goes with some left at lua_close.
+  // Workers may still run their vms then, the last job to complete frees
+  // the code and the slots.
+  if (ctx->pending) ctx->dead = 1;
+  else luv_work_ctx_free(ctx);
+
   lua_rawgeti(L, LUA_REGISTRYINDEX, ctx->pool_ref);
   n = lua_rawlen(L, -1);
   for (i=1; i<=n; i++) {
@@ -64,12 +106,47 @@ static int luv_work_ctx_tostring(lua_State* L) {
   return 1;
 }
 
+static int64_t luv_work_init_ids;
+
+// Runs the init code of ctx the first time L is used for it. VMs from a
+// luv_set_thread_cb hook may serve several contexts, the registry table
+// "luv_work_init" maps each ctx address to the id of the ctx it ran for.
+static void luv_work_init_vm(lua_State* L, luv_work_ctx_t* ctx) {
+  lua_getfield(L, LUA_REGISTRYINDEX, "luv_work_init");
+  if (lua_isnil(L, -1)) {
+    lua_pop(L, 1);
+    lua_newtable(L);
+    lua_pushvalue(L, -1);
+    lua_setfield(L, LUA_REGISTRYINDEX, "luv_work_init");
+  }
+  lua_pushlightuserdata(L, ctx);
+  lua_rawget(L, -2);
+  if (lua_tonumber(L, -1) == (lua_Number)ctx->init_id) {
+    lua_pop(L, 2);
+    return;
+  }
+  lua_pop(L, 1);
+  lua_pushlightuserdata(L, ctx);
+  lua_pushnumber(L, (lua_Number)ctx->init_id);
+  lua_rawset(L, -3);
+  lua_pop(L, 1);
+  if (luaL_loadbuffer(L, ctx->init_code, ctx->init_len, "=init") != 0) {
+    fprintf(stderr, "Uncaught Error in work init callback: %s\n", lua_tostring(L, -1));
+    lua_pop(L, 1);
+    return;
+  }
+  luv_cfpcall(L, 0, 0, 0);
+}
+
 static void luv_work_cb(uv_work_t* req) {
   luv_work_t* work = (luv_work_t*)req->data;
   luv_work_ctx_t* ctx = work->ctx;
   lua_State *L = work->args.L;
 
   int top = lua_gettop(L);
+  work->started = uv_hrtime();
+
+  if (ctx->init_code) luv_work_init_vm(L, ctx);
 
   /* push lua function */
   lua_pushlstring(L, ctx->code, ctx->len);
@@ -109,10 +186,50 @@ static void luv_work_cb(uv_work_t* req) {
     luv_thread_arg_clear(L, &work->args, LUVF_THREAD_SIDE_CHILD);
   }
   work->args.L = L;
+  work->finished = uv_hrtime();
   if (top!=lua_gettop(L))
     luaL_error(L, "stack not balance in luv_work_cb, need %d but %d", top, lua_gettop(L));
 }
 
+static void luv_after_work_cb(uv_work_t* req, int status);
+
+static int luv_work_submit(lua_State* L, luv_work_t* work) {
+  int ret;
+  work->work.data = work;
+  // taken before queueing, a worker may pick it up right away
+  work->submitted = uv_hrtime();
+  work->started = work->finished = 0;
+  // the job may fail before setting them, after_work still pushes them
+  work->rets.argc = 0;
+  ret = uv_queue_work(luv_loop(L), &work->work, luv_work_cb, luv_after_work_cb);
+  if (ret < 0) return ret;
+  luv_threadpool_submit(luv_context(L), LUV_TP_WORK, &work->submitted);
+  return 0;
+}
+
+// Frees a job that won't run, or ran for a ctx collected meanwhile
+static void luv_work_drop(lua_State* L, luv_work_t* work) {
+  work->ctx->pending--;
+  luaL_unref(L, LUA_REGISTRYINDEX, work->ref);
+  luv_thread_arg_clear(L, &work->args, LUVF_THREAD_SIDE_MAIN);
+  luv_free(work);
+}
+
+// The vm of a slot runs one job at a time, the next one waits for it
+static void luv_work_slot_next(lua_State* L, luv_work_slot_t* slot) {
+  while (slot->head) {
+    luv_work_t* work = slot->head;
+    int ret;
+    slot->head = work->next;
+    if (!slot->head) slot->tail = NULL;
+    ret = luv_work_submit(L, work);
+    if (ret == 0) return;
+    fprintf(stderr, "Error: can't queue keyed work: %s\n", uv_strerror(ret));
+    luv_work_drop(L, work);
+  }
+  slot->busy = 0;
+}
+
 static void luv_after_work_cb(uv_work_t* req, int status) {
   luv_work_t* work = (luv_work_t*)req->data;
   luv_work_ctx_t* ctx = work->ctx;
@@ -121,46 +238,81 @@ static void luv_after_work_cb(uv_work_t* req, int status) {
 
   (void)status;
 
+  luv_threadpool_complete(luv_context(L), LUV_TP_WORK, work->submitted,
+                          work->started, work->finished);
+  if (ctx->dead) {
+    // no callback, the jobs still waiting for the vm are dropped
+    luv_work_slot_t* slot = work->slot;
+    luv_thread_arg_clear(L, &work->rets, LUVF_THREAD_MODE_ASYNC|LUVF_THREAD_SIDE_MAIN);
+    if (!slot) release_vm_cb(work->args.L);
+    luv_work_drop(L, work);
+    if (slot) {
+      while (slot->head) {
+        work = slot->head;
+        slot->head = work->next;
+        luv_work_drop(L, work);
+      }
+      slot->tail = NULL;
+      slot->busy = 0;
+    }
+    if (!ctx->pending) luv_work_ctx_free(ctx);
+    return;
+  }
   lua_rawgeti(L, LUA_REGISTRYINDEX, ctx->after_work_cb);
   i = luv_thread_arg_push(L, &work->rets, LUVF_THREAD_SIDE_MAIN);
   luv_cfpcall(L, i, 0, 0);
 
-  //cache lua_State to reuse
-  lua_rawgeti(L, LUA_REGISTRYINDEX, ctx->pool_ref);
-  i = lua_rawlen(L, -1);
-  *(lua_State**)lua_newuserdata(L, sizeof(lua_State*)) = work->args.L;
-  lua_rawseti(L, -2, i+1);
-  lua_pop(L, 1);
-
-  //ref down to ctx, up in luv_queue_work()
-  luaL_unref(L, LUA_REGISTRYINDEX, work->ref);
-  work->ref = LUA_NOREF;
+  if (work->slot) {
+    // the vm stays with its slot
+    luv_work_slot_next(L, work->slot);
+  } else {
+    //cache lua_State to reuse
+    lua_rawgeti(L, LUA_REGISTRYINDEX, ctx->pool_ref);
+    i = lua_rawlen(L, -1);
+    *(lua_State**)lua_newuserdata(L, sizeof(lua_State*)) = work->args.L;
+    lua_rawseti(L, -2, i+1);
+    lua_pop(L, 1);
+  }
 
-  luv_thread_arg_clear(L, &work->args, LUVF_THREAD_SIDE_MAIN);
   luv_thread_arg_clear(L, &work->rets, LUVF_THREAD_MODE_ASYNC|LUVF_THREAD_SIDE_MAIN);
-  free(work);
+  //ref down to ctx, up in luv_queue_work()
+  luv_work_drop(L, work);
 }
 
 static int luv_new_work(lua_State* L) {
-  size_t len;
+  size_t len, init_len = 0;
   char* code;
+  char* init_code = NULL;
   luv_work_ctx_t* ctx;
 
   luv_thread_dumped(L, 1);
   len = lua_rawlen(L, -1);
-  code = malloc(len);
+  code = (char*)luv_malloc(len, LUV_MEM_OTHER);
   memcpy(code, lua_tostring(L, -1), len);
   lua_pop(L, 1);
 
   luaL_checktype(L, 2, LUA_TFUNCTION);
-  if(!lua_isnoneornil(L, 3))
+  if(!lua_isnoneornil(L, 3)) {
     luaL_checktype(L, 3, LUA_TFUNCTION);
+    luv_thread_dumped(L, 3);
+    init_len = lua_rawlen(L, -1);
+    init_code = (char*)luv_malloc(init_len, LUV_MEM_OTHER);
+    if (!init_code) {
+      luv_free(code);
+      return luaL_error(L, "Can't allocate work init code");
+    }
+    memcpy(init_code, lua_tostring(L, -1), init_len);
+    lua_pop(L, 1);
+  }
 
   ctx = (luv_work_ctx_t*)lua_newuserdata(L, sizeof(*ctx));
   memset(ctx, 0, sizeof(*ctx));
 
   ctx->len = len;
   ctx->code = code;
+  ctx->init_len = init_len;
+  ctx->init_code = init_code;
+  if (init_code) ctx->init_id = luv_atomic_add(&luv_work_init_ids, 1);
 
   lua_pushvalue(L, 2);
   ctx->after_work_cb = luaL_ref(L, LUA_REGISTRYINDEX);
@@ -178,7 +330,7 @@ static int luv_new_work(lua_State* L) {
 static int luv_queue_work(lua_State* L) {
   int top = lua_gettop(L);
   luv_work_ctx_t* ctx = luv_check_work_ctx(L, 1);
-  luv_work_t* work = (luv_work_t*)malloc(sizeof(*work));
+  luv_work_t* work = (luv_work_t*)luv_malloc(sizeof(*work), LUV_MEM_OTHER);
   int ret, n;
 
   //prepare lua_State for threadpool
@@ -202,16 +354,106 @@ static int luv_queue_work(lua_State* L) {
 
   luv_thread_arg_set(L, &work->args, 2, top, LUVF_THREAD_SIDE_MAIN); //clear in sub threads,luv_work_cb
   work->ctx = ctx;
-  work->work.data = work;
-  ret = uv_queue_work(luv_loop(L), &work->work, luv_work_cb, luv_after_work_cb);
+  work->slot = NULL;
+  ret = luv_work_submit(L, work);
   if (ret < 0) {
-    free(work);
+    luv_thread_arg_clear(L, &work->args, LUVF_THREAD_SIDE_MAIN);
+    luv_free(work);
     return luv_error(L, ret);
   }
 
   //ref up to ctx
   lua_pushvalue(L, 1);
   work->ref = luaL_ref(L, LUA_REGISTRYINDEX);
+  ctx->pending++;
+
+  lua_pushboolean(L, 1);
+  return 1;
+}
+
+// FNV-1a of the key, numbers by value
+static uint32_t luv_work_key_hash(lua_State* L, int index) {
+  const unsigned char* p;
+  uint32_t hash = 2166136261u;
+  lua_Number n;
+  size_t len, i;
+  switch (lua_type(L, index)) {
+    case LUA_TNUMBER:
+      n = lua_tonumber(L, index);
+      if (n == 0) n = 0;  // -0
+      p = (const unsigned char*)&n;
+      len = sizeof(n);
+      break;
+    case LUA_TSTRING:
+      p = (const unsigned char*)lua_tolstring(L, index, &len);
+      break;
+    default:
+      luaL_argerror(L, index, "expected string or number");
+      return 0;
+  }
+  for (i = 0; i < len; i++) {
+    hash ^= p[i];
+    hash *= 16777619u;
+  }
+  return hash;
+}
+
+// One slot per threadpool thread, as many keys can run in parallel
+static int luv_work_slots(luv_work_ctx_t* ctx) {
+  char buf[16];
+  size_t size = sizeof(buf);
+  int n = 4;
+  if (uv_os_getenv("UV_THREADPOOL_SIZE", buf, &size) == 0) n = atoi(buf);
+  if (n < 1) n = 1;
+  if (n > 1024) n = 1024;
+  ctx->slots = (luv_work_slot_t*)luv_malloc(n * sizeof(*ctx->slots), LUV_MEM_OTHER);
+  if (!ctx->slots) return UV_ENOMEM;
+  memset(ctx->slots, 0, n * sizeof(*ctx->slots));
+  ctx->nslots = n;
+  return 0;
+}
+
+static int luv_queue_keyed_work(lua_State* L) {
+  int top = lua_gettop(L);
+  luv_work_ctx_t* ctx = luv_check_work_ctx(L, 1);
+  uint32_t hash = luv_work_key_hash(L, 2);
+  luv_work_slot_t* slot;
+  luv_work_t* work;
+  int ret;
+
+  if (!ctx->slots) {
+    ret = luv_work_slots(ctx);
+    if (ret < 0) return luv_error(L, ret);
+  }
+  slot = &ctx->slots[hash % (uint32_t)ctx->nslots];
+  if (!slot->L) slot->L = acquire_vm_cb();
+
+  work = (luv_work_t*)luv_malloc(sizeof(*work), LUV_MEM_OTHER);
+  if (!work) return luv_error(L, UV_ENOMEM);
+  work->args.L = slot->L;
+  luv_thread_arg_set(L, &work->args, 3, top, LUVF_THREAD_SIDE_MAIN); //clear in sub threads,luv_work_cb
+  work->ctx = ctx;
+  work->slot = slot;
+  work->next = NULL;
+
+  if (slot->busy) {
+    if (slot->tail) slot->tail->next = work;
+    else slot->head = work;
+    slot->tail = work;
+  } else {
+    ret = luv_work_submit(L, work);
+    if (ret < 0) {
+      luv_thread_arg_clear(L, &work->args, LUVF_THREAD_SIDE_MAIN);
+      luv_free(work);
+      return luv_error(L, ret);
+    }
+    slot->busy = 1;
+  }
+
+  //ref up to ctx
+  lua_pushvalue(L, 1);
+  work->ref = luaL_ref(L, LUA_REGISTRYINDEX);
+  ctx->pending++;
 
   lua_pushboolean(L, 1);
   return 1;
@@ -219,6 +461,7 @@ static int luv_queue_work(lua_State* L) {
 
 static const luaL_Reg luv_work_ctx_methods[] = {
   {"queue", luv_queue_work},
+  {"queue_keyed", luv_queue_keyed_work},
   {NULL, NULL}
 };
 
@@ -0,0 +1,200 @@
+/*
+ *  Copyright 2014 The Luvit Authors. All Rights Reserved.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ */
+
+/* Embeds luv with a pool allocator installed through luv_set_allocator and
+   checks that luv and libuv allocations are served by it.
+
+   Build with -DBUILD_EMBED_TESTS=ON and run ./build/test-allocator
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <lua.h>
+#include <lauxlib.h>
+#include <lualib.h>
+
+#include "luv.h"
+
+/* assert() is gone in release builds, these checks have to run anyway */
+#define CHECK(expr) \
+  do { \
+    if (!(expr)) { \
+      fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #expr); \
+      abort(); \
+    } \
+  } while (0)
+
+#define POOL_ARENA_SIZE (64 * 1024 * 1024)
+#define POOL_MIN_SIZE 16
+#define POOL_CLASSES 16 /* 16 bytes to 512 KiB */
+
+typedef struct pool_block_s {
+  struct pool_block_s* next;
+} pool_block_t;
+
+/* Bump allocator over a fixed arena with per size class free lists */
+typedef struct {
+  uv_mutex_t mutex;
+  char* arena;
+  size_t used;
+  pool_block_t* free_list[POOL_CLASSES];
+  size_t allocs;
+  size_t frees;
+  size_t reused;
+  size_t live;
+} pool_t;
+
+static int pool_class(size_t size) {
+  int c = 0;
+  size_t block = POOL_MIN_SIZE;
+  while (block < size) {
+    block <<= 1;
+    c++;
+  }
+  return c;
+}
+
+static void* pool_malloc(void* ud, size_t size) {
+  pool_t* pool = (pool_t*)ud;
+  int c = pool_class(size);
+  size_t block = (size_t)POOL_MIN_SIZE << c;
+  void* ptr = NULL;
+  if (c >= POOL_CLASSES) return NULL;
+  uv_mutex_lock(&pool->mutex);
+  if (pool->free_list[c]) {
+    ptr = pool->free_list[c];
+    pool->free_list[c] = pool->free_list[c]->next;
+    pool->reused++;
+  } else if (pool->used + block <= POOL_ARENA_SIZE) {
+    ptr = pool->arena + pool->used;
+    pool->used += block;
+  }
+  if (ptr) {
+    pool->allocs++;
+    pool->live++;
+  }
+  uv_mutex_unlock(&pool->mutex);
+  return ptr;
+}
+
+static void pool_free(void* ud, void* ptr, size_t size) {
+  pool_t* pool = (pool_t*)ud;
+  pool_block_t* block = (pool_block_t*)ptr;
+  int c = pool_class(size);
+  CHECK((char*)ptr >= pool->arena && (char*)ptr < pool->arena + POOL_ARENA_SIZE);
+  uv_mutex_lock(&pool->mutex);
+  block->next = pool->free_list[c];
+  pool->free_list[c] = block;
+  pool->frees++;
+  pool->live--;
+  uv_mutex_unlock(&pool->mutex);
+}
+
+static const char* script =
+  "local uv = ...\n"
+  "local before = uv.memory_stats()\n"
+  // handles churn through the pool
+  "for i = 1, 100 do\n"
+  "  local timer = uv.new_timer()\n"
+  "  timer:start(0, 0, function () timer:close() end)\n"
+  "end\n"
+  "uv.run()\n"
+  "collectgarbage()\n"
+  "collectgarbage()\n"
+  // streams, threadpool and fs requests
+  "local server = uv.new_tcp()\n"
+  "assert(server:bind('127.0.0.1', 0))\n"
+  "assert(server:listen(128, function (err)\n"
+  "  assert(not err, err)\n"
+  "  local client = uv.new_tcp()\n"
+  "  server:accept(client)\n"
+  "  client:read_start(function (err, data)\n"
+  "    assert(not err, err)\n"
+  "    if data then client:write(data) else client:close() end\n"
+  "  end)\n"
+  "end))\n"
+  "local echoed = ''\n"
+  "local socket = uv.new_tcp()\n"
+  "socket:connect('127.0.0.1', server:getsockname().port, function (err)\n"
+  "  assert(not err, err)\n"
+  "  socket:read_start(function (err, data)\n"
+  "    assert(not err, err)\n"
+  "    echoed = echoed .. data\n"
+  "    if #echoed == 4 then\n"
+  "      socket:close()\n"
+  "      server:close()\n"
+  "    end\n"
+  "  end)\n"
+  "  socket:write('ping')\n"
+  "end)\n"
+  "local work = uv.new_work(function (a, b) return a + b end,\n"
+  "  function (sum) assert(sum == 3) end)\n"
+  "work:queue(1, 2)\n"
+  "uv.fs_stat('.', function (err, stat) assert(not err, err) end)\n"
+  "local during = uv.memory_stats()\n"
+  "assert(during.bytes > before.bytes)\n"
+  "uv.run()\n"
+  "assert(echoed == 'ping')\n"
+  "return uv.memory_stats().libuv.count\n";
+
+int main(int argc, char* argv[]) {
+  static pool_t pool;
+  lua_State* L;
+  int ret;
+  (void)argc;
+  (void)argv;
+
+  pool.arena = (char*)malloc(POOL_ARENA_SIZE);
+  CHECK(pool.arena);
+  ret = uv_mutex_init(&pool.mutex);
+  CHECK(ret == 0);
+  ret = luv_set_allocator(pool_malloc, NULL, &pool, 0);
+  CHECK(ret == UV_EINVAL);
+  ret = luv_set_allocator(pool_malloc, pool_free, &pool, LUV_ALLOCATOR_REPLACE_UV);
+  CHECK(ret == 0);
+
+  L = luaL_newstate();
+  luaL_openlibs(L);
+  lua_pushcfunction(L, luaopen_luv);
+  lua_call(L, 0, 1);
+
+  ret = luaL_loadstring(L, script);
+  if (ret == 0) {
+    lua_insert(L, -2);
+    ret = lua_pcall(L, 1, 1, 0);
+  }
+  if (ret != 0) {
+    fprintf(stderr, "%s\n", lua_tostring(L, -1));
+    return EXIT_FAILURE;
+  }
+  printf("libuv blocks: %d\n", (int)lua_tointeger(L, -1));
+  lua_pop(L, 1);
+
+  /* closed handles not collected yet and libuv's loop internals */
+  CHECK(pool.live > 0);
+  ret = luv_set_allocator(NULL, NULL, NULL, 0);
+  CHECK(ret == UV_EBUSY);
+  CHECK(pool.allocs > 0);
+  CHECK(pool.reused > 0);
+
+  lua_close(L);
+  printf("allocs: %u, frees: %u, reused: %u, live: %u, arena used: %u\n",
+         (unsigned)pool.allocs, (unsigned)pool.frees, (unsigned)pool.reused,
+         (unsigned)pool.live, (unsigned)pool.used);
+  return EXIT_SUCCESS;
+}
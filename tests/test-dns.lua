@@ -165,4 +165,134 @@ return require('lib/tap')(function (test)
     end)))
   end)
 
+  test("getaddrinfo cache", function (print, p, expect, uv)
+    assert(uv.getaddrinfo_cache({ ttl = 60000, negative_ttl = 60000, max_entries = 2 }))
+    local hints = { family = "inet", numerichost = true }
+
+    -- sync: miss then hit
+    local first = assert(uv.getaddrinfo("127.0.0.1", nil, hints))
+    local second = assert(uv.getaddrinfo("127.0.0.1", nil, hints))
+    assert(first ~= second and second[1].addr == "127.0.0.1")
+    local stats = uv.getaddrinfo_cache_stats()
+    p(stats)
+    assert(stats.misses == 1 and stats.hits == 1 and stats.entries == 1)
+
+    -- failures about the name are cached too
+    local _, _, err = uv.getaddrinfo("not an address", nil, hints)
+    local _, _, again = uv.getaddrinfo("not an address", nil, hints)
+    assert(err and err == again)
+    assert(uv.getaddrinfo_cache_stats().negative_hits == 1)
+
+    -- async: the second lookup waits on the first
+    local req = uv.getaddrinfo("127.0.0.2", nil, hints, expect(function (err, res)
+      assert(not err, err)
+      assert(res[1].addr == "127.0.0.2")
+    end))
+    assert(type(req) == "userdata")
+    local results = {}
+    assert(uv.getaddrinfo("127.0.0.2", nil, hints, expect(function (err, res)
+      assert(not err, err)
+      results[#results + 1] = res
+      assert(uv.getaddrinfo_cache_stats().coalesced == 1)
+
+      -- a hit is delivered from the loop, not from the call
+      local called = false
+      assert(uv.getaddrinfo("127.0.0.2", nil, hints, expect(function (err, res)
+        assert(not err, err)
+        called = true
+        assert(res ~= results[1] and res[1].addr == "127.0.0.2")
+
+        -- max_entries is 2, 127.0.0.1 was used least recently
+        stats = uv.getaddrinfo_cache_stats(true)
+        p(stats)
+        assert(stats.entries == 2 and stats.evictions == 1)
+        assert(uv.getaddrinfo_cache())
+        assert(uv.getaddrinfo_cache_stats().entries == 0)
+        assert(uv.getaddrinfo_cache_stats().hits == 0)
+      end)) == true)
+      assert(not called)
+    end)) == true)
+  end, "1.3.0")
+
+  test("getaddrinfo cache cancel", function (print, p, expect, uv)
+    assert(uv.getaddrinfo_cache({ ttl = 60000 }))
+    local hints = { family = "inet", numerichost = true }
+    local canceled
+    local req = uv.getaddrinfo("127.0.0.3", nil, hints, expect(function (err, res)
+      assert(canceled == (err == "ECANCELED"), err)
+      assert(err or res[1].addr == "127.0.0.3")
+    end))
+    assert(uv.getaddrinfo("127.0.0.3", nil, hints, expect(function (err, res)
+      -- the waiter doesn't share the cancel of the first caller
+      assert(not err, err)
+      assert(res[1].addr == "127.0.0.3")
+      assert(uv.getaddrinfo_cache())
+    end)) == true)
+    -- fails when a worker picked the lookup up already
+    canceled = uv.cancel(req) == 0
+  end, "1.3.0")
+
+  test("getaddrinfo_many", function (print, p, expect, uv)
+    local hosts = { "127.0.0.1", "not an address", "127.0.0.2", "127.0.0.1", "127.0.0.3" }
+    local called = false
+    assert(uv.getaddrinfo_many(hosts, { family = "inet", socktype = "stream", numerichost = true }, { concurrency = 2 },
+      expect(function (err, results)
+        p(err, results)
+        called = true
+        assert(not err, err)
+        assert(results["127.0.0.1"][1].addr == "127.0.0.1")
+        assert(results["127.0.0.3"][1].addr == "127.0.0.3")
+        assert(type(results["not an address"]) == "string")
+        local count = 0
+        for _ in pairs(results) do count = count + 1 end
+        assert(count == 4)
+      end)) == true)
+    assert(not called)
+
+    -- an empty list still calls back from the loop
+    assert(uv.getaddrinfo_many({}, nil, nil, expect(function (err, results)
+      assert(not err and next(results) == nil)
+    end)))
+  end, "1.3.0")
+
+  test("getaddrinfo compact results", function (print, p, expect, uv)
+    local ips = assert(uv.getaddrinfo("127.0.0.1", "80", { numerichost = true, result = "ip" }))
+    p(ips)
+    assert(#ips == 1 and ips[1] == "127.0.0.1")
+
+    local addrs = assert(uv.getaddrinfo("127.0.0.1", "80", { numerichost = true, result = "sockaddr" }))
+    local addr = addrs[1]
+    p(addrs, addr)
+    assert(#addrs == 1 and tostring(addr) == "uv_sockaddr: 127.0.0.1:80")
+    assert(addr.family == "inet" and addr.ip == "127.0.0.1" and addr.port == 80)
+    assert(addr == uv.getaddrinfo("127.0.0.1", "80", { numerichost = true, result = "sockaddr" })[1])
+
+    -- usable in place of host, with the port overridden
+    local server = uv.new_tcp()
+    assert(server:bind("127.0.0.1", 0))
+    local port = server:getsockname().port
+    assert(server:listen(1, expect(function ()
+      server:close()
+    end)))
+    local client = uv.new_tcp()
+    assert(client:connect(addr, port, expect(function (err)
+      assert(not err, err)
+      assert(client:getpeername().port == port)
+      client:close()
+    end)))
+
+    local receiver = uv.new_udp()
+    assert(receiver:bind("127.0.0.1", 0))
+    local sender = uv.new_udp()
+    assert(receiver:recv_start(expect(function (err, data)
+      assert(not err, err)
+      assert(data == "ping")
+      receiver:close()
+      sender:close()
+    end)))
+    assert(sender:send("ping", addr, receiver:getsockname().port, expect(function (err)
+      assert(not err, err)
+    end)))
+  end, "1.3.0")
+
 end)
@@ -13,4 +13,45 @@ return require('lib/tap')(function (test)
     pipe:close()
   end, "1.19.0")
 
+  test("handle type checks", function (print, p, expect, uv)
+    local timer = uv.new_timer()
+    local tcp = uv.new_tcp()
+
+    assert(uv.is_writable(tcp) == false)
+    assert(uv.is_active(timer) == false)
+
+    -- a timer is a handle but not a stream
+    local ok, err = pcall(uv.is_writable, timer)
+    p(err)
+    assert(not ok and err:find("Expected uv_stream userdata"))
+    ok, err = pcall(uv.timer_again, tcp)
+    p(err)
+    assert(not ok and err:find("uv_timer expected"))
+
+    -- userdata that isn't a luv handle
+    ok, err = pcall(uv.is_active, io.stdout)
+    p(err)
+    assert(not ok and err:find("Expected uv_handle userdata"))
+
+    timer:close()
+    tcp:close()
+  end)
+
+  test("replaced callbacks are released", function (print, p, expect, uv)
+    local timer = uv.new_timer()
+    local weak = setmetatable({}, { __mode = "v" })
+    weak[1] = setmetatable({}, { __call = function ()
+      error("replaced callback called")
+    end })
+    timer:start(10, 0, weak[1])
+    timer:start(10, 0, expect(function ()
+      timer:close(expect(function ()
+        collectgarbage()
+        collectgarbage()
+        -- the handle no longer holds on to the replaced callback
+        assert(weak[1] == nil)
+      end))
+    end))
+  end)
+
 end)
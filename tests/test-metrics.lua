@@ -0,0 +1,90 @@
+return require('lib/tap')(function (test)
+
+  test("threadpool stats for fs requests", function (print, p, expect, uv)
+    uv.threadpool_stats(true)
+    assert(uv.fs_stat("tests", expect(function (err, stat)
+      assert(not err, err)
+      local stats = uv.threadpool_stats()
+      p(stats.fs)
+      assert(stats.fs.submitted == 1)
+      assert(stats.fs.completed == 1)
+      assert(stats.fs.total.count == 1)
+      -- libuv does not report when a worker picked up a fs request
+      assert(stats.fs.wait.count == 0)
+    end)))
+    local stats = uv.threadpool_stats()
+    assert(stats.fs.inflight == 1)
+    assert(stats.inflight >= 1)
+    -- sync calls are not counted
+    assert(uv.fs_stat("tests"))
+    assert(uv.threadpool_stats().fs.submitted == 1)
+  end)
+
+  test("threadpool stats for work requests", function (print, p, expect, uv)
+    uv.threadpool_stats(true)
+    local count = 4
+    local work
+    work = uv.new_work(function (n)
+      require('luv').sleep(10)
+      return n
+    end, expect(function ()
+      local stats = uv.threadpool_stats()
+      if stats.work.completed < count then return end
+      p(stats.work)
+      assert(stats.work.inflight == 0)
+      assert(stats.work.wait.count == count)
+      assert(stats.work.service.count == count)
+      -- each job sleeps 10ms
+      assert(stats.work.service.max >= 9000)
+      assert(stats.work.service.p50 >= 8192)
+    end, count))
+    for i = 1, count do
+      work:queue(i)
+    end
+    assert(uv.threadpool_stats().work.inflight == count)
+  end)
+
+  test("memory stats", function (print, p, expect, uv)
+    local before = uv.memory_stats()
+    local timer = uv.new_timer()
+    local after = uv.memory_stats()
+    p(after)
+    assert(after.handle.count == before.handle.count + 1)
+    assert(after.bytes > before.bytes)
+    timer:close()
+  end)
+
+  test("memory soft limit", function (print, p, expect, uv)
+    assert(uv.set_memory_limit(1, expect(function (bytes, limit)
+      p(bytes, limit)
+      assert(limit == 1)
+      assert(bytes > limit)
+      assert(uv.memory_stats().limit == 1)
+      assert(uv.set_memory_limit(nil))
+    end)))
+    -- keep the loop running for at least one iteration
+    local timer = uv.new_timer()
+    timer:start(10, 0, function ()
+      timer:close()
+    end)
+  end)
+
+  test("gc in idle iterations", function (print, p, expect, uv)
+    assert(uv.gc_idle({ budget = 500 }) == 0)
+    -- garbage for the collector
+    for i = 1, 10000 do
+      local _ = { i }
+    end
+    local timer = uv.new_timer()
+    timer:start(50, 0, expect(function ()
+      local stats = uv.gc_idle_stats(true)
+      p(stats)
+      assert(stats.active and stats.steps > 0)
+      assert(stats.max <= stats.time)
+      assert(uv.gc_idle() == 0)
+      assert(not uv.gc_idle_stats().active)
+      timer:close()
+    end))
+  end)
+
+end)
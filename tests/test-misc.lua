@@ -133,6 +133,24 @@ return require('lib/tap')(function (test)
     assert(now-begin >= val)
   end)
 
+  test("ffi fast path", function(print, p, expect, uv)
+    local fast = require('lib/luv_ffi')
+    if not fast then
+      print("skipped, no FFI")
+      return
+    end
+    assert(fast.version >= 1)
+    assert(math.abs(fast.now() - uv.now()) <= 1)
+    local timer = fast.timer(uv.new_timer())
+    -- again without a repeat
+    assert(timer:again() == uv.errno.EINVAL)
+    assert(timer:set_repeat(1000) == 0 and timer:get_repeat() == 1000)
+    timer.handle:start(1000, 1000, function () end)
+    assert(timer:again() == 0 and timer:is_active())
+    timer.handle:close()
+    assert(timer:again() == uv.errno.EINVAL)
+  end)
+
   test("uv.random async", function(print, p, expect, uv)
     local len = 256
     assert(uv.random(len, {}, expect(function(err, randomBytes)
@@ -153,6 +171,38 @@ return require('lib/tap')(function (test)
     assert(randomBytes ~= string.rep("\0", len))
   end, "1.33.0")
 
+  test("uv.random pool", function(print, p, expect, uv)
+    assert(uv.random_pool({ size = 1024, max_request = 64 }) == 0)
+    local seen = {}
+    for _ = 1, 200 do
+      local id = assert(uv.random(16))
+      assert(#id == 16 and not seen[id])
+      seen[id] = true
+    end
+    assert(#assert(uv.random(100)) == 100)
+    local stats = uv.random_pool_stats(true)
+    p(stats)
+    assert(stats.hits == 200 and stats.misses == 1)
+    -- 3200 bytes out of 1024 byte buffers
+    assert(stats.refills + stats.sync_refills >= 3)
+
+    -- the bytes have to fit in the userdata
+    assert(not pcall(uv.random_fill, io.stdout, 1024 * 1024))
+    local ok, ffi = pcall(require, "ffi")
+    if ok then
+      assert(not pcall(uv.random_fill, ffi.new("uint8_t[32]"), 16))
+    end
+    -- strings and tables are not buffers
+    assert(not pcall(uv.random_fill, string.rep("x", 16), 16))
+    assert(not pcall(uv.random_fill, {}, 16))
+
+    -- refills finish in the threadpool
+    uv.random(0, nil, expect(function()
+      assert(uv.random_pool() == 0)
+      assert(uv.random_pool_stats() == nil)
+    end))
+  end, "1.33.0")
+
   test("uv.random errors", function(print, p, expect, uv)
     -- invalid flag
     local _, err = uv.random(0, -1)
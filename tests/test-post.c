@@ -0,0 +1,159 @@
+/*
+ *  Copyright 2014 The Luvit Authors. All Rights Reserved.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ */
+
+/* Embeds luv and calls into Lua from native threads through luv_post, the
+   way a driver's IO thread would hand over its results.
+
+   Build with -DBUILD_EMBED_TESTS=ON and run ./build/test-post
+*/
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <lua.h>
+#include <lauxlib.h>
+#include <lualib.h>
+
+#include "luv.h"
+
+/* unlike assert() this still runs when NDEBUG is defined */
+#define CHECK(expr) \
+  do { \
+    if (!(expr)) { \
+      fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #expr); \
+      abort(); \
+    } \
+  } while (0)
+
+#define THREADS 4
+#define POSTS 10000
+
+typedef struct {
+  lua_State* L;
+  int id;
+} poster_t;
+
+static int released;
+
+/* on_post(thread id, sequence number) in Lua */
+static void post_cb(lua_State* L, void* ud) {
+  intptr_t value = (intptr_t)ud;
+  if (!L) {
+    released++;
+    return;
+  }
+  lua_getglobal(L, "on_post");
+  lua_pushinteger(L, value / POSTS);
+  lua_pushinteger(L, value % POSTS + 1);
+  lua_call(L, 2, 0);
+}
+
+static void poster_entry(void* arg) {
+  poster_t* poster = (poster_t*)arg;
+  int i;
+  for (i = 0; i < POSTS; i++) {
+    intptr_t value = (intptr_t)poster->id * POSTS + i;
+    int ret = luv_post(poster->L, post_cb, (void*)value);
+    CHECK(ret == 0);
+  }
+}
+
+static const char* script =
+  "local uv, threads, posts = ...\n"
+  "local seen, total = {}, 0\n"
+  // a timer keeps the loop alive, the post queue doesn't
+  "local timer = uv.new_timer()\n"
+  "timer:start(10000, 0, function () error('timeout') end)\n"
+  "function on_post(id, n)\n"
+  "  assert(uv.thread_self():equal(main))\n"
+  "  local last = seen[id] or 0\n"
+  "  assert(n == last + 1, 'out of order')\n"
+  "  seen[id] = n\n"
+  "  total = total + 1\n"
+  "  if total == threads * posts then timer:close() end\n"
+  "end\n"
+  "main = uv.thread_self()\n"
+  "return function () uv.run() return total end\n";
+
+int main(int argc, char* argv[]) {
+  static poster_t posters[THREADS];
+  uv_thread_t threads[THREADS];
+  lua_State* L;
+  lua_State* other;
+  int ret, i;
+  (void)argc;
+  (void)argv;
+
+  L = luaL_newstate();
+  luaL_openlibs(L);
+  ret = luv_post(L, post_cb, NULL);
+  CHECK(ret == UV_EINVAL);
+  lua_pushcfunction(L, luaopen_luv);
+  lua_call(L, 0, 1);
+
+  ret = luaL_loadstring(L, script);
+  if (ret == 0) {
+    lua_insert(L, -2);
+    lua_pushinteger(L, THREADS);
+    lua_pushinteger(L, POSTS);
+    ret = lua_pcall(L, 3, 1, 0);
+  }
+  if (ret != 0) {
+    fprintf(stderr, "%s\n", lua_tostring(L, -1));
+    return EXIT_FAILURE;
+  }
+
+  for (i = 0; i < THREADS; i++) {
+    posters[i].L = L;
+    posters[i].id = i;
+    ret = uv_thread_create(&threads[i], poster_entry, &posters[i]);
+    CHECK(ret == 0);
+  }
+  ret = lua_pcall(L, 0, 1, 0);
+  if (ret != 0) {
+    fprintf(stderr, "%s\n", lua_tostring(L, -1));
+    return EXIT_FAILURE;
+  }
+  for (i = 0; i < THREADS; i++) {
+    ret = uv_thread_join(&threads[i]);
+    CHECK(ret == 0);
+  }
+  printf("callbacks: %d\n", (int)lua_tointeger(L, -1));
+  CHECK(lua_tointeger(L, -1) == THREADS * POSTS);
+  lua_pop(L, 1);
+
+  /* never run, released when the state closes */
+  ret = luv_post(L, post_cb, NULL);
+  CHECK(ret == 0);
+  ret = luv_post(L, post_cb, NULL);
+  CHECK(ret == 0);
+  lua_close(L);
+  CHECK(released == 2);
+
+  /* the next state takes over the closed one's queue */
+  other = luaL_newstate();
+  luaL_openlibs(other);
+  lua_pushcfunction(other, luaopen_luv);
+  lua_call(other, 0, 1);
+  lua_pop(other, 1);
+  ret = luv_post(other, post_cb, NULL);
+  CHECK(ret == 0);
+  lua_close(other);
+  CHECK(released == 3);
+  return EXIT_SUCCESS;
+}
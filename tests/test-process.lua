@@ -146,4 +146,171 @@ return require('lib/tap')(function (test)
     handle:kill("sigterm")
   end, "1.19.0")
 
+  test("spawn_capture", function (print, p, expect, uv)
+    if isWindows then return end
+    local called = false
+    local pid = assert(uv.spawn_capture("sh", {
+      args = { "-c", "cat; echo err >&2; exit 3" },
+      stdin = "Hello World",
+    }, expect(function (code, signal, stdout, stderr, truncated)
+      p{code=code, signal=signal, stdout=stdout, stderr=stderr, truncated=truncated}
+      called = true
+      assert(code == 3 and signal == 0)
+      assert(stdout == "Hello World" and stderr == "err\n")
+      assert(truncated == false)
+
+      -- output past the limit is dropped
+      uv.spawn_capture("sh", {
+        args = { "-c", "head -c 100000 /dev/zero" },
+        max_output = 1000,
+      }, expect(function (code, signal, stdout, stderr, truncated)
+        assert(code == 0)
+        assert(#stdout == 1000 and stderr == "" and truncated)
+      end))
+    end)))
+    assert(type(pid) == "number" and not called)
+
+    local ok, err = uv.spawn_capture("ksjdfksjdflkjsflksdf", {}, function () assert(false) end)
+    assert(ok == nil and err)
+  end)
+
+  test("spawn_template", function (print, p, expect, uv)
+    if isWindows then return end
+    local tmpl = uv.spawn_template("sh", {
+      args = { "-c", "echo $GREETING" },
+      env = { "GREETING=hello" },
+    })
+    p(tmpl)
+
+    local function run(overrides, expected, done)
+      local stdout = uv.new_pipe(false)
+      overrides = overrides or {}
+      overrides.stdio = { nil, stdout }
+      local output = ""
+      local handle, pid = tmpl:spawn(overrides, expect(function (code, signal)
+        assert(code == 0 and signal == 0)
+      end))
+      assert(handle and pid, pid)
+      local finish = expect(function ()
+        assert(output == expected, output)
+        stdout:close()
+        handle:close()
+        if done then done() end
+      end)
+      stdout:read_start(function (err, chunk)
+        assert(not err, err)
+        if chunk then
+          output = output .. chunk
+        else
+          finish()
+        end
+      end)
+    end
+
+    run(nil, "hello\n", function ()
+      run({ env = { "GREETING=bye" } }, "bye\n", function ()
+        run({ args = { "-c", "echo $GREETING; pwd" }, cwd = "/" }, "hello\n/\n")
+      end)
+    end)
+
+    local pipe = uv.new_pipe(false)
+    assert(not pcall(uv.spawn_template, "sh", { stdio = { nil, pipe } }))
+    pipe:close()
+  end)
+
+  test("process pool", function (print, p, expect, uv)
+    if isWindows then return end
+    local child = [[
+      local uv = require('luv')
+      uv.process_pool_serve(function (payload)
+        if payload == "crash" then os.exit(1) end
+        if payload == "fail" then error("bad input", 0) end
+        return payload:upper() .. " " .. uv.os_getpid()
+      end)
+      uv.run()
+    ]]
+    local pool = assert(uv.new_process_pool(uv.exepath(), {
+      args = { "-e", child },
+      size = 2,
+      max_tasks = 10,
+    }))
+    p(pool)
+
+    local pids, pending = {}, 4
+    for i = 1, 4 do
+      assert(pool:submit("task" .. i, expect(function (err, result)
+        assert(not err, err)
+        local word, pid = result:match("^(%S+) (%d+)$")
+        assert(word == "TASK" .. i, result)
+        pids[pid] = true
+        pending = pending - 1
+        if pending > 0 then return end
+
+        -- least loaded: both children got tasks
+        local count = 0
+        for _ in pairs(pids) do count = count + 1 end
+        assert(count == 2)
+
+        pool:submit("fail", expect(function (err, result)
+          assert(err == "bad input" and result == nil)
+          pool:submit("crash", expect(function (err)
+            assert(err == "EPIPE")
+            local stats = pool:stats()
+            p(stats)
+            assert(stats.respawns == 1 and stats.workers == 2 and stats.failed == 1)
+            pool:submit("again", expect(function (err, result)
+              assert(not err, err)
+              assert(result:match("^AGAIN "))
+              assert(pool:close(expect(function ()
+                assert(not pool:submit("late", function () end))
+
+                -- recycled after every task
+                local single = assert(uv.new_process_pool(uv.exepath(), {
+                  args = { "-e", child }, size = 1, max_tasks = 1,
+                }))
+                single:submit("one", expect(function (err, first)
+                  assert(not err, err)
+                  single:submit("two", expect(function (err, second)
+                    assert(not err, err)
+                    assert(first:match("%d+$") ~= second:match("%d+$"))
+                    assert(single:stats().recycled == 2)
+                    single:close()
+
+                    -- a child that can't start isn't respawned forever
+                    local broken = assert(uv.new_process_pool(uv.exepath(), {
+                      args = { "-e", "os.exit(3)" }, size = 1,
+                    }))
+                    local timer = uv.new_timer()
+                    timer:start(50, 50, function ()
+                      local stats = broken:stats()
+                      if stats.crashes < 5 then return end
+                      timer:close()
+                      assert(stats.workers == 0 and stats.respawns == 4)
+                      local ok, err = broken:submit("x", function () end)
+                      assert(not ok and err:match("^ESRCH"))
+                      assert(broken:close(expect(function ()
+                        -- answers over max_frame kill the child
+                        local small = assert(uv.new_process_pool(uv.exepath(), {
+                          args = { "-e", child }, size = 1, max_frame = 64,
+                        }))
+                        small:submit(string.rep("x", 100), expect(function (err)
+                          assert(err == "E2BIG")
+                          small:submit("ok", expect(function (err, result)
+                            assert(not err, err)
+                            assert(result:match("^OK "))
+                            small:close()
+                          end))
+                        end))
+                      end)))
+                    end)
+                  end))
+                end))
+              end)))
+            end))
+          end))
+        end))
+      end)))
+    end
+  end)
+
 end)
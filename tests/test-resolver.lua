@@ -0,0 +1,213 @@
+local TEST_PORT = 9153
+
+local A, AAAA = 1, 28
+
+local function u16(n)
+  return string.char(math.floor(n / 256) % 256, n % 256)
+end
+
+-- Zone of the stand-in nameserver, by name and query type
+local zone = {
+  ["example.test"] = { [A] = { "\10\0\0\1" }, [AAAA] = { "\253\0" .. string.rep("\0", 13) .. "\1" } },
+  ["big.test"] = { [A] = { "\10\0\0\2" }, truncate = true },
+  ["slow.test"] = { [A] = { "\10\0\0\3" }, drop = 1 },
+  ["short.search.test"] = { [A] = { "\10\0\0\4" } },
+}
+
+-- Answers a query, nil to drop it
+local function answer(query, tcp)
+  local labels = {}
+  local pos = 13
+  while true do
+    local len = query:byte(pos)
+    if len == 0 then break end
+    labels[#labels + 1] = query:sub(pos + 1, pos + len)
+    pos = pos + len + 1
+  end
+  local name = table.concat(labels, "."):lower()
+  local qtype = query:byte(pos + 1) * 256 + query:byte(pos + 2)
+  local question = query:sub(13, pos + 4)
+  local entry = zone[name]
+  local flags, records = "\129\128", {}
+  if not entry then
+    flags = "\129\131" -- NXDOMAIN
+  elseif entry.drop and entry.drop > 0 then
+    entry.drop = entry.drop - 1
+    return nil
+  elseif entry.truncate and not tcp then
+    flags = "\131\128" -- TC
+  else
+    for _, rdata in ipairs(entry[qtype] or {}) do
+      records[#records + 1] = "\192\12" .. u16(qtype) .. u16(1) .. "\0\0\0\60" .. u16(#rdata) .. rdata
+    end
+  end
+  return query:sub(1, 2) .. flags .. u16(1) .. u16(#records) .. u16(0) .. u16(0)
+    .. question .. table.concat(records)
+end
+
+-- Nameserver on udp and tcp TEST_PORT, returns a function closing it
+local function nameserver(uv)
+  local udp = uv.new_udp()
+  assert(udp:bind("127.0.0.1", TEST_PORT))
+  assert(udp:recv_start(function (err, data, addr)
+    assert(not err, err)
+    if not data then return end
+    local response = answer(data, false)
+    if response then udp:send(response, addr.ip, addr.port) end
+  end))
+  local tcp = uv.new_tcp()
+  assert(tcp:bind("127.0.0.1", TEST_PORT))
+  assert(tcp:listen(8, function ()
+    local client = uv.new_tcp()
+    tcp:accept(client)
+    local buffer = ""
+    client:read_start(function (err, data)
+      if err or not data then return client:close() end
+      buffer = buffer .. data
+      local len = buffer:byte(1) * 256 + buffer:byte(2)
+      if #buffer < len + 2 then return end
+      local response = answer(buffer:sub(3, len + 2), true)
+      client:write(u16(#response) .. response)
+    end)
+  end))
+  return function ()
+    udp:close()
+    tcp:close()
+  end
+end
+
+local function addrs(res)
+  local list = {}
+  for _, info in ipairs(res) do
+    if info.socktype == "stream" then list[#list + 1] = info.addr end
+  end
+  return table.concat(list, " ")
+end
+
+return require('lib/tap')(function (test)
+
+  local function resolver(uv, options)
+    options = options or {}
+    options.nameservers = { "127.0.0.1:" .. TEST_PORT }
+    options.resolv_conf = false
+    options.hosts = options.hosts or false
+    options.timeout = 200
+    return uv.new_resolver(options)
+  end
+
+  test("resolver A and AAAA", function (print, p, expect, uv)
+    local close = nameserver(uv)
+    local r = resolver(uv)
+    assert(r:resolve("example.test", nil, expect(function (err, res)
+      p(err, res)
+      assert(not err, err)
+      assert(addrs(res) == "10.0.0.1 fd00::1")
+      assert(res[1].family == "inet" and res[1].protocol == "tcp")
+      assert(res[2].socktype == "dgram")
+      r:resolve("EXAMPLE.test.", { family = "inet6", socktype = "stream", port = 80 }, expect(function (err, res)
+        assert(not err, err)
+        assert(#res == 1 and res[1].addr == "fd00::1" and res[1].port == 80)
+        close()
+      end))
+    end)) == true)
+  end)
+
+  test("resolver errors", function (print, p, expect, uv)
+    local close = nameserver(uv)
+    local r = resolver(uv)
+    r:resolve("missing.test", nil, expect(function (err, res)
+      p(err, res)
+      assert(err == "EAI_NONAME" and not res)
+      -- no AAAA record for big.test
+      r:resolve("big.test", { family = "inet6" }, expect(function (err)
+        assert(err == "EAI_NONAME")
+        close()
+        -- nobody answers anymore
+        r:resolve("example.test", nil, expect(function (err)
+          p(err)
+          assert(err == "EAI_AGAIN")
+        end))
+      end))
+    end))
+  end)
+
+  test("resolver tcp fallback, retries and search", function (print, p, expect, uv)
+    local close = nameserver(uv)
+    local r = resolver(uv, { search = { "search.test" } })
+    local pending = 3
+    local function done()
+      pending = pending - 1
+      if pending == 0 then close() end
+    end
+    r:resolve("big.test", { family = "inet" }, expect(function (err, res)
+      assert(not err, err)
+      assert(addrs(res) == "10.0.0.2")
+      done()
+    end))
+    r:resolve("slow.test", { family = "inet" }, expect(function (err, res)
+      assert(not err, err)
+      assert(addrs(res) == "10.0.0.3")
+      done()
+    end))
+    r:resolve("short", { family = "inet" }, expect(function (err, res)
+      assert(not err, err)
+      assert(addrs(res) == "10.0.0.4")
+      done()
+    end))
+  end)
+
+  test("resolver hosts file and numeric hosts", function (print, p, expect, uv)
+    local path = assert(uv.fs_mkdtemp(uv.os_tmpdir() .. "/luv-hosts-XXXXXX")) .. "/hosts"
+    local fd = assert(uv.fs_open(path, "w", 420))
+    assert(uv.fs_write(fd, "# comment\n10.9.9.9  myhost.local  MyAlias\n::1 myhost.local\n"))
+    assert(uv.fs_close(fd))
+    local r = resolver(uv, { hosts = path })
+    assert(uv.fs_unlink(path))
+    assert(uv.fs_rmdir(path:match("^(.*)/hosts$")))
+
+    local called = false
+    r:resolve("myalias", nil, expect(function (err, res)
+      called = true
+      assert(not err, err)
+      assert(addrs(res) == "10.9.9.9")
+      r:resolve("myhost.local", { socktype = "dgram" }, expect(function (err, res)
+        assert(not err, err)
+        assert(#res == 2 and res[1].addr == "10.9.9.9" and res[2].addr == "::1")
+        r:resolve("192.0.2.1", nil, expect(function (err, res)
+          assert(not err, err)
+          assert(addrs(res) == "192.0.2.1")
+        end))
+      end))
+    end))
+    -- never called from within resolve
+    assert(not called)
+  end)
+
+  test("resolver lua_close with a tcp fallback in flight", function (print, p, expect, uv)
+    local thread = uv.new_thread(function (port)
+      local uv = require('luv')
+      -- every udp answer is truncated, the tcp side never answers
+      local udp = uv.new_udp()
+      assert(udp:bind("127.0.0.1", port))
+      assert(udp:recv_start(function (err, data, addr)
+        if err or not data then return end
+        udp:send(data:sub(1, 2) .. "\131\128" .. data:sub(5), addr.ip, addr.port)
+      end))
+      local tcp = uv.new_tcp()
+      assert(tcp:bind("127.0.0.1", port))
+      assert(tcp:listen(8, function () end))
+      local r = uv.new_resolver({
+        nameservers = { "127.0.0.1:" .. port }, resolv_conf = false, hosts = false, timeout = 5000,
+      })
+      assert(r:resolve("example.test", { family = "inet" }, function ()
+        error("called back while the state closes")
+      end))
+      local timer = uv.new_timer()
+      timer:start(100, 0, function () uv.stop() end)
+      uv.run()
+      -- the state closes with the lookup waiting on tcp
+    end, TEST_PORT + 1)
+    thread:join()
+  end)
+
+end)
@@ -353,4 +353,62 @@ return require('lib/tap')(function (test)
       end))
     end))
   end, "1.41.0")
+
+  test("try_write error modes", function(print, p, expect, uv)
+    local fds = assert(uv.socketpair("stream", 0, {nonblock=true}, {nonblock=true}))
+    local writer, reader = uv.new_tcp(), uv.new_tcp()
+    assert(writer:open(fds[1]))
+    assert(reader:open(fds[2]))
+    -- nobody reads, fill the socket buffer until it fails with EAGAIN
+    local chunk = string.rep("x", 65536)
+    local n, err, name
+    repeat
+      n, err, name = writer:try_write(chunk)
+    until not n
+    p(err, name)
+    assert(name == "EAGAIN" and err:find("^EAGAIN: "))
+
+    assert(uv.set_try_error_mode("name") == "message")
+    n, err, name = writer:try_write(chunk)
+    assert(n == nil and err == "EAGAIN" and name == nil)
+
+    assert(uv.set_try_error_mode("code") == "name")
+    n, err = writer:try_write(chunk)
+    assert(n == uv.errno.EAGAIN and err == nil)
+    assert(uv.set_try_error_mode("message") == "code")
+
+    writer:close()
+    reader:close()
+  end, "1.41.0")
+
+  test("tcp_connect_host", function(print, p, expect, uv)
+    local server = uv.new_tcp()
+    assert(server:bind("127.0.0.1", 0))
+    local port = server:getsockname().port
+    assert(server:listen(128, expect(function (err)
+      assert(not err, err)
+      local peer = uv.new_tcp()
+      server:accept(peer)
+      peer:close()
+    end)))
+
+    -- localhost may come back as ::1 first, that attempt is refused and the
+    -- next family is tried right away
+    local called = false
+    assert(uv.tcp_connect_host("localhost", port, { delay = 50, timeout = 5000 }, expect(function (err, client)
+      p(err, client)
+      called = true
+      assert(not err, err)
+      assert(client:getpeername().port == port)
+      client:close()
+      server:close(expect(function ()
+        -- nobody listens anymore
+        assert(uv.tcp_connect_host("127.0.0.1", port, nil, expect(function (err, client)
+          p(err)
+          assert(err == "ECONNREFUSED" and client == nil)
+        end)))
+      end))
+    end)) == true)
+    assert(not called)
+  end)
 end)
@@ -82,4 +82,89 @@ return require('lib/tap')(function (test)
     assert(elapsed >= 100, "elapsed should be at least delay ")
   end, "1.26.0")
 
+  test("shared map", function(print, p, expect, uv)
+    local map = uv.shared_map("test")
+    p(map)
+    assert(map:set("name", "luv") == 0)
+    assert(map:set("flag", true) == 0)
+    assert(map:get("name") == "luv" and map:get("flag") == true)
+    assert(map:get("missing") == nil)
+    assert(map:cas("name", "other", "x") == false)
+    assert(map:cas("name", "luv", "libuv") == true and map:get("name") == "libuv")
+    assert(map:cas("fresh", nil, 1) == true and map:get("fresh") == 1)
+    assert(map:incr("fresh", 2.5) == 3.5)
+    assert(not map:incr("name"))
+    assert(map:set("fresh", nil) == 0 and map:count() == 2)
+    assert(not pcall(map.set, map, "bad", {}))
+
+    local threads = {}
+    for i = 1, 4 do
+      threads[i] = uv.new_thread(function(n)
+        local map = require('luv').shared_map("test")
+        for _ = 1, n do map:incr("counter") end
+        assert(map:get("name") == "libuv")
+      end, 1000)
+    end
+    for i = 1, 4 do threads[i]:join() end
+    assert(uv.shared_map("test"):get("counter") == 4000)
+  end)
+
+  test("sync primitives across threads", function(print, p, expect, uv)
+    local mutex, cond = uv.new_mutex(), uv.new_cond()
+    local items, free = uv.new_sem(0), uv.new_sem(2)
+    local counter = uv.new_counter()
+    local barrier = uv.new_barrier(3)
+    p(mutex, items, counter)
+    assert(mutex:trylock() and not mutex:trylock())
+    mutex:unlock()
+    assert(not items:trywait())
+    assert(counter:add(5) == 5 and counter:set(0) == 5)
+    assert(counter:cas(0, 1) and not counter:cas(0, 2) and counter:get() == 1)
+    counter:set(0)
+    -- nobody signals
+    mutex:lock()
+    assert(cond:wait(mutex, 10) == false)
+    mutex:unlock()
+
+    -- bounded producer/consumer, at most 2 items in flight
+    local producer = uv.new_thread(function(items, free, counter, n)
+      for _ = 1, n do
+        free:wait()
+        counter:add(1)
+        items:post()
+      end
+    end, items, free, counter, 100)
+    local consumer = uv.new_thread(function(items, free, counter, n, barrier)
+      for i = 1, n do
+        items:wait()
+        -- one free slot per consumed item plus the initial two
+        assert(counter:get() <= i + 1)
+        free:post()
+      end
+      barrier:wait()
+    end, items, free, counter, 100, barrier)
+    local other = uv.new_thread(function(barrier)
+      barrier:wait()
+    end, barrier)
+    barrier:wait()
+    producer:join()
+    consumer:join()
+    other:join()
+    assert(counter:get() == 100)
+  end)
+
+  test("sync objects returned by work outlive the worker", function(print, p, expect, uv)
+    local ctx = uv.new_work(function(n)
+      local counter = require('luv').new_counter()
+      counter:set(n)
+      -- the worker state may collect its own copy before the loop gets this
+      return counter
+    end, expect(function(counter)
+      collectgarbage()
+      assert(counter:get() == 42)
+      assert(counter:add(1) == 43)
+    end))
+    uv.queue_work(ctx, 42)
+  end)
+
 end)
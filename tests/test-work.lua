@@ -103,4 +103,37 @@ return require('lib/tap')(function (test)
     print(2)
     coroutine.resume(co)
   end)
+
+  test("keyed work and vm init", function(print,p,expect,_uv)
+    local keys, perkey = { "a", "b", "c", 42 }, 5
+    local vms, counts, pending = {}, {}, #keys * perkey
+    local ctx = _uv.new_work(function(key)
+      -- runs in the vm set up by the init function below
+      seen[key] = (seen[key] or 0) + 1
+      return key, vm, seen[key]
+    end, function(key, id, count)
+      assert(id, "init did not run")
+      vms[key] = vms[key] or id
+      assert(vms[key] == id, "key moved to another vm")
+      -- jobs of a key run one after the other
+      counts[key] = (counts[key] or 0) + 1
+      assert(count == counts[key])
+      pending = pending - 1
+    end, function()
+      local uv = require('luv')
+      seen = {}
+      vm = tostring(seen) .. uv.hrtime()
+    end)
+    for _ = 1, perkey do
+      for _, key in ipairs(keys) do
+        assert(ctx:queue_keyed(key, key))
+      end
+    end
+    assert(not pcall(ctx.queue_keyed, ctx, {}))
+    local timer = _uv.new_timer()
+    timer:start(10, 10, function()
+      if pending > 0 then return end
+      timer:close()
+    end)
+  end)
 end)